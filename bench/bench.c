@@ -0,0 +1,215 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks - runner
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Every benchmark runs on fixed, generated input, so results from
+ * different builds and releases are comparable. Each benchmark is
+ * calibrated to run for at least the requested time per repetition,
+ * and the fastest and median repetitions are reported.
+ *
+ * The output is one tab separated line per benchmark, preceded by a
+ * header line starting with '#':
+ *
+ *   name  bytes  iterations  ns_min  ns_median  mb_per_s
+ *
+ * where bytes is the amount of input processed per iteration and
+ * mb_per_s is derived from the median.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define MAX_BENCHMARKS 64
+#define MAX_REPEAT 32
+
+struct benchmark
+{
+	const char *name;
+	size_t bytes;
+	bench_fn fn;
+	void *arg;
+};
+
+static struct benchmark g_benchmarks[MAX_BENCHMARKS];
+static int g_num_benchmarks;
+
+void
+bench_add(const char *name, size_t bytes, bench_fn fn, void *arg)
+{
+	struct benchmark *b;
+
+	if (g_num_benchmarks == MAX_BENCHMARKS)
+		bench_fail(name, "too many benchmarks");
+
+	b = &g_benchmarks[g_num_benchmarks++];
+	b->name = name;
+	b->bytes = bytes;
+	b->fn = fn;
+	b->arg = arg;
+}
+
+/* Corpus set up went wrong; numbers would be meaningless */
+void
+bench_fail(const char *name, const char *what)
+{
+	fprintf(stderr, "%s: %s\n", name, what);
+	exit(EX_SOFTWARE);
+}
+
+static uint64
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64
+run_iterations(struct benchmark *b, uint32 iterations)
+{
+	uint64 start = now_ns();
+	uint32 i;
+
+	for (i = 0; i < iterations; i++)
+		b->fn(b->arg);
+
+	return now_ns() - start;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+run_benchmark(struct benchmark *b, uint64 min_ns, int repeat)
+{
+	double ns[MAX_REPEAT], median;
+	uint32 iterations = 1;
+	uint64 elapsed;
+	int i;
+
+	/* warm up caches, then find an iteration count filling min_ns */
+	b->fn(b->arg);
+	while ((elapsed = run_iterations(b, iterations)) < min_ns && iterations < (1 << 30))
+	{
+		if (elapsed < min_ns / 16)
+			iterations *= 8;
+		else
+			iterations *= 2;
+	}
+
+	for (i = 0; i < repeat; i++)
+		ns[i] = (double) run_iterations(b, iterations) / iterations;
+
+	qsort(ns, repeat, sizeof(double), compare_double);
+	median = (repeat % 2) ? ns[repeat / 2] : (ns[repeat / 2 - 1] + ns[repeat / 2]) / 2;
+
+	printf("%s\t%lu\t%u\t%.1f\t%.1f\t%.2f\n", b->name, (unsigned long) b->bytes,
+	       iterations, ns[0], median, b->bytes ? (b->bytes * 1000.0) / median : 0.0);
+	fflush(stdout);
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-l] [-t ms] [-r repeat] [filter...]\n", program);
+	fprintf(stderr, "   -l: list benchmarks and exit\n");
+	fprintf(stderr, "   -t: minimum time per repetition in ms (default 200)\n");
+	fprintf(stderr, "   -r: number of repetitions (default 5)\n");
+	fprintf(stderr, "   filter: only run benchmarks whose name starts with one of these\n");
+}
+
+static RD_BOOL
+selected(const char *name, int argc, char *argv[])
+{
+	int i;
+
+	if (argc == 0)
+		return True;
+
+	for (i = 0; i < argc; i++)
+		if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+			return True;
+
+	return False;
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint32 min_ms = 200;
+	int c, i, repeat = 5;
+	RD_BOOL list = False;
+
+	while ((c = getopt(argc, argv, "lt:r:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'l':
+				list = True;
+				break;
+			case 't':
+				min_ms = strtol(optarg, NULL, 10);
+				break;
+			case 'r':
+				repeat = strtol(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return EX_USAGE;
+		}
+	}
+
+	if (repeat < 1 || repeat > MAX_REPEAT || min_ms < 1)
+	{
+		usage(argv[0]);
+		return EX_USAGE;
+	}
+
+#ifdef BENCH_X11
+	translate_bench_init();
+#else
+	codec_bench_init();
+	orders_bench_init();
+	sound_bench_init();
+#endif
+
+	if (!list)
+		printf("# rdesktop %s\n# name\tbytes\titerations\tns_min\tns_median\tmb_per_s\n",
+		       PACKAGE_VERSION);
+
+	for (i = 0; i < g_num_benchmarks; i++)
+	{
+		if (!selected(g_benchmarks[i].name, argc - optind, argv + optind))
+			continue;
+
+		if (list)
+			printf("%s\n", g_benchmarks[i].name);
+		else
+			run_benchmark(&g_benchmarks[i], (uint64) min_ms * 1000000, repeat);
+	}
+
+	return 0;
+}
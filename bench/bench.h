@@ -0,0 +1,49 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "../rdesktop.h"
+
+/* One benchmark: fn is run repeatedly and processes bytes per call */
+typedef void (*bench_fn) (void *arg);
+
+void bench_add(const char *name, size_t bytes, bench_fn fn, void *arg);
+void bench_fail(const char *name, const char *what);
+
+/* Deterministic input generation, see corpus.c */
+void corpus_seed(uint32 seed);
+uint32 corpus_random(void);
+uint8 *corpus_image(int width, int height, int Bpp);
+int corpus_rle_encode(uint8 * out, const uint8 * image, int width, int height, int Bpp);
+int corpus_plane_encode(uint8 * out, const uint8 * image, int width, int height, int plane);
+int corpus_planar_encode(uint8 * out, const uint8 * image, int width, int height);
+int corpus_mppc_compress(uint8 * out, const uint8 * history, int offset, int length);
+
+/* Suites */
+void codec_bench_init(void);
+void orders_bench_init(void);
+void sound_bench_init(void);
+void translate_bench_init(void);
+
+/* Shared by the codec and orders suites */
+uint8 *orders_corpus(int Bpp, size_t * length);
+
+#endif /* _BENCH_H */
@@ -0,0 +1,259 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks - bitmap codecs, MPPC and RC4
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* process_plane() is static */
+#include "../bitmap.c"
+#include "../ssl.h"
+#include "bench.h"
+
+#define TILE_SIZE 64
+#define NUM_TILES 32
+#define MPPC_PACKET_SIZE 16384
+
+extern RDPCOMP g_mppc_dict;
+
+struct tile
+{
+	uint8 *data;
+	int size;
+};
+
+struct bitmap_corpus
+{
+	int Bpp;
+	struct tile tiles[NUM_TILES];
+	uint8 *output;
+};
+
+struct mppc_packet
+{
+	uint8 *data;
+	uint32 size;
+	uint8 ctype;
+};
+
+struct mppc_corpus
+{
+	int count;
+	struct mppc_packet *packets;
+};
+
+static struct bitmap_corpus g_bitmaps[4];
+static struct bitmap_corpus g_planes;
+static struct mppc_corpus g_mppc;
+static RDSSL_RC4 g_rc4;
+static uint8 g_rc4_data[16384];
+
+/* Decoded tiles are bottom-up, generated ones in stream order */
+static RD_BOOL
+tile_matches(const uint8 * decoded, const uint8 * image, int Bpp)
+{
+	int y, row = TILE_SIZE * Bpp;
+
+	for (y = 0; y < TILE_SIZE; y++)
+		if (memcmp(decoded + (TILE_SIZE - 1 - y) * row, image + y * row, row) != 0)
+			return False;
+
+	return True;
+}
+
+static void
+bench_bitmap_decompress(void *arg)
+{
+	struct bitmap_corpus *c = arg;
+	int i;
+
+	for (i = 0; i < NUM_TILES; i++)
+		bitmap_decompress(c->output, TILE_SIZE, TILE_SIZE, c->tiles[i].data,
+				  c->tiles[i].size, c->Bpp);
+}
+
+static void
+bench_process_plane(void *arg)
+{
+	struct bitmap_corpus *c = arg;
+	int i;
+
+	for (i = 0; i < NUM_TILES; i++)
+		process_plane(c->tiles[i].data, TILE_SIZE, TILE_SIZE, c->output, c->tiles[i].size);
+}
+
+static void
+bench_mppc_expand(void *arg)
+{
+	struct mppc_corpus *c = arg;
+	uint32 roff, rlen;
+	int i;
+
+	for (i = 0; i < c->count; i++)
+		mppc_expand(c->packets[i].data, c->packets[i].size, c->packets[i].ctype, &roff,
+			    &rlen);
+}
+
+static void
+bench_rc4(void *arg)
+{
+	UNUSED(arg);
+	rdssl_rc4_crypt(&g_rc4, g_rc4_data, g_rc4_data, sizeof(g_rc4_data));
+}
+
+static void
+setup_bitmaps(void)
+{
+	static const char *names[] = {
+		"bitmap_decompress/8bpp", "bitmap_decompress/16bpp",
+		"bitmap_decompress/24bpp", "bitmap_decompress/32bpp"
+	};
+	struct bitmap_corpus *c;
+	uint8 *image, *encoded;
+	int Bpp, i;
+
+	encoded = xmalloc(TILE_SIZE * TILE_SIZE * 4 * 2 + 16);
+
+	for (Bpp = 1; Bpp <= 4; Bpp++)
+	{
+		c = &g_bitmaps[Bpp - 1];
+		c->Bpp = Bpp;
+		c->output = xmalloc(TILE_SIZE * TILE_SIZE * Bpp);
+
+		corpus_seed(Bpp);
+		for (i = 0; i < NUM_TILES; i++)
+		{
+			image = corpus_image(TILE_SIZE, TILE_SIZE, Bpp);
+			if (Bpp == 4)
+				c->tiles[i].size = corpus_planar_encode(encoded, image, TILE_SIZE,
+									TILE_SIZE);
+			else
+				c->tiles[i].size = corpus_rle_encode(encoded, image, TILE_SIZE,
+								     TILE_SIZE, Bpp);
+
+			c->tiles[i].data = xmalloc(c->tiles[i].size);
+			memcpy(c->tiles[i].data, encoded, c->tiles[i].size);
+
+			if (!bitmap_decompress(c->output, TILE_SIZE, TILE_SIZE, c->tiles[i].data,
+					       c->tiles[i].size, Bpp)
+			    || !tile_matches(c->output, image, Bpp))
+				bench_fail(names[Bpp - 1], "corpus does not round trip");
+
+			/* a single plane of the 32 bpp tiles for process_plane */
+			if (Bpp == 4)
+			{
+				g_planes.tiles[i].size = corpus_plane_encode(encoded, image,
+									     TILE_SIZE, TILE_SIZE,
+									     2);
+				g_planes.tiles[i].data = xmalloc(g_planes.tiles[i].size);
+				memcpy(g_planes.tiles[i].data, encoded, g_planes.tiles[i].size);
+			}
+
+			xfree(image);
+		}
+
+		bench_add(names[Bpp - 1], NUM_TILES * TILE_SIZE * TILE_SIZE * Bpp,
+			  bench_bitmap_decompress, c);
+	}
+
+	g_planes.Bpp = 4;
+	g_planes.output = xmalloc(TILE_SIZE * TILE_SIZE * 4);
+	bench_add("process_plane", NUM_TILES * TILE_SIZE * TILE_SIZE, bench_process_plane,
+		  &g_planes);
+
+	xfree(encoded);
+}
+
+/* Compress what a session typically carries: orders and bitmap data */
+static void
+setup_mppc(void)
+{
+	uint8 *input, *image, *encoded;
+	size_t length, orders_length, pos, history;
+	struct mppc_packet *p;
+	uint32 roff, rlen, size;
+	int i;
+
+	input = orders_corpus(2, &orders_length);
+	length = orders_length + NUM_TILES * TILE_SIZE * TILE_SIZE * 2;
+	input = xrealloc(input, length);
+	corpus_seed(16);
+	for (i = 0; i < NUM_TILES; i++)
+	{
+		image = corpus_image(TILE_SIZE, TILE_SIZE, 2);
+		memcpy(input + orders_length + i * TILE_SIZE * TILE_SIZE * 2, image,
+		       TILE_SIZE * TILE_SIZE * 2);
+		xfree(image);
+	}
+
+	g_mppc.count = (length + MPPC_PACKET_SIZE - 1) / MPPC_PACKET_SIZE;
+	g_mppc.packets = xmalloc(g_mppc.count * sizeof(struct mppc_packet));
+	encoded = xmalloc(MPPC_PACKET_SIZE * 2);
+
+	history = 0;
+	for (i = 0, pos = 0; pos < length; i++, pos += size)
+	{
+		p = &g_mppc.packets[i];
+		size = MIN(MPPC_PACKET_SIZE, length - pos);
+
+		/* start over at the front of the history when it is full */
+		p->ctype = RDP_MPPC_COMPRESSED | RDP_MPPC_BIG;
+		if (i == 0)
+			p->ctype |= RDP_MPPC_FLUSH;
+		if (history + size >= RDP_MPPC_DICT_SIZE)
+		{
+			p->ctype |= RDP_MPPC_RESET;
+			history = 0;
+		}
+
+		p->size = corpus_mppc_compress(encoded, input + pos - history, history, size);
+		p->data = xmalloc(p->size);
+		memcpy(p->data, encoded, p->size);
+		history += size;
+
+		if (mppc_expand(p->data, p->size, p->ctype, &roff, &rlen) != 0 || rlen != size
+		    || memcmp(g_mppc_dict.hist + roff, input + pos, size) != 0)
+			bench_fail("mppc_expand", "corpus does not round trip");
+	}
+
+	bench_add("mppc_expand", length, bench_mppc_expand, &g_mppc);
+
+	xfree(encoded);
+	xfree(input);
+}
+
+static void
+setup_rc4(void)
+{
+	uint8 key[16];
+	size_t i;
+
+	corpus_seed(128);
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = corpus_random();
+	for (i = 0; i < sizeof(g_rc4_data); i++)
+		g_rc4_data[i] = corpus_random();
+
+	rdssl_rc4_set_key(&g_rc4, key, sizeof(key));
+	bench_add("rdssl_rc4_crypt", sizeof(g_rc4_data), bench_rc4, NULL);
+}
+
+void
+codec_bench_init(void)
+{
+	setup_bitmaps();
+	setup_mppc();
+	setup_rc4();
+}
@@ -0,0 +1,412 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks - input generation
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The encoders here produce the server side formats that the client
+ * decodes: interleaved RLE and planar bitmaps, and MPPC (RDP 5, 64k
+ * history). They are simple greedy encoders; the goal is valid and
+ * representative input, not good compression.
+ *
+ * Images are generated in the order the decoders consume rows, i.e.
+ * the first row of an image is the bottom row of the decoded bitmap.
+ */
+
+#include "bench.h"
+
+static uint32 g_corpus_state = 1;
+
+void
+corpus_seed(uint32 seed)
+{
+	g_corpus_state = seed ? seed : 1;
+}
+
+/* xorshift32, so that the corpus is identical on every platform */
+uint32
+corpus_random(void)
+{
+	uint32 x = g_corpus_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return g_corpus_state = x;
+}
+
+static uint32
+random_colour(int Bpp)
+{
+	uint32 colour = corpus_random();
+
+	if (Bpp == 4)
+		return colour | 0xff000000;
+	return colour & ((1 << (Bpp * 8)) - 1);
+}
+
+static void
+put_pixel(uint8 * image, int i, int Bpp, uint32 colour)
+{
+	uint8 *p = image + i * Bpp;
+
+	switch (Bpp)
+	{
+		case 4:
+			p[3] = colour >> 24;
+			/* fall through */
+		case 3:
+			p[2] = colour >> 16;
+			/* fall through */
+		case 2:
+			p[1] = colour >> 8;
+			/* fall through */
+		default:
+			p[0] = colour;
+	}
+}
+
+static void
+fill_region(uint8 * image, int width, int x, int y, int cx, int cy, int Bpp, int kind,
+	    uint32 colour, uint32 ink)
+{
+	int i, j;
+	uint32 value;
+
+	for (j = y; j < y + cy; j++)
+	{
+		value = colour;
+		for (i = x; i < x + cx; i++)
+		{
+			switch (kind)
+			{
+				case 1:	/* text: glyph-like dots in 13 pixel rows */
+					value = ((j % 16) < 13 && (i % 8) != 7
+						 && (corpus_random() % 3) == 0) ? ink : colour;
+					break;
+				case 2:	/* horizontal gradient */
+					value = colour + (i - x) * 0x010101;
+					break;
+				case 3:	/* photo: small steps from the left neighbour */
+					value += (corpus_random() % 7) * 0x010101 - 0x030303;
+					break;
+			}
+
+			put_pixel(image, j * width + i, Bpp,
+				  Bpp == 4 ? value | 0xff000000 : value);
+		}
+	}
+}
+
+/* A desktop like image: a background with windows of text, gradients and photos */
+uint8 *
+corpus_image(int width, int height, int Bpp)
+{
+	uint8 *image = xmalloc(width * height * Bpp);
+	int n, x, y, cx, cy;
+
+	fill_region(image, width, 0, 0, width, height, Bpp, 0, random_colour(Bpp), 0);
+
+	for (n = 1 + corpus_random() % 4; n > 0; n--)
+	{
+		cx = 1 + corpus_random() % width;
+		cy = 1 + corpus_random() % height;
+		x = corpus_random() % (width - cx + 1);
+		y = corpus_random() % (height - cy + 1);
+		fill_region(image, width, x, y, cx, cy, Bpp, corpus_random() % 4,
+			    random_colour(Bpp), random_colour(Bpp));
+	}
+
+	return image;
+}
+
+static int
+rle_order(uint8 * out, int opcode, int count)
+{
+	int n = 0;
+
+	if (count < 32)
+	{
+		out[n++] = (opcode << 5) | count;
+	}
+	else if (count < 32 + 256)
+	{
+		out[n++] = opcode << 5;
+		out[n++] = count - 32;
+	}
+	else
+	{
+		out[n++] = 0xf0 | opcode;
+		out[n++] = count;
+		out[n++] = count >> 8;
+	}
+
+	return n;
+}
+
+/* Interleaved RLE using fill, colour and copy orders */
+int
+corpus_rle_encode(uint8 * out, const uint8 * image, int width, int height, int Bpp)
+{
+	static const uint8 zero[4];
+	int i, j, n = width * height, len = 0, literal = -1, fill, colour;
+	const uint8 *above;
+
+	for (i = 0; i <= n; i++)
+	{
+		fill = colour = 0;
+		if (i < n)
+		{
+			for (j = i; j < n && j - i < 0xffff; j++)
+			{
+				above = (j >= width) ? image + (j - width) * Bpp : zero;
+				if (memcmp(image + j * Bpp, above, Bpp) != 0)
+					break;
+			}
+			fill = j - i;
+
+			for (j = i; j < n && j - i < 0xffff; j++)
+				if (memcmp(image + j * Bpp, image + i * Bpp, Bpp) != 0)
+					break;
+			colour = j - i;
+
+			if (fill < 3 && colour < 3)
+			{
+				if (literal < 0)
+					literal = i;
+				continue;
+			}
+		}
+
+		if (literal >= 0)
+		{
+			len += rle_order(out + len, 4, i - literal);
+			memcpy(out + len, image + literal * Bpp, (i - literal) * Bpp);
+			len += (i - literal) * Bpp;
+			literal = -1;
+		}
+
+		if (fill >= 3)
+		{
+			len += rle_order(out + len, 0, fill);
+			i += fill - 1;
+		}
+		else if (colour >= 3)
+		{
+			len += rle_order(out + len, 3, colour);
+			memcpy(out + len, image + i * Bpp, Bpp);
+			len += Bpp;
+			i += colour - 1;
+		}
+	}
+
+	return len;
+}
+
+/* One colour plane: raw values in the first row, deltas to the row above after that */
+int
+corpus_plane_encode(uint8 * out, const uint8 * image, int width, int height, int plane)
+{
+	int len = 0, x, y, i, lits, run, colour;
+	uint8 values[4096];
+	sint8 delta;
+
+	for (y = 0; y < height; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			if (y == 0)
+			{
+				values[x] = image[x * 4 + plane];
+				continue;
+			}
+
+			delta = image[(y * width + x) * 4 + plane] -
+				image[((y - 1) * width + x) * 4 + plane];
+			values[x] = (delta >= 0) ? 2 * delta : 2 * (-delta - 1) + 1;
+		}
+
+		/* runs repeat the last raw value, which starts out as 0 */
+		colour = 0;
+		x = 0;
+		while (x < width)
+		{
+			for (lits = 0; x + lits < width && lits < 15; lits++)
+			{
+				i = lits ? values[x + lits - 1] : colour;
+				for (run = 0; x + lits + run < width; run++)
+					if (values[x + lits + run] != i)
+						break;
+				if (run >= 3)
+					break;
+			}
+
+			i = len++;
+			memcpy(out + len, values + x, lits);
+			len += lits;
+			x += lits;
+			if (lits)
+				colour = values[x - 1];
+
+			for (run = 0; x + run < width && values[x + run] == colour; run++);
+
+			/* codes with 1 or 2 in the low nibble are long repeats */
+			if (run >= 16)
+			{
+				out[i] = lits << 4;
+				if (lits == 0)
+					len--;
+				while (run >= 16)
+				{
+					lits = MIN(run, 47);
+					out[len++] = ((lits & 0xf) << 4) | (lits >> 4);
+					x += lits;
+					run -= lits;
+				}
+				if (run >= 3)
+				{
+					out[len++] = run;
+					x += run;
+				}
+				continue;
+			}
+
+			if (run < 3)
+				run = 0;
+			out[i] = (lits << 4) | run;
+			x += run;
+		}
+	}
+
+	return len;
+}
+
+int
+corpus_planar_encode(uint8 * out, const uint8 * image, int width, int height)
+{
+	int plane, len = 0;
+
+	out[len++] = 0x10;
+	for (plane = 3; plane >= 0; plane--)
+		len += corpus_plane_encode(out + len, image, width, height, plane);
+
+	return len;
+}
+
+struct bitwriter
+{
+	uint8 *out;
+	int len;
+	uint32 bits;
+	int nbits;
+};
+
+static void
+put_bits(struct bitwriter *w, uint32 value, int count)
+{
+	while (count--)
+	{
+		w->bits = (w->bits << 1) | ((value >> count) & 1);
+		if (++w->nbits == 8)
+		{
+			w->out[w->len++] = w->bits;
+			w->bits = w->nbits = 0;
+		}
+	}
+}
+
+#define MPPC_HASH(p) ((((p)[0] << 10) ^ ((p)[1] << 5) ^ (p)[2]) & 0x7fff)
+
+/* RDP 5 MPPC with a 64k history. Packets of one history are compressed in
+   order by passing their offset in it; offset 0 starts a new history. */
+int
+corpus_mppc_compress(uint8 * out, const uint8 * history, int offset, int length)
+{
+	static int head[0x8000], chain[RDP_MPPC_DICT_SIZE];
+	struct bitwriter w = { out, 0, 0, 0 };
+	const uint8 *in = history;
+	int i, k, cand, tries, best, best_off, len, end = offset + length;
+
+	if (offset == 0)
+		memset(head, 0xff, sizeof(head));
+
+	for (i = offset; i < end;)
+	{
+		best = best_off = 0;
+		if (i + 3 <= end)
+		{
+			cand = head[MPPC_HASH(in + i)];
+			for (tries = 0; cand >= 0 && tries < 32; tries++, cand = chain[cand])
+			{
+				for (len = 0; i + len < end && len < 4096; len++)
+					if (in[cand + len] != in[i + len])
+						break;
+				if (len > best)
+				{
+					best = len;
+					best_off = i - cand;
+				}
+			}
+		}
+
+		if (best < 3)
+		{
+			best = 1;
+			if (in[i] < 0x80)
+				put_bits(&w, in[i], 8);
+			else
+				put_bits(&w, 0x100 | (in[i] & 0x7f), 9);
+		}
+		else
+		{
+			if (best_off < 64)
+				put_bits(&w, 0x7c0 | best_off, 11);
+			else if (best_off < 320)
+				put_bits(&w, 0x1e00 | (best_off - 64), 13);
+			else if (best_off < 2368)
+				put_bits(&w, 0x7000 | (best_off - 320), 15);
+			else
+				put_bits(&w, 0x60000 | (best_off - 2368), 19);
+
+			if (best == 3)
+			{
+				put_bits(&w, 0, 1);
+			}
+			else
+			{
+				for (k = 2; (best >> (k + 1)) != 0; k++);
+				put_bits(&w, ((1 << k) - 2), k);
+				put_bits(&w, best & ((1 << k) - 1), k);
+			}
+		}
+
+		for (k = 0; k < best; k++, i++)
+		{
+			/* matches may reach into following packets of the history */
+			if (i + 3 <= end)
+			{
+				chain[i] = head[MPPC_HASH(in + i)];
+				head[MPPC_HASH(in + i)] = i;
+			}
+		}
+	}
+
+	if (w.nbits)
+		put_bits(&w, 0, 8 - w.nbits);
+
+	return w.len;
+}
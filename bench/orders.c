@@ -0,0 +1,640 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks - drawing order processing
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The order streams are generated the way a server encodes them: fields
+ * that did not change since the last order of the same type are left
+ * out, coordinates are sent as deltas when they fit in a byte, and the
+ * present flags are truncated with the SMALL and TINY flags. A session
+ * starts by filling the glyph and bitmap caches and then draws frames of
+ * window backgrounds, toolbar bitmaps, text, scrolling and lines.
+ *
+ * Drawing goes to the headless ui, so the results cover parsing, caches,
+ * bitmap decompression and a simple software rasteriser.
+ */
+
+#include "bench.h"
+#include "../orders.h"
+
+#define NUM_FRAMES 200
+#define NUM_TILES 48
+#define TILE_SIZE 64
+#define NUM_GLYPHS 95
+#define TEXT_LENGTH 40
+
+extern int g_server_depth;
+
+enum field_kind
+{
+	COORD,
+	BYTE,
+	U16,
+	COLOUR,
+	TEXT
+};
+
+struct field
+{
+	enum field_kind kind;
+	int value;
+	const uint8 *data;
+};
+
+/* Last state of each primary order type, as the client will see it */
+struct order_state
+{
+	int values[32];
+	uint8 text[256];
+	int length;
+};
+
+struct writer
+{
+	uint8 *data;
+	size_t length, size;
+	uint8 last_type;
+	int bounds[4];
+	struct order_state state[32];
+};
+
+struct pdu
+{
+	size_t offset, length;
+	uint16 count;
+};
+
+struct orders_corpus
+{
+	int depth;
+	uint8 *data;
+	struct pdu *pdus;
+	int count;
+};
+
+static struct orders_corpus g_corpus[2];
+
+static void
+put8(struct writer *w, uint8 value)
+{
+	if (w->length == w->size)
+	{
+		w->size = w->size ? w->size * 2 : 65536;
+		w->data = xrealloc(w->data, w->size);
+	}
+	w->data[w->length++] = value;
+}
+
+static void
+put16(struct writer *w, uint16 value)
+{
+	put8(w, value);
+	put8(w, value >> 8);
+}
+
+static void
+put24(struct writer *w, uint32 value)
+{
+	put16(w, value);
+	put8(w, value >> 16);
+}
+
+static void
+put_data(struct writer *w, const uint8 * data, int length)
+{
+	while (length--)
+		put8(w, *(data++));
+}
+
+static RD_BOOL
+fits_delta(int diff)
+{
+	return diff >= -128 && diff <= 127;
+}
+
+/* Number of present flag bytes per primary order type */
+static int
+present_size(uint8 type)
+{
+	switch (type)
+	{
+		case RDP_ORDER_TRIBLT:
+		case RDP_ORDER_TEXT2:
+			return 3;
+		case RDP_ORDER_PATBLT:
+		case RDP_ORDER_MEMBLT:
+		case RDP_ORDER_LINE:
+		case RDP_ORDER_POLYGON2:
+		case RDP_ORDER_ELLIPSE2:
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+static void
+put_bounds(struct writer *w, const int *bounds)
+{
+	uint8 present = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (bounds[i] == w->bounds[i])
+			continue;
+		present |= fits_delta(bounds[i] - w->bounds[i]) ? (16 << i) : (1 << i);
+	}
+
+	put8(w, present);
+	for (i = 0; i < 4; i++)
+	{
+		if (present & (16 << i))
+			put8(w, bounds[i] - w->bounds[i]);
+		else if (present & (1 << i))
+			put16(w, bounds[i]);
+		w->bounds[i] = bounds[i];
+	}
+}
+
+static void
+put_primary(struct writer *w, uint8 type, struct field *fields, int count, const int *bounds)
+{
+	struct order_state *state = &w->state[type];
+	uint32 present = 0;
+	RD_BOOL delta = True;
+	uint8 flags = RDP_ORDER_STANDARD;
+	int i, size;
+
+	for (i = 0; i < count; i++)
+	{
+		if (fields[i].kind == TEXT)
+		{
+			if (fields[i].value == state->length
+			    && memcmp(fields[i].data, state->text, state->length) == 0)
+				continue;
+		}
+		else if (fields[i].value == state->values[i])
+		{
+			continue;
+		}
+
+		present |= 1 << i;
+		if (fields[i].kind == COORD && !fits_delta(fields[i].value - state->values[i]))
+			delta = False;
+	}
+
+	size = present_size(type);
+	if (size > 1 && (present >> ((size - 2) * 8)) == 0)
+	{
+		flags |= RDP_ORDER_TINY;
+		size -= 2;
+	}
+	else if ((present >> ((size - 1) * 8)) == 0)
+	{
+		flags |= RDP_ORDER_SMALL;
+		size -= 1;
+	}
+
+	if (type != w->last_type)
+		flags |= RDP_ORDER_CHANGE;
+	if (delta)
+		flags |= RDP_ORDER_DELTA;
+	if (bounds)
+	{
+		flags |= RDP_ORDER_BOUNDS;
+		if (memcmp(bounds, w->bounds, sizeof(w->bounds)) == 0)
+			flags |= RDP_ORDER_LASTBOUNDS;
+	}
+
+	put8(w, flags);
+	if (flags & RDP_ORDER_CHANGE)
+		put8(w, type);
+	for (i = 0; i < size; i++)
+		put8(w, present >> (i * 8));
+	if (bounds && !(flags & RDP_ORDER_LASTBOUNDS))
+		put_bounds(w, bounds);
+
+	for (i = 0; i < count; i++)
+	{
+		if (!(present & (1 << i)))
+			continue;
+
+		switch (fields[i].kind)
+		{
+			case COORD:
+				if (delta)
+					put8(w, fields[i].value - state->values[i]);
+				else
+					put16(w, fields[i].value);
+				break;
+			case BYTE:
+				put8(w, fields[i].value);
+				break;
+			case U16:
+				put16(w, fields[i].value);
+				break;
+			case COLOUR:
+				put24(w, fields[i].value);
+				break;
+			case TEXT:
+				put8(w, fields[i].value);
+				put_data(w, fields[i].data, fields[i].value);
+				memcpy(state->text, fields[i].data, fields[i].value);
+				state->length = fields[i].value;
+				break;
+		}
+		state->values[i] = fields[i].value;
+	}
+
+	w->last_type = type;
+}
+
+static void
+put_secondary(struct writer *w, uint8 type, uint16 flags, const uint8 * data, int length)
+{
+	put8(w, RDP_ORDER_STANDARD | RDP_ORDER_SECONDARY);
+	put16(w, length - 7);
+	put16(w, flags);
+	put8(w, type);
+	put_data(w, data, length);
+}
+
+#define FIELD(k, v) fields[n].kind = k; fields[n].value = v; fields[n++].data = NULL
+
+static void
+put_rect(struct writer *w, int x, int y, int cx, int cy, uint32 colour)
+{
+	struct field fields[7];
+	int n = 0;
+
+	FIELD(COORD, x);
+	FIELD(COORD, y);
+	FIELD(COORD, cx);
+	FIELD(COORD, cy);
+	FIELD(BYTE, colour & 0xff);
+	FIELD(BYTE, (colour >> 8) & 0xff);
+	FIELD(BYTE, (colour >> 16) & 0xff);
+	put_primary(w, RDP_ORDER_RECT, fields, n, NULL);
+}
+
+static void
+put_memblt(struct writer *w, int x, int y, int cache_idx)
+{
+	struct field fields[9];
+	int n = 0;
+
+	FIELD(U16, 2);		/* cache id 2, no colour table */
+	FIELD(COORD, x);
+	FIELD(COORD, y);
+	FIELD(COORD, TILE_SIZE);
+	FIELD(COORD, TILE_SIZE);
+	FIELD(BYTE, 0xcc);	/* SRCCOPY */
+	FIELD(COORD, 0);
+	FIELD(COORD, 0);
+	FIELD(U16, cache_idx);
+	put_primary(w, RDP_ORDER_MEMBLT, fields, n, NULL);
+}
+
+static void
+put_screenblt(struct writer *w, int x, int y, int cx, int cy, int srcx, int srcy)
+{
+	struct field fields[7];
+	int n = 0;
+
+	FIELD(COORD, x);
+	FIELD(COORD, y);
+	FIELD(COORD, cx);
+	FIELD(COORD, cy);
+	FIELD(BYTE, 0xcc);	/* SRCCOPY */
+	FIELD(COORD, srcx);
+	FIELD(COORD, srcy);
+	put_primary(w, RDP_ORDER_SCREENBLT, fields, n, NULL);
+}
+
+static void
+put_destblt(struct writer *w, int x, int y, int cx, int cy)
+{
+	struct field fields[5];
+	int n = 0;
+
+	FIELD(COORD, x);
+	FIELD(COORD, y);
+	FIELD(COORD, cx);
+	FIELD(COORD, cy);
+	FIELD(BYTE, 0x55);	/* DSTINVERT */
+	put_primary(w, RDP_ORDER_DESTBLT, fields, n, NULL);
+}
+
+static void
+put_patblt(struct writer *w, int x, int y, int cx, int cy, int style, int hatch,
+	   uint32 bgcolour, uint32 fgcolour, const int *bounds)
+{
+	struct field fields[12];
+	int n = 0;
+
+	FIELD(COORD, x);
+	FIELD(COORD, y);
+	FIELD(COORD, cx);
+	FIELD(COORD, cy);
+	FIELD(BYTE, 0xf0);	/* PATCOPY */
+	FIELD(COLOUR, bgcolour);
+	FIELD(COLOUR, fgcolour);
+	FIELD(BYTE, 0);		/* brush origin */
+	FIELD(BYTE, 0);
+	FIELD(BYTE, style);
+	FIELD(BYTE, hatch);
+	put_primary(w, RDP_ORDER_PATBLT, fields, n, bounds);
+}
+
+static void
+put_line(struct writer *w, int startx, int starty, int endx, int endy, uint32 colour)
+{
+	struct field fields[10];
+	int n = 0;
+
+	FIELD(U16, 1);		/* mixmode */
+	FIELD(COORD, startx);
+	FIELD(COORD, starty);
+	FIELD(COORD, endx);
+	FIELD(COORD, endy);
+	FIELD(COLOUR, 0);
+	FIELD(BYTE, 13);	/* R2_COPYPEN */
+	FIELD(BYTE, 0);		/* pen style */
+	FIELD(BYTE, 1);		/* pen width */
+	FIELD(COLOUR, colour);
+	put_primary(w, RDP_ORDER_LINE, fields, n, NULL);
+}
+
+static void
+put_text(struct writer *w, int x, int y, int width, const uint8 * text, int length,
+	 uint32 fgcolour, uint32 bgcolour)
+{
+	struct field fields[22];
+	int n = 0;
+
+	FIELD(BYTE, 0);		/* font */
+	FIELD(BYTE, 0);		/* flags */
+	FIELD(BYTE, 1);		/* opcode */
+	FIELD(BYTE, MIX_TRANSPARENT);
+	FIELD(COLOUR, fgcolour);
+	FIELD(COLOUR, bgcolour);
+	FIELD(U16, x);		/* clip */
+	FIELD(U16, y);
+	FIELD(U16, x + width);
+	FIELD(U16, y + 16);
+	FIELD(U16, x);		/* opaque box */
+	FIELD(U16, y);
+	FIELD(U16, x + width);
+	FIELD(U16, y + 16);
+	FIELD(BYTE, 0);		/* brush */
+	FIELD(BYTE, 0);
+	FIELD(BYTE, 0);
+	FIELD(BYTE, 0);
+	FIELD(BYTE, 0);
+	FIELD(U16, x);
+	FIELD(U16, y + 13);
+	fields[n].kind = TEXT;
+	fields[n].value = length;
+	fields[n++].data = text;
+	put_primary(w, RDP_ORDER_TEXT2, fields, n, NULL);
+}
+
+static void
+put_glyphs(struct writer *w)
+{
+	uint8 data[2 + 32 * (10 + 16)];
+	int i, j, len, first, count;
+
+	for (first = 0; first < NUM_GLYPHS; first += count)
+	{
+		count = MIN(32, NUM_GLYPHS - first);
+		len = 0;
+		data[len++] = 0;	/* font */
+		data[len++] = count;
+		for (i = first; i < first + count; i++)
+		{
+			data[len++] = 32 + i;	/* character */
+			data[len++] = 0;
+			data[len++] = 0;	/* offset */
+			data[len++] = 0;
+			data[len++] = (uint8) - 11;	/* baseline */
+			data[len++] = 0xff;
+			data[len++] = 7;	/* width */
+			data[len++] = 0;
+			data[len++] = 13;	/* height */
+			data[len++] = 0;
+			for (j = 0; j < 16; j++)
+				data[len++] = (j < 13) ? corpus_random() & 0xfe : 0;
+		}
+		put_secondary(w, RDP_ORDER_FONTCACHE, 0, data, len);
+	}
+}
+
+static void
+put_tiles(struct writer *w, int Bpp)
+{
+	uint8 *data, *image;
+	int i, size, len;
+
+	data = xmalloc(TILE_SIZE * TILE_SIZE * Bpp * 2 + 16);
+	for (i = 0; i < NUM_TILES; i++)
+	{
+		/* the size field has 14 bits, so pick another tile if it does not fit */
+		do
+		{
+			image = corpus_image(TILE_SIZE, TILE_SIZE, Bpp);
+			len = 5;
+			if (Bpp == 4)
+				size = corpus_planar_encode(data + len, image, TILE_SIZE, TILE_SIZE);
+			else
+				size = corpus_rle_encode(data + len, image, TILE_SIZE, TILE_SIZE,
+							 Bpp);
+			xfree(image);
+		}
+		while (size > BUFSIZE_MASK);
+
+		/* header in front of the data */
+		data[0] = TILE_SIZE;
+		data[1] = size >> 8;
+		data[2] = size;
+		if (i < 0x80)
+		{
+			memmove(data + 4, data + 5, size);
+			data[3] = i;
+			len = 4;
+		}
+		else
+		{
+			data[3] = LONG_FORMAT | (i >> 8);
+			data[4] = i;
+		}
+
+		put_secondary(w, RDP_ORDER_BMPCACHE2, 2 | ((Bpp + 2) << MODE_SHIFT) | SQUARE, data,
+			      len + size);
+	}
+
+	xfree(data);
+}
+
+static void
+put_frame(struct writer *w, int frame)
+{
+	static const int bounds[4] = { 100, 100, 499, 399 };
+	uint8 text[TEXT_LENGTH * 2 + 3];
+	int i, j, x, y, len;
+
+	/* window and toolbar */
+	x = 32 + corpus_random() % 256;
+	y = 32 + corpus_random() % 128;
+	put_rect(w, x, y, 640, 480, corpus_random());
+	for (i = 0; i < 8; i++)
+		put_memblt(w, x + i * TILE_SIZE, y, (frame + i) % NUM_TILES);
+
+	/* lines of text, the first one is a cached fragment after the first frame */
+	for (i = 0; i < 10; i++)
+	{
+		len = 0;
+		if (i == 0 && frame > 0)
+		{
+			text[len++] = 0xfe;
+			text[len++] = 0;
+		}
+		else
+		{
+			for (j = 0; j < TEXT_LENGTH; j++)
+			{
+				text[len++] = 32 + corpus_random() % NUM_GLYPHS;
+				text[len++] = 8;
+			}
+			if (i == 0)
+			{
+				text[len++] = 0xff;
+				text[len++] = 0;
+				text[len++] = TEXT_LENGTH * 2;
+			}
+		}
+		put_text(w, x + 4, y + TILE_SIZE + i * 16, TEXT_LENGTH * 8, text, len, 0,
+			 0xffffff);
+	}
+
+	/* scroll the text up a line and draw a selection */
+	put_screenblt(w, x + 4, y + TILE_SIZE, TEXT_LENGTH * 8, 144, x + 4, y + TILE_SIZE + 16);
+	put_destblt(w, x + 4, y + TILE_SIZE + 16 * (frame % 10), TEXT_LENGTH * 8, 16);
+
+	put_patblt(w, x, y + 400, 640, 80, 0, 0, 0, corpus_random(), NULL);
+	put_patblt(w, 0, 0, 1024, 768, 2, frame % 6, 0xffffff, 0x808080, bounds);
+
+	for (i = 0; i < 6; i++)
+		put_line(w, x, y + 240 + i * 20, x + 639, y + 240 + i * 20, 0x404040);
+}
+
+static uint8 *
+generate(struct orders_corpus *c, int Bpp)
+{
+	struct writer w;
+	size_t start;
+	int frame;
+
+	memset(&w, 0, sizeof(w));
+	w.last_type = RDP_ORDER_PATBLT;
+	c->count = NUM_FRAMES + 1;
+	c->pdus = xmalloc(c->count * sizeof(struct pdu));
+
+	corpus_seed(0x5eed + Bpp);
+	put_glyphs(&w);
+	put_tiles(&w, Bpp);
+	c->pdus[0].offset = 0;
+	c->pdus[0].length = w.length;
+	c->pdus[0].count = (NUM_GLYPHS + 31) / 32 + NUM_TILES;
+
+	for (frame = 0; frame < NUM_FRAMES; frame++)
+	{
+		start = w.length;
+		put_frame(&w, frame);
+		c->pdus[frame + 1].offset = start;
+		c->pdus[frame + 1].length = w.length - start;
+		c->pdus[frame + 1].count = 8 + 1 + 10 + 2 + 2 + 6;
+	}
+
+	c->data = w.data;
+	return w.data;
+}
+
+uint8 *
+orders_corpus(int Bpp, size_t * length)
+{
+	struct orders_corpus c;
+	uint8 *data = generate(&c, Bpp);
+
+	*length = c.pdus[c.count - 1].offset + c.pdus[c.count - 1].length;
+	xfree(c.pdus);
+	return data;
+}
+
+static RD_BOOL
+replay(struct orders_corpus *c)
+{
+	struct stream s;
+	RD_BOOL complete = True;
+	int i;
+
+	g_server_depth = c->depth;
+	reset_order_state();
+
+	for (i = 0; i < c->count; i++)
+	{
+		memset(&s, 0, sizeof(s));
+		s.data = s.p = c->data + c->pdus[i].offset;
+		s.end = s.p + c->pdus[i].length;
+		s.size = c->pdus[i].length;
+		process_orders(&s, c->pdus[i].count);
+		complete = complete && s_check_end(&s);
+	}
+
+	return complete;
+}
+
+static void
+bench_process_orders(void *arg)
+{
+	replay(arg);
+}
+
+void
+orders_bench_init(void)
+{
+	static const char *names[] = { "process_orders/16bpp", "process_orders/32bpp" };
+	struct orders_corpus *c;
+	int i;
+
+	g_server_depth = 32;
+	ui_init();
+	ui_create_window(1024, 768);
+
+	for (i = 0; i < 2; i++)
+	{
+		c = &g_corpus[i];
+		c->depth = i ? 32 : 16;
+		generate(c, c->depth / 8);
+		if (!replay(c))
+			bench_fail(names[i], "order stream was not fully consumed");
+
+		bench_add(names[i], c->pdus[c->count - 1].offset + c->pdus[c->count - 1].length,
+			  bench_process_orders, c);
+	}
+}
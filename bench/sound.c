@@ -0,0 +1,168 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks - sound resampling
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bench.h"
+
+#ifdef WITH_RDPSND
+
+#include "../rdpsnd.h"
+#include "../rdpsnd_dsp.h"
+
+/* One second of audio per iteration, played on a 44.1 kHz 16 bit stereo device */
+struct resample_case
+{
+	const char *name;
+	uint32 rate;
+	uint16 bits;
+	uint16 channels;
+	RD_WAVEFORMATEX format;
+	uint8 *data;
+	uint32 size;
+};
+
+/* Resampling alone, for a device with its own volume control */
+static struct resample_case g_cases[] = {
+	{"rdpsnd_dsp_process/22050m16-44100s16", 22050, 16, 1, {0}, NULL, 0},
+	{"rdpsnd_dsp_process/11025m8-44100s16", 11025, 8, 1, {0}, NULL, 0},
+	{"rdpsnd_dsp_process/22050s16-44100s16", 22050, 16, 2, {0}, NULL, 0}
+};
+
+/* The whole chain for a device using software volume */
+static struct resample_case g_softvol_cases[] = {
+	{"rdpsnd_dsp_process/44100s16-softvol", 44100, 16, 2, {0}, NULL, 0},
+	{"rdpsnd_dsp_process/22050s16-44100s16-softvol", 22050, 16, 2, {0}, NULL, 0}
+};
+
+/* IMA ADPCM as sent by the server, decoded on the way */
+static struct resample_case g_adpcm_case =
+	{"rdpsnd_dsp_process/22050s4-ima-44100s16", 22050, 16, 2, {0}, NULL, 0};
+
+static struct audio_driver g_driver, g_softvol_driver;
+static STREAM g_process_out;
+
+static void
+bench_resample(void *arg)
+{
+	struct resample_case *c = arg;
+
+	rdpsnd_dsp_release(g_process_out);
+	if (!rdpsnd_dsp_process(c->data, c->size, &g_driver, &c->format, g_process_out))
+		bench_fail(c->name, "no room in the ring");
+}
+
+static void
+bench_softvol(void *arg)
+{
+	struct resample_case *c = arg;
+
+	rdpsnd_dsp_release(g_process_out);
+	if (!rdpsnd_dsp_process(c->data, c->size, &g_softvol_driver, &c->format, g_process_out))
+		bench_fail(c->name, "no room in the ring");
+}
+
+/* A triangle wave with some noise */
+static void
+setup_case(struct resample_case *c)
+{
+	static int phase = 0;
+	uint32 j, frames;
+
+	c->format.wFormatTag = WAVE_FORMAT_PCM;
+	c->format.nChannels = c->channels;
+	c->format.nSamplesPerSec = c->rate;
+	c->format.wBitsPerSample = c->bits;
+	c->format.nBlockAlign = c->channels * c->bits / 8;
+	c->format.nAvgBytesPerSec = c->rate * c->format.nBlockAlign;
+
+	frames = c->rate;
+	c->size = frames * c->format.nBlockAlign;
+	c->data = xmalloc(c->size);
+
+	for (j = 0; j < c->size / (c->bits / 8); j++)
+	{
+		phase = (phase + 300) & 0xffff;
+		if (c->bits == 8)
+			c->data[j] = 128 + ((abs(phase - 0x8000) >> 9) - 64)
+				+ (corpus_random() & 3);
+		else
+			((sint16 *) c->data)[j] = abs(phase - 0x8000) - 0x4000
+				+ (corpus_random() & 0xff);
+	}
+}
+
+void
+sound_bench_init(void)
+{
+	struct resample_case *c;
+	STREAM encoded;
+	uint32 i;
+
+	if (!rdpsnd_dsp_resample_set(44100, 16, 2))
+		bench_fail("rdpsnd_dsp_process", "no resampler");
+
+	g_driver.need_resampling = True;
+	g_softvol_driver.need_resampling = True;
+	g_softvol_driver.wave_out_volume = rdpsnd_dsp_softvol_set;
+	rdpsnd_dsp_softvol_set(49152, 32768);
+	g_process_out = s_inherit(NULL, 0);
+
+	corpus_seed(44100);
+	for (i = 0; i < sizeof(g_cases) / sizeof(g_cases[0]); i++)
+	{
+		c = &g_cases[i];
+		setup_case(c);
+
+		bench_resample(c);
+		if ((uint32) s_length(g_process_out) < c->size)
+			bench_fail(c->name, "format not resampled");
+
+		bench_add(c->name, c->size, bench_resample, c);
+	}
+
+	for (i = 0; i < sizeof(g_softvol_cases) / sizeof(g_softvol_cases[0]); i++)
+	{
+		c = &g_softvol_cases[i];
+		setup_case(c);
+		bench_add(c->name, c->size, bench_softvol, c);
+	}
+
+	/* whole 2048 byte blocks of the triangle wave */
+	c = &g_adpcm_case;
+	setup_case(c);
+	c->format.wFormatTag = WAVE_FORMAT_IMA_ADPCM;
+	c->format.wBitsPerSample = 4;
+	c->format.nBlockAlign = 2048;
+	c->format.cbSize = 2;
+	encoded = rdpsnd_dsp_encode(c->data, c->size, &c->format);
+	xfree(c->data);
+	c->size = s_length(encoded);
+	c->data = xmalloc(c->size);
+	memcpy(c->data, encoded->data, c->size);
+	s_free(encoded);
+	bench_add(c->name, c->size, bench_resample, c);
+}
+
+#else
+
+void
+sound_bench_init(void)
+{
+}
+
+#endif /* WITH_RDPSND */
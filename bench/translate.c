@@ -0,0 +1,119 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Microbenchmarks - pixel format translation
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * translate_image() and its helpers are static, and only depend on the
+ * visual chosen in ui_init(). The visual is set up by hand here for a
+ * little endian X server with the usual colour masks, so no display is
+ * needed.
+ */
+
+#include "../xwin.c"
+#include "bench.h"
+
+#define TILE_SIZE 64
+#define NUM_TILES 16
+
+struct translate_case
+{
+	char name[32];
+	int server_depth;
+	int bpp;
+	uint8 *tiles[NUM_TILES];
+};
+
+static struct translate_case g_cases[12];
+
+static void
+setup_visual(int bpp)
+{
+	uint16 endianness_test = 1;
+
+	g_host_be = !(RD_BOOL) (*(uint8 *) (&endianness_test));
+	g_xserver_be = False;
+	g_compatible_arch = !g_host_be;
+	g_no_translate_image = False;
+	g_bpp = bpp;
+	g_depth = (bpp == 16) ? 16 : 24;
+
+	if (g_depth == 16)
+	{
+		calculate_shifts(0xf800, &g_red_shift_r, &g_red_shift_l);
+		calculate_shifts(0x07e0, &g_green_shift_r, &g_green_shift_l);
+		calculate_shifts(0x001f, &g_blue_shift_r, &g_blue_shift_l);
+	}
+	else
+	{
+		calculate_shifts(0xff0000, &g_red_shift_r, &g_red_shift_l);
+		calculate_shifts(0x00ff00, &g_green_shift_r, &g_green_shift_l);
+		calculate_shifts(0x0000ff, &g_blue_shift_r, &g_blue_shift_l);
+	}
+}
+
+static void
+bench_translate(void *arg)
+{
+	struct translate_case *c = arg;
+	uint8 *out;
+	int i;
+
+	g_server_depth = c->server_depth;
+	setup_visual(c->bpp);
+
+	for (i = 0; i < NUM_TILES; i++)
+	{
+		out = translate_image(TILE_SIZE, TILE_SIZE, c->tiles[i]);
+		if (out != c->tiles[i])
+			xfree(out);
+	}
+}
+
+void
+translate_bench_init(void)
+{
+	static const int depths[] = { 8, 15, 16, 24 };
+	static const int bpps[] = { 16, 24, 32 };
+	struct translate_case *c = g_cases;
+	int d, b, i, Bpp;
+
+	/* an arbitrary but fixed palette for 8 bpp */
+	g_colmap = xmalloc(256 * sizeof(uint32));
+	corpus_seed(256);
+	for (i = 0; i < 256; i++)
+		g_colmap[i] = corpus_random();
+
+	for (d = 0; d < 4; d++)
+	{
+		for (b = 0; b < 3; b++, c++)
+		{
+			c->server_depth = depths[d];
+			c->bpp = bpps[b];
+			snprintf(c->name, sizeof(c->name), "translate_image/%dto%d", c->server_depth,
+				 c->bpp);
+
+			Bpp = (c->server_depth + 7) / 8;
+			corpus_seed(c->server_depth);
+			for (i = 0; i < NUM_TILES; i++)
+				c->tiles[i] = corpus_image(TILE_SIZE, TILE_SIZE, Bpp);
+
+			bench_add(c->name, NUM_TILES * TILE_SIZE * TILE_SIZE * Bpp,
+				  bench_translate, c);
+		}
+	}
+}
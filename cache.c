@@ -350,54 +350,263 @@ cache_put_text(uint8 cache_id, void *data, int length)
 
 
 /* DESKTOP CACHE */
-static uint8 g_deskcache[0x38400 * 4];
+/*
+ * The server addresses its desktop save area as a flat byte array of
+ * DESKCACHE_SIZE bytes.  Rather than keeping the pixel data itself, we
+ * keep the ui bitmap each save order produced, together with the byte
+ * range it occupies, so that save and restore stay on the ui side.  A
+ * later save over part of that range only takes away the rows it touches.
+ *
+ * Bytes that lose their bitmap without being overwritten are read back
+ * into g_deskcache_data, so a restore that no single bitmap can serve is
+ * put together there, as the server expects.
+ */
+#define DESKCACHE_SIZE (0x38400 * 4)
+#define DESKCACHE_ENTRIES 64
 
-/* Retrieve desktop data from the cache */
-uint8 *
-cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel)
+struct deskcache_entry
+{
+	uint32 offset;
+	uint32 length;
+	int cx;
+	int cy;			/* rows still valid */
+	int y;			/* first of them in bitmap */
+	RD_HBITMAP bitmap;
+};
+
+static struct deskcache_entry g_deskcache[DESKCACHE_ENTRIES];
+static int g_deskcache_victim;
+static uint8 g_deskcache_data[DESKCACHE_SIZE];
+
+/* Drop the desktop cache entry in slot n */
+static void
+cache_evict_desktop(int n)
+{
+	ui_destroy_bitmap(g_deskcache[n].bitmap);
+	g_deskcache[n].bitmap = NULL;
+}
+
+/* Read rows first to first + count - 1 of the entry in slot n back into
+   the byte array */
+static void
+cache_flush_desktop(int n, int first, int count)
+{
+	struct deskcache_entry *e = &g_deskcache[n];
+
+	if (count <= 0)
+		return;
+
+	ui_desktop_read(e->bitmap, e->y + first, e->cx, count,
+			&g_deskcache_data[e->offset + first * (e->length / e->cy)]);
+}
+
+/* Keep the rows of the entry in slot n that a save of length bytes at offset
+   leaves alone. If the save splits them, only the larger part is kept, and
+   the rest goes to the byte array along with rows the save only partly
+   covers. */
+static void
+cache_trim_desktop(int n, uint32 offset, uint32 length)
+{
+	struct deskcache_entry *e = &g_deskcache[n];
+	uint32 scanline, head, tail, tail_start, end;
+
+	if (e->length == 0)
+	{
+		cache_evict_desktop(n);
+		return;
+	}
+
+	scanline = e->length / e->cy;
+	head = (offset > e->offset) ? (offset - e->offset) / scanline : 0;
+	tail_start = (offset + length - e->offset + scanline - 1) / scanline;
+	tail = (tail_start < (uint32) e->cy) ? e->cy - tail_start : 0;
+
+	/* the bytes of these rows before and after the save are still valid */
+	end = offset + length - e->offset;
+	if (offset > e->offset && (offset - e->offset) % scanline != 0)
+		cache_flush_desktop(n, head, 1);
+	if (end < e->length && end % scanline != 0)
+		cache_flush_desktop(n, end / scanline, 1);
+
+	if (head == 0 && tail == 0)
+	{
+		cache_evict_desktop(n);
+		return;
+	}
+
+	if (head >= tail)
+	{
+		cache_flush_desktop(n, tail_start, tail);
+		e->cy = head;
+	}
+	else
+	{
+		cache_flush_desktop(n, 0, head);
+		e->offset += tail_start * scanline;
+		e->y += tail_start;
+		e->cy = tail;
+	}
+	e->length = e->cy * scanline;
+}
+
+/* Retrieve desktop data from the cache. Returns the bitmap holding the
+   requested range and sets *y to the first row of it within the bitmap. */
+RD_HBITMAP
+cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel, int *y)
 {
-	int length = cx * cy * bytes_per_pixel;
+	struct deskcache_entry *e;
+	uint32 scanline = cx * bytes_per_pixel;
+	uint32 length = scanline * cy;
+	int n;
 
-	if (offset > sizeof(g_deskcache))
+	if (offset > DESKCACHE_SIZE)
 		offset = 0;
 
-	if ((offset + length) <= sizeof(g_deskcache))
+	if (length != 0 && (offset + length) <= DESKCACHE_SIZE)
 	{
-		return &g_deskcache[offset];
+		/* a restore may cover any whole number of rows of an earlier
+		   save, as long as it is read back with the same width */
+		for (n = 0; n < DESKCACHE_ENTRIES; n++)
+		{
+			e = &g_deskcache[n];
+			if (e->bitmap == NULL || e->cx != cx)
+				continue;
+
+			if (offset < e->offset || (offset + length) > (e->offset + e->length))
+				continue;
+
+			if ((offset - e->offset) % scanline != 0)
+				continue;
+
+			*y = e->y + (offset - e->offset) / scanline;
+			return e->bitmap;
+		}
 	}
 
 	logger(Core, Debug, "cache_get_desktop(), offset=%d, length=%d", offset, length);
 	return NULL;
 }
 
+/* Retrieve desktop data as bytes, for a restore that no single bitmap
+   holds. The rows of every bitmap in the range are read back first. */
+uint8 *
+cache_get_desktop_data(uint32 offset, int cx, int cy, int bytes_per_pixel)
+{
+	struct deskcache_entry *e;
+	uint32 length = cx * cy * bytes_per_pixel;
+	uint32 scanline, first, last;
+	int n;
+
+	if (offset > DESKCACHE_SIZE)
+		offset = 0;
+
+	if ((offset + length) > DESKCACHE_SIZE)
+	{
+		logger(Core, Debug, "cache_get_desktop_data(), offset=%d, length=%d", offset,
+		       length);
+		return NULL;
+	}
+
+	for (n = 0; n < DESKCACHE_ENTRIES; n++)
+	{
+		e = &g_deskcache[n];
+		if (e->bitmap == NULL || e->length == 0)
+			continue;
+
+		if (offset >= (e->offset + e->length) || e->offset >= (offset + length))
+			continue;
+
+		scanline = e->length / e->cy;
+		first = (offset > e->offset) ? (offset - e->offset) / scanline : 0;
+		last = MIN((uint32) e->cy, (offset + length - e->offset + scanline - 1) / scanline);
+		cache_flush_desktop(n, first, last - first);
+	}
+
+	return &g_deskcache_data[offset];
+}
+
 /* Store desktop data in the cache */
+/* this function takes over the bitmap, e.g. caller gives it up */
 void
-cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_per_pixel, uint8 * data)
+cache_put_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel, RD_HBITMAP bitmap)
 {
-	int length = cx * cy * bytes_per_pixel;
+	struct deskcache_entry *e;
+	uint32 length = cx * cy * bytes_per_pixel;
+	int n, slot = -1;
 
-	if (offset > sizeof(g_deskcache))
+	if (offset > DESKCACHE_SIZE)
 		offset = 0;
 
-	if ((offset + length) <= sizeof(g_deskcache))
+	if ((offset + length) > DESKCACHE_SIZE)
+	{
+		logger(Core, Error, "cache_put_desktop(), offset=%d, length=%d", offset, length);
+		ui_destroy_bitmap(bitmap);
+		return;
+	}
+
+	/* the new data overwrites these bytes of any earlier save */
+	for (n = 0; n < DESKCACHE_ENTRIES; n++)
 	{
-		cx *= bytes_per_pixel;
-		while (cy--)
+		e = &g_deskcache[n];
+		if (e->bitmap == NULL)
+		{
+			if (slot < 0)
+				slot = n;
+			continue;
+		}
+
+		if (offset < (e->offset + e->length) && e->offset < (offset + length))
 		{
-			memcpy(&g_deskcache[offset], data, cx);
-			data += scanline;
-			offset += cx;
+			cache_trim_desktop(n, offset, length);
+			if (e->bitmap == NULL && slot < 0)
+				slot = n;
 		}
 	}
-	else
+
+	if (slot < 0)
 	{
-		logger(Core, Error, "cache_put_desktop(), offset=%d, length=%d", offset, length);
+		slot = g_deskcache_victim;
+		g_deskcache_victim = (g_deskcache_victim + 1) % DESKCACHE_ENTRIES;
+		cache_flush_desktop(slot, 0, g_deskcache[slot].cy);
+		cache_evict_desktop(slot);
 	}
+
+	e = &g_deskcache[slot];
+	e->offset = offset;
+	e->length = length;
+	e->cx = cx;
+	e->cy = cy;
+	e->y = 0;
+	e->bitmap = bitmap;
 }
 
 
 /* CURSOR CACHE */
-static RD_HCURSOR g_cursorcache[0x20];
+static RD_HCURSOR *g_cursorcache;
+static uint16 g_cursorcache_size;
+
+/* Size the cursor cache to the negotiated pointer cache size */
+void
+cache_resize_cursors(uint16 size)
+{
+	uint16 i;
+
+	if (size == g_cursorcache_size)
+		return;
+
+	logger(Core, Debug, "cache_resize_cursors(), %d -> %d entries", g_cursorcache_size, size);
+
+	/* the server will resend anything it wants to use again */
+	for (i = 0; i < g_cursorcache_size; i++)
+	{
+		if (g_cursorcache[i] != NULL)
+			ui_destroy_cursor(g_cursorcache[i]);
+	}
+
+	g_cursorcache = xrealloc(g_cursorcache, size * sizeof(RD_HCURSOR));
+	memset(g_cursorcache, 0, size * sizeof(RD_HCURSOR));
+	g_cursorcache_size = size;
+}
 
 /* Retrieve cursor from cache */
 RD_HCURSOR
@@ -405,7 +614,7 @@ cache_get_cursor(uint16 cache_idx)
 {
 	RD_HCURSOR cursor;
 
-	if (cache_idx < NUM_ELEMENTS(g_cursorcache))
+	if (cache_idx < g_cursorcache_size)
 	{
 		cursor = g_cursorcache[cache_idx];
 		if (cursor != NULL)
@@ -422,7 +631,7 @@ cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor)
 {
 	RD_HCURSOR old;
 
-	if (cache_idx < NUM_ELEMENTS(g_cursorcache))
+	if (cache_idx < g_cursorcache_size)
 	{
 		old = g_cursorcache[cache_idx];
 		if (old != NULL)
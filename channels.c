@@ -23,6 +23,7 @@
 
 #define MAX_CHANNELS			6
 #define CHANNEL_CHUNK_LENGTH		1600
+#define CHANNEL_CHUNK_MAX_LENGTH	16256
 #define CHANNEL_FLAG_FIRST		0x01
 #define CHANNEL_FLAG_LAST		0x02
 #define CHANNEL_FLAG_SHOW_PROTOCOL	0x10
@@ -30,7 +31,7 @@
 extern RDP_VERSION g_rdp_version;
 extern RD_BOOL g_encryption;
 
-uint32 vc_chunk_size = CHANNEL_CHUNK_LENGTH;
+static uint32 vc_chunk_size = CHANNEL_CHUNK_LENGTH;
 
 VCHANNEL g_channels[MAX_CHANNELS];
 unsigned int g_num_channels;
@@ -69,6 +70,52 @@ channel_register(char *name, uint32 flags, void (*callback) (STREAM))
 	return channel;
 }
 
+/* Have fragmented messages passed to callback as they arrive. The callback
+   returns False for a first fragment, without reading from it, to get that
+   message reassembled as usual. */
+void
+channel_set_fragment_handler(VCHANNEL * channel,
+			     RD_BOOL(*callback) (STREAM, uint32, RD_BOOL, RD_BOOL))
+{
+	channel->fragment = callback;
+}
+
+/* Set the chunk size from the server's virtual channel capability, 0 if it sent none */
+void
+channel_set_chunk_size(uint32 size)
+{
+	if (size == 0)
+		size = CHANNEL_CHUNK_LENGTH;
+
+	if (size < CHANNEL_CHUNK_LENGTH || size > CHANNEL_CHUNK_MAX_LENGTH)
+	{
+		logger(Protocol, Warning,
+		       "channel_set_chunk_size(), invalid chunk size %u, using %u", size,
+		       CHANNEL_CHUNK_LENGTH);
+		size = CHANNEL_CHUNK_LENGTH;
+	}
+
+	logger(Protocol, Debug, "channel_set_chunk_size(), chunk size %u", size);
+	vc_chunk_size = size;
+}
+
+/* Log how much went through each channel */
+void
+channel_log_stats(void)
+{
+	VCHANNEL *channel;
+	unsigned int i;
+
+	for (i = 0; i < g_num_channels; i++)
+	{
+		channel = &g_channels[i];
+		logger(Protocol, Verbose,
+		       "channel_log_stats(), %.8s: sent %llu bytes in %u chunks, received %llu bytes in %u chunks",
+		       channel->name, (unsigned long long) channel->bytes_out, channel->chunks_out,
+		       (unsigned long long) channel->bytes_in, channel->chunks_in);
+	}
+}
+
 STREAM
 channel_init(VCHANNEL * channel, uint32 length)
 {
@@ -95,7 +142,7 @@ channel_send_chunk(STREAM s, VCHANNEL * channel, uint32 length)
 
 	/* Actually, CHANNEL_CHUNK_LENGTH (default value is 1600 bytes) is described
 	   in MS-RDPBCGR (s. 2.2.6, s.3.1.5.2.1) and can be set by server only
-	   in the optional field VCChunkSize of VC Caps) */
+	   in the optional field VCChunkSize of VC Caps), see channel_set_chunk_size() */
 
 	thislength = MIN(s_remaining(s), vc_chunk_size);
 
@@ -142,6 +189,8 @@ channel_send_chunk(STREAM s, VCHANNEL * channel, uint32 length)
 		s_mark_end(chunk);
 	}
 	sec_send_to_channel(chunk, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
+	channel->bytes_out += thislength;
+	channel->chunks_out++;
 
 	/* Sending modifies the current offset, so make it is marked as
 	   fully completed. */
@@ -182,6 +231,88 @@ channel_send(STREAM s, VCHANNEL * channel)
 #endif
 }
 
+/* Start a message of length bytes, sent piece by piece with channel_send_data() */
+void
+channel_send_start(VCHANNEL * channel, uint32 length)
+{
+	logger(Protocol, Debug, "channel_send_start(), channel = %d, length = %d",
+	       channel->mcs_id, length);
+
+	s_realloc(&channel->out, vc_chunk_size);
+	s_reset(&channel->out);
+	channel->out_length = length;
+	channel->out_sent = 0;
+}
+
+static void
+channel_send_out(VCHANNEL * channel)
+{
+	uint32 flags, thislength;
+	STREAM chunk;
+
+	thislength = s_tell(&channel->out);
+
+	flags = 0;
+	if (channel->out_sent == 0)
+		flags |= CHANNEL_FLAG_FIRST;
+	if (channel->out_sent + thislength == channel->out_length)
+		flags |= CHANNEL_FLAG_LAST;
+	if (channel->flags & CHANNEL_OPTION_SHOW_PROTOCOL)
+		flags |= CHANNEL_FLAG_SHOW_PROTOCOL;
+
+	logger(Protocol, Debug, "channel_send_out(), sending %d bytes with flags 0x%x",
+	       thislength, flags);
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_CHANNEL);
+#endif
+
+	chunk = sec_init(g_encryption ? SEC_ENCRYPT : 0, thislength + 8);
+	out_uint32_le(chunk, channel->out_length);
+	out_uint32_le(chunk, flags);
+	out_uint8a(chunk, channel->out.data, thislength);
+	s_mark_end(chunk);
+	sec_send_to_channel(chunk, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
+	s_free(chunk);
+
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+
+	channel->bytes_out += thislength;
+	channel->chunks_out++;
+	channel->out_sent += thislength;
+	s_reset(&channel->out);
+}
+
+/* Add data to the message started with channel_send_start(), sending each
+   chunk as soon as it is full */
+void
+channel_send_data(VCHANNEL * channel, uint8 * data, uint32 length)
+{
+	uint32 thislength, room;
+
+	while (length > 0)
+	{
+		room = MIN(vc_chunk_size, channel->out_length - channel->out_sent);
+		thislength = MIN(length, room - s_tell(&channel->out));
+		if (thislength == 0)
+		{
+			logger(Protocol, Error,
+			       "channel_send_data(), %.8s: dropping %u bytes beyond message length %u",
+			       channel->name, length, channel->out_length);
+			return;
+		}
+
+		out_uint8a(&channel->out, data, thislength);
+		data += thislength;
+		length -= thislength;
+
+		if (s_tell(&channel->out) == room)
+			channel_send_out(channel);
+	}
+}
+
 void
 channel_process(STREAM s, uint16 mcs_channel)
 {
@@ -203,6 +334,9 @@ channel_process(STREAM s, uint16 mcs_channel)
 
 	in_uint32_le(s, length);
 	in_uint32_le(s, flags);
+	channel->bytes_in += s_remaining(s);
+	channel->chunks_in++;
+
 	if ((flags & CHANNEL_FLAG_FIRST) && (flags & CHANNEL_FLAG_LAST))
 	{
 		/* single fragment - pass straight up */
@@ -210,6 +344,20 @@ channel_process(STREAM s, uint16 mcs_channel)
 	}
 	else
 	{
+		if (flags & CHANNEL_FLAG_FIRST)
+			channel->streaming = channel->fragment != NULL
+				&& channel->fragment(s, length, True, False);
+		else if (channel->streaming)
+			channel->fragment(s, length, False,
+					  (flags & CHANNEL_FLAG_LAST) != 0);
+
+		if (channel->streaming)
+		{
+			if (flags & CHANNEL_FLAG_LAST)
+				channel->streaming = False;
+			return;
+		}
+
 		/* add fragment to defragmentation buffer */
 		in = &channel->in;
 		if (flags & CHANNEL_FLAG_FIRST)
@@ -218,7 +366,19 @@ channel_process(STREAM s, uint16 mcs_channel)
 			s_reset(in);
 		}
 
+		/* Chunks may be up to CHANNEL_CHUNK_MAX_LENGTH, but never past the
+		   total. The rest of a broken message is dropped up to the next
+		   first chunk. */
 		thislength = s_remaining(s);
+		if (s_tell(in) >= length || thislength > length - s_tell(in)
+		    || thislength > s_left(in))
+		{
+			logger(Protocol, Error,
+			       "channel_process(), %.8s: dropping chunk of %u bytes beyond message length %u",
+			       channel->name, thislength, length);
+			in->p = in->data + in->size;
+			return;
+		}
 		out_uint8stream(in, s, thislength);
 
 		if (flags & CHANNEL_FLAG_LAST)
@@ -19,22 +19,67 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iconv.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include "rdesktop.h"
+#include "disk.h"
 
 #define CLIPRDR_CONNECT			1
 #define CLIPRDR_FORMAT_ANNOUNCE		2
 #define CLIPRDR_FORMAT_ACK		3
 #define CLIPRDR_DATA_REQUEST		4
 #define CLIPRDR_DATA_RESPONSE		5
+#define CLIPRDR_CLIP_CAPS		7
+#define CLIPRDR_FILECONTENTS_REQUEST	8
+#define CLIPRDR_FILECONTENTS_RESPONSE	9
 
 #define CLIPRDR_REQUEST			0
 #define CLIPRDR_RESPONSE		1
 #define CLIPRDR_ERROR			2
+#define CLIPRDR_ASCII_NAMES		4
+
+#define CB_CAPSTYPE_GENERAL		1
+#define CB_CAPS_VERSION_2		2
+#define CB_STREAM_FILECLIP_ENABLED	0x04
+#define CB_FILECLIP_NO_FILE_PATHS	0x08
+
+#define FILECONTENTS_SIZE		1
+#define FILECONTENTS_RANGE		2
+
+#define FD_ATTRIBUTES			0x0004
+#define FD_WRITESTIME			0x0020
+#define FD_FILESIZE			0x0040
+#define FD_SHOWPROGRESSUI		0x4000
+#define FILEDESCRIPTOR_LENGTH		592
+#define FILEDESCRIPTOR_NAME_LENGTH	520
+
+#define CLIPRDR_FILE_THREADS		4
+#define CLIPRDR_FILE_DEPTH		32
+/* Largest range served, and how far ahead of it the kernel is asked to read */
+#define CLIPRDR_RANGE_MAX		(4 * 1024 * 1024)
+#define CLIPRDR_READAHEAD		(1024 * 1024)
+/* Largest data response taken from the server */
+#define CLIPRDR_RECV_MAX		(1024 * 1024 * 1024)
 
 static VCHANNEL *cliprdr_channel;
 
 static uint8 *last_formats = NULL;
 static uint32 last_formats_length = 0;
+static uint16 last_formats_flags = 0;
+
+/* Data response being sent, or received, piece by piece */
+static uint32 send_remaining = 0;
+static RD_BOOL send_pad = False;
+static uint32 recv_length = 0;
+static uint32 recv_offset = 0;
 
 static void
 cliprdr_send_packet(uint16 type, uint16 status, uint8 * data, uint32 length)
@@ -49,12 +94,31 @@ cliprdr_send_packet(uint16 type, uint16 status, uint8 * data, uint32 length)
 	out_uint16_le(s, status);
 	out_uint32_le(s, length);
 	out_uint8a(s, data, length);
-	out_uint32(s, 0);	/* pad? */
+	/* MS-RDPECLIP ends a PDU after dataLen bytes. These four are not
+	   counted there, servers ignore them, and every PDU has them. */
+	out_uint32(s, 0);
 	s_mark_end(s);
 	channel_send(s, cliprdr_channel);
 	s_free(s);
 }
 
+static void
+cliprdr_send_format_announce(uint16 flags, uint8 * formats_data, uint32 formats_data_length)
+{
+	cliprdr_send_packet(CLIPRDR_FORMAT_ANNOUNCE, flags, formats_data, formats_data_length);
+
+	if (formats_data != last_formats)
+	{
+		if (last_formats)
+			xfree(last_formats);
+
+		last_formats = xmalloc(formats_data_length);
+		memcpy(last_formats, formats_data, formats_data_length);
+		last_formats_length = formats_data_length;
+		last_formats_flags = flags;
+	}
+}
+
 /* Helper which announces our readiness to supply clipboard data
    in a single format (such as CF_TEXT) to the RDP side.
    To announce more than one format at a time, use
@@ -73,6 +137,22 @@ cliprdr_send_simple_native_format_announce(uint32 format)
 	cliprdr_send_native_format_announce(buffer, sizeof(buffer));
 }
 
+/* Announces a file list along with a text format. The file list format
+   is known by its name, which only fits the 32 bytes as ASCII. */
+void
+cliprdr_send_file_format_announce(uint32 format)
+{
+	uint8 buffer[72];
+
+	logger(Clipboard, Debug, "cliprdr_send_file_format_announce() format 0x%x", format);
+
+	memset(buffer, 0, sizeof(buffer));
+	buf_out_uint32(buffer, format);
+	buf_out_uint32(buffer + 36, CF_FILEGROUPDESCRIPTORW);
+	memcpy(buffer + 40, "FileGroupDescriptorW", 20);
+	cliprdr_send_format_announce(CLIPRDR_ASCII_NAMES, buffer, sizeof(buffer));
+}
+
 /* Announces our readiness to supply clipboard data in multiple
    formats, each denoted by a 36-byte format descriptor of
    [ uint32 format + 32-byte description ].
@@ -82,18 +162,21 @@ cliprdr_send_native_format_announce(uint8 * formats_data, uint32 formats_data_le
 {
 	logger(Clipboard, Debug, "cliprdr_send_native_format_announce()");
 
-	cliprdr_send_packet(CLIPRDR_FORMAT_ANNOUNCE, CLIPRDR_REQUEST, formats_data,
-			    formats_data_length);
+	cliprdr_send_format_announce(CLIPRDR_REQUEST, formats_data, formats_data_length);
+}
 
-	if (formats_data != last_formats)
-	{
-		if (last_formats)
-			xfree(last_formats);
+/* Tell the server we can hand out files in ranges. Without long format
+   names, the format lists stay in the 36-byte form. */
+static void
+cliprdr_send_capabilities(void)
+{
+	uint8 buffer[16];
 
-		last_formats = xmalloc(formats_data_length);
-		memcpy(last_formats, formats_data, formats_data_length);
-		last_formats_length = formats_data_length;
-	}
+	buf_out_uint32(buffer, 1);	/* cCapabilitiesSets, pad */
+	buf_out_uint32(buffer + 4, CB_CAPSTYPE_GENERAL | (12 << 16));
+	buf_out_uint32(buffer + 8, CB_CAPS_VERSION_2);
+	buf_out_uint32(buffer + 12, CB_STREAM_FILECLIP_ENABLED | CB_FILECLIP_NO_FILE_PATHS);
+	cliprdr_send_packet(CLIPRDR_CLIP_CAPS, CLIPRDR_REQUEST, buffer, sizeof(buffer));
 }
 
 void
@@ -113,6 +196,591 @@ cliprdr_send_data(uint8 * data, uint32 length)
 	cliprdr_send_packet(CLIPRDR_DATA_RESPONSE, CLIPRDR_RESPONSE, data, length);
 }
 
+static void
+cliprdr_send_packet_more(uint8 * data, uint32 length)
+{
+	length = MIN(length, send_remaining);
+	if (length > 0)
+		channel_send_data(cliprdr_channel, data, length);
+	send_remaining -= length;
+
+	/* the same trailing four bytes as cliprdr_send_packet() */
+	if (send_remaining == 0 && send_pad)
+	{
+		channel_send_data(cliprdr_channel, (uint8 *) "\0\0\0\0", 4);
+		send_pad = False;
+	}
+}
+
+/* Start a packet with length bytes of data, to be followed by exactly that
+   much in cliprdr_send_packet_more() */
+static void
+cliprdr_send_packet_start(uint16 type, uint16 status, uint32 length)
+{
+	uint8 header[8];
+
+	logger(Clipboard, Debug, "cliprdr_send_packet_start(), type=%d, status=%d, length=%d",
+	       type, status, length);
+
+	buf_out_uint32(header, type | (status << 16));
+	buf_out_uint32(header + 4, length);
+
+	channel_send_start(cliprdr_channel, length + 12);
+	channel_send_data(cliprdr_channel, header, sizeof(header));
+	send_remaining = length;
+	send_pad = True;
+	cliprdr_send_packet_more(NULL, 0);
+}
+
+/* Start a data response of length bytes, to be followed by exactly that
+   much in cliprdr_send_data_more() */
+void
+cliprdr_send_data_start(uint32 length)
+{
+	cliprdr_send_packet_start(CLIPRDR_DATA_RESPONSE, CLIPRDR_RESPONSE, length);
+}
+
+void
+cliprdr_send_data_more(uint8 * data, uint32 length)
+{
+	cliprdr_send_packet_more(data, length);
+}
+
+/* Pass data responses on as they arrive, everything else is reassembled */
+static RD_BOOL
+cliprdr_process_fragment(STREAM s, uint32 length, RD_BOOL first, RD_BOOL last)
+{
+	uint16 type, status;
+	uint32 thislength;
+	size_t start;
+	uint8 *data;
+
+	if (first)
+	{
+		if (!s_check_rem(s, 8))
+			return False;
+
+		start = s_tell(s);
+		in_uint16_le(s, type);
+		in_uint16_le(s, status);
+		in_uint32_le(s, recv_length);
+		if (type != CLIPRDR_DATA_RESPONSE || status == CLIPRDR_ERROR)
+		{
+			s_seek(s, start);
+			return False;
+		}
+
+		/* the data has to fit in the message, which is 8 bytes of header
+		   and the data itself, and possibly some padding */
+		recv_offset = 0;
+		if (length < 8 || recv_length > length - 8 || recv_length > CLIPRDR_RECV_MAX)
+		{
+			logger(Clipboard, Error,
+			       "cliprdr_process_fragment(), dropping data response of %u bytes in a message of %u",
+			       recv_length, length);
+			recv_length = 0;
+			ui_clip_request_failed();
+			return True;
+		}
+
+		logger(Clipboard, Debug, "cliprdr_process_fragment(), data response of %d bytes",
+		       recv_length);
+	}
+
+	thislength = MIN(s_remaining(s), recv_length - recv_offset);
+	if (first || thislength > 0)
+	{
+		in_uint8p(s, data, thislength);
+		ui_clip_handle_data(data, thislength, recv_offset, recv_length);
+		recv_offset += thislength;
+	}
+
+	if (last && recv_offset < recv_length)
+	{
+		logger(Clipboard, Warning,
+		       "cliprdr_process_fragment(), data response short by %d bytes",
+		       recv_length - recv_offset);
+		ui_clip_handle_data(NULL, 0, recv_offset, recv_offset);
+	}
+
+	return True;
+}
+
+/*
+ * Files copied on the X side are offered as a FileGroupDescriptorW: a flat
+ * list of files and directories below the copied ones. The server then
+ * asks for their sizes and contents by index, in ranges. Ranges are read
+ * on a few worker threads so that a big file or a slow file system does
+ * not hold up the main loop, and the answers are sent from the main loop
+ * once a worker hands them back through an eventfd.
+ */
+
+struct clip_file
+{
+	char *path;
+	uint8 name[FILEDESCRIPTOR_NAME_LENGTH];	/* UTF-16, relative, null-terminated */
+	struct stat st;
+};
+
+struct clip_file_list
+{
+	unsigned int refs;
+	unsigned int count, size;
+	struct clip_file *files;
+};
+
+struct file_contents
+{
+	uint32 stream_id;
+	struct clip_file_list *list;
+	uint32 index;
+	uint64 offset;
+	uint32 length;
+	uint8 *buffer;
+	uint32 result;
+	RD_BOOL ok;
+	struct file_contents *next;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct file_contents *queue, *queue_tail;
+	struct file_contents *done, *done_tail;
+	int event_fd[2];	/* read and write ends, the same for an eventfd */
+	RD_BOOL started, failed;
+} g_file_io = {
+PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, NULL, {-1, -1}, False,
+		False};
+
+/* The list the server was last given */
+static struct clip_file_list *g_file_list = NULL;
+
+static void
+cliprdr_file_list_release(struct clip_file_list *list)
+{
+	unsigned int i, refs;
+
+	pthread_mutex_lock(&g_file_io.lock);
+	refs = --list->refs;
+	pthread_mutex_unlock(&g_file_io.lock);
+	if (refs > 0)
+		return;
+
+	for (i = 0; i < list->count; i++)
+		xfree(list->files[i].path);
+	xfree(list->files);
+	xfree(list);
+}
+
+/* Adds path under the given name, and whatever is below it */
+static void
+cliprdr_file_list_add(struct clip_file_list *list, iconv_t cd, const char *path,
+		      const char *name, int depth)
+{
+	struct clip_file *file;
+	struct dirent *entry;
+	struct stat st;
+	char *child_path, *child_name;
+	char *in, *out;
+	size_t in_length, out_length;
+	DIR *dir;
+
+	if (stat(path, &st) != 0)
+	{
+		logger(Clipboard, Warning, "cliprdr_file_list_add(), skipping %s: %s", path,
+		       strerror(errno));
+		return;
+	}
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+		return;
+
+	if (list->count == list->size)
+	{
+		list->size = list->size ? list->size * 2 : 16;
+		list->files = xrealloc(list->files, list->size * sizeof(struct clip_file));
+	}
+	file = &list->files[list->count];
+	memset(file->name, 0, sizeof(file->name));
+
+	in = (char *) name;
+	in_length = strlen(name);
+	out = (char *) file->name;
+	out_length = sizeof(file->name) - 2;
+	iconv(cd, NULL, NULL, NULL, NULL);
+	if (iconv(cd, &in, &in_length, &out, &out_length) == (size_t) - 1)
+	{
+		logger(Clipboard, Warning, "cliprdr_file_list_add(), skipping %s: %s", path,
+		       (errno == E2BIG) ? "name too long" : "name not valid");
+		return;
+	}
+
+	file->path = xstrdup(path);
+	file->st = st;
+	list->count++;
+
+	if (!S_ISDIR(st.st_mode) || depth >= CLIPRDR_FILE_DEPTH)
+		return;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		child_path = xmalloc(strlen(path) + strlen(entry->d_name) + 2);
+		sprintf(child_path, "%s/%s", path, entry->d_name);
+
+		/* don't follow links into directories, they may loop */
+		if (lstat(child_path, &st) == 0 && S_ISLNK(st.st_mode)
+		    && stat(child_path, &st) == 0 && S_ISDIR(st.st_mode))
+		{
+			xfree(child_path);
+			continue;
+		}
+
+		child_name = xmalloc(strlen(name) + strlen(entry->d_name) + 2);
+		sprintf(child_name, "%s\\%s", name, entry->d_name);
+		cliprdr_file_list_add(list, cd, child_path, child_name, depth + 1);
+		xfree(child_name);
+		xfree(child_path);
+	}
+
+	closedir(dir);
+}
+
+/* Sends the files at paths, and everything below them, as a
+   FileGroupDescriptorW data response, and keeps them for the server to read */
+void
+cliprdr_send_file_list(char **paths, unsigned int count)
+{
+	struct clip_file_list *list;
+	struct clip_file *file;
+	uint8 descriptor[FILEDESCRIPTOR_LENGTH];
+	uint32 attributes, high, low;
+	const char *name;
+	unsigned int i;
+	iconv_t cd;
+
+	list = xmalloc(sizeof(struct clip_file_list));
+	memset(list, 0, sizeof(struct clip_file_list));
+	list->refs = 1;
+
+	cd = iconv_open(WINDOWS_CODEPAGE, "UTF-8");
+	if (cd != (iconv_t) - 1)
+	{
+		for (i = 0; i < count; i++)
+		{
+			name = strrchr(paths[i], '/');
+			name = (name != NULL && name[1] != '\0') ? name + 1 : paths[i];
+			cliprdr_file_list_add(list, cd, paths[i], name, 0);
+		}
+		iconv_close(cd);
+	}
+
+	logger(Clipboard, Debug, "cliprdr_send_file_list(), %u files", list->count);
+
+	if (g_file_list != NULL)
+		cliprdr_file_list_release(g_file_list);
+	g_file_list = list;
+
+	cliprdr_send_data_start(4 + list->count * FILEDESCRIPTOR_LENGTH);
+	buf_out_uint32(descriptor, list->count);
+	cliprdr_send_data_more(descriptor, 4);
+
+	for (i = 0; i < list->count; i++)
+	{
+		file = &list->files[i];
+		memset(descriptor, 0, sizeof(descriptor));
+
+		buf_out_uint32(descriptor, FD_ATTRIBUTES | FD_WRITESTIME | FD_FILESIZE
+			       | FD_SHOWPROGRESSUI);
+		attributes = S_ISDIR(file->st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY
+			: FILE_ATTRIBUTE_NORMAL;
+		if (!(file->st.st_mode & S_IWUSR))
+			attributes |= FILE_ATTRIBUTE_READONLY;
+		buf_out_uint32(descriptor + 36, attributes);
+		seconds_since_1970_to_filetime(file->st.st_mtime, &high, &low);
+		buf_out_uint32(descriptor + 56, low);
+		buf_out_uint32(descriptor + 60, high);
+		if (!S_ISDIR(file->st.st_mode))
+		{
+			buf_out_uint32(descriptor + 64, (uint64) file->st.st_size >> 32);
+			buf_out_uint32(descriptor + 68, file->st.st_size);
+		}
+		memcpy(descriptor + 72, file->name, FILEDESCRIPTOR_NAME_LENGTH);
+
+		cliprdr_send_data_more(descriptor, sizeof(descriptor));
+	}
+}
+
+static void
+cliprdr_send_file_contents(uint32 stream_id, RD_BOOL ok, uint8 * data, uint32 length)
+{
+	uint8 buffer[4];
+
+	if (!ok)
+		length = 0;
+
+	buf_out_uint32(buffer, stream_id);
+	cliprdr_send_packet_start(CLIPRDR_FILECONTENTS_RESPONSE,
+				  ok ? CLIPRDR_RESPONSE : CLIPRDR_ERROR, 4 + length);
+	cliprdr_send_packet_more(buffer, sizeof(buffer));
+	cliprdr_send_packet_more(data, length);
+}
+
+static void
+cliprdr_read_file_contents(struct file_contents *job)
+{
+	struct clip_file *file = &job->list->files[job->index];
+	ssize_t n;
+	int fd;
+
+	job->ok = False;
+	job->result = 0;
+
+	fd = open(file->path, O_RDONLY);
+	if (fd == -1)
+	{
+		logger(Clipboard, Warning, "cliprdr_read_file_contents(), open %s failed: %s",
+		       file->path, strerror(errno));
+		return;
+	}
+
+	while (job->result < job->length)
+	{
+		n = pread(fd, job->buffer + job->result, job->length - job->result,
+			  job->offset + job->result);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			logger(Clipboard, Warning,
+			       "cliprdr_read_file_contents(), read %s failed: %s", file->path,
+			       strerror(errno));
+			close(fd);
+			return;
+		}
+		if (n == 0)
+			break;
+		job->result += n;
+	}
+
+#ifdef POSIX_FADV_WILLNEED
+	/* the server reads files front to back, so have the next ranges on their way */
+	if (job->result == job->length)
+		posix_fadvise(fd, job->offset + job->length, CLIPRDR_READAHEAD,
+			      POSIX_FADV_WILLNEED);
+#endif
+
+	close(fd);
+	job->ok = True;
+}
+
+static void *
+cliprdr_file_worker(void *arg)
+{
+	struct file_contents *job;
+	uint64 one = 1;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_file_io.lock);
+	while (1)
+	{
+		job = g_file_io.queue;
+		if (job == NULL)
+		{
+			pthread_cond_wait(&g_file_io.work, &g_file_io.lock);
+			continue;
+		}
+
+		g_file_io.queue = job->next;
+		if (g_file_io.queue == NULL)
+			g_file_io.queue_tail = NULL;
+		pthread_mutex_unlock(&g_file_io.lock);
+
+		cliprdr_read_file_contents(job);
+
+		pthread_mutex_lock(&g_file_io.lock);
+		job->next = NULL;
+		if (g_file_io.done_tail != NULL)
+			g_file_io.done_tail->next = job;
+		else
+			g_file_io.done = job;
+		g_file_io.done_tail = job;
+
+		if (write(g_file_io.event_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+			logger(Clipboard, Error, "cliprdr_file_worker(), write() failed: %s",
+			       strerror(errno));
+	}
+
+	return NULL;
+}
+
+static RD_BOOL
+cliprdr_file_io_start(void)
+{
+	pthread_t thread;
+	int i;
+
+	if (g_file_io.started || g_file_io.failed)
+		return g_file_io.started;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	g_file_io.event_fd[0] = g_file_io.event_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_file_io.event_fd[0] == -1)
+#else
+	if (pipe(g_file_io.event_fd) == -1 || fcntl(g_file_io.event_fd[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(g_file_io.event_fd[1], F_SETFL, O_NONBLOCK) == -1)
+#endif
+	{
+		logger(Clipboard, Warning, "cliprdr_file_io_start(), no completion fd: %s",
+		       strerror(errno));
+		g_file_io.failed = True;
+		return False;
+	}
+
+	for (i = 0; i < CLIPRDR_FILE_THREADS; i++)
+	{
+		if (pthread_create(&thread, NULL, cliprdr_file_worker, NULL) != 0)
+		{
+			/* fine as long as there is at least one */
+			logger(Clipboard, Warning, "cliprdr_file_io_start(), pthread_create() failed");
+			if (i == 0)
+			{
+				g_file_io.failed = True;
+				return False;
+			}
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	g_file_io.started = True;
+	return True;
+}
+
+static void
+cliprdr_file_contents_done(struct file_contents *job)
+{
+	cliprdr_send_file_contents(job->stream_id, job->ok, job->buffer, job->result);
+	cliprdr_file_list_release(job->list);
+	xfree(job->buffer);
+	xfree(job);
+}
+
+static void
+cliprdr_process_file_contents(STREAM s)
+{
+	uint32 stream_id, index, flags, low, high, length;
+	struct file_contents *job;
+	struct clip_file *file;
+	uint8 size[8];
+
+	in_uint32_le(s, stream_id);
+	in_uint32_le(s, index);
+	in_uint32_le(s, flags);
+	in_uint32_le(s, low);
+	in_uint32_le(s, high);
+	in_uint32_le(s, length);
+
+	logger(Clipboard, Debug,
+	       "cliprdr_process_file_contents(), stream %d, index %d, flags 0x%x, offset %llu, length %d",
+	       stream_id, index, flags, ((unsigned long long) high << 32) | low, length);
+
+	if (g_file_list == NULL || index >= g_file_list->count)
+	{
+		cliprdr_send_file_contents(stream_id, False, NULL, 0);
+		return;
+	}
+	file = &g_file_list->files[index];
+
+	if (flags & FILECONTENTS_SIZE)
+	{
+		memset(size, 0, sizeof(size));
+		if (!S_ISDIR(file->st.st_mode))
+		{
+			buf_out_uint32(size, file->st.st_size);
+			buf_out_uint32(size + 4, (uint64) file->st.st_size >> 32);
+		}
+		cliprdr_send_file_contents(stream_id, True, size, sizeof(size));
+		return;
+	}
+
+	if (!(flags & FILECONTENTS_RANGE) || S_ISDIR(file->st.st_mode))
+	{
+		cliprdr_send_file_contents(stream_id, False, NULL, 0);
+		return;
+	}
+
+	job = xmalloc(sizeof(struct file_contents));
+	job->stream_id = stream_id;
+	job->list = g_file_list;
+	job->index = index;
+	job->offset = ((uint64) high << 32) | low;
+	job->length = MIN(length, CLIPRDR_RANGE_MAX);
+	job->buffer = xmalloc(MAX(job->length, 1));
+	job->next = NULL;
+
+	pthread_mutex_lock(&g_file_io.lock);
+	g_file_list->refs++;
+	pthread_mutex_unlock(&g_file_io.lock);
+
+	if (!cliprdr_file_io_start())
+	{
+		cliprdr_read_file_contents(job);
+		cliprdr_file_contents_done(job);
+		return;
+	}
+
+	pthread_mutex_lock(&g_file_io.lock);
+	if (g_file_io.queue_tail != NULL)
+		g_file_io.queue_tail->next = job;
+	else
+		g_file_io.queue = job;
+	g_file_io.queue_tail = job;
+	pthread_cond_signal(&g_file_io.work);
+	pthread_mutex_unlock(&g_file_io.lock);
+}
+
+void
+cliprdr_add_fds(int *n, fd_set * rfds)
+{
+	if (!g_file_io.started)
+		return;
+
+	FD_SET(g_file_io.event_fd[0], rfds);
+	*n = MAX(*n, g_file_io.event_fd[0]);
+}
+
+void
+cliprdr_check_fds(fd_set * rfds)
+{
+	struct file_contents *job, *next;
+	uint64 events[8];
+
+	if (!g_file_io.started || !FD_ISSET(g_file_io.event_fd[0], rfds))
+		return;
+
+	while (read(g_file_io.event_fd[0], events, sizeof(events)) > 0);
+
+	pthread_mutex_lock(&g_file_io.lock);
+	job = g_file_io.done;
+	g_file_io.done = g_file_io.done_tail = NULL;
+	pthread_mutex_unlock(&g_file_io.lock);
+
+	for (; job != NULL; job = next)
+	{
+		next = job->next;
+		cliprdr_file_contents_done(job);
+	}
+}
+
 static void
 cliprdr_process(STREAM s)
 {
@@ -134,8 +802,8 @@ cliprdr_process(STREAM s)
 			case CLIPRDR_FORMAT_ACK:
 				/* FIXME: We seem to get this when we send an announce while the server is
 				   still processing a paste. Try sending another announce. */
-				cliprdr_send_native_format_announce(last_formats,
-								    last_formats_length);
+				cliprdr_send_format_announce(last_formats_flags, last_formats,
+							     last_formats_length);
 				break;
 			case CLIPRDR_DATA_RESPONSE:
 				ui_clip_request_failed();
@@ -151,6 +819,7 @@ cliprdr_process(STREAM s)
 	switch (type)
 	{
 		case CLIPRDR_CONNECT:
+			cliprdr_send_capabilities();
 			ui_clip_sync();
 			break;
 		case CLIPRDR_FORMAT_ANNOUNCE:
@@ -166,9 +835,12 @@ cliprdr_process(STREAM s)
 			break;
 		case CLIPRDR_DATA_RESPONSE:
 			in_uint8p(s, data, length);
-			ui_clip_handle_data(data, length);
+			ui_clip_handle_data(data, length, 0, length);
+			break;
+		case CLIPRDR_CLIP_CAPS:	/* TODO: W2K3 SP1 sends this on connect with a value of 1 */
 			break;
-		case 7:	/* TODO: W2K3 SP1 sends this on connect with a value of 1 */
+		case CLIPRDR_FILECONTENTS_REQUEST:
+			cliprdr_process_file_contents(s);
 			break;
 		default:
 			logger(Clipboard, Warning, "cliprdr_process(), unhandled packet type %d",
@@ -190,5 +862,9 @@ cliprdr_init(void)
 				 CHANNEL_OPTION_INITIALIZED | CHANNEL_OPTION_ENCRYPT_RDP |
 				 CHANNEL_OPTION_COMPRESS_RDP | CHANNEL_OPTION_SHOW_PROTOCOL,
 				 cliprdr_process);
-	return (cliprdr_channel != NULL);
+	if (cliprdr_channel == NULL)
+		return False;
+
+	channel_set_fragment_handler(cliprdr_channel, cliprdr_process_fragment);
+	return True;
 }
@@ -51,6 +51,7 @@
 #define FASTPATH_UPDATETYPE_COLOR		0x9
 #define FASTPATH_UPDATETYPE_CACHED		0xA
 #define FASTPATH_UPDATETYPE_POINTER		0xB
+#define FASTPATH_UPDATETYPE_LARGE_POINTER	0xC
 
 #define FASTPATH_FRAGMENT_SINGLE	(0x0 << 4)
 #define FASTPATH_FRAGMENT_LAST		(0x1 << 4)
@@ -59,7 +60,8 @@
 
 #define FASTPATH_OUTPUT_COMPRESSION_USED	(0x2 << 6)
 
-#define RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE 65535
+/* [MS-RDPBCGR] 2.2.7.2.7, large enough for a 384x384 pointer */
+#define RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE 608299
 
 /* ISO PDU codes */
 enum ISO_PDU_CODE
@@ -266,7 +268,8 @@ enum RDP_POINTER_PDU_TYPE
 	RDP_POINTER_MOVE = 3,
 	RDP_POINTER_COLOR = 6,
 	RDP_POINTER_CACHED = 7,
-	RDP_POINTER_NEW = 8
+	RDP_POINTER_NEW = 8,
+	RDP_POINTER_LARGE = 9
 };
 
 /* [MS-RDPBCGR] 2.2.9.1.1.4.3 */
@@ -367,6 +370,7 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_POINTER	8
 #define RDP_CAPLEN_POINTER	0x08
 #define RDP_CAPLEN_NEWPOINTER	0x0a
+#define RDP_POINTER_CACHE_SIZE	0x40	/* upper bound, the server may ask for less */
 
 #define RDP_CAPSET_SHARE	9
 #define RDP_CAPLEN_SHARE	0x08
@@ -496,11 +500,16 @@ enum RDP_INPUT_DEVICE
 #define CF_GDIOBJLAST   1023
 #endif
 
+/* A registered format for file lists, announced by name. Any id in the
+   registered range will do. */
+#define CF_FILEGROUPDESCRIPTORW	0xc0bc
+
 /* Sound format constants */
 #define WAVE_FORMAT_PCM		1
 #define WAVE_FORMAT_ADPCM	2
 #define WAVE_FORMAT_ALAW	6
 #define WAVE_FORMAT_MULAW	7
+#define WAVE_FORMAT_IMA_ADPCM	0x11
 
 /* Virtual channel options */
 #define CHANNEL_OPTION_INITIALIZED	0x80000000
@@ -814,6 +823,7 @@ enum RDP_DESKTOP_ORIENTATION
 
 /* [MS-RDPBCGR] 2.2.7.2.7 */
 #define LARGE_POINTER_FLAG_96x96	1
+#define LARGE_POINTER_FLAG_384x384	2
 
 /* [MS-RDPBCGR] TS_SUPPRESS_OUTPUT_PDU allowDisplayUpdates */
 enum RDP_SUPPRESS_STATUS
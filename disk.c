@@ -35,6 +35,16 @@
 #include <utime.h>
 #include <time.h>		/* ctime */
 
+#include <pthread.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #if (defined(HAVE_DIRFD) || (HAVE_DECL_DIRFD == 1))
 #define DIRFD(a) (dirfd(a))
 #else
@@ -156,6 +166,11 @@ typedef struct
 } FsInfoType;
 
 static RD_NTSTATUS NotifyInfo(RD_NTHANDLE handle, uint32 info_class, NOTIFY * p);
+static void disk_cache_share(RD_NTHANDLE handle);
+static void disk_cache_flush_all(void);
+#ifdef HAVE_SYS_INOTIFY_H
+static void notify_unwatch(RD_NTHANDLE handle);
+#endif
 
 static time_t
 get_create_time(struct stat *filestat)
@@ -172,7 +187,7 @@ get_create_time(struct stat *filestat)
 }
 
 /* Convert seconds since 1970 to a filetime */
-static void
+void
 seconds_since_1970_to_filetime(time_t seconds, uint32 * high, uint32 * low)
 {
 	unsigned long long ticks;
@@ -345,6 +360,247 @@ disk_enum_devices(uint32 * id, char *optarg)
 	return count;
 }
 
+/*
+ * A directory is listed in one pass into a snapshot holding the stat
+ * results of all its entries, shared by every handle on the directory.
+ * Snapshots are reused until the directory changes. Changes to a file do
+ * not touch its directory, so a snapshot is also dropped after a few
+ * seconds, and when a file opened for writing here is closed. Queries for
+ * a single name, without wildcards, only stat that name.
+ */
+
+#define DIR_CACHE_ENTRIES	8
+#define DIR_CACHE_SIZE		(16 * 1024 * 1024)	/* bytes, all snapshots together */
+#define DIR_CACHE_TIMEOUT	5	/* seconds */
+
+struct dir_entry
+{
+	size_t name;		/* offset in names */
+	int error;		/* errno from stat() */
+	struct stat st;
+};
+
+struct dir_snapshot
+{
+	char path[PATH_MAX];
+	struct stat st;		/* of the directory itself */
+	time_t taken;
+	struct dir_entry *entries;
+	unsigned int count;
+	char *names;
+	size_t size;		/* of entries and names */
+	unsigned int refs;	/* the cache and each handle listing it */
+};
+
+static struct dir_snapshot *g_dir_cache[DIR_CACHE_ENTRIES];
+static size_t g_dir_cache_size;
+
+static void
+dir_snapshot_put(struct dir_snapshot *snap)
+{
+	if (snap == NULL || --snap->refs > 0)
+		return;
+
+	xfree(snap->entries);
+	xfree(snap->names);
+	xfree(snap);
+}
+
+static void
+dir_cache_drop(int slot)
+{
+	if (g_dir_cache[slot] == NULL)
+		return;
+
+	g_dir_cache_size -= g_dir_cache[slot]->size;
+	dir_snapshot_put(g_dir_cache[slot]);
+	g_dir_cache[slot] = NULL;
+}
+
+static void
+dir_cache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < DIR_CACHE_ENTRIES; i++)
+		dir_cache_drop(i);
+}
+
+/* stat(), or lstat() unless follow, of name in the directory pdir open on path */
+static int
+dir_entry_stat(DIR * pdir, const char *path, const char *name, RD_BOOL follow, struct stat *st)
+{
+#ifdef HAVE_FSTATAT
+	UNUSED(path);
+	return fstatat(DIRFD(pdir), name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	char fullpath[PATH_MAX];
+
+	UNUSED(pdir);
+	if (snprintf(fullpath, sizeof(fullpath), "%s/%s", path, name) >= (int) sizeof(fullpath))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return follow ? stat(fullpath, st) : lstat(fullpath, st);
+#endif
+}
+
+static struct dir_snapshot *
+dir_snapshot_read(DIR * pdir, const char *path, struct stat *st)
+{
+	struct dir_snapshot *snap;
+	struct dirent *pdirent;
+	struct dir_entry *entry;
+	unsigned int size = 0;
+	size_t names_size = 0, names_length = 0, length;
+
+	snap = xmalloc(sizeof(struct dir_snapshot));
+	memset(snap, 0, sizeof(struct dir_snapshot));
+	strncpy(snap->path, path, PATH_MAX - 1);
+	snap->st = *st;
+	snap->taken = time(NULL);
+	snap->refs = 1;
+
+	rewinddir(pdir);
+	while ((pdirent = readdir(pdir)) != NULL)
+	{
+		if (snap->count == size)
+		{
+			size = size ? size * 2 : 64;
+			snap->entries = xrealloc(snap->entries, size * sizeof(struct dir_entry));
+		}
+
+		length = strlen(pdirent->d_name) + 1;
+		if (names_length + length > names_size)
+		{
+			names_size = MAX(names_size * 2, names_length + length + 1024);
+			snap->names = xrealloc(snap->names, names_size);
+		}
+
+		entry = &snap->entries[snap->count++];
+		entry->name = names_length;
+		memcpy(snap->names + names_length, pdirent->d_name, length);
+		names_length += length;
+
+		entry->error = 0;
+		if (dir_entry_stat(pdir, path, pdirent->d_name, True, &entry->st) != 0)
+		{
+			entry->error = errno;
+			memset(&entry->st, 0, sizeof(entry->st));
+		}
+	}
+
+	/* the cache holds on to it, so give back what was not used */
+	snap->entries = xrealloc(snap->entries, snap->count * sizeof(struct dir_entry));
+	snap->names = xrealloc(snap->names, names_length);
+	snap->size = snap->count * sizeof(struct dir_entry) + names_length;
+	return snap;
+}
+
+/* A snapshot of just name in the directory open on handle, for a
+   query without wildcards. It is not cached, and does not list the
+   directory. */
+static struct dir_snapshot *
+dir_snapshot_lookup(RD_NTHANDLE handle, const char *name)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	struct dir_snapshot *snap;
+	struct dir_entry *entry;
+
+	disk_cache_flush_all();
+
+	snap = xmalloc(sizeof(struct dir_snapshot));
+	memset(snap, 0, sizeof(struct dir_snapshot));
+	strncpy(snap->path, pfinfo->path, PATH_MAX - 1);
+	snap->taken = time(NULL);
+	snap->refs = 1;
+	snap->entries = xmalloc(sizeof(struct dir_entry));
+	snap->names = xstrdup(name);
+
+	entry = &snap->entries[0];
+	entry->name = 0;
+	entry->error = 0;
+	snap->count = 1;
+	if (dir_entry_stat(pfinfo->pdir, pfinfo->path, name, True, &entry->st) != 0)
+	{
+		entry->error = errno;
+
+		/* a dangling symlink is still listed */
+		if (entry->error == ENOENT
+		    && dir_entry_stat(pfinfo->pdir, pfinfo->path, name, False, &entry->st) != 0)
+			snap->count = 0;
+		memset(&entry->st, 0, sizeof(entry->st));
+	}
+
+	return snap;
+}
+
+/* A snapshot of the directory open on handle, for it to hold on to */
+static struct dir_snapshot *
+dir_snapshot_get(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	struct dir_snapshot *snap;
+	struct stat st;
+	time_t now;
+	int i, slot, oldest;
+
+	if (fstat(DIRFD(pfinfo->pdir), &st) != 0)
+		return NULL;
+
+	disk_cache_flush_all();
+
+	now = time(NULL);
+	for (i = 0; i < DIR_CACHE_ENTRIES; i++)
+	{
+		snap = g_dir_cache[i];
+		if (snap == NULL || strcmp(snap->path, pfinfo->path) != 0)
+			continue;
+
+		/* a snapshot taken in the second of a change may have missed it */
+		if (snap->st.st_dev == st.st_dev && snap->st.st_ino == st.st_ino
+		    && snap->st.st_mtime == st.st_mtime && snap->st.st_ctime == st.st_ctime
+		    && snap->taken > st.st_mtime && snap->taken > st.st_ctime
+		    && now - snap->taken < DIR_CACHE_TIMEOUT)
+		{
+			snap->refs++;
+			return snap;
+		}
+
+		dir_cache_drop(i);
+	}
+
+	snap = dir_snapshot_read(pfinfo->pdir, pfinfo->path, &st);
+
+	/* one too large for the cache only lives as long as its handle */
+	if (snap->size > DIR_CACHE_SIZE)
+		return snap;
+
+	/* make room, oldest first */
+	for (;;)
+	{
+		slot = oldest = -1;
+		for (i = 0; i < DIR_CACHE_ENTRIES; i++)
+		{
+			if (g_dir_cache[i] == NULL)
+				slot = i;
+			else if (oldest == -1 || g_dir_cache[i]->taken < g_dir_cache[oldest]->taken)
+				oldest = i;
+		}
+
+		if (slot != -1 && g_dir_cache_size + snap->size <= DIR_CACHE_SIZE)
+			break;
+		dir_cache_drop(oldest);
+	}
+
+	g_dir_cache[slot] = snap;
+	g_dir_cache_size += snap->size;
+	snap->refs++;
+
+	return snap;
+}
+
 /* Opens or creates a file or directory */
 static RD_NTSTATUS
 disk_create(uint32 device_id, uint32 accessmask, uint32 sharemode, uint32 create_disposition,
@@ -525,26 +781,220 @@ disk_create(uint32 device_id, uint32 accessmask, uint32 sharemode, uint32 create
 	if (accessmask & GENERIC_ALL || accessmask & GENERIC_WRITE)
 		g_notify_stamp = True;
 
+	if (!dirp && fstat(handle, &filestat) == 0)
+	{
+		if (S_ISREG(filestat.st_mode))
+		{
+			g_fileinfo[handle].dev = filestat.st_dev;
+			g_fileinfo[handle].ino = filestat.st_ino;
+			disk_cache_share(handle);
+		}
+		else	/* a pipe or device, where read-ahead would take what is not asked for */
+			g_fileinfo[handle].shared = True;
+	}
+
 	*phandle = handle;
 	return RD_STATUS_SUCCESS;
 }
 
+/*
+ * Sequential reads are served from a read-ahead buffer, and sequential
+ * writes are gathered in the same buffer until it is full or something
+ * else is done with the file. A failed coalesced write is reported by
+ * the next write or the close of that handle. Read-ahead is dropped when
+ * the file changes on the host. Nothing is cached for a file that more
+ * than one handle has open, nor for anything but a regular file.
+ */
+
+#define DISK_CACHE_SIZE		(512 * 1024)
+#define DISK_SEQUENTIAL		2	/* requests in a row before caching */
+
+/* Returns True if this request continues a run of sequential ones */
+static RD_BOOL
+disk_cache_track(RD_NTHANDLE handle, uint64 offset, uint32 length)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+
+	if (offset != pfinfo->next_offset)
+		pfinfo->sequential = 0;
+	else if (pfinfo->sequential < DISK_SEQUENTIAL)
+	{
+		pfinfo->sequential++;
+#ifdef POSIX_FADV_SEQUENTIAL
+		if (pfinfo->sequential == DISK_SEQUENTIAL)
+			posix_fadvise(handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+
+	pfinfo->next_offset = offset + length;
+	return pfinfo->sequential == DISK_SEQUENTIAL;
+}
+
+/* Finds the other handles on the file opened as handle, and stops caching on
+   all of them once there is more than one */
+static void
+disk_cache_share(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	struct fileinfo *other;
+	int i;
+
+	pfinfo->shared = False;
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+	{
+		other = &g_fileinfo[i];
+		if (i == (int) handle || other->pdir != NULL || other->ino == 0
+		    || other->ino != pfinfo->ino || other->dev != pfinfo->dev)
+			continue;
+
+		if (!other->shared)
+		{
+			/* write out what it has gathered and forget its read-ahead */
+			disk_wait_io(i);
+			other->shared = True;
+		}
+		pfinfo->shared = True;
+	}
+}
+
+/* The last but one handle on a file is closing, the last may cache again */
+static void
+disk_cache_unshare(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	struct fileinfo *other;
+	int i, last = -1;
+
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+	{
+		other = &g_fileinfo[i];
+		if (i == (int) handle || other->pdir != NULL || other->ino == 0
+		    || other->ino != pfinfo->ino || other->dev != pfinfo->dev)
+			continue;
+
+		if (last != -1)
+			return;
+		last = i;
+	}
+
+	if (last != -1)
+	{
+		disk_wait_io(last);
+		g_fileinfo[last].shared = False;
+	}
+}
+
+/* pread(), or read() on what cannot seek, like a FIFO */
+static ssize_t
+disk_pread(int fd, void *data, size_t length, off_t offset)
+{
+	ssize_t n = pread(fd, data, length, offset);
+
+	if (n < 0 && errno == ESPIPE)
+		n = read(fd, data, length);
+	return n;
+}
+
+/* pwrite(), or write() on what cannot seek */
+static ssize_t
+disk_pwrite(int fd, const void *data, size_t length, off_t offset)
+{
+	ssize_t n = pwrite(fd, data, length, offset);
+
+	if (n < 0 && errno == ESPIPE)
+		n = write(fd, data, length);
+	return n;
+}
+
+static RD_NTSTATUS
+disk_cache_flush(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	uint32 done;
+	ssize_t n;
+
+	if (!pfinfo->cache_dirty)
+		return RD_STATUS_SUCCESS;
+
+	/* what was written stays valid for reading */
+	pfinfo->cache_dirty = False;
+	for (done = 0; done < pfinfo->cache_length; done += n)
+	{
+		n = disk_pwrite(handle, pfinfo->cache + done, pfinfo->cache_length - done,
+				pfinfo->cache_offset + done);
+		if (n < 0)
+		{
+			logger(Disk, Error, "disk_cache_flush(), write() failed: %s",
+			       strerror(errno));
+			pfinfo->cache_length = 0;
+			pfinfo->cache_status =
+				(errno == ENOSPC) ? RD_STATUS_DISK_FULL : RD_STATUS_ACCESS_DENIED;
+			return pfinfo->cache_status;
+		}
+	}
+
+	return RD_STATUS_SUCCESS;
+}
+
+static void
+disk_cache_free(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+
+	xfree(pfinfo->cache);
+	pfinfo->cache = NULL;
+	pfinfo->cache_length = 0;
+	pfinfo->cache_dirty = False;
+	pfinfo->cache_status = RD_STATUS_SUCCESS;
+	pfinfo->next_offset = 0;
+	pfinfo->sequential = 0;
+	pfinfo->shared = False;
+	pfinfo->ino = 0;
+}
+
+/* Writes gathered on any handle are done before sizes are looked up by name */
+static void
+disk_cache_flush_all(void)
+{
+	struct fileinfo *pfinfo;
+	int i;
+
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+	{
+		pfinfo = &g_fileinfo[i];
+		if (pfinfo->pdir == NULL && pfinfo->ino != 0
+		    && (pfinfo->accessmask & GENERIC_ALL || pfinfo->accessmask & GENERIC_WRITE))
+			disk_wait_io(i);
+	}
+}
+
 static RD_NTSTATUS
 disk_close(RD_NTHANDLE handle)
 {
 	struct fileinfo *pfinfo;
+	RD_NTSTATUS status = RD_STATUS_SUCCESS;
 
 	logger(Disk, Debug, "disk_close(handle=0x%x)", handle);
 
 	pfinfo = &(g_fileinfo[handle]);
 
 	if (pfinfo->accessmask & GENERIC_ALL || pfinfo->accessmask & GENERIC_WRITE)
+	{
 		g_notify_stamp = True;
+		dir_cache_clear();
+	}
 
 	rdpdr_abort_io(handle, 0, RD_STATUS_CANCELLED);
 
+#ifdef HAVE_SYS_INOTIFY_H
+	notify_unwatch(handle);
+#endif
+
 	if (pfinfo->pdir)
 	{
+		dir_snapshot_put(pfinfo->listing);
+		pfinfo->listing = NULL;
+
 		if (closedir(pfinfo->pdir) < 0)
 		{
 			logger(Disk, Error, "disk_close(), closedir() failed: %s", strerror(errno));
@@ -562,6 +1012,12 @@ disk_close(RD_NTHANDLE handle)
 	}
 	else
 	{
+		disk_cache_flush(handle);
+		status = pfinfo->cache_status;
+		if (pfinfo->shared)
+			disk_cache_unshare(handle);
+		disk_cache_free(handle);
+
 		if (close(handle) < 0)
 		{
 			logger(Disk, Error, "disk_close(), close() failed: %s", strerror(errno));
@@ -578,12 +1034,15 @@ disk_close(RD_NTHANDLE handle)
 		pfinfo->delete_on_close = False;
 	}
 
-	return RD_STATUS_SUCCESS;
+	return status;
 }
 
 static RD_NTSTATUS
 disk_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
 {
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	struct stat filestat;
+	RD_BOOL sequential;
 	int n;
 
 #if 0
@@ -596,9 +1055,47 @@ disk_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32
 	}
 #endif
 
-	lseek(handle, offset, SEEK_SET);
+	sequential = disk_cache_track(handle, offset, length) && !pfinfo->shared;
+
+	/* a failure is left for the next write or the close to report */
+	disk_cache_flush(handle);
+
+	if (pfinfo->cache_length > 0 && offset >= pfinfo->cache_offset
+	    && offset + length <= pfinfo->cache_offset + pfinfo->cache_length)
+	{
+		if (fstat(handle, &filestat) == 0 && filestat.st_mtime == pfinfo->cache_mtime
+		    && filestat.st_size == pfinfo->cache_size)
+		{
+			memcpy(data, pfinfo->cache + (offset - pfinfo->cache_offset), length);
+			*result = length;
+			return RD_STATUS_SUCCESS;
+		}
+		pfinfo->cache_length = 0;
+	}
 
-	n = read(handle, data, length);
+	if (sequential && length < DISK_CACHE_SIZE && fstat(handle, &filestat) == 0)
+	{
+		if (pfinfo->cache == NULL)
+			pfinfo->cache = xmalloc(DISK_CACHE_SIZE);
+
+		pfinfo->cache_length = 0;
+		pfinfo->cache_mtime = filestat.st_mtime;
+		pfinfo->cache_size = filestat.st_size;
+		n = disk_pread(handle, pfinfo->cache, DISK_CACHE_SIZE, offset);
+		if (n >= 0)
+		{
+			pfinfo->cache_offset = offset;
+			pfinfo->cache_length = n;
+#ifdef POSIX_FADV_WILLNEED
+			/* and have the kernel start on the next one */
+			posix_fadvise(handle, offset + n, DISK_CACHE_SIZE, POSIX_FADV_WILLNEED);
+#endif
+			n = MIN((uint32) n, length);
+			memcpy(data, pfinfo->cache, n);
+		}
+	}
+	else
+		n = disk_pread(handle, data, length, offset);
 
 	if (n < 0)
 	{
@@ -625,11 +1122,47 @@ disk_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32
 static RD_NTSTATUS
 disk_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
 {
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	RD_BOOL sequential;
+	RD_NTSTATUS status;
 	int n;
 
-	lseek(handle, offset, SEEK_SET);
+	sequential = disk_cache_track(handle, offset, length) && !pfinfo->shared;
 
-	n = write(handle, data, length);
+	/* a write that continues the pending one */
+	if (pfinfo->cache_dirty && offset == pfinfo->cache_offset + pfinfo->cache_length
+	    && length <= DISK_CACHE_SIZE - pfinfo->cache_length)
+	{
+		memcpy(pfinfo->cache + pfinfo->cache_length, data, length);
+		pfinfo->cache_length += length;
+		*result = length;
+		return RD_STATUS_SUCCESS;
+	}
+
+	disk_cache_flush(handle);
+	pfinfo->cache_length = 0;
+	status = pfinfo->cache_status;
+	pfinfo->cache_status = RD_STATUS_SUCCESS;
+	if (status != RD_STATUS_SUCCESS)
+	{
+		*result = 0;
+		return status;
+	}
+
+	if (sequential && length < DISK_CACHE_SIZE)
+	{
+		if (pfinfo->cache == NULL)
+			pfinfo->cache = xmalloc(DISK_CACHE_SIZE);
+
+		memcpy(pfinfo->cache, data, length);
+		pfinfo->cache_offset = offset;
+		pfinfo->cache_length = length;
+		pfinfo->cache_dirty = True;
+		*result = length;
+		return RD_STATUS_SUCCESS;
+	}
+
+	n = disk_pwrite(handle, data, length, offset);
 
 	if (n < 0)
 	{
@@ -756,6 +1289,7 @@ disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM ou
 
 	pfinfo = &(g_fileinfo[handle]);
 	g_notify_stamp = True;
+	dir_cache_clear();
 	newname = NULL;
 
 	switch (info_class)
@@ -949,8 +1483,285 @@ disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM ou
 	return RD_STATUS_SUCCESS;
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Directory change notification through inotify. All watched
+ * directories share one inotify descriptor, read from the main loop.
+ * Handles on the same directory share its watch descriptor, so events
+ * go to every handle that has it. Each handle collects
+ * FILE_NOTIFY_INFORMATION records until its request is completed.
+ */
+
+#define NOTIFY_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+				 IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static int g_inotify_fd = -1;
+
+static void
+notify_unwatch(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	int i;
+
+	if (!pfinfo->watch)
+		return;
+
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+		if (i != (int) handle && g_fileinfo[i].watch == pfinfo->watch)
+			break;
+	if (i == MAX_OPEN_FILES)
+		inotify_rm_watch(g_inotify_fd, pfinfo->watch);
+
+	pfinfo->watch = 0;
+	s_free(pfinfo->notify_records);
+	pfinfo->notify_records = NULL;
+}
+
+static RD_BOOL
+notify_watch(RD_NTHANDLE handle)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	int wd;
+
+	if (pfinfo->watch)
+		return True;
+
+	if (g_inotify_fd == -1)
+	{
+		g_inotify_fd = inotify_init();
+		if (g_inotify_fd == -1)
+		{
+			logger(Disk, Warning, "notify_watch(), inotify_init() failed: %s",
+			       strerror(errno));
+			g_inotify_fd = -2;
+		}
+		else
+		{
+			fcntl(g_inotify_fd, F_SETFL, O_NONBLOCK);
+			fcntl(g_inotify_fd, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	if (g_inotify_fd < 0)
+		return False;
+
+	wd = inotify_add_watch(g_inotify_fd, pfinfo->path, NOTIFY_WATCH_MASK);
+	if (wd == -1)
+	{
+		logger(Disk, Debug, "notify_watch(), inotify_add_watch(%s) failed: %s",
+		       pfinfo->path, strerror(errno));
+		return False;
+	}
+
+	pfinfo->watch = wd;
+	pfinfo->notify_overflow = False;
+	pfinfo->notify_records = s_alloc(NOTIFY_BUFFER_SIZE);
+	pfinfo->notify_last = NULL;
+	return True;
+}
+
+/* Appends a FILE_NOTIFY_INFORMATION record, if the handle asked for it */
+static void
+notify_add_record(struct fileinfo *pfinfo, uint32 filter, uint32 action, const char *name)
+{
+	STREAM s = pfinfo->notify_records;
+	unsigned char *record, *namestart, *end;
+	size_t length, last;
+
+	if (!(pfinfo->info_class & filter) || pfinfo->notify_overflow)
+		return;
+
+	/* The name grows at most four times in UTF-16, plus alignment. The
+	   request does not say how much the caller takes, so what does not
+	   fit the largest reply it could is sent as STATUS_NOTIFY_ENUM_DIR. */
+	length = s_tell(s) + 3 + 12 + 4 * strlen(name);
+	if (length > NOTIFY_REPLY_SIZE)
+	{
+		pfinfo->notify_overflow = True;
+		return;
+	}
+
+	if (length > s->size)
+	{
+		last = pfinfo->notify_last ? pfinfo->notify_last - s->data : 0;
+		s_realloc(s, MIN(MAX(s->size * 2, length), NOTIFY_REPLY_SIZE));
+		if (pfinfo->notify_last != NULL)
+			pfinfo->notify_last = s->data + last;
+	}
+
+	while (s_tell(s) % 4)
+		out_uint8(s, 0);
+
+	record = s->p;
+	if (pfinfo->notify_last != NULL)
+	{
+		s->p = pfinfo->notify_last;
+		out_uint32_le(s, record - pfinfo->notify_last);	/* NextEntryOffset */
+		s->p = record;
+	}
+	pfinfo->notify_last = record;
+
+	out_uint32_le(s, 0);	/* NextEntryOffset */
+	out_uint32_le(s, action);
+	out_uint32_le(s, 0);	/* FileNameLength */
+	namestart = s->p;
+	out_utf16s_no_eos(s, name);
+
+	end = s->p;
+	s->p = record + 8;
+	out_uint32_le(s, end - namestart);
+	s->p = end;
+}
+
+static uint32
+notify_filter(struct inotify_event *ev)
+{
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		return (ev->mask & IN_ISDIR) ? FILE_NOTIFY_CHANGE_DIR_NAME :
+			FILE_NOTIFY_CHANGE_FILE_NAME;
+	if (ev->mask & IN_MODIFY)
+		return FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+	return FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_LAST_WRITE |
+		FILE_NOTIFY_CHANGE_LAST_ACCESS | FILE_NOTIFY_CHANGE_CREATION |
+		FILE_NOTIFY_CHANGE_SECURITY;
+}
+
+/* Both halves of a rename within a directory */
+static RD_BOOL
+notify_is_rename(struct inotify_event *from, struct inotify_event *to)
+{
+	return from != NULL && to != NULL && (from->mask & IN_MOVED_FROM)
+		&& (to->mask & IN_MOVED_TO) && from->cookie == to->cookie && from->wd == to->wd;
+}
+
+static void
+notify_dispatch(struct inotify_event *prev, struct inotify_event *ev, struct inotify_event *next)
+{
+	struct fileinfo *pfinfo;
+	uint32 action;
+	int i;
+
+	if (ev->mask & IN_MOVED_FROM)
+		action = notify_is_rename(ev, next) ?
+			FILE_ACTION_RENAMED_OLD_NAME : FILE_ACTION_REMOVED;
+	else if (ev->mask & IN_MOVED_TO)
+		action = notify_is_rename(prev, ev) ?
+			FILE_ACTION_RENAMED_NEW_NAME : FILE_ACTION_ADDED;
+	else if (ev->mask & IN_CREATE)
+		action = FILE_ACTION_ADDED;
+	else if (ev->mask & IN_DELETE)
+		action = FILE_ACTION_REMOVED;
+	else
+		action = FILE_ACTION_MODIFIED;
+
+	for (i = 0; i < MAX_OPEN_FILES; i++)
+	{
+		pfinfo = &g_fileinfo[i];
+		if (!pfinfo->watch || (ev->wd != pfinfo->watch && !(ev->mask & IN_Q_OVERFLOW)))
+			continue;
+
+		/* the directory itself went away, or events were lost */
+		if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+		{
+			pfinfo->notify_overflow = True;
+			continue;
+		}
+
+		if (ev->len == 0)
+			continue;
+
+		notify_add_record(pfinfo, notify_filter(ev), action, ev->name);
+	}
+}
+
+/* Collects the records for all watched directories */
+static void
+notify_read(void)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *prev, *ev, *next;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(g_inotify_fd, buf, sizeof(buf))) > 0)
+	{
+		prev = NULL;
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (struct inotify_event *) p;
+			next = (struct inotify_event *) (p + sizeof(struct inotify_event) + ev->len);
+			if ((char *) next >= buf + len)
+				next = NULL;
+
+			notify_dispatch(prev, ev, next);
+			prev = ev;
+		}
+	}
+}
+
+void
+disk_add_notify_fd(int *n, fd_set * rfds)
+{
+	if (g_inotify_fd < 0)
+		return;
+
+	FD_SET(g_inotify_fd, rfds);
+	*n = MAX(*n, g_inotify_fd);
+}
+
+void
+disk_check_notify_fd(fd_set * rfds)
+{
+	if (g_inotify_fd < 0 || !FD_ISSET(g_inotify_fd, rfds))
+		return;
+
+	notify_read();
+}
+
+/* Hands over what has been collected, if anything */
+static RD_NTSTATUS
+notify_complete(RD_NTHANDLE handle, STREAM out)
+{
+	struct fileinfo *pfinfo = &g_fileinfo[handle];
+	STREAM s = pfinfo->notify_records;
+
+	if (pfinfo->notify_overflow)
+	{
+		pfinfo->notify_overflow = False;
+		s_reset(s);
+		pfinfo->notify_last = NULL;
+		return RD_STATUS_NOTIFY_ENUM_DIR;
+	}
+
+	if (s_tell(s) == 0)
+		return RD_STATUS_PENDING;
+
+	s_realloc(out, s_tell(s));
+	out_uint8a(out, s->data, s_tell(s));
+	s_reset(s);
+	pfinfo->notify_last = NULL;
+
+	return RD_STATUS_SUCCESS;
+}
+
+#else
+
+void
+disk_add_notify_fd(int *n, fd_set * rfds)
+{
+	UNUSED(n);
+	UNUSED(rfds);
+}
+
+void
+disk_check_notify_fd(fd_set * rfds)
+{
+	UNUSED(rfds);
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
 RD_NTSTATUS
-disk_check_notify(RD_NTHANDLE handle)
+disk_check_notify(RD_NTHANDLE handle, STREAM out)
 {
 	struct fileinfo *pfinfo;
 	RD_NTSTATUS status = RD_STATUS_PENDING;
@@ -962,7 +1773,17 @@ disk_check_notify(RD_NTHANDLE handle)
 	if (!pfinfo->pdir)
 		return RD_STATUS_INVALID_DEVICE_REQUEST;
 
+#ifdef HAVE_SYS_INOTIFY_H
+	if (pfinfo->watch)
+		return notify_complete(handle, out);
+#else
+	UNUSED(out);
+#endif
 
+	/* Polling, only rescanned after we have changed something ourselves */
+	if (!g_notify_stamp)
+		return RD_STATUS_PENDING;
+	g_notify_stamp = False;
 
 	status = NotifyInfo(handle, pfinfo->info_class, &notify);
 
@@ -977,12 +1798,10 @@ disk_check_notify(RD_NTHANDLE handle)
 	}
 
 	return status;
-
-
 }
 
 RD_NTSTATUS
-disk_create_notify(RD_NTHANDLE handle, uint32 info_class)
+disk_create_notify(RD_NTHANDLE handle, uint32 info_class, STREAM out)
 {
 	struct fileinfo *pfinfo;
 	RD_NTSTATUS ret = RD_STATUS_PENDING;
@@ -992,9 +1811,17 @@ disk_create_notify(RD_NTHANDLE handle, uint32 info_class)
 	pfinfo = &(g_fileinfo[handle]);
 	pfinfo->info_class = info_class;
 
+#ifdef HAVE_SYS_INOTIFY_H
+	/* changes since the last request are returned right away */
+	if (pfinfo->pdir && notify_watch(handle))
+		return notify_complete(handle, out);
+#else
+	UNUSED(out);
+#endif
+
 	ret = NotifyInfo(handle, info_class, &pfinfo->notify);
 
-	if (info_class & 0x1000)
+	if (info_class & FILE_NOTIFY_CHANGE_LAST_WRITE)
 	{			/* ???? */
 		if (ret == RD_STATUS_PENDING)
 			return RD_STATUS_SUCCESS;
@@ -1212,10 +2039,10 @@ RD_NTSTATUS
 disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out)
 {
 	uint32 file_attributes, ft_low, ft_high;
-	char *dirname, fullpath[PATH_MAX];
-	DIR *pdir;
-	struct dirent *pdirent;
-	struct stat filestat;
+	char *name;
+	struct dir_snapshot *listing;
+	struct dir_entry *entry;
+	struct stat *filestat;
 	struct fileinfo *pfinfo;
 	STREAM stmp;
 
@@ -1223,8 +2050,6 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 	       handle, info_class, pattern);
 
 	pfinfo = &(g_fileinfo[handle]);
-	pdir = pfinfo->pdir;
-	dirname = pfinfo->path;
 	file_attributes = 0;
 
 	switch (info_class)
@@ -1238,48 +2063,65 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 			if (pattern != NULL && pattern[0] != 0)
 			{
 				strncpy(pfinfo->pattern, 1 + strrchr(pattern, '/'), PATH_MAX - 1);
-				rewinddir(pdir);
+				dir_snapshot_put(pfinfo->listing);
+				pfinfo->listing = NULL;
 			}
 
-			/* find next dirent matching pattern */
-			pdirent = readdir(pdir);
-			while (pdirent && fnmatch(pfinfo->pattern, pdirent->d_name, 0) != 0)
-				pdirent = readdir(pdir);
+			if (pfinfo->listing == NULL)
+			{
+				if (strpbrk(pfinfo->pattern, "*?[\\") == NULL)
+					pfinfo->listing = dir_snapshot_lookup(handle, pfinfo->pattern);
+				else
+					pfinfo->listing = dir_snapshot_get(handle);
+				pfinfo->listing_pos = 0;
+				if (pfinfo->listing == NULL)
+				{
+					logger(Disk, Error, "disk_query_directory(), fstat() failed: %s",
+					       strerror(errno));
+					out_uint8(out, 0);
+					return RD_STATUS_NO_SUCH_FILE;
+				}
+			}
 
-			if (pdirent == NULL)
+			/* find next entry matching pattern */
+			listing = pfinfo->listing;
+			while (pfinfo->listing_pos < listing->count
+			       && fnmatch(pfinfo->pattern,
+					  listing->names + listing->entries[pfinfo->listing_pos].name,
+					  0) != 0)
+				pfinfo->listing_pos++;
+
+			if (pfinfo->listing_pos >= listing->count)
 				return RD_STATUS_NO_MORE_FILES;
 
-			/* Get information for directory entry */
-			sprintf(fullpath, "%s/%s", dirname, pdirent->d_name);
+			entry = &listing->entries[pfinfo->listing_pos++];
+			name = listing->names + entry->name;
+			filestat = &entry->st;
 
-			if (stat(fullpath, &filestat))
+			switch (entry->error)
 			{
-				switch (errno)
-				{
-					case ENOENT:
-					case ELOOP:
-					case EACCES:
-						/* These are non-fatal errors. */
-						memset(&filestat, 0, sizeof(filestat));
-						break;
-					default:
-						/* Fatal error. By returning STATUS_NO_SUCH_FILE, 
-						   the directory list operation will be aborted */
-						logger(Disk, Error,
-						       "disk_query_directory(), stat() failed: %s",
-						       strerror(errno));
-						out_uint8(out, 0);
-						return RD_STATUS_NO_SUCH_FILE;
-				}
+				case 0:
+				case ENOENT:
+				case ELOOP:
+				case EACCES:
+					/* These are non-fatal errors. */
+					break;
+				default:
+					/* Fatal error. By returning STATUS_NO_SUCH_FILE, 
+					   the directory list operation will be aborted */
+					logger(Disk, Error, "disk_query_directory(), stat() failed: %s",
+					       strerror(entry->error));
+					out_uint8(out, 0);
+					return RD_STATUS_NO_SUCH_FILE;
 			}
 
-			if (S_ISDIR(filestat.st_mode))
+			if (S_ISDIR(filestat->st_mode))
 				file_attributes |= FILE_ATTRIBUTE_DIRECTORY;
-			if (pdirent->d_name[0] == '.')
+			if (name[0] == '.')
 				file_attributes |= FILE_ATTRIBUTE_HIDDEN;
 			if (!file_attributes)
 				file_attributes |= FILE_ATTRIBUTE_NORMAL;
-			if (!(filestat.st_mode & S_IWUSR))
+			if (!(filestat->st_mode & S_IWUSR))
 				file_attributes |= FILE_ATTRIBUTE_READONLY;
 
 			/* Return requested information */
@@ -1296,32 +2138,32 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 	// Write entry name as utf16 into stmp
 	stmp = s_alloc(PATH_MAX * 4);
-	out_utf16s_no_eos(stmp, pdirent->d_name);
+	out_utf16s_no_eos(stmp, name);
 	s_mark_end(stmp);
 
 	switch (info_class)
 	{
 		case FileBothDirectoryInformation:
 
-			seconds_since_1970_to_filetime(get_create_time(&filestat), &ft_high,
+			seconds_since_1970_to_filetime(get_create_time(filestat), &ft_high,
 						       &ft_low);
 			out_uint32_le(out, ft_low);	/* create time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_atime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_atime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_access_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_mtime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_mtime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_write_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_ctime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_ctime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* change_write_time */
 			out_uint32_le(out, ft_high);
 
-			out_uint64_le(out, filestat.st_size);	/* filesize */
-			out_uint64_le(out, filestat.st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
 			out_uint32_le(out, file_attributes);	/* FileAttributes */
 			out_uint32_le(out, s_length(stmp));	/* length of dir entry name string */
 			out_uint32_le(out, 0);	/* EaSize */
@@ -1333,25 +2175,25 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 		case FileDirectoryInformation:
 
-			seconds_since_1970_to_filetime(get_create_time(&filestat), &ft_high,
+			seconds_since_1970_to_filetime(get_create_time(filestat), &ft_high,
 						       &ft_low);
 			out_uint32_le(out, ft_low);	/* create time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_atime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_atime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_access_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_mtime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_mtime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_write_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_ctime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_ctime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* change_write_time */
 			out_uint32_le(out, ft_high);
 
-			out_uint64_le(out, filestat.st_size);	/* filesize */
-			out_uint64_le(out, filestat.st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
 			out_uint32_le(out, file_attributes);
 			out_uint32_le(out, s_length(stmp));	/* dir entry name string length */
 			out_stream(out, stmp);	/* dir entry name */
@@ -1360,25 +2202,25 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 		case FileFullDirectoryInformation:
 
-			seconds_since_1970_to_filetime(get_create_time(&filestat), &ft_high,
+			seconds_since_1970_to_filetime(get_create_time(filestat), &ft_high,
 						       &ft_low);
 			out_uint32_le(out, ft_low);	/* create time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_atime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_atime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_access_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_mtime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_mtime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* last_write_time */
 			out_uint32_le(out, ft_high);
 
-			seconds_since_1970_to_filetime(filestat.st_ctime, &ft_high, &ft_low);
+			seconds_since_1970_to_filetime(filestat->st_ctime, &ft_high, &ft_low);
 			out_uint32_le(out, ft_low);	/* change_write_time */
 			out_uint32_le(out, ft_high);
 
-			out_uint64_le(out, filestat.st_size);	/* filesize */
-			out_uint64_le(out, filestat.st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
+			out_uint64_le(out, filestat->st_size);	/* filesize */
 			out_uint32_le(out, file_attributes);
 			out_uint32_le(out, s_length(stmp));	/* dir entry name string length */
 			out_uint32_le(out, 0);	/* EaSize */
@@ -1435,6 +2277,249 @@ disk_device_control(RD_NTHANDLE handle, uint32 request, STREAM in, STREAM out)
 	return RD_STATUS_SUCCESS;
 }
 
+/*
+ * Reads and writes run on a small pool of worker threads, so that a slow
+ * share does not hold up the main loop. Jobs for the same handle run one
+ * at a time and in the order they arrived. Finished jobs are handed back
+ * through an eventfd and completed from the main loop.
+ *
+ * Directory queries stay on the main thread. They are answered from
+ * the snapshot cache, which all handles share without a lock, and only
+ * list the directory again when it has changed.
+ */
+
+#define DISK_IO_THREADS	4
+
+struct disk_io
+{
+	uint32 device, id;
+	RD_BOOL is_write;
+	RD_NTHANDLE handle;
+	uint8 *buffer;
+	uint32 length, result;
+	uint64 offset;
+	RD_NTSTATUS status;
+	struct disk_io *next;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job was queued, or a handle became free */
+	pthread_cond_t idle;	/* a job finished */
+	struct disk_io *queue, *queue_tail;
+	struct disk_io *done, *done_tail;
+	RD_BOOL busy[MAX_OPEN_FILES];	/* a job for the handle is running */
+	unsigned int pending[MAX_OPEN_FILES];	/* queued or running */
+	int event_fd[2];	/* read and write ends, the same for an eventfd */
+	RD_BOOL started, failed;
+} g_disk_io = {
+PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL,
+		NULL, NULL, {False}, {0}, {-1, -1}, False, False};
+
+static void *
+disk_io_worker(void *arg)
+{
+	struct disk_io *job, *prev;
+	uint64 one = 1;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_disk_io.lock);
+	while (1)
+	{
+		/* the oldest job whose handle is not already being worked on */
+		for (prev = NULL, job = g_disk_io.queue; job != NULL; prev = job, job = job->next)
+			if (!g_disk_io.busy[job->handle])
+				break;
+
+		if (job == NULL)
+		{
+			pthread_cond_wait(&g_disk_io.work, &g_disk_io.lock);
+			continue;
+		}
+
+		if (prev == NULL)
+			g_disk_io.queue = job->next;
+		else
+			prev->next = job->next;
+		if (g_disk_io.queue_tail == job)
+			g_disk_io.queue_tail = prev;
+		g_disk_io.busy[job->handle] = True;
+		pthread_mutex_unlock(&g_disk_io.lock);
+
+		if (job->is_write)
+			job->status = disk_write(job->handle, job->buffer, job->length, job->offset,
+						 &job->result);
+		else
+			job->status = disk_read(job->handle, job->buffer, job->length, job->offset,
+						&job->result);
+
+		pthread_mutex_lock(&g_disk_io.lock);
+		g_disk_io.busy[job->handle] = False;
+		g_disk_io.pending[job->handle]--;
+		job->next = NULL;
+		if (g_disk_io.done_tail != NULL)
+			g_disk_io.done_tail->next = job;
+		else
+			g_disk_io.done = job;
+		g_disk_io.done_tail = job;
+
+		pthread_cond_broadcast(&g_disk_io.work);
+		pthread_cond_broadcast(&g_disk_io.idle);
+		if (write(g_disk_io.event_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+			logger(Disk, Error, "disk_io_worker(), write() failed: %s", strerror(errno));
+	}
+
+	return NULL;
+}
+
+static RD_BOOL
+disk_io_start(void)
+{
+	pthread_t thread;
+	int i;
+
+	if (g_disk_io.started || g_disk_io.failed)
+		return g_disk_io.started;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	g_disk_io.event_fd[0] = g_disk_io.event_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_disk_io.event_fd[0] == -1)
+#else
+	if (pipe(g_disk_io.event_fd) == -1 || fcntl(g_disk_io.event_fd[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(g_disk_io.event_fd[1], F_SETFL, O_NONBLOCK) == -1)
+#endif
+	{
+		logger(Disk, Warning, "disk_io_start(), no completion fd: %s", strerror(errno));
+		g_disk_io.failed = True;
+		return False;
+	}
+
+	for (i = 0; i < DISK_IO_THREADS; i++)
+	{
+		if (pthread_create(&thread, NULL, disk_io_worker, NULL) != 0)
+		{
+			/* fine as long as there is at least one */
+			logger(Disk, Warning, "disk_io_start(), pthread_create() failed");
+			if (i == 0)
+			{
+				g_disk_io.failed = True;
+				return False;
+			}
+			break;
+		}
+		pthread_detach(thread);
+	}
+
+	g_disk_io.started = True;
+	return True;
+}
+
+/* Queues a read or write, taking over the buffer. False if it has to be done here. */
+RD_BOOL
+disk_submit_io(uint32 device, uint32 id, RD_NTHANDLE handle, RD_BOOL is_write, uint8 * buffer,
+	       uint32 length, uint64 offset)
+{
+	struct disk_io *job;
+
+	if (handle >= MAX_OPEN_FILES || g_fileinfo[handle].pdir || !disk_io_start())
+		return False;
+
+	job = xmalloc(sizeof(struct disk_io));
+	job->device = device;
+	job->id = id;
+	job->is_write = is_write;
+	job->handle = handle;
+	job->buffer = buffer;
+	job->length = length;
+	job->offset = offset;
+	job->result = 0;
+	job->next = NULL;
+
+	pthread_mutex_lock(&g_disk_io.lock);
+	if (g_disk_io.queue_tail != NULL)
+		g_disk_io.queue_tail->next = job;
+	else
+		g_disk_io.queue = job;
+	g_disk_io.queue_tail = job;
+	g_disk_io.pending[handle]++;
+	pthread_cond_signal(&g_disk_io.work);
+	pthread_mutex_unlock(&g_disk_io.lock);
+
+	return True;
+}
+
+/* Sends the completions for everything the workers have finished */
+static void
+disk_io_complete(void)
+{
+	struct disk_io *job, *next;
+
+	pthread_mutex_lock(&g_disk_io.lock);
+	job = g_disk_io.done;
+	g_disk_io.done = g_disk_io.done_tail = NULL;
+	pthread_mutex_unlock(&g_disk_io.lock);
+
+	for (; job != NULL; job = next)
+	{
+		next = job->next;
+		if (job->is_write)
+			rdpdr_send_completion(job->device, job->id, job->status, job->result,
+					      (uint8 *) "", 1);
+		else
+			rdpdr_send_completion(job->device, job->id, job->status, job->result,
+					      job->buffer, job->result);
+		xfree(job->buffer);
+		xfree(job);
+	}
+}
+
+/* Other requests on a handle wait for its reads and writes to finish first */
+void
+disk_wait_io(RD_NTHANDLE handle)
+{
+	if (handle >= MAX_OPEN_FILES)
+		return;
+
+	if (g_disk_io.started)
+	{
+		pthread_mutex_lock(&g_disk_io.lock);
+		while (g_disk_io.pending[handle] > 0)
+			pthread_cond_wait(&g_disk_io.idle, &g_disk_io.lock);
+		pthread_mutex_unlock(&g_disk_io.lock);
+
+		disk_io_complete();
+	}
+
+	/* and see what has been written, without stale read-ahead */
+	disk_cache_flush(handle);
+	g_fileinfo[handle].cache_length = 0;
+}
+
+void
+disk_add_io_fd(int *n, fd_set * rfds)
+{
+	if (!g_disk_io.started)
+		return;
+
+	FD_SET(g_disk_io.event_fd[0], rfds);
+	*n = MAX(*n, g_disk_io.event_fd[0]);
+}
+
+void
+disk_check_io_fd(fd_set * rfds)
+{
+	uint64 events[8];
+
+	if (!g_disk_io.started || !FD_ISSET(g_disk_io.event_fd[0], rfds))
+		return;
+
+	while (read(g_disk_io.event_fd[0], events, sizeof(events)) > 0);
+
+	disk_io_complete();
+}
+
 DEVICE_FNS disk_fns = {
 	disk_create,
 	disk_close,
@@ -78,7 +78,24 @@
 #define ERROR_FILE_NOT_FOUND			2L
 #define ERROR_ALREADY_EXISTS			183L
 
+#define FILE_NOTIFY_CHANGE_FILE_NAME		0x00000001
+#define FILE_NOTIFY_CHANGE_DIR_NAME		0x00000002
+#define FILE_NOTIFY_CHANGE_ATTRIBUTES		0x00000004
+#define FILE_NOTIFY_CHANGE_SIZE			0x00000008
+#define FILE_NOTIFY_CHANGE_LAST_WRITE		0x00000010
+#define FILE_NOTIFY_CHANGE_LAST_ACCESS		0x00000020
+#define FILE_NOTIFY_CHANGE_CREATION		0x00000040
+#define FILE_NOTIFY_CHANGE_SECURITY		0x00000100
+
+#define FILE_ACTION_ADDED			0x00000001
+#define FILE_ACTION_REMOVED			0x00000002
+#define FILE_ACTION_MODIFIED			0x00000003
+#define FILE_ACTION_RENAMED_OLD_NAME		0x00000004
+#define FILE_ACTION_RENAMED_NEW_NAME		0x00000005
+
 #define	MAX_OPEN_FILES	0x100
+#define NOTIFY_BUFFER_SIZE	4096	/* FILE_NOTIFY_INFORMATION collected per handle, to start with */
+#define NOTIFY_REPLY_SIZE	65536	/* most a caller over the network can ask for */
 
 typedef enum _FILE_INFORMATION_CLASS
 {
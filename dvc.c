@@ -20,8 +20,11 @@
 
 #include "rdesktop.h"
 
-#define MAX_DVC_CHANNELS 20
+#define DVC_HASH_SIZE 64
 #define INVALID_CHANNEL ((uint32)-1)
+#define DVC_CHUNK_LENGTH 1600	/* the largest DVC PDU, headers included */
+#define DVC_CAPS_VERSION 3	/* version 3 allows compressed data */
+#define DVC_MAX_MESSAGE (16 * 1024 * 1024)	/* largest message gathered from chunks */
 
 #define DYNVC_CREATE_REQ		0x01
 #define DYNVC_DATA_FIRST		0x02
@@ -44,44 +47,58 @@ typedef union dvc_hdr_t
 	} hdr;
 } dvc_hdr_t;
 
+/* Registered channels are kept in a list, and the open ones are also
+   hashed on their channel id, which every data PDU is looked up by */
 typedef struct dvc_channel_t
 {
 	uint32 hash;
 	uint32 channel_id;
 	dvc_channel_process_fn handler;
+	struct stream in;	/* message being reassembled */
+	uint32 in_length;
+	uint32 in_skip;		/* rest of a message too large to gather */
+	struct dvc_channel_t *next;
+	struct dvc_channel_t *next_by_id;
 } dvc_channel_t;
 
 static VCHANNEL *dvc_channel;
-static dvc_channel_t channels[MAX_DVC_CHANNELS];
+static dvc_channel_t *channels = NULL;
+static dvc_channel_t *channels_by_id[DVC_HASH_SIZE];
+static struct stream expanded;
 
 static uint32 dvc_in_channelid(STREAM s, dvc_hdr_t hdr);
 
-static RD_BOOL
-dvc_channels_exists(const char *name)
+static dvc_channel_t *
+dvc_channels_get_by_name(const char *name)
 {
-	int i;
+	dvc_channel_t *ch;
 	uint32 hash;
+
 	hash = utils_djb2_hash(name);
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	for (ch = channels; ch; ch = ch->next)
 	{
-		if (channels[i].hash == hash)
-			return True;
+		if (ch->hash == hash)
+			return ch;
 	}
 
-	return False;
+	return NULL;
 }
 
-static const dvc_channel_t *
+static RD_BOOL
+dvc_channels_exists(const char *name)
+{
+	return dvc_channels_get_by_name(name) != NULL;
+}
+
+static dvc_channel_t *
 dvc_channels_get_by_id(uint32 id)
 {
-	int i;
+	dvc_channel_t *ch;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	for (ch = channels_by_id[id % DVC_HASH_SIZE]; ch; ch = ch->next_by_id)
 	{
-		if (channels[i].channel_id == id)
-		{
-			return &channels[i];
-		}
+		if (ch->channel_id == id)
+			return ch;
 	}
 
 	return NULL;
@@ -90,42 +107,57 @@ dvc_channels_get_by_id(uint32 id)
 static uint32
 dvc_channels_get_id(const char *name)
 {
-	int i;
-	uint32 hash;
-	hash = utils_djb2_hash(name);
+	dvc_channel_t *ch;
+
+	ch = dvc_channels_get_by_name(name);
+	if (ch == NULL)
+		return INVALID_CHANNEL;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	return ch->channel_id;
+}
+
+/* Take an open channel out of the id hash, it stays registered */
+static void
+dvc_channels_close(dvc_channel_t * channel)
+{
+	dvc_channel_t **prevnext;
+
+	if (channel->channel_id == INVALID_CHANNEL)
+		return;
+
+	for (prevnext = &channels_by_id[channel->channel_id % DVC_HASH_SIZE]; *prevnext;
+	     prevnext = &(*prevnext)->next_by_id)
 	{
-		if (channels[i].hash == hash)
+		if (*prevnext == channel)
 		{
-			return channels[i].channel_id;
+			*prevnext = channel->next_by_id;
+			break;
 		}
 	}
 
-	return INVALID_CHANNEL;
+	channel->channel_id = INVALID_CHANNEL;
+	channel->next_by_id = NULL;
+	channel->in_length = 0;
+	channel->in_skip = 0;
 }
 
 static RD_BOOL
 dvc_channels_remove_by_id(uint32 channelid)
 {
-	int i;
+	dvc_channel_t *ch;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
-	{
-		if (channels[i].channel_id == channelid)
-		{
-			memset(&channels[i], 0, sizeof(dvc_channel_t));
-			return True;
-		}
-	}
-	return False;
+	ch = dvc_channels_get_by_id(channelid);
+	if (ch == NULL)
+		return False;
+
+	dvc_channels_close(ch);
+	return True;
 }
 
 static RD_BOOL
 dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channel_id)
 {
-	int i;
-	uint32 hash;
+	dvc_channel_t *ch;
 
 	if (dvc_channels_exists(name) == True)
 	{
@@ -134,64 +166,48 @@ dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channe
 		return False;
 	}
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
-	{
-		if (channels[i].hash == 0)
-		{
-			hash = utils_djb2_hash(name);
-			channels[i].hash = hash;
-			channels[i].handler = handler;
-			channels[i].channel_id = channel_id;
-			logger(Core, Debug,
-			       "dvc_channels_add(), Added hash=%x, channel_id=%d, name=%s, handler=%p",
-			       hash, channel_id, name, handler);
-			return True;
-		}
-	}
-
-	logger(Core, Warning,
-	       "dvc_channels_add(), Failed to add channel, maximum number of channels are being used");
-	return False;
+	ch = xmalloc(sizeof(dvc_channel_t));
+	memset(ch, 0, sizeof(dvc_channel_t));
+	ch->hash = utils_djb2_hash(name);
+	ch->handler = handler;
+	ch->channel_id = channel_id;
+	ch->next = channels;
+	channels = ch;
+
+	logger(Core, Debug,
+	       "dvc_channels_add(), Added hash=%x, channel_id=%d, name=%s, handler=%p",
+	       ch->hash, channel_id, name, handler);
+	return True;
 }
 
 static int
 dvc_channels_set_id(const char *name, uint32 channel_id)
 {
-	int i;
-	uint32 hash;
+	dvc_channel_t *ch, *old;
 
-	hash = utils_djb2_hash(name);
+	ch = dvc_channels_get_by_name(name);
+	if (ch == NULL)
+		return -1;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
-	{
-		if (channels[i].hash == hash)
-		{
-			logger(Core, Debug, "dvc_channels_set_id(), name = '%s', channel_id = %d",
-			       name, channel_id);
-			channels[i].channel_id = channel_id;
-			return 0;
-		}
-	}
+	logger(Core, Debug, "dvc_channels_set_id(), name = '%s', channel_id = %d",
+	       name, channel_id);
+
+	/* the server may reuse an id without closing the channel first */
+	dvc_channels_close(ch);
+	old = dvc_channels_get_by_id(channel_id);
+	if (old != NULL)
+		dvc_channels_close(old);
 
-	return -1;
+	ch->channel_id = channel_id;
+	ch->next_by_id = channels_by_id[channel_id % DVC_HASH_SIZE];
+	channels_by_id[channel_id % DVC_HASH_SIZE] = ch;
+	return 0;
 }
 
 RD_BOOL
 dvc_channels_is_available(const char *name)
 {
-	int i;
-	uint32 hash;
-	hash = utils_djb2_hash(name);
-
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
-	{
-		if (channels[i].hash == hash)
-		{
-			return (channels[i].channel_id != INVALID_CHANNEL);
-		}
-	}
-
-	return False;
+	return dvc_channels_get_id(name) != INVALID_CHANNEL;
 }
 
 RD_BOOL
@@ -245,7 +261,7 @@ dvc_send(const char *name, STREAM s)
 {
 	STREAM ls;
 	dvc_hdr_t hdr;
-	uint32 channel_id;
+	uint32 channel_id, length, offset, chunk;
 
 	channel_id = dvc_channels_get_id(name);
 	if (channel_id == INVALID_CHANNEL)
@@ -255,29 +271,45 @@ dvc_send(const char *name, STREAM s)
 		return;
 	}
 
-	/* FIXME: we assume length is less than 1600 */
-
-	hdr.hdr.cmd = DYNVC_DATA;
+	length = s_length(s);
 	hdr.hdr.cbid = 2;
-	hdr.hdr.sp = 0;
 
-	ls = dvc_init_packet(hdr, channel_id, s_length(s));
+	/* Larger messages are split up, the first part carries the total length */
+	for (offset = 0; offset == 0 || offset < length; offset += chunk)
+	{
+		if (offset == 0 && length > DVC_CHUNK_LENGTH - 5)
+		{
+			hdr.hdr.cmd = DYNVC_DATA_FIRST;
+			hdr.hdr.sp = 2;
+			chunk = DVC_CHUNK_LENGTH - 9;
+			ls = dvc_init_packet(hdr, channel_id, 4 + chunk);
+			out_uint32_le(ls, length);
+		}
+		else
+		{
+			hdr.hdr.cmd = DYNVC_DATA;
+			hdr.hdr.sp = 0;
+			chunk = MIN(length - offset, DVC_CHUNK_LENGTH - 5);
+			ls = dvc_init_packet(hdr, channel_id, chunk);
+		}
 
-	out_stream(ls, s);
+		out_uint8a(ls, s->data + offset, chunk);
+		s_mark_end(ls);
 
-	s_mark_end(ls);
+		channel_send(ls, dvc_channel);
+		s_free(ls);
 
-	channel_send(ls, dvc_channel);
-	s_free(ls);
+		if (chunk == 0)
+			break;
+	}
 }
 
 
 static void
-dvc_send_capabilities_response()
+dvc_send_capabilities_response(uint16 supportedversion)
 {
 	STREAM s;
 	dvc_hdr_t hdr;
-	uint16 supportedversion = 0x01;
 
 	hdr.hdr.cbid = 0x00;
 	hdr.hdr.sp = 0x00;
@@ -299,15 +331,21 @@ dvc_send_capabilities_response()
 static void
 dvc_process_caps_pdu(STREAM s)
 {
+	dvc_channel_t *ch;
 	uint16 version;
 
-	/* VERSION1 */
+	/* VERSION1, later versions add priority charges we do not use */
 	in_uint8s(s, 1);	/* pad */
 	in_uint16_le(s, version);	/* version */
 
 	logger(Protocol, Debug, "dvc_process_caps(), server supports dvc %d", version);
 
-	dvc_send_capabilities_response();
+	/* a new session, the server opens its channels again */
+	for (ch = channels; ch; ch = ch->next)
+		dvc_channels_close(ch);
+	rdp8_bulk_reset();
+
+	dvc_send_capabilities_response(MIN(version, DVC_CAPS_VERSION));
 }
 
 static void
@@ -374,13 +412,40 @@ dvc_in_channelid(STREAM s, dvc_hdr_t hdr)
 	return id;
 }
 
+static uint32
+dvc_in_length(STREAM s, dvc_hdr_t hdr)
+{
+	uint32 length;
+
+	length = 0;
+
+	switch (hdr.hdr.sp)
+	{
+		case 0:
+			in_uint8(s, length);
+			break;
+		case 1:
+			in_uint16_le(s, length);
+			break;
+		default:
+			in_uint32_le(s, length);
+			break;
+	}
+	return length;
+}
+
+/* Data PDUs, compressed or not. A message starting with a DATA_FIRST
+   PDU is gathered until its total length has arrived. */
 static void
-dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr)
+dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr, RD_BOOL first, RD_BOOL compressed)
 {
-	const dvc_channel_t *ch;
-	uint32 channelid;
+	dvc_channel_t *ch;
+	uint32 channelid, length;
+	STREAM data;
 
 	channelid = dvc_in_channelid(s, hdr);
+	length = first ? dvc_in_length(s, hdr) : 0;
+
 	ch = dvc_channels_get_by_id(channelid);
 	if (ch == NULL)
 	{
@@ -389,8 +454,69 @@ dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr)
 		return;
 	}
 
-	/* dispatch packet to channel handler */
-	ch->handler(s);
+	data = s;
+	if (compressed)
+	{
+		s_reset(&expanded);
+		if (!rdp8_bulk_expand(s->p, s_remaining(s), &expanded))
+		{
+			logger(Protocol, Warning,
+			       "dvc_process_data(), dropping undecodable data on channel %d",
+			       channelid);
+			ch->in_length = 0;
+			return;
+		}
+		in_uint8s(s, s_remaining(s));
+		s_mark_end(&expanded);
+		s_seek(&expanded, 0);
+		data = &expanded;
+	}
+
+	if (first)
+	{
+		if (length > DVC_MAX_MESSAGE)
+		{
+			logger(Protocol, Warning,
+			       "dvc_process_data(), dropping message of %u bytes on channel %d",
+			       length, channelid);
+			ch->in_length = 0;
+			ch->in_skip = length - s_remaining(data);
+			return;
+		}
+		ch->in_skip = 0;
+		s_realloc(&ch->in, length);
+		s_reset(&ch->in);
+		ch->in_length = length;
+	}
+	else if (ch->in_skip > 0)
+	{
+		ch->in_skip -= MIN(ch->in_skip, s_remaining(data));
+		return;
+	}
+	else if (ch->in_length == 0)
+	{
+		/* dispatch packet to channel handler */
+		ch->handler(data);
+		return;
+	}
+
+	if (s_remaining(data) > ch->in_length - s_tell(&ch->in))
+	{
+		logger(Protocol, Warning,
+		       "dvc_process_data(), dropping message beyond its length %d on channel %d",
+		       ch->in_length, channelid);
+		ch->in_length = 0;
+		return;
+	}
+	out_uint8stream(&ch->in, data, s_remaining(data));
+
+	if (s_tell(&ch->in) == ch->in_length)
+	{
+		ch->in_length = 0;
+		s_mark_end(&ch->in);
+		s_seek(&ch->in, 0);
+		ch->handler(&ch->in);
+	}
 }
 
 static void
@@ -427,8 +553,20 @@ dvc_process_pdu(STREAM s)
 			dvc_process_create_pdu(s, hdr);
 			break;
 
+		case DYNVC_DATA_FIRST:
+			dvc_process_data_pdu(s, hdr, True, False);
+			break;
+
 		case DYNVC_DATA:
-			dvc_process_data_pdu(s, hdr);
+			dvc_process_data_pdu(s, hdr, False, False);
+			break;
+
+		case DYNVC_DATA_FIRST_COMPRESSED:
+			dvc_process_data_pdu(s, hdr, True, True);
+			break;
+
+		case DYNVC_DATA_COMPRESSED:
+			dvc_process_data_pdu(s, hdr, False, True);
 			break;
 
 		case DYNVC_CLOSE:
@@ -437,12 +575,6 @@ dvc_process_pdu(STREAM s)
 
 #if 0				/* Unimplemented */
 
-		case DYNVC_DATA_FIRST:
-			break;
-		case DYNVC_DATA_FIRST_COMPRESSED:
-			break;
-		case DYNVC_DATA_COMPRESSED:
-			break;
 		case DYNVC_SOFT_SYNC_REQUEST:
 			break;
 		case DYNVC_SOFT_SYNC_RESPONSE:
@@ -460,7 +592,6 @@ dvc_process_pdu(STREAM s)
 RD_BOOL
 dvc_init()
 {
-	memset(channels, 0, sizeof(channels));
 	dvc_channel = channel_register("drdynvc",
 				       CHANNEL_OPTION_INITIALIZED | CHANNEL_OPTION_ENCRYPT_RDP,
 				       dvc_process_pdu);
@@ -0,0 +1,1302 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   User interface services - headless in-memory framebuffer
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * This is a ui port without any display. All drawing goes to a
+ * framebuffer in memory, so the complete protocol path (bitmap decoding,
+ * caches, order processing) runs exactly as with a real display, but
+ * without an X server. It is built as rdesktop-null and is meant for
+ * benchmarking and for generating load against terminal servers.
+ *
+ * Pixels are kept as one uint32 per pixel holding the raw server colour
+ * value, i.e. a palette index at 8 bpp and the packed colour otherwise.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include "rdesktop.h"
+
+extern int g_server_depth;
+extern RD_BOOL g_exit_mainloop;
+extern RD_BOOL g_pending_resize;
+
+RD_BOOL g_dynamic_session_resize = False;
+time_t g_wait_for_deactivate_ts = 0;
+
+#define NULL_SCREEN_WIDTH 1024
+#define NULL_SCREEN_HEIGHT 768
+
+typedef struct _null_surface
+{
+	int width;
+	int height;
+	uint32 *data;
+} null_surface;
+
+/* glyphs are kept as one byte per pixel, non-zero where set */
+typedef struct _null_glyph
+{
+	int width;
+	int height;
+	uint8 *data;
+} null_glyph;
+
+static null_surface g_fb;
+static uint32 g_fb_mask;
+static uint32 *g_colmap = NULL;
+static int g_cursor_dummy;
+
+static struct
+{
+	int x, y, cx, cy;
+} g_clip;
+
+/* what the session made us do, reported on exit */
+static struct
+{
+	uint32 updates;
+	uint32 bitmaps;
+	uint32 glyphs;
+	uint32 fills;
+	uint32 blits;
+	uint32 text;
+	uint32 lines;
+	uint64 pixels;
+	struct timeval start;
+} g_stats;
+
+/* ROP2 codes as boolean functions of source and destination, using the
+   same bit layout as the X11 GX functions */
+static const uint8 rop2_fn[] = {
+	0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+	0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+};
+
+static inline uint32
+rop2_apply(uint8 opcode, uint32 src, uint32 dst)
+{
+	uint8 fn = rop2_fn[opcode & 0xf];
+	uint32 res = 0;
+
+	if (opcode == ROP2_COPY)
+		return src;
+
+	if (fn & 0x1)
+		res |= src & dst;
+	if (fn & 0x2)
+		res |= src & ~dst;
+	if (fn & 0x4)
+		res |= ~src & dst;
+	if (fn & 0x8)
+		res |= ~src & ~dst;
+
+	return res & g_fb_mask;
+}
+
+/* Clip a destination rectangle against the clip rectangle and the
+   framebuffer, moving the source position along with it */
+static RD_BOOL
+clip_rect(int *x, int *y, int *cx, int *cy, int *srcx, int *srcy)
+{
+	int left = MAX(g_clip.x, 0);
+	int top = MAX(g_clip.y, 0);
+	int right = MIN(g_clip.x + g_clip.cx, g_fb.width);
+	int bottom = MIN(g_clip.y + g_clip.cy, g_fb.height);
+	int d;
+
+	if (*x < left)
+	{
+		d = left - *x;
+		*x += d;
+		*cx -= d;
+		if (srcx)
+			*srcx += d;
+	}
+
+	if (*y < top)
+	{
+		d = top - *y;
+		*y += d;
+		*cy -= d;
+		if (srcy)
+			*srcy += d;
+	}
+
+	if (*x + *cx > right)
+		*cx = right - *x;
+	if (*y + *cy > bottom)
+		*cy = bottom - *y;
+
+	if (*cx <= 0 || *cy <= 0)
+		return False;
+
+	g_stats.pixels += *cx * *cy;
+	return True;
+}
+
+static inline void
+put_pixel(int x, int y, uint32 colour, uint8 opcode)
+{
+	uint32 *p;
+
+	if (x < g_clip.x || x >= g_clip.x + g_clip.cx || y < g_clip.y || y >= g_clip.y + g_clip.cy)
+		return;
+	if (x < 0 || x >= g_fb.width || y < 0 || y >= g_fb.height)
+		return;
+
+	p = &g_fb.data[y * g_fb.width + x];
+	*p = rop2_apply(opcode, colour, *p);
+}
+
+static void
+fill_rect(uint8 opcode, int x, int y, int cx, int cy, uint32 colour)
+{
+	uint32 *p;
+	int i;
+
+	g_stats.fills++;
+	if (!clip_rect(&x, &y, &cx, &cy, NULL, NULL))
+		return;
+
+	while (cy--)
+	{
+		p = &g_fb.data[y++ * g_fb.width + x];
+		for (i = 0; i < cx; i++)
+			p[i] = rop2_apply(opcode, colour, p[i]);
+	}
+}
+
+/* Copy between surfaces, handling overlap within the same surface */
+static void
+copy_rect(uint8 opcode, null_surface * src, int x, int y, int cx, int cy, int srcx, int srcy)
+{
+	uint32 *s, *d;
+	int i, row, step;
+
+	g_stats.blits++;
+	if (!clip_rect(&x, &y, &cx, &cy, &srcx, &srcy))
+		return;
+
+	/* clip against the source as well */
+	if (srcx < 0 || srcy < 0)
+		return;
+	cx = MIN(cx, src->width - srcx);
+	cy = MIN(cy, src->height - srcy);
+	if (cx <= 0 || cy <= 0)
+		return;
+
+	row = 0;
+	step = 1;
+	if (src == &g_fb && srcy < y)
+	{
+		row = cy - 1;
+		step = -1;
+	}
+
+	for (; row >= 0 && row < cy; row += step)
+	{
+		s = &src->data[(srcy + row) * src->width + srcx];
+		d = &g_fb.data[(y + row) * g_fb.width + x];
+		if (opcode == ROP2_COPY)
+		{
+			memmove(d, s, cx * sizeof(uint32));
+			continue;
+		}
+
+		if (src == &g_fb && srcy == y && srcx < x)
+		{
+			for (i = cx - 1; i >= 0; i--)
+				d[i] = rop2_apply(opcode, s[i], d[i]);
+			continue;
+		}
+
+		for (i = 0; i < cx; i++)
+			d[i] = rop2_apply(opcode, s[i], d[i]);
+	}
+}
+
+/* Draw a mono mask at x, y: fg where set, and bg elsewhere unless transparent */
+static void
+draw_mask(null_glyph * glyph, int x, int y, int cx, int cy, int srcx, int srcy,
+	  RD_BOOL transparent, uint32 bgcolour, uint32 fgcolour)
+{
+	uint8 *m;
+	uint32 *d;
+	int i;
+
+	g_stats.glyphs++;
+	if (!clip_rect(&x, &y, &cx, &cy, &srcx, &srcy))
+		return;
+
+	cx = MIN(cx, glyph->width - srcx);
+	cy = MIN(cy, glyph->height - srcy);
+
+	for (; cy > 0; cy--, y++, srcy++)
+	{
+		m = &glyph->data[srcy * glyph->width + srcx];
+		d = &g_fb.data[y * g_fb.width + x];
+		for (i = 0; i < cx; i++)
+		{
+			if (m[i])
+				d[i] = fgcolour;
+			else if (!transparent)
+				d[i] = bgcolour;
+		}
+	}
+}
+
+static uint32
+read_pixel(uint8 * data, int Bpp)
+{
+	switch (Bpp)
+	{
+		case 1:
+			return data[0];
+		case 2:
+			return data[0] | (data[1] << 8);
+		case 3:
+			return data[0] | (data[1] << 8) | (data[2] << 16);
+		default:
+			return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32) data[3] << 24);
+	}
+}
+
+/* Convert server format pixel data into a surface */
+static void
+surface_load(null_surface * surface, int width, int height, uint8 * data)
+{
+	int Bpp = (g_server_depth + 7) / 8;
+	int i, n = width * height;
+
+	surface->width = width;
+	surface->height = height;
+	surface->data = xmalloc(n * sizeof(uint32));
+	for (i = 0; i < n; i++)
+		surface->data[i] = read_pixel(data + i * Bpp, Bpp);
+}
+
+/* Fetch a brush pixel, with patterns anchored at the brush origin */
+static uint32
+brush_pixel(BRUSH * brush, int x, int y, uint32 bgcolour, uint32 fgcolour)
+{
+	static const uint8 hatch_patterns[] = {
+		0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00,	/* 0 - bsHorizontal */
+		0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,	/* 1 - bsVertical */
+		0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,	/* 2 - bsFDiagonal */
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,	/* 3 - bsBDiagonal */
+		0x08, 0x08, 0x08, 0xff, 0x08, 0x08, 0x08, 0x08,	/* 4 - bsCross */
+		0x81, 0x42, 0x24, 0x18, 0x18, 0x24, 0x42, 0x81	/* 5 - bsDiagCross */
+	};
+	int px = (x - brush->xorigin) & 7;
+	int py = (y - brush->yorigin) & 7;
+	int Bpp;
+
+	switch (brush->style)
+	{
+		case 2:	/* Hatch */
+			if (brush->pattern[0] > 5)
+				return fgcolour;
+			if (hatch_patterns[brush->pattern[0] * 8 + py] & (0x80 >> px))
+				return fgcolour;
+			return bgcolour;
+
+		case 3:	/* Pattern */
+			if (brush->bd == NULL)
+				return (brush->pattern[7 - py] & (0x80 >> px)) ? bgcolour : fgcolour;
+
+			if (brush->bd->colour_code > 1)
+			{
+				Bpp = brush->bd->colour_code - 2;
+				return read_pixel(brush->bd->data + (py * 8 + px) * Bpp, Bpp);
+			}
+
+			return (brush->bd->data[py] & (0x80 >> px)) ? bgcolour : fgcolour;
+
+		default:	/* Solid */
+			return fgcolour;
+	}
+}
+
+static void
+fill_brush(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, uint32 bgcolour,
+	   uint32 fgcolour)
+{
+	uint32 *p;
+	int i;
+
+	if (brush == NULL || brush->style == 0)
+	{
+		fill_rect(opcode, x, y, cx, cy, fgcolour);
+		return;
+	}
+
+	g_stats.fills++;
+	if (!clip_rect(&x, &y, &cx, &cy, NULL, NULL))
+		return;
+
+	for (; cy > 0; cy--, y++)
+	{
+		p = &g_fb.data[y * g_fb.width + x];
+		for (i = 0; i < cx; i++)
+			p[i] = rop2_apply(opcode, brush_pixel(brush, x + i, y, bgcolour, fgcolour),
+					  p[i]);
+	}
+}
+
+static void
+draw_line(uint8 opcode, int x0, int y0, int x1, int y1, uint32 colour)
+{
+	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy, e2;
+
+	g_stats.lines++;
+
+	/* X11 does not draw the last point of a line */
+	while (x0 != x1 || y0 != y1)
+	{
+		put_pixel(x0, y0, colour, opcode);
+		e2 = 2 * err;
+		if (e2 >= dy)
+		{
+			err += dy;
+			x0 += sx;
+		}
+		if (e2 <= dx)
+		{
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+RD_BOOL
+ui_init(void)
+{
+	if (g_server_depth > 32)
+		g_server_depth = 32;
+
+	g_fb_mask = (g_server_depth >= 32) ? 0xffffffff : ((1u << g_server_depth) - 1);
+	gettimeofday(&g_stats.start, NULL);
+
+	logger(GUI, Notice, "Using headless null ui, nothing will be displayed");
+	return True;
+}
+
+void
+ui_deinit(void)
+{
+	struct timeval now;
+	double elapsed;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - g_stats.start.tv_sec) + (now.tv_usec - g_stats.start.tv_usec) / 1e6;
+
+	/* a single line so that load generation runs can be collected easily */
+	logger(GUI, Notice,
+	       "null ui stats: seconds=%.3f updates=%u bitmaps=%u fills=%u blits=%u glyphs=%u text=%u lines=%u pixels=%llu",
+	       elapsed, g_stats.updates, g_stats.bitmaps, g_stats.fills, g_stats.blits,
+	       g_stats.glyphs, g_stats.text, g_stats.lines, (unsigned long long) g_stats.pixels);
+
+	ui_destroy_window();
+	xfree(g_colmap);
+	g_colmap = NULL;
+}
+
+void
+ui_get_screen_size(uint32 * width, uint32 * height)
+{
+	*width = NULL_SCREEN_WIDTH;
+	*height = NULL_SCREEN_HEIGHT;
+}
+
+void
+ui_get_screen_size_from_percentage(uint32 pw, uint32 ph, uint32 * width, uint32 * height)
+{
+	*width = NULL_SCREEN_WIDTH * pw / 100;
+	*height = NULL_SCREEN_HEIGHT * ph / 100;
+}
+
+void
+ui_get_workarea_size(uint32 * width, uint32 * height)
+{
+	ui_get_screen_size(width, height);
+}
+
+RD_BOOL
+ui_create_window(uint32 width, uint32 height)
+{
+	ui_resize_window(width, height);
+	return True;
+}
+
+void
+ui_resize_window(uint32 width, uint32 height)
+{
+	if (g_fb.data != NULL && g_fb.width == (int) width && g_fb.height == (int) height)
+		return;
+
+	g_fb.width = width;
+	g_fb.height = height;
+	g_fb.data = xrealloc(g_fb.data, width * height * sizeof(uint32));
+	memset(g_fb.data, 0, width * height * sizeof(uint32));
+	ui_reset_clip();
+}
+
+void
+ui_destroy_window(void)
+{
+	xfree(g_fb.data);
+	g_fb.data = NULL;
+	g_fb.width = g_fb.height = 0;
+}
+
+void
+ui_update_window_sizehints(uint32 width, uint32 height)
+{
+	UNUSED(width);
+	UNUSED(height);
+}
+
+RD_BOOL
+ui_have_window(void)
+{
+	return g_fb.data != NULL;
+}
+
+void
+ui_select(int rdp_socket)
+{
+	int n, ret;
+	fd_set rfds, wfds;
+	struct timeval tv;
+	RD_BOOL s_timeout;
+
+	while (g_exit_mainloop == False)
+	{
+		/* there is no display to resize */
+		g_pending_resize = False;
+
+		n = rdp_socket;
+		s_timeout = False;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(rdp_socket, &rfds);
+
+		tv.tv_sec = 60;
+		tv.tv_usec = 0;
+
+#ifdef WITH_RDPSND
+		rdpsnd_add_fds(&n, &rfds, &wfds, &tv);
+#endif
+		rdpdr_add_fds(&n, &rfds, &wfds, &tv, &s_timeout);
+		ctrl_add_fds(&n, &rfds);
+		cliprdr_add_fds(&n, &rfds);
+
+		n++;
+
+		ret = select(n, &rfds, &wfds, NULL, &tv);
+		if (ret <= 0)
+		{
+			if (ret == -1 && errno == EINTR)
+				continue;
+#ifdef WITH_RDPSND
+			rdpsnd_check_fds(&rfds, &wfds);
+#endif
+			/* Abort serial read calls, or check polled serial events */
+			if (s_timeout)
+				rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) True);
+			else if (ret == 0)
+				rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
+			continue;
+		}
+
+#ifdef WITH_RDPSND
+		rdpsnd_check_fds(&rfds, &wfds);
+#endif
+		rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
+		ctrl_check_fds(&rfds, &wfds);
+		cliprdr_check_fds(&rfds);
+
+		if (FD_ISSET(rdp_socket, &rfds))
+			return;
+	}
+}
+
+void
+ui_move_pointer(int x, int y)
+{
+	UNUSED(x);
+	UNUSED(y);
+}
+
+RD_HBITMAP
+ui_create_bitmap(int width, int height, uint8 * data)
+{
+	null_surface *bitmap = xmalloc(sizeof(null_surface));
+
+	g_stats.bitmaps++;
+	surface_load(bitmap, width, height, data);
+	return (RD_HBITMAP) bitmap;
+}
+
+void
+ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data)
+{
+	null_surface bitmap;
+
+	g_stats.bitmaps++;
+	surface_load(&bitmap, width, height, data);
+	copy_rect(ROP2_COPY, &bitmap, x, y, cx, cy, 0, 0);
+	xfree(bitmap.data);
+}
+
+void
+ui_destroy_bitmap(RD_HBITMAP bmp)
+{
+	null_surface *bitmap = (null_surface *) bmp;
+
+	xfree(bitmap->data);
+	xfree(bitmap);
+}
+
+RD_HGLYPH
+ui_create_glyph(int width, int height, uint8 * data)
+{
+	null_glyph *glyph = xmalloc(sizeof(null_glyph));
+	int x, y, scanline = (width + 7) / 8;
+
+	glyph->width = width;
+	glyph->height = height;
+	glyph->data = xmalloc(width * height);
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			glyph->data[y * width + x] = data[y * scanline + x / 8] & (0x80 >> (x % 8));
+
+	return (RD_HGLYPH) glyph;
+}
+
+void
+ui_destroy_glyph(RD_HGLYPH glyph)
+{
+	xfree(((null_glyph *) glyph)->data);
+	xfree(glyph);
+}
+
+RD_HCURSOR
+ui_create_cursor(unsigned int x, unsigned int y, uint32 width, uint32 height,
+		 uint8 * andmask, uint8 * xormask, int bpp)
+{
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(andmask);
+	UNUSED(xormask);
+	UNUSED(bpp);
+
+	/* any non-NULL handle will do, the cache only checks for presence */
+	return (RD_HCURSOR) & g_cursor_dummy;
+}
+
+void
+ui_set_cursor(RD_HCURSOR cursor)
+{
+	UNUSED(cursor);
+}
+
+void
+ui_destroy_cursor(RD_HCURSOR cursor)
+{
+	UNUSED(cursor);
+}
+
+void
+ui_set_null_cursor(void)
+{
+}
+
+void
+ui_set_standard_cursor(void)
+{
+}
+
+RD_HCOLOURMAP
+ui_create_colourmap(COLOURMAP * colours)
+{
+	uint32 *map = xmalloc(sizeof(*map) * MAX(colours->ncolours, 1));
+	int i;
+
+	for (i = 0; i < colours->ncolours; i++)
+		map[i] = (colours->colours[i].red << 16) | (colours->colours[i].green << 8) |
+			colours->colours[i].blue;
+
+	return (RD_HCOLOURMAP) map;
+}
+
+void
+ui_destroy_colourmap(RD_HCOLOURMAP map)
+{
+	xfree(map);
+}
+
+void
+ui_set_colourmap(RD_HCOLOURMAP map)
+{
+	xfree(g_colmap);
+	g_colmap = (uint32 *) map;
+}
+
+void
+ui_set_clip(int x, int y, int cx, int cy)
+{
+	g_clip.x = x;
+	g_clip.y = y;
+	g_clip.cx = cx;
+	g_clip.cy = cy;
+}
+
+void
+ui_reset_clip(void)
+{
+	ui_set_clip(0, 0, g_fb.width, g_fb.height);
+}
+
+void
+ui_bell(void)
+{
+}
+
+void
+ui_destblt(uint8 opcode,
+	   /* dest */ int x, int y, int cx, int cy)
+{
+	/* the source of these operations is the destination itself */
+	copy_rect(opcode, &g_fb, x, y, cx, cy, x, y);
+}
+
+void
+ui_patblt(uint8 opcode,
+	  /* dest */ int x, int y, int cx, int cy,
+	  /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	fill_brush(opcode, x, y, cx, cy, brush, bgcolour, fgcolour);
+}
+
+void
+ui_screenblt(uint8 opcode,
+	     /* dest */ int x, int y, int cx, int cy,
+	     /* src */ int srcx, int srcy)
+{
+	copy_rect(opcode, &g_fb, x, y, cx, cy, srcx, srcy);
+}
+
+void
+ui_memblt(uint8 opcode,
+	  /* dest */ int x, int y, int cx, int cy,
+	  /* src */ RD_HBITMAP src, int srcx, int srcy)
+{
+	copy_rect(opcode, (null_surface *) src, x, y, cx, cy, srcx, srcy);
+}
+
+void
+ui_triblt(uint8 opcode,
+	  /* dest */ int x, int y, int cx, int cy,
+	  /* src */ RD_HBITMAP src, int srcx, int srcy,
+	  /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	/* same decomposition as the X11 ui */
+	switch (opcode)
+	{
+		case 0x69:	/* PDSxxn */
+			ui_memblt(ROP2_XOR, x, y, cx, cy, src, srcx, srcy);
+			ui_patblt(ROP2_NXOR, x, y, cx, cy, brush, bgcolour, fgcolour);
+			break;
+
+		case 0xb8:	/* PSDPxax */
+			ui_patblt(ROP2_XOR, x, y, cx, cy, brush, bgcolour, fgcolour);
+			ui_memblt(ROP2_AND, x, y, cx, cy, src, srcx, srcy);
+			ui_patblt(ROP2_XOR, x, y, cx, cy, brush, bgcolour, fgcolour);
+			break;
+
+		case 0xc0:	/* PSa */
+			ui_memblt(ROP2_COPY, x, y, cx, cy, src, srcx, srcy);
+			ui_patblt(ROP2_AND, x, y, cx, cy, brush, bgcolour, fgcolour);
+			break;
+
+		default:
+			ui_memblt(ROP2_COPY, x, y, cx, cy, src, srcx, srcy);
+	}
+}
+
+void
+ui_line(uint8 opcode,
+	/* dest */ int startx, int starty, int endx, int endy,
+	/* pen */ PEN * pen)
+{
+	draw_line(opcode, startx, starty, endx, endy, pen->colour);
+}
+
+void
+ui_rect(
+	       /* dest */ int x, int y, int cx, int cy,
+	       /* brush */ uint32 colour)
+{
+	fill_rect(ROP2_COPY, x, y, cx, cy, colour);
+}
+
+/* Resolve a CoordModePrevious point list to absolute coordinates */
+static RD_POINT *
+point_list_absolute(RD_POINT * points, int npoints)
+{
+	RD_POINT *pts = xmalloc(npoints * sizeof(RD_POINT));
+	int i;
+
+	pts[0] = points[0];
+	for (i = 1; i < npoints; i++)
+	{
+		pts[i].x = pts[i - 1].x + points[i].x;
+		pts[i].y = pts[i - 1].y + points[i].y;
+	}
+
+	return pts;
+}
+
+void
+ui_polygon(uint8 opcode,
+	   /* mode */ uint8 fillmode,
+	   /* dest */ RD_POINT * point, int npoints,
+	   /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	int i, j, x, y, x0, y0, x1, y1, miny, maxy, n, winding, tmp;
+	int *xs, *dirs;
+	RD_POINT *pts;
+
+	if (npoints < 2)
+		return;
+
+	/* points are relative to the previous one */
+	pts = point_list_absolute(point, npoints);
+	miny = maxy = pts[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		miny = MIN(miny, pts[i].y);
+		maxy = MAX(maxy, pts[i].y);
+	}
+
+	xs = xmalloc(npoints * sizeof(int));
+	dirs = xmalloc(npoints * sizeof(int));
+
+	g_stats.fills++;
+	for (y = miny; y <= maxy; y++)
+	{
+		/* collect edge crossings of this scanline */
+		n = 0;
+		for (i = 0; i < npoints; i++)
+		{
+			j = (i + 1) % npoints;
+			x0 = pts[i].x;
+			y0 = pts[i].y;
+			x1 = pts[j].x;
+			y1 = pts[j].y;
+			if (y0 == y1 || y < MIN(y0, y1) || y >= MAX(y0, y1))
+				continue;
+
+			xs[n] = x0 + (y - y0) * (x1 - x0) / (y1 - y0);
+			dirs[n] = (y1 > y0) ? 1 : -1;
+			n++;
+		}
+
+		/* insertion sort, there are only a handful */
+		for (i = 1; i < n; i++)
+		{
+			for (j = i; j > 0 && xs[j - 1] > xs[j]; j--)
+			{
+				tmp = xs[j];
+				xs[j] = xs[j - 1];
+				xs[j - 1] = tmp;
+				tmp = dirs[j];
+				dirs[j] = dirs[j - 1];
+				dirs[j - 1] = tmp;
+			}
+		}
+
+		winding = 0;
+		for (i = 0; i + 1 < n; i++)
+		{
+			winding += dirs[i];
+			if ((fillmode == WINDING) ? (winding == 0) : (i % 2))
+				continue;
+
+			for (x = xs[i]; x < xs[i + 1]; x++)
+				put_pixel(x, y, brush ? brush_pixel(brush, x, y, bgcolour, fgcolour)
+					  : fgcolour, opcode);
+		}
+	}
+
+	xfree(xs);
+	xfree(dirs);
+	xfree(pts);
+}
+
+void
+ui_polyline(uint8 opcode,
+	    /* dest */ RD_POINT * points, int npoints,
+	    /* pen */ PEN * pen)
+{
+	int i, x, y;
+
+	if (npoints < 1)
+		return;
+
+	/* points are relative to the previous one */
+	x = points[0].x;
+	y = points[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		draw_line(opcode, x, y, x + points[i].x, y + points[i].y, pen->colour);
+		x += points[i].x;
+		y += points[i].y;
+	}
+}
+
+void
+ui_ellipse(uint8 opcode,
+	   /* mode */ uint8 fillmode,
+	   /* dest */ int x, int y, int cx, int cy,
+	   /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	sint64 rx2 = (sint64) cx * cx, ry2 = (sint64) cy * cy;
+	sint64 dx, dy;
+	int row, col, left, right;
+
+	g_stats.fills++;
+	for (row = 0; row < cy; row++)
+	{
+		/* pixel centres inside the ellipse, in doubled coordinates */
+		dy = 2 * row + 1 - cy;
+		left = -1;
+		for (col = 0; col < (cx + 1) / 2; col++)
+		{
+			dx = 2 * col + 1 - cx;
+			if (dx * dx * ry2 + dy * dy * rx2 <= rx2 * ry2)
+			{
+				left = col;
+				break;
+			}
+		}
+		if (left < 0)
+			continue;
+		right = cx - left;
+
+		if (!fillmode)
+		{
+			put_pixel(x + left, y + row, fgcolour, opcode);
+			put_pixel(x + right - 1, y + row, fgcolour, opcode);
+			continue;
+		}
+
+		for (col = left; col < right; col++)
+			put_pixel(x + col, y + row,
+				  brush ? brush_pixel(brush, x + col, y + row, bgcolour, fgcolour)
+				  : fgcolour, opcode);
+	}
+}
+
+void
+ui_draw_glyph(int mixmode,
+	      /* dest */ int x, int y, int cx, int cy,
+	      /* src */ RD_HGLYPH glyph, int srcx, int srcy,
+	      uint32 bgcolour, uint32 fgcolour)
+{
+	draw_mask((null_glyph *) glyph, x, y, cx, cy, srcx, srcy, mixmode == MIX_TRANSPARENT,
+		  bgcolour, fgcolour);
+}
+
+#define DO_GLYPH(ttext,idx) \
+{\
+  glyph = cache_get_font (font, ttext[idx]);\
+  if (!(flags & TEXT2_IMPLICIT_X))\
+  {\
+    xyoffset = ttext[++idx];\
+    if ((xyoffset & 0x80))\
+    {\
+      if (flags & TEXT2_VERTICAL)\
+        y += ttext[idx+1] | (ttext[idx+2] << 8);\
+      else\
+        x += ttext[idx+1] | (ttext[idx+2] << 8);\
+      idx += 2;\
+    }\
+    else\
+    {\
+      if (flags & TEXT2_VERTICAL)\
+        y += xyoffset;\
+      else\
+        x += xyoffset;\
+    }\
+  }\
+  if (glyph != NULL)\
+  {\
+    x1 = x + glyph->offset;\
+    y1 = y + glyph->baseline;\
+    draw_mask((null_glyph *) glyph->pixmap, x1, y1, glyph->width, glyph->height, 0, 0,\
+	      True, bgcolour, fgcolour);\
+    if (flags & TEXT2_IMPLICIT_X)\
+      x += glyph->width;\
+  }\
+}
+
+void
+ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
+	     int clipx, int clipy, int clipcx, int clipcy,
+	     int boxx, int boxy, int boxcx, int boxcy, BRUSH * brush,
+	     uint32 bgcolour, uint32 fgcolour, uint8 * text, uint8 length)
+{
+	FONTGLYPH *glyph;
+	int i, j, xyoffset, x1, y1;
+	DATABLOB *entry;
+
+	UNUSED(opcode);
+	UNUSED(brush);
+
+	g_stats.text++;
+
+	if (boxx + boxcx > g_fb.width)
+		boxcx = g_fb.width - boxx;
+
+	if (boxcx > 1)
+		fill_rect(ROP2_COPY, boxx, boxy, boxcx, boxcy, bgcolour);
+	else if (mixmode == MIX_OPAQUE)
+		fill_rect(ROP2_COPY, clipx, clipy, clipcx, clipcy, bgcolour);
+
+	/* Paint text, character by character */
+	for (i = 0; i < length;)
+	{
+		switch (text[i])
+		{
+			case 0xff:
+				/* At least two bytes needs to follow */
+				if (i + 3 > length)
+				{
+					i = length = 0;
+					break;
+				}
+				cache_put_text(text[i + 1], text, text[i + 2]);
+				i += 3;
+				length -= i;
+				text = &(text[i]);
+				i = 0;
+				break;
+
+			case 0xfe:
+				/* At least one byte needs to follow */
+				if (i + 2 > length)
+				{
+					i = length = 0;
+					break;
+				}
+				entry = cache_get_text(text[i + 1]);
+				if (entry->data != NULL)
+				{
+					if ((((uint8 *) (entry->data))[1] == 0)
+					    && (!(flags & TEXT2_IMPLICIT_X)) && (i + 2 < length))
+					{
+						if (flags & TEXT2_VERTICAL)
+							y += text[i + 2];
+						else
+							x += text[i + 2];
+					}
+					for (j = 0; j < entry->size; j++)
+						DO_GLYPH(((uint8 *) (entry->data)), j);
+				}
+				if (i + 2 < length)
+					i += 3;
+				else
+					i += 2;
+				length -= i;
+				text = &(text[i]);
+				i = 0;
+				break;
+
+			default:
+				DO_GLYPH(text, i);
+				i++;
+				break;
+		}
+	}
+}
+
+void
+ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
+{
+	null_surface *save;
+	int left, top, right, bottom, row;
+
+	if (cx <= 0 || cy <= 0)
+		return;
+
+	save = xmalloc(sizeof(null_surface));
+	save->width = cx;
+	save->height = cy;
+	save->data = xmalloc(cx * cy * sizeof(uint32));
+
+	/* off the framebuffer is saved as zero, the range is overwritten all the same */
+	memset(save->data, 0, cx * cy * sizeof(uint32));
+	left = MAX(x, 0);
+	top = MAX(y, 0);
+	right = MIN(x + cx, g_fb.width);
+	bottom = MIN(y + cy, g_fb.height);
+	for (row = top; left < right && row < bottom; row++)
+		memcpy(&save->data[(row - y) * cx + left - x], &g_fb.data[row * g_fb.width + left],
+		       (right - left) * sizeof(uint32));
+
+	offset *= (g_server_depth + 7) / 8;
+	cache_put_desktop(offset, cx, cy, (g_server_depth + 7) / 8, (RD_HBITMAP) save);
+}
+
+void
+ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
+{
+	null_surface *save;
+	uint8 *data;
+	int srcy;
+
+	offset *= (g_server_depth + 7) / 8;
+	save = (null_surface *) cache_get_desktop(offset, cx, cy, (g_server_depth + 7) / 8, &srcy);
+	if (save == NULL)
+	{
+		/* spread over several saves, or saved with another width */
+		data = cache_get_desktop_data(offset, cx, cy, (g_server_depth + 7) / 8);
+		if (data != NULL)
+			ui_paint_bitmap(x, y, cx, cy, cx, cy, data);
+		return;
+	}
+
+	copy_rect(ROP2_COPY, save, x, y, cx, cy, 0, srcy);
+}
+
+void
+ui_desktop_read(RD_HBITMAP bitmap, int y, int cx, int cy, uint8 * data)
+{
+	null_surface *save = (null_surface *) bitmap;
+	int Bpp = (g_server_depth + 7) / 8;
+	uint32 pixel;
+	int i, b;
+
+	/* the surface holds server pixel values, see surface_load() */
+	for (i = 0; i < cx * cy; i++)
+	{
+		pixel = save->data[y * save->width + i];
+		for (b = 0; b < Bpp; b++)
+			*data++ = pixel >> (8 * b);
+	}
+}
+
+void
+ui_begin_update(void)
+{
+}
+
+void
+ui_end_update(void)
+{
+	g_stats.updates++;
+}
+
+void
+ui_seamless_begin(RD_BOOL hidden)
+{
+	UNUSED(hidden);
+}
+
+void
+ui_seamless_end()
+{
+}
+
+void
+ui_seamless_hide_desktop(void)
+{
+}
+
+void
+ui_seamless_unhide_desktop(void)
+{
+}
+
+void
+ui_seamless_toggle(void)
+{
+}
+
+void
+ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long parent,
+			  unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(group);
+	UNUSED(parent);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_destroy_window(unsigned long id, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_destroy_group(unsigned long id, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_seticon(unsigned long id, const char *format, int width, int height, int chunk,
+		    const char *data, size_t chunk_len)
+{
+	UNUSED(id);
+	UNUSED(format);
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(chunk);
+	UNUSED(data);
+	UNUSED(chunk_len);
+}
+
+void
+ui_seamless_delicon(unsigned long id, const char *format, int width, int height)
+{
+	UNUSED(id);
+	UNUSED(format);
+	UNUSED(width);
+	UNUSED(height);
+}
+
+void
+ui_seamless_move_window(unsigned long id, int x, int y, int width, int height,
+			unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_restack_window(unsigned long id, unsigned long behind, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(behind);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_settitle(unsigned long id, const char *title, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(title);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_setstate(unsigned long id, unsigned int state, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(state);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_syncbegin(unsigned long flags)
+{
+	UNUSED(flags);
+}
+
+void
+ui_seamless_ack(unsigned int serial)
+{
+	UNUSED(serial);
+}
+
+/* There is no local clipboard; answer the server as an empty one would */
+void
+ui_clip_format_announce(uint8 * data, uint32 length)
+{
+	UNUSED(data);
+	UNUSED(length);
+}
+
+void
+ui_clip_handle_data(uint8 * data, uint32 length, uint32 offset, uint32 total)
+{
+	UNUSED(data);
+	UNUSED(length);
+	UNUSED(offset);
+	UNUSED(total);
+}
+
+void
+ui_clip_request_failed(void)
+{
+}
+
+void
+ui_clip_request_data(uint32 format)
+{
+	UNUSED(format);
+	cliprdr_send_data(NULL, 0);
+}
+
+void
+ui_clip_sync(void)
+{
+}
+
+void
+ui_clip_set_mode(const char *optarg)
+{
+	UNUSED(optarg);
+}
+
+/* No local keyboard either */
+RD_BOOL
+xkeymap_from_locale(const char *locale)
+{
+	UNUSED(locale);
+	return False;
+}
+
+unsigned int
+read_keyboard_state(void)
+{
+	return 0;
+}
+
+uint16
+ui_get_numlock_state(unsigned int state)
+{
+	UNUSED(state);
+	return 0;
+}
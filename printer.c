@@ -17,9 +17,245 @@
 */
 
 #include "rdesktop.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+/*
+ * Print data is queued in memory and fed to the spooler by a thread per
+ * job, so that a slow spooler does not hold up the session. Writes are
+ * completed as soon as they are queued, unless that would take the queue
+ * past PRINTER_BUFFER_SIZE. Then the write is completed once enough of
+ * the queue has been written out, through g_print_event.
+ */
+
+#define PRINTER_BUFFER_SIZE	(8 * 1024 * 1024)
+
+struct print_chunk
+{
+	uint32 device, id;
+	uint8 *data;
+	uint32 length;
+	RD_BOOL completed;	/* the server has been told it is written */
+	RD_NTSTATUS status;
+	struct print_chunk *next;
+};
+
+struct print_job
+{
+	char *printer;
+	FILE *fp;
+	pthread_cond_t cond;
+	struct print_chunk *queue, *queue_tail;
+	size_t buffered;	/* completed but not yet written */
+	RD_BOOL closing, failed;
+	/* statistics */
+	struct timeval start;
+	uint64 bytes;
+	uint32 writes, waits;
+};
+
+/* for all jobs */
+static pthread_mutex_t g_print_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct print_chunk *g_print_done, *g_print_done_tail;
+static int g_print_event[2] = { -1, -1 };
 
 extern RDPDR_DEVICE g_rdpdr_device[];
 
+/* Passes writes that now fit in the buffer to the main loop to complete, lock held */
+static void
+print_job_complete(struct print_job *job)
+{
+	struct print_chunk *chunk, *done;
+	RD_BOOL posted = False;
+	uint64 one = 1;
+
+	for (chunk = job->queue; chunk != NULL; chunk = chunk->next)
+	{
+		if (chunk->completed)
+			continue;
+
+		/* a write larger than the buffer still goes in on its own */
+		if (!job->failed && job->buffered > 0
+		    && job->buffered + chunk->length > PRINTER_BUFFER_SIZE)
+			break;
+
+		chunk->completed = True;
+		job->buffered += chunk->length;
+
+		done = xmalloc(sizeof(struct print_chunk));
+		*done = *chunk;
+		done->data = NULL;
+		done->status = job->failed ? RD_STATUS_INVALID_HANDLE : RD_STATUS_SUCCESS;
+		done->next = NULL;
+		if (g_print_done_tail != NULL)
+			g_print_done_tail->next = done;
+		else
+			g_print_done = done;
+		g_print_done_tail = done;
+		posted = True;
+	}
+
+	if (posted && write(g_print_event[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+		logger(Core, Error, "print_job_complete(), write() failed: %s", strerror(errno));
+}
+
+static void
+print_job_stats(struct print_job *job)
+{
+	struct timeval now;
+	double seconds;
+
+	gettimeofday(&now, NULL);
+	seconds = (now.tv_sec - job->start.tv_sec) + (now.tv_usec - job->start.tv_usec) / 1e6;
+
+	logger(Core, Verbose,
+	       "print_job_stats(), %s: %llu bytes in %u writes, %.1f s, %.0f kB/s, %u writes waited for buffer space",
+	       job->printer, (unsigned long long) job->bytes, job->writes, seconds,
+	       seconds > 0 ? job->bytes / seconds / 1000 : 0.0, job->waits);
+}
+
+/* Writes the queue to the spooler, and finishes the job once it is closed */
+static void *
+print_job_thread(void *arg)
+{
+	struct print_job *job = arg;
+	struct print_chunk *chunk;
+	RD_BOOL ok;
+
+	/* The chunk at the head is always completed, as nothing before it is
+	   buffered any more. It stays queued while written, so that it still
+	   counts as buffered. */
+	pthread_mutex_lock(&g_print_lock);
+	while (1)
+	{
+		chunk = job->queue;
+		if (chunk == NULL)
+		{
+			if (job->closing)
+				break;
+			pthread_cond_wait(&job->cond, &g_print_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&g_print_lock);
+		ok = job->failed || fwrite(chunk->data, chunk->length, 1, job->fp) == 1;
+		pthread_mutex_lock(&g_print_lock);
+
+		if (!ok && !job->failed)
+		{
+			logger(Core, Error, "print_job_thread(), %s: write failed: %s", job->printer,
+			       strerror(errno));
+			job->failed = True;
+		}
+
+		job->queue = chunk->next;
+		if (job->queue == NULL)
+			job->queue_tail = NULL;
+		job->buffered -= chunk->length;
+		xfree(chunk->data);
+		xfree(chunk);
+
+		print_job_complete(job);
+	}
+	pthread_mutex_unlock(&g_print_lock);
+
+	pclose(job->fp);
+	print_job_stats(job);
+	pthread_cond_destroy(&job->cond);
+	xfree(job);
+
+	return NULL;
+}
+
+static RD_BOOL
+print_event_init(void)
+{
+	if (g_print_event[0] != -1)
+		return True;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	g_print_event[0] = g_print_event[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_print_event[0] == -1)
+#else
+	if (pipe(g_print_event) == -1 || fcntl(g_print_event[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(g_print_event[1], F_SETFL, O_NONBLOCK) == -1)
+#endif
+	{
+		logger(Core, Error, "print_event_init(), no completion fd: %s", strerror(errno));
+		g_print_event[0] = g_print_event[1] = -1;
+		return False;
+	}
+
+	return True;
+}
+
+static struct print_job *
+print_job_start(char *printer, FILE * fp)
+{
+	struct print_job *job;
+	pthread_t thread;
+
+	if (!print_event_init())
+		return NULL;
+
+	job = xmalloc(sizeof(struct print_job));
+	memset(job, 0, sizeof(struct print_job));
+	job->printer = printer;
+	job->fp = fp;
+	pthread_cond_init(&job->cond, NULL);
+	gettimeofday(&job->start, NULL);
+
+	if (pthread_create(&thread, NULL, print_job_thread, job) != 0)
+	{
+		logger(Core, Error, "print_job_start(), pthread_create() failed");
+		pthread_cond_destroy(&job->cond);
+		xfree(job);
+		return NULL;
+	}
+	pthread_detach(thread);
+
+	return job;
+}
+
+/* Queues a copy of data, lock held */
+static void
+print_job_queue(struct print_job *job, uint32 device, uint32 id, uint8 * data, uint32 length,
+		RD_BOOL completed)
+{
+	struct print_chunk *chunk;
+
+	chunk = xmalloc(sizeof(struct print_chunk));
+	chunk->device = device;
+	chunk->id = id;
+	chunk->data = xmalloc(length);
+	memcpy(chunk->data, data, length);
+	chunk->length = length;
+	chunk->completed = completed;
+	chunk->next = NULL;
+
+	if (job->queue_tail != NULL)
+		job->queue_tail->next = chunk;
+	else
+		job->queue = chunk;
+	job->queue_tail = chunk;
+
+	job->bytes += length;
+	job->writes++;
+	if (completed)
+		job->buffered += length;
+	else
+		job->waits++;
+
+	pthread_cond_signal(&job->cond);
+}
+
 static PRINTER *
 get_printer_data(RD_NTHANDLE handle)
 {
@@ -60,6 +296,8 @@ printer_enum_devices(uint32 * id, char *optarg)
 	while ((pos = next_arg(optarg, ',')) && *id < RDPDR_MAX_DEVICES)
 	{
 		pprinter_data = (PRINTER *) xmalloc(sizeof(PRINTER));
+		pprinter_data->printer_fp = NULL;
+		pprinter_data->job = NULL;
 
 		strcpy(g_rdpdr_device[*id].name, "PRN");
 		strcat(g_rdpdr_device[*id].name, l_to_a(already + count + 1, 10));
@@ -124,6 +362,20 @@ printer_create(uint32 device_id, uint32 access, uint32 share_mode, uint32 dispos
 		pprinter_data->printer_fp = popen(cmd, "w");
 	}
 
+	if (pprinter_data->printer_fp == NULL)
+	{
+		logger(Core, Error, "printer_create(), popen() failed: %s", strerror(errno));
+		return RD_STATUS_DEVICE_OFF_LINE;
+	}
+
+	pprinter_data->job = print_job_start(pprinter_data->printer, pprinter_data->printer_fp);
+	if (pprinter_data->job == NULL)
+	{
+		pclose(pprinter_data->printer_fp);
+		pprinter_data->printer_fp = NULL;
+		return RD_STATUS_DEVICE_BUSY;
+	}
+
 	g_rdpdr_device[device_id].handle = fileno(pprinter_data->printer_fp);
 	*handle = g_rdpdr_device[device_id].handle;
 	return RD_STATUS_SUCCESS;
@@ -136,28 +388,98 @@ printer_close(RD_NTHANDLE handle)
 	if (i >= 0)
 	{
 		PRINTER *pprinter_data = g_rdpdr_device[i].pdevice_data;
-		if (pprinter_data)
-			pclose(pprinter_data->printer_fp);
+		if (pprinter_data && pprinter_data->job)
+		{
+			/* the job thread closes the pipe once everything is written */
+			pthread_mutex_lock(&g_print_lock);
+			pprinter_data->job->closing = True;
+			pthread_cond_signal(&pprinter_data->job->cond);
+			pthread_mutex_unlock(&g_print_lock);
+
+			pprinter_data->job = NULL;
+			pprinter_data->printer_fp = NULL;
+		}
 		g_rdpdr_device[i].handle = 0;
 	}
 	return RD_STATUS_SUCCESS;
 }
 
+/* Queues data for the spooler, or returns RD_STATUS_PENDING if the buffer is full */
 static RD_NTSTATUS
 printer_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
 {
 	UNUSED(offset);  /* Currently unused, MS-RDPEPC reserves for later use */
 	PRINTER *pprinter_data;
+	struct print_job *job;
+	RD_NTSTATUS status;
 
 	pprinter_data = get_printer_data(handle);
-	*result = length * fwrite(data, length, 1, pprinter_data->printer_fp);
+	job = pprinter_data->job;
+	*result = 0;
 
-	if (ferror(pprinter_data->printer_fp))
+	pthread_mutex_lock(&g_print_lock);
+	if (job->failed)
+		status = RD_STATUS_INVALID_HANDLE;
+	else if ((job->queue_tail != NULL && !job->queue_tail->completed)
+		 || (job->buffered > 0 && job->buffered + length > PRINTER_BUFFER_SIZE))
+		status = RD_STATUS_PENDING;
+	else
 	{
-		*result = 0;
-		return RD_STATUS_INVALID_HANDLE;
+		print_job_queue(job, 0, 0, data, length, True);
+		*result = length;
+		status = RD_STATUS_SUCCESS;
+	}
+	pthread_mutex_unlock(&g_print_lock);
+
+	return status;
+}
+
+/* Queues a write printer_write() had no room for, completed by printer_check_fds() */
+void
+printer_defer_write(uint32 device, uint32 id, RD_NTHANDLE handle, uint8 * data, uint32 length)
+{
+	struct print_job *job = get_printer_data(handle)->job;
+
+	pthread_mutex_lock(&g_print_lock);
+	print_job_queue(job, device, id, data, length, False);
+	print_job_complete(job);
+	pthread_mutex_unlock(&g_print_lock);
+}
+
+void
+printer_add_fds(int *n, fd_set * rfds)
+{
+	if (g_print_event[0] == -1)
+		return;
+
+	FD_SET(g_print_event[0], rfds);
+	*n = MAX(*n, g_print_event[0]);
+}
+
+void
+printer_check_fds(fd_set * rfds)
+{
+	struct print_chunk *done, *next;
+	uint64 events[8];
+
+	if (g_print_event[0] == -1 || !FD_ISSET(g_print_event[0], rfds))
+		return;
+
+	while (read(g_print_event[0], events, sizeof(events)) > 0);
+
+	pthread_mutex_lock(&g_print_lock);
+	done = g_print_done;
+	g_print_done = g_print_done_tail = NULL;
+	pthread_mutex_unlock(&g_print_lock);
+
+	for (; done != NULL; done = next)
+	{
+		next = done->next;
+		rdpdr_send_completion(done->device, done->id, done->status,
+				      done->status == RD_STATUS_SUCCESS ? done->length : 0,
+				      (uint8 *) "", 1);
+		xfree(done);
 	}
-	return RD_STATUS_SUCCESS;
 }
 
 DEVICE_FNS printer_fns = {
@@ -44,23 +44,36 @@ void cache_put_font(uint8 font, uint16 character, uint16 offset, uint16 baseline
 		    uint16 height, RD_HGLYPH pixmap);
 DATABLOB *cache_get_text(uint8 cache_id);
 void cache_put_text(uint8 cache_id, void *data, int length);
-uint8 *cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel);
-void cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_per_pixel,
-		       uint8 * data);
+RD_HBITMAP cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel, int *y);
+uint8 *cache_get_desktop_data(uint32 offset, int cx, int cy, int bytes_per_pixel);
+void cache_put_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel, RD_HBITMAP bitmap);
 RD_HCURSOR cache_get_cursor(uint16 cache_idx);
 void cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor);
+void cache_resize_cursors(uint16 size);
 BRUSHDATA *cache_get_brush_data(uint8 colour_code, uint8 idx);
 void cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data);
 /* channels.c */
 VCHANNEL *channel_register(char *name, uint32 flags, void (*callback) (STREAM));
+void channel_set_fragment_handler(VCHANNEL * channel,
+				  RD_BOOL(*callback) (STREAM, uint32, RD_BOOL, RD_BOOL));
+void channel_set_chunk_size(uint32 size);
+void channel_log_stats(void);
 STREAM channel_init(VCHANNEL * channel, uint32 length);
 void channel_send(STREAM s, VCHANNEL * channel);
+void channel_send_start(VCHANNEL * channel, uint32 length);
+void channel_send_data(VCHANNEL * channel, uint8 * data, uint32 length);
 void channel_process(STREAM s, uint16 mcs_channel);
 /* cliprdr.c */
 void cliprdr_send_simple_native_format_announce(uint32 format);
+void cliprdr_send_file_format_announce(uint32 format);
 void cliprdr_send_native_format_announce(uint8 * formats_data, uint32 formats_data_length);
 void cliprdr_send_data_request(uint32 format);
 void cliprdr_send_data(uint8 * data, uint32 length);
+void cliprdr_send_data_start(uint32 length);
+void cliprdr_send_data_more(uint8 * data, uint32 length);
+void cliprdr_send_file_list(char **paths, unsigned int count);
+void cliprdr_add_fds(int *n, fd_set * rfds);
+void cliprdr_check_fds(fd_set * rfds);
 void cliprdr_set_mode(const char *optarg);
 RD_BOOL cliprdr_init(void);
 /* ctrl.c */
@@ -72,15 +85,26 @@ void ctrl_add_fds(int *n, fd_set * rfds);
 void ctrl_check_fds(fd_set * rfds, fd_set * wfds);
 
 /* disk.c */
+void seconds_since_1970_to_filetime(time_t seconds, uint32 * high, uint32 * low);
 int disk_enum_devices(uint32 * id, char *optarg);
 RD_NTSTATUS disk_query_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
 RD_NTSTATUS disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM out);
-RD_NTSTATUS disk_check_notify(RD_NTHANDLE handle);
-RD_NTSTATUS disk_create_notify(RD_NTHANDLE handle, uint32 info_class);
+RD_NTSTATUS disk_check_notify(RD_NTHANDLE handle, STREAM out);
+RD_NTSTATUS disk_create_notify(RD_NTHANDLE handle, uint32 info_class, STREAM out);
+void disk_add_notify_fd(int *n, fd_set * rfds);
+void disk_check_notify_fd(fd_set * rfds);
+RD_BOOL disk_submit_io(uint32 device, uint32 id, RD_NTHANDLE handle, RD_BOOL is_write, uint8 * buffer,
+		       uint32 length, uint64 offset);
+void disk_wait_io(RD_NTHANDLE handle);
+void disk_add_io_fd(int *n, fd_set * rfds);
+void disk_check_io_fd(fd_set * rfds);
 RD_NTSTATUS disk_query_volume_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
 RD_NTSTATUS disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out);
 /* mppc.c */
 int mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen);
+/* rdp8bulk.c */
+void rdp8_bulk_reset(void);
+RD_BOOL rdp8_bulk_expand(uint8 * data, uint32 length, STREAM out);
 /* ewmhints.c */
 int get_current_workarea(uint32 * x, uint32 * y, uint32 * width, uint32 * height);
 void ewmh_init(void);
@@ -113,6 +137,9 @@ void reset_order_state(void);
 int parallel_enum_devices(uint32 * id, char *optarg);
 /* printer.c */
 int printer_enum_devices(uint32 * id, char *optarg);
+void printer_defer_write(uint32 device, uint32 id, RD_NTHANDLE handle, uint8 * data, uint32 length);
+void printer_add_fds(int *n, fd_set * rfds);
+void printer_check_fds(fd_set * rfds);
 /* printercache.c */
 int printercache_load_blob(char *printer_name, uint8 ** data);
 void printercache_process(STREAM s);
@@ -159,6 +186,7 @@ void rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint1
 void rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates);
 void process_colour_pointer_pdu(STREAM s);
 void process_new_pointer_pdu(STREAM s);
+void process_large_pointer_pdu(STREAM s);
 void process_cached_pointer_pdu(STREAM s);
 void process_system_pointer_pdu(STREAM s);
 void set_system_pointer(uint32 ptr);
@@ -187,6 +215,7 @@ RD_BOOL rdpdr_abort_io(uint32 fd, uint32 major, RD_NTSTATUS status);
 /* rdpsnd.c */
 void rdpsnd_record(const void *data, unsigned int size);
 RD_BOOL rdpsnd_init(char *optarg);
+RD_BOOL rdpsnd_auto_select(void);
 void rdpsnd_show_help(void);
 void rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv);
 void rdpsnd_check_fds(fd_set * rfds, fd_set * wfds);
@@ -217,6 +246,9 @@ int serial_enum_devices(uint32 * id, char *optarg);
 RD_BOOL serial_get_event(RD_NTHANDLE handle, uint32 * result);
 RD_BOOL serial_get_timeout(RD_NTHANDLE handle, uint32 length, uint32 * timeout,
 			   uint32 * itv_timeout);
+RD_BOOL serial_read_partial(RD_NTHANDLE handle, RD_BOOL immediate);
+RD_BOOL serial_add_fds(RD_NTHANDLE handle, int *n, fd_set * rfds);
+void serial_check_fds(fd_set * rfds);
 /* tcp.c */
 STREAM tcp_init(uint32 maxlen);
 void tcp_send(STREAM s);
@@ -239,13 +271,15 @@ void ber_out_sequence(STREAM s, STREAM contents);
 
 /* xclip.c */
 void ui_clip_format_announce(uint8 * data, uint32 length);
-void ui_clip_handle_data(uint8 * data, uint32 length);
+void ui_clip_handle_data(uint8 * data, uint32 length, uint32 offset, uint32 total);
 void ui_clip_request_failed(void);
 void ui_clip_request_data(uint32 format);
 void ui_clip_sync(void);
 void ui_clip_set_mode(const char *optarg);
 void xclip_init(void);
 void xclip_deinit(void);
+void xclip_check_timers(void);
+void xclip_select_timeout(struct timeval *tv);
 /* xkeymap.c */
 RD_BOOL xkeymap_from_locale(const char *locale);
 FILE *xkeymap_open(const char *filename);
@@ -316,6 +350,7 @@ void ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int
 		  BRUSH * brush, uint32 bgcolour, uint32 fgcolour, uint8 * text, uint8 length);
 void ui_desktop_save(uint32 offset, int x, int y, int cx, int cy);
 void ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy);
+void ui_desktop_read(RD_HBITMAP bitmap, int y, int cx, int cy, uint8 * data);
 void ui_begin_update(void);
 void ui_end_update(void);
 void ui_seamless_begin(RD_BOOL hidden);
@@ -343,6 +378,10 @@ RD_BOOL lspci_init(void);
 void rdpedisp_init(void);
 RD_BOOL rdpedisp_is_available();
 void rdpedisp_set_session_size(uint32 width, uint32 height);
+/* rdpeai.c */
+void rdpeai_init(void);
+void rdpeai_record(const void *data, unsigned int size);
+void rdpeai_check(void);
 /* dvc.c */
 typedef void (*dvc_channel_process_fn) (STREAM s);
 RD_BOOL dvc_init(void);
@@ -147,6 +147,8 @@ struct timeval g_pending_resize_defer_timer = { 0 };
 
 #ifdef WITH_RDPSND
 RD_BOOL g_rdpsnd = False;
+uint32 g_rdpsnd_latency = 0;
+RD_BOOL g_rdpsnd_capture = False;
 #endif
 
 char g_codepage[16] = "";
@@ -220,8 +222,12 @@ usage(char *program)
 		"             or      mydeskjet=\"HP LaserJet IIIP\" to enter server driver as well\n");
 #ifdef WITH_RDPSND
 	fprintf(stderr,
-		"         '-r sound:[local[:driver[:device]]|off|remote]': enable sound redirection\n");
+		"         '-r sound:[local[:driver[:device]]|off|remote][,latency=ms][,mic]': enable sound redirection\n");
 	fprintf(stderr, "                     remote would leave sound on server\n");
+	fprintf(stderr, "                     mic also redirects audio input to the server\n");
+	fprintf(stderr,
+		"                     latency=ms sets the lowest playout latency, default adapts\n");
+	fprintf(stderr, "                     to network jitter\n");
 	fprintf(stderr, "                     available drivers for 'local':\n");
 	rdpsnd_show_help();
 #endif
@@ -1046,6 +1052,23 @@ main(int argc, char *argv[])
 								       "Not compiled with sound support");
 #endif
 
+							if (str_startswith(optarg, "latency="))
+#ifdef WITH_RDPSND
+								g_rdpsnd_latency =
+									strtoul(optarg + 8, NULL, 10);
+#else
+								logger(Core, Warning,
+								       "Not compiled with sound support");
+#endif
+
+							if (str_startswith(optarg, "mic"))
+#ifdef WITH_RDPSND
+								g_rdpsnd_capture = True;
+#else
+								logger(Core, Warning,
+								       "Not compiled with sound support");
+#endif
+
 							optarg = p;
 						}
 					}
@@ -1342,6 +1365,10 @@ main(int argc, char *argv[])
 
 	dvc_init();
 	rdpedisp_init();
+#ifdef WITH_RDPSND
+	if (g_rdpsnd_capture)
+		rdpeai_init();
+#endif
 
 	setup_user_requested_session_size();
 
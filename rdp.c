@@ -64,7 +64,6 @@ uint32 g_rdp_shareid;
 
 extern RDPCOMP g_mppc_dict;
 
-extern uint32 vc_chunk_size;
 
 /* Session Directory support */
 extern RD_BOOL g_redirect;
@@ -96,6 +95,9 @@ extern RD_BOOL g_fullscreen;
 uint16 g_session_width;
 uint16 g_session_height;
 
+/* pointer cache size negotiated with the server */
+static uint16 g_pointer_cache_size = RDP_POINTER_CACHE_SIZE;
+
 static void rdp_out_unistr(STREAM s, char *string, int len);
 
 /* reads a TS_SHARECONTROLHEADER from stream, returns True of there is
@@ -923,7 +925,7 @@ rdp_out_pointer_caps(STREAM s)
 	out_uint16_le(s, RDP_CAPLEN_POINTER);
 
 	out_uint16(s, 0);	/* Colour pointer */
-	out_uint16_le(s, 20);	/* Cache size */
+	out_uint16_le(s, g_pointer_cache_size);	/* Cache size */
 }
 
 /* Output new pointer capability set */
@@ -934,8 +936,26 @@ rdp_out_newpointer_caps(STREAM s)
 	out_uint16_le(s, RDP_CAPLEN_NEWPOINTER);
 
 	out_uint16_le(s, 1);	/* Colour pointer */
-	out_uint16_le(s, 20);	/* Cache size */
-	out_uint16_le(s, 20);	/* Cache size for new pointers */
+	out_uint16_le(s, g_pointer_cache_size);	/* Cache size */
+	out_uint16_le(s, g_pointer_cache_size);	/* Cache size for new pointers */
+}
+
+/* Process a pointer capability set */
+static void
+rdp_process_pointer_caps(STREAM s, uint16 length)
+{
+	uint16 colour_cache_size, cache_size;
+
+	in_uint8s(s, 2);	/* colorPointerFlag */
+	in_uint16_le(s, colour_cache_size);
+	cache_size = colour_cache_size;
+	if (length >= RDP_CAPLEN_NEWPOINTER)
+		in_uint16_le(s, cache_size);
+
+	logger(Protocol, Debug, "%s(), server pointer cache size %d", __func__, cache_size);
+
+	if (cache_size != 0 && cache_size < g_pointer_cache_size)
+		g_pointer_cache_size = cache_size;
 }
 
 /* Output share capability set */
@@ -989,7 +1009,7 @@ rdp_process_virtchan_caps(STREAM s)
 	in_uint32_le(s, chunk_size);
 
 	UNUSED(flags);
-	vc_chunk_size = chunk_size;
+	channel_set_chunk_size(chunk_size);
 }
 
 /* Output Input Capability Set */
@@ -1081,7 +1101,7 @@ rdp_out_ts_multifragmentupdate_capabilityset(STREAM s)
 static void
 rdp_out_ts_large_pointer_capabilityset(STREAM s)
 {
-	uint16 flags = LARGE_POINTER_FLAG_96x96;
+	uint16 flags = LARGE_POINTER_FLAG_96x96 | LARGE_POINTER_FLAG_384x384;
 
 	out_uint16_le(s, RDP_CAPSET_LARGE_POINTER);
 	out_uint16_le(s, RDP_CAPLEN_LARGE_POINTER);
@@ -1281,10 +1301,17 @@ rdp_process_server_caps(STREAM s, uint16 length)
 			case RDP_CAPSET_BITMAP:
 				rdp_process_bitmap_caps(s);
 				break;
+
+			case RDP_CAPSET_POINTER:
+				rdp_process_pointer_caps(s, capset_length);
+				break;
+
 			case RDP_CAPSET_VC:
 				/* Parse only if we got VCChunkSize */
 				if (capset_length > 8) {
 					rdp_process_virtchan_caps(s);
+				} else {
+					channel_set_chunk_size(0);
 				}
 				break;
 		}
@@ -1316,7 +1343,9 @@ process_demand_active(STREAM s)
 
 	logger(Protocol, Debug, "process_demand_active(), shareid=0x%x", g_rdp_shareid);
 
+	g_pointer_cache_size = RDP_POINTER_CACHE_SIZE;
 	rdp_process_server_caps(s, len_combined_caps);
+	cache_resize_cursors(g_pointer_cache_size);
 
 	rdp_send_confirm_active();
 	rdp_send_synchronise();
@@ -1345,11 +1374,12 @@ process_demand_active(STREAM s)
 
 /* Process a colour pointer PDU */
 static void
-process_colour_pointer_common(STREAM s, int bpp)
+process_colour_pointer_common(STREAM s, int bpp, RD_BOOL large)
 {
 	extern RD_BOOL g_local_cursor;
-	uint16 width, height, cache_idx, masklen, datalen;
+	uint16 width, height, cache_idx;
 	uint16 x, y;
+	uint32 masklen, datalen;
 	uint8 *mask;
 	uint8 *data;
 	RD_HCURSOR cursor;
@@ -1359,8 +1389,16 @@ process_colour_pointer_common(STREAM s, int bpp)
 	in_uint16_le(s, y);
 	in_uint16_le(s, width);
 	in_uint16_le(s, height);
-	in_uint16_le(s, masklen);
-	in_uint16_le(s, datalen);
+	if (large)
+	{
+		in_uint32_le(s, masklen);
+		in_uint32_le(s, datalen);
+	}
+	else
+	{
+		in_uint16_le(s, masklen);
+		in_uint16_le(s, datalen);
+	}
 	in_uint8p(s, data, datalen);
 	in_uint8p(s, mask, masklen);
 
@@ -1368,6 +1406,24 @@ process_colour_pointer_common(STREAM s, int bpp)
 	       "process_colour_pointer_common(), new pointer %d with width %d and height %d",
 	       cache_idx, width, height);
 
+	if (width > 384 || height > 384)
+	{
+		logger(Protocol, Warning,
+		       "process_colour_pointer_common(), invalid pointer size %dx%d", width,
+		       height);
+		return;
+	}
+
+	/* the ui reads both masks by width and height, not by these lengths */
+	if (datalen < (uint32) ((width * bpp + 15) / 16) * 2 * height
+	    || masklen < (uint32) ((width + 15) / 16) * 2 * height)
+	{
+		logger(Protocol, Warning,
+		       "process_colour_pointer_common(), %dx%d pointer with %u mask and %u data bytes",
+		       width, height, masklen, datalen);
+		return;
+	}
+
 	/* keep hotspot within cursor bounding box */
 	x = MIN(x, width - 1);
 	y = MIN(y, height - 1);
@@ -1384,7 +1440,7 @@ process_colour_pointer_pdu(STREAM s)
 {
 	logger(Protocol, Debug, "%s()", __func__);
 
-	process_colour_pointer_common(s, 24);
+	process_colour_pointer_common(s, 24, False);
 }
 
 /* Process a New Pointer PDU - these pointers have variable bit depth */
@@ -1396,7 +1452,18 @@ process_new_pointer_pdu(STREAM s)
 
 
 	in_uint16_le(s, xor_bpp);
-	process_colour_pointer_common(s, xor_bpp);
+	process_colour_pointer_common(s, xor_bpp, False);
+}
+
+/* Process a Large Pointer PDU - up to 384x384 with 32 bit mask lengths */
+void
+process_large_pointer_pdu(STREAM s)
+{
+	uint16 xor_bpp;
+	logger(Protocol, Debug, "%s()", __func__);
+
+	in_uint16_le(s, xor_bpp);
+	process_colour_pointer_common(s, xor_bpp, True);
 }
 
 /* Process a cached pointer PDU */
@@ -1477,6 +1544,10 @@ process_pointer_pdu(STREAM s)
 			process_new_pointer_pdu(s);
 			break;
 
+		case RDP_POINTER_LARGE:
+			process_large_pointer_pdu(s);
+			break;
+
 		default:
 			logger(Protocol, Warning,
 			       "process_pointer_pdu(), unhandled message type 0x%x", message_type);
@@ -2141,6 +2212,7 @@ void
 rdp_disconnect(void)
 {
 	logger(Protocol, Debug, "%s()", __func__);
+	channel_log_stats();
 	sec_disconnect();
 }
 
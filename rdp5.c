@@ -67,6 +67,9 @@ process_ts_fp_update_by_code(STREAM s, uint8 code)
 		case FASTPATH_UPDATETYPE_POINTER:
 			process_new_pointer_pdu(s);
 			break;
+		case FASTPATH_UPDATETYPE_LARGE_POINTER:
+			process_large_pointer_pdu(s);
+			break;
 		default:
 			logger(Protocol, Warning,
 			       "process_ts_fp_updates_by_code(), unhandled opcode %d", code);
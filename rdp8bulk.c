@@ -0,0 +1,422 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Protocol services - RDP 8.0 bulk decompression
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+
+/* MS-RDPEGFX 2.2.5 and 3.1.9.1. Data comes as segments, each LZ77
+   compressed against a history of the last 2.5 MB decompressed. Literals
+   and matches are coded with the prefix codes in the token table below,
+   and a segment ends with the number of padding bits in its last byte. */
+
+#define RDP8_BULK_HISTORY_SIZE		2500000
+#define RDP8_BULK_SEGMENT_SIZE		65535
+
+#define RDP8_BULK_SEGMENTED_SINGLE	0xe0
+#define RDP8_BULK_SEGMENTED_MULTIPART	0xe1
+
+#define RDP8_BULK_COMPRESSION_TYPE	0x0f
+#define RDP8_BULK_COMPRESSION_RDP8	0x04
+#define RDP8_BULK_PACKET_COMPRESSED	0x20
+
+#define RDP8_BULK_PREFIX_BITS		9
+
+typedef struct
+{
+	int prefix_length;
+	uint16 prefix_code;
+	int value_bits;
+	RD_BOOL match;
+	uint32 value_base;
+} rdp8_bulk_token;
+
+static const rdp8_bulk_token rdp8_bulk_tokens[] = {
+	{1, 0x000, 8, False, 0},
+	{5, 0x011, 5, True, 0},
+	{5, 0x012, 7, True, 32},
+	{5, 0x013, 9, True, 160},
+	{5, 0x014, 10, True, 672},
+	{5, 0x015, 12, True, 1696},
+	{5, 0x018, 0, False, 0x00},
+	{5, 0x019, 0, False, 0x01},
+	{6, 0x02c, 14, True, 5792},
+	{6, 0x02d, 15, True, 22176},
+	{6, 0x034, 0, False, 0x02},
+	{6, 0x035, 0, False, 0x03},
+	{6, 0x036, 0, False, 0xff},
+	{7, 0x05c, 18, True, 54944},
+	{7, 0x05d, 20, True, 317088},
+	{7, 0x06e, 0, False, 0x04},
+	{7, 0x06f, 0, False, 0x05},
+	{7, 0x070, 0, False, 0x06},
+	{7, 0x071, 0, False, 0x07},
+	{7, 0x072, 0, False, 0x08},
+	{7, 0x073, 0, False, 0x09},
+	{7, 0x074, 0, False, 0x0a},
+	{7, 0x075, 0, False, 0x0b},
+	{7, 0x076, 0, False, 0x3a},
+	{7, 0x077, 0, False, 0x3b},
+	{7, 0x078, 0, False, 0x3c},
+	{7, 0x079, 0, False, 0x3d},
+	{7, 0x07a, 0, False, 0x3e},
+	{7, 0x07b, 0, False, 0x3f},
+	{7, 0x07c, 0, False, 0x40},
+	{7, 0x07d, 0, False, 0x80},
+	{8, 0x0bc, 20, True, 1365664},
+	{8, 0x0bd, 21, True, 2414240},
+	{8, 0x0fc, 0, False, 0x0c},
+	{8, 0x0fd, 0, False, 0x38},
+	{8, 0x0fe, 0, False, 0x39},
+	{8, 0x0ff, 0, False, 0x66},
+	{9, 0x17c, 22, True, 4511392},
+	{9, 0x17d, 23, True, 8705696},
+	{9, 0x17e, 24, True, 17094304}
+};
+
+#define RDP8_BULK_NUM_TOKENS	(sizeof(rdp8_bulk_tokens) / sizeof(rdp8_bulk_tokens[0]))
+
+/* Token for each possible value of the next RDP8_BULK_PREFIX_BITS bits,
+   0xff where no prefix matches */
+static uint8 rdp8_bulk_lookup[1 << RDP8_BULK_PREFIX_BITS];
+
+static uint8 *g_rdp8_bulk_history = NULL;
+static uint32 g_rdp8_bulk_history_pos;
+
+typedef struct
+{
+	uint8 *p;
+	uint8 *end;
+	uint32 bits;
+	int nbits;
+	uint32 remaining;	/* bits left, padding excluded */
+} rdp8_bulk_reader;
+
+static void
+rdp8_bulk_fill(rdp8_bulk_reader * r, int n)
+{
+	while (r->nbits < n && r->p < r->end)
+	{
+		r->bits = (r->bits << 8) | *r->p++;
+		r->nbits += 8;
+	}
+}
+
+/* The next n bits, zero padded past the end of the data */
+static uint32
+rdp8_bulk_peek(rdp8_bulk_reader * r, int n)
+{
+	rdp8_bulk_fill(r, n);
+	if (r->nbits < n)
+		return (r->bits << (n - r->nbits)) & ((1 << n) - 1);
+	return (r->bits >> (r->nbits - n)) & ((1 << n) - 1);
+}
+
+static RD_BOOL
+rdp8_bulk_get_bits(rdp8_bulk_reader * r, int n, uint32 * value)
+{
+	if ((uint32) n > r->remaining)
+		return False;
+
+	*value = n ? rdp8_bulk_peek(r, n) : 0;
+	r->nbits -= n;
+	r->remaining -= n;
+	return True;
+}
+
+/* Drop the rest of the current byte and hand back the bytes read ahead */
+static RD_BOOL
+rdp8_bulk_align(rdp8_bulk_reader * r)
+{
+	if ((uint32) (r->nbits % 8) > r->remaining)
+		return False;
+
+	r->remaining -= r->nbits % 8;
+	r->p -= r->nbits / 8;
+	r->nbits = 0;
+	return True;
+}
+
+static void
+rdp8_bulk_history_put(uint8 * data, uint32 length)
+{
+	uint32 part;
+
+	while (length > 0)
+	{
+		part = MIN(length, RDP8_BULK_HISTORY_SIZE - g_rdp8_bulk_history_pos);
+		memcpy(g_rdp8_bulk_history + g_rdp8_bulk_history_pos, data, part);
+		g_rdp8_bulk_history_pos = (g_rdp8_bulk_history_pos + part) % RDP8_BULK_HISTORY_SIZE;
+		data += part;
+		length -= part;
+	}
+}
+
+static void
+rdp8_bulk_history_copy(uint32 distance, uint32 count)
+{
+	uint32 src, dst;
+
+	dst = g_rdp8_bulk_history_pos;
+	src = (dst + RDP8_BULK_HISTORY_SIZE - distance) % RDP8_BULK_HISTORY_SIZE;
+
+	if (distance >= count && src + count <= RDP8_BULK_HISTORY_SIZE
+	    && dst + count <= RDP8_BULK_HISTORY_SIZE)
+	{
+		memcpy(g_rdp8_bulk_history + dst, g_rdp8_bulk_history + src, count);
+		g_rdp8_bulk_history_pos = (dst + count) % RDP8_BULK_HISTORY_SIZE;
+		return;
+	}
+
+	/* overlapping matches repeat what they have just written */
+	while (count--)
+	{
+		g_rdp8_bulk_history[dst] = g_rdp8_bulk_history[src];
+		if (++src == RDP8_BULK_HISTORY_SIZE)
+			src = 0;
+		if (++dst == RDP8_BULK_HISTORY_SIZE)
+			dst = 0;
+	}
+	g_rdp8_bulk_history_pos = dst;
+}
+
+/* Append what was written to the history since start to out */
+static void
+rdp8_bulk_output(uint32 start, uint32 length, STREAM out)
+{
+	uint32 part;
+
+	if (s_left(out) < length)
+		s_realloc(out, MAX(s_tell(out) + length, out->size * 2));
+
+	part = MIN(length, RDP8_BULK_HISTORY_SIZE - start);
+	out_uint8a(out, g_rdp8_bulk_history + start, part);
+	out_uint8a(out, g_rdp8_bulk_history, length - part);
+}
+
+static RD_BOOL
+rdp8_bulk_expand_compressed(uint8 * data, uint32 length, uint32 * produced)
+{
+	rdp8_bulk_reader r;
+	const rdp8_bulk_token *token;
+	uint32 value, distance, count, extra, bit;
+	uint8 index;
+
+	if (length < 1 || data[length - 1] > 7 || (length - 1) * 8 < data[length - 1])
+		return False;
+
+	r.p = data;
+	r.end = data + length - 1;
+	r.bits = 0;
+	r.nbits = 0;
+	r.remaining = (length - 1) * 8 - data[length - 1];
+
+	*produced = 0;
+	while (r.remaining > 0)
+	{
+		index = rdp8_bulk_lookup[rdp8_bulk_peek(&r, RDP8_BULK_PREFIX_BITS)];
+		if (index == 0xff)
+			return False;
+
+		token = &rdp8_bulk_tokens[index];
+		if (!rdp8_bulk_get_bits(&r, token->prefix_length, &value)
+		    || !rdp8_bulk_get_bits(&r, token->value_bits, &value))
+			return False;
+
+		if (!token->match)
+		{
+			g_rdp8_bulk_history[g_rdp8_bulk_history_pos] = token->value_base + value;
+			if (++g_rdp8_bulk_history_pos == RDP8_BULK_HISTORY_SIZE)
+				g_rdp8_bulk_history_pos = 0;
+			count = 1;
+		}
+		else if ((distance = token->value_base + value) != 0)
+		{
+			if (!rdp8_bulk_get_bits(&r, 1, &bit))
+				return False;
+
+			if (bit == 0)
+			{
+				count = 3;
+			}
+			else
+			{
+				count = 4;
+				extra = 2;
+				while (1)
+				{
+					if (!rdp8_bulk_get_bits(&r, 1, &bit))
+						return False;
+					if (bit == 0)
+						break;
+					count *= 2;
+					extra++;
+					if (extra > 16)
+						return False;
+				}
+				if (!rdp8_bulk_get_bits(&r, extra, &value))
+					return False;
+				count += value;
+			}
+
+			if (distance > RDP8_BULK_HISTORY_SIZE)
+				return False;
+			if (*produced + count > RDP8_BULK_SEGMENT_SIZE)
+				return False;
+			rdp8_bulk_history_copy(distance, count);
+		}
+		else
+		{
+			/* unencoded bytes, starting at the next whole byte */
+			if (!rdp8_bulk_get_bits(&r, 15, &count) || !rdp8_bulk_align(&r))
+				return False;
+			if (count * 8 > r.remaining)
+				return False;
+			if (*produced + count > RDP8_BULK_SEGMENT_SIZE)
+				return False;
+			rdp8_bulk_history_put(r.p, count);
+			r.p += count;
+			r.remaining -= count * 8;
+		}
+
+		*produced += count;
+		if (*produced > RDP8_BULK_SEGMENT_SIZE)
+			return False;
+	}
+
+	return True;
+}
+
+/* Expand one RDP8_BULK_ENCODED_DATA segment */
+static RD_BOOL
+rdp8_bulk_expand_segment(uint8 * data, uint32 length, STREAM out)
+{
+	uint32 start, produced;
+	uint8 flags;
+
+	if (length < 1)
+		return False;
+
+	flags = data[0];
+	if ((flags & RDP8_BULK_COMPRESSION_TYPE) != RDP8_BULK_COMPRESSION_RDP8)
+	{
+		logger(Protocol, Warning,
+		       "rdp8_bulk_expand_segment(), unknown compression type 0x%x", flags);
+		return False;
+	}
+
+	start = g_rdp8_bulk_history_pos;
+	if (flags & RDP8_BULK_PACKET_COMPRESSED)
+	{
+		if (!rdp8_bulk_expand_compressed(data + 1, length - 1, &produced))
+		{
+			logger(Protocol, Warning,
+			       "rdp8_bulk_expand_segment(), invalid compressed data");
+			return False;
+		}
+	}
+	else
+	{
+		produced = length - 1;
+		if (produced > RDP8_BULK_SEGMENT_SIZE)
+			return False;
+		rdp8_bulk_history_put(data + 1, produced);
+	}
+
+	rdp8_bulk_output(start, produced, out);
+	return True;
+}
+
+static void
+rdp8_bulk_init(void)
+{
+	unsigned int i, j, shift;
+
+	g_rdp8_bulk_history = xmalloc(RDP8_BULK_HISTORY_SIZE);
+	memset(g_rdp8_bulk_history, 0, RDP8_BULK_HISTORY_SIZE);
+	g_rdp8_bulk_history_pos = 0;
+
+	memset(rdp8_bulk_lookup, 0xff, sizeof(rdp8_bulk_lookup));
+	for (i = 0; i < RDP8_BULK_NUM_TOKENS; i++)
+	{
+		shift = RDP8_BULK_PREFIX_BITS - rdp8_bulk_tokens[i].prefix_length;
+		for (j = 0; j < (1u << shift); j++)
+			rdp8_bulk_lookup[(rdp8_bulk_tokens[i].prefix_code << shift) | j] = i;
+	}
+}
+
+/* Forget the history, for a new session */
+void
+rdp8_bulk_reset(void)
+{
+	if (g_rdp8_bulk_history == NULL)
+		return;
+
+	memset(g_rdp8_bulk_history, 0, RDP8_BULK_HISTORY_SIZE);
+	g_rdp8_bulk_history_pos = 0;
+}
+
+/* Expand an RDP_SEGMENTED_DATA structure, appending the data to out */
+RD_BOOL
+rdp8_bulk_expand(uint8 * data, uint32 length, STREAM out)
+{
+	struct stream s;
+	uint16 count;
+	uint32 segment;
+	uint8 descriptor;
+	uint8 *p;
+
+	if (g_rdp8_bulk_history == NULL)
+		rdp8_bulk_init();
+
+	memset(&s, 0, sizeof(s));
+	s.data = s.p = data;
+	s.end = data + length;
+	s.size = length;
+
+	if (!s_check_rem(&s, 1))
+		return False;
+	in_uint8(&s, descriptor);
+
+	if (descriptor == RDP8_BULK_SEGMENTED_SINGLE)
+		return rdp8_bulk_expand_segment(s.p, s_remaining(&s), out);
+
+	if (descriptor != RDP8_BULK_SEGMENTED_MULTIPART || !s_check_rem(&s, 6))
+	{
+		logger(Protocol, Warning, "rdp8_bulk_expand(), invalid descriptor 0x%x",
+		       descriptor);
+		return False;
+	}
+
+	in_uint16_le(&s, count);
+	in_uint8s(&s, 4);	/* uncompressedSize */
+
+	while (count--)
+	{
+		if (!s_check_rem(&s, 4))
+			return False;
+		in_uint32_le(&s, segment);
+		if (!s_check_rem(&s, segment))
+			return False;
+		in_uint8p(&s, p, segment);
+
+		if (!rdp8_bulk_expand_segment(p, segment, out))
+			return False;
+	}
+
+	return True;
+}
@@ -58,6 +58,8 @@
 #define IRP_MN_QUERY_DIRECTORY          0x01
 #define IRP_MN_NOTIFY_CHANGE_DIRECTORY  0x02
 
+#define SERIAL_POLL_INTERVAL		5	/* ms */
+
 extern char g_hostname[16];
 extern DEVICE_FNS serial_fns;
 extern DEVICE_FNS printer_fns;
@@ -67,7 +69,6 @@ extern DEVICE_FNS disk_fns;
 extern DEVICE_FNS scard_fns;
 #endif
 extern FILEINFO g_fileinfo[];
-extern RD_BOOL g_notify_stamp;
 
 static VCHANNEL *rdpdr_channel;
 static uint32 g_epoch;
@@ -470,6 +471,9 @@ rdpdr_process_irp(STREAM s)
 
 			fns = &disk_fns;
 			rw_blocking = False;
+			/* keep the order of requests on a file with reads or writes in flight */
+			if (major != IRP_MJ_CREATE && major != IRP_MJ_READ && major != IRP_MJ_WRITE)
+				disk_wait_io(file);
 			break;
 
 		case DEVICE_TYPE_SCARD:
@@ -552,7 +556,8 @@ rdpdr_process_irp(STREAM s)
 				break;
 			}
 
-			if (rw_blocking)	/* Complete read immediately */
+			/* Complete read immediately */
+			if (rw_blocking || serial_read_partial(file, True))
 			{
 				uint8* buffer;
 				out = s_alloc(length);
@@ -572,6 +577,13 @@ rdpdr_process_irp(STREAM s)
 				status = RD_STATUS_CANCELLED;
 				break;
 			}
+			if (g_rdpdr_device[device].device_type == DEVICE_TYPE_DISK
+			    && disk_submit_io(device, id, file, False, pst_buf, length, offset))
+			{
+				status = RD_STATUS_PENDING;
+				break;
+			}
+
 			serial_get_timeout(file, length, &total_timeout, &interval_timeout);
 			if (add_async_iorequest
 			    (device, file, id, major, length, fns, total_timeout, interval_timeout,
@@ -614,6 +626,10 @@ rdpdr_process_irp(STREAM s)
 				unsigned char *data;
 				in_uint8p(s, data, length);
 				status = fns->write(file, data, length, offset, &result);
+				/* a printer with a full buffer completes the write later */
+				if (status == RD_STATUS_PENDING
+				    && g_rdpdr_device[device].device_type == DEVICE_TYPE_PRINTER)
+					printer_defer_write(device, id, file, data, length);
 				break;
 			}
 
@@ -627,6 +643,13 @@ rdpdr_process_irp(STREAM s)
 
 			in_uint8a(s, pst_buf, length);
 
+			if (g_rdpdr_device[device].device_type == DEVICE_TYPE_DISK
+			    && disk_submit_io(device, id, file, True, pst_buf, length, offset))
+			{
+				status = RD_STATUS_PENDING;
+				break;
+			}
+
 			if (add_async_iorequest
 			    (device, file, id, major, length, fns, 0, 0, pst_buf, offset))
 			{
@@ -727,10 +750,13 @@ rdpdr_process_irp(STREAM s)
 					/* JIF
 					   unimpl("IRP major=0x%x minor=0x%x: IRP_MN_NOTIFY_CHANGE_DIRECTORY\n", major, minor);  */
 
+					in_uint8s(s, 1);	/* WatchTree, only the directory itself is watched */
 					in_uint32_le(s, info_level);	/* notify mask */
 
-					status = disk_create_notify(file, info_level);
-					result = 0;
+					out = s_alloc(1024);
+					status = disk_create_notify(file, info_level, out);
+					s_mark_end(out);
+					result = s_length(out);
 
 					if (status == RD_STATUS_PENDING)
 						add_async_iorequest(device, file, id, major, length,
@@ -995,6 +1021,7 @@ rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL
 {
 	uint32 select_timeout = 0;	/* Timeout value to be used for select() (in milliseconds). */
 	struct async_iorequest *iorq;
+	RD_BOOL serial_poll = False;
 	char c;
 
 	iorq = g_iorequest;
@@ -1050,8 +1077,13 @@ rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL
 					break;
 
 				case IRP_MJ_DEVICE_CONTROL:
-					if (select_timeout > 5)
-						select_timeout = 5;	/* serial event queue */
+					/* serial event queue */
+					if (serial_add_fds(iorq->fd, n, rfds))
+						serial_poll = True;
+					break;
+
+				case IRP_MJ_DIRECTORY_CONTROL:
+					disk_add_notify_fd(n, rfds);
 					break;
 
 			}
@@ -1060,6 +1092,18 @@ rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL
 
 		iorq = iorq->next;
 	}
+
+	/* Serial events that cannot wake up select(). Not a read timeout, so
+	   the read timeouts start over on the next round. */
+	if (serial_poll && (tv->tv_sec > 0 || tv->tv_usec > SERIAL_POLL_INTERVAL * 1000))
+	{
+		tv->tv_sec = 0;
+		tv->tv_usec = SERIAL_POLL_INTERVAL * 1000;
+		*timeout = False;
+	}
+
+	disk_add_io_fd(n, rfds);
+	printer_add_fds(n, rfds);
 }
 
 struct async_iorequest *
@@ -1182,8 +1226,9 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 
 						/* only delete link if all data has been transfered */
 						/* or if result was 0 and status success - EOF      */
+						/* or if a serial port returns what it has          */
 						if ((iorq->partial_len == iorq->length) ||
-						    (result == 0))
+						    (result == 0) || serial_read_partial(iorq->fd, False))
 						{
 							logger(Protocol, Debug,
 							       "_rdpdr_check_fds(), AIO total %u bytes read of %u",
@@ -1266,7 +1311,12 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 			iorq = iorq->next;
 	}
 
-	/* Check notify */
+	/* Check notify, disk reads and writes, print jobs and serial events */
+	disk_check_notify_fd(rfds);
+	disk_check_io_fd(rfds);
+	printer_check_fds(rfds);
+	serial_check_fds(rfds);
+
 	iorq = g_iorequest;
 	prev = NULL;
 	while (iorq != NULL)
@@ -1281,20 +1331,19 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 					    DEVICE_TYPE_DISK)
 					{
 
-						if (g_notify_stamp)
+						memset(&out, 0, sizeof(out));
+						status = disk_check_notify(iorq->fd, &out);
+						if (status != RD_STATUS_PENDING)
 						{
-							g_notify_stamp = False;
-							status = disk_check_notify(iorq->fd);
-							if (status != RD_STATUS_PENDING)
-							{
-								rdpdr_send_completion(iorq->device,
-										      iorq->id,
-										      status, 0,
-										      NULL, 0);
-								iorq = rdpdr_remove_iorequest(prev,
-											      iorq);
-							}
+							rdpdr_send_completion(iorq->device,
+									      iorq->id,
+									      status,
+									      out.p - out.data,
+									      out.data,
+									      out.p - out.data);
+							iorq = rdpdr_remove_iorequest(prev, iorq);
 						}
+						xfree(out.data);
 					}
 					break;
 
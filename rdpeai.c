@@ -0,0 +1,382 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Audio Input Redirection Virtual Channel Extension.
+   Copyright 2026 rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "rdesktop.h"
+#include "rdpsnd.h"
+#include "rdpsnd_dsp.h"
+
+#define MSG_SNDIN_VERSION		0x01
+#define MSG_SNDIN_FORMATS		0x02
+#define MSG_SNDIN_OPEN			0x03
+#define MSG_SNDIN_OPEN_REPLY		0x04
+#define MSG_SNDIN_DATA_INCOMING		0x05
+#define MSG_SNDIN_DATA			0x06
+#define MSG_SNDIN_FORMATCHANGE		0x07
+
+#define RDPEAI_CHANNEL_NAME "AUDIO_INPUT"
+#define RDPEAI_VERSION 1
+
+#define MAX_FORMATS	16
+#define RING_SIZE	(1 << 18)	/* over a second of 48 kHz 16 bit stereo */
+
+extern struct audio_driver *current_driver;
+
+/*
+ * Captured PCM, written by whatever thread the audio driver records on
+ * and read by the main loop. There is a single producer and a single
+ * consumer, each moving only its own position, so the capture side never
+ * waits for the network. If the main loop falls behind, new data is
+ * dropped.
+ */
+static struct
+{
+	uint8 data[RING_SIZE];
+	uint32 head;		/* only written by the producer */
+	uint32 tail;		/* only written by the consumer */
+	uint32 overruns;
+} ring;
+
+static RD_BOOL capturing;
+
+static RD_WAVEFORMATEX formats[MAX_FORMATS];
+static unsigned int format_count;
+static unsigned int current_format;
+
+static uint32 packet_frames;	/* as asked for by the server */
+static uint8 *packet_buf;
+static unsigned int packet_size;
+
+/* Called by the audio drivers, possibly from their own thread */
+void
+rdpeai_record(const void *data, unsigned int size)
+{
+	uint32 head, tail, offset, len;
+
+	if (!__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+		return;
+
+	head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	if (size > RING_SIZE - (head - tail))
+	{
+		__atomic_add_fetch(&ring.overruns, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	offset = head % RING_SIZE;
+	len = MIN(size, RING_SIZE - offset);
+	memcpy(ring.data + offset, data, len);
+	memcpy(ring.data, (const uint8 *) data + len, size - len);
+
+	__atomic_store_n(&ring.head, head + size, __ATOMIC_RELEASE);
+}
+
+static RD_BOOL
+ring_read(uint8 * out, uint32 size)
+{
+	uint32 head, tail, offset, len;
+
+	tail = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	if (head - tail < size)
+		return False;
+
+	offset = tail % RING_SIZE;
+	len = MIN(size, RING_SIZE - offset);
+	memcpy(out, ring.data + offset, len);
+	memcpy(out + len, ring.data, size - len);
+
+	__atomic_store_n(&ring.tail, tail + size, __ATOMIC_RELEASE);
+	return True;
+}
+
+static void
+ring_clear(void)
+{
+	__atomic_store_n(&ring.tail, __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+}
+
+static void
+rdpeai_send(STREAM s)
+{
+	s_mark_end(s);
+	dvc_send(RDPEAI_CHANNEL_NAME, s);
+	s_free(s);
+}
+
+static void
+rdpeai_send_uint32_pdu(uint8 type, uint32 value)
+{
+	STREAM s;
+
+	s = s_alloc(5);
+	out_uint8(s, type);
+	out_uint32_le(s, value);
+	rdpeai_send(s);
+}
+
+/* We capture PCM and can compress it to IMA ADPCM */
+static RD_BOOL
+rdpeai_format_supported(RD_WAVEFORMATEX * format)
+{
+	RD_WAVEFORMATEX pcm;
+
+	if (format->wFormatTag != WAVE_FORMAT_PCM && format->wFormatTag != WAVE_FORMAT_IMA_ADPCM)
+		return False;
+	if (!rdpsnd_dsp_decode_format(format, &pcm))
+		return False;
+	if (format->wFormatTag == WAVE_FORMAT_PCM && !rdpsnd_dsp_resample_supported(format))
+		return False;
+
+	if (current_driver == NULL || current_driver->wave_in_format_supported == NULL)
+		return False;
+
+	return current_driver->wave_in_format_supported(&pcm);
+}
+
+static void
+rdpeai_process_formats(STREAM s)
+{
+	uint32 num_formats, i, size;
+	RD_WAVEFORMATEX format;
+	STREAM out;
+
+	in_uint32_le(s, num_formats);
+	in_uint8s(s, 4);	/* cbSizeFormatsPacket */
+
+	/* the server may ask for input before it sets up output */
+	if (current_driver == NULL)
+		rdpsnd_auto_select();
+
+	format_count = 0;
+	for (i = 0; i < num_formats; i++)
+	{
+		if (!s_check_rem(s, 18))
+		{
+			logger(Sound, Warning, "rdpeai_process_formats(), truncated format list");
+			break;
+		}
+
+		memset(&format, 0, sizeof(format));
+		in_uint16_le(s, format.wFormatTag);
+		in_uint16_le(s, format.nChannels);
+		in_uint32_le(s, format.nSamplesPerSec);
+		in_uint32_le(s, format.nAvgBytesPerSec);
+		in_uint16_le(s, format.nBlockAlign);
+		in_uint16_le(s, format.wBitsPerSample);
+		in_uint16_le(s, format.cbSize);
+		if (!s_check_rem(s, format.cbSize))
+			break;
+		in_uint8a(s, format.cb, MIN(format.cbSize, MAX_CBSIZE));
+		in_uint8s(s, format.cbSize - MIN(format.cbSize, MAX_CBSIZE));
+
+		if (format_count < MAX_FORMATS && rdpeai_format_supported(&format))
+			formats[format_count++] = format;
+	}
+
+	logger(Sound, Debug, "rdpeai_process_formats(), %d of %d formats supported",
+	       format_count, num_formats);
+
+	size = 9;
+	for (i = 0; i < format_count; i++)
+		size += 18 + formats[i].cbSize;
+
+	out = s_alloc(size);
+	out_uint8(out, MSG_SNDIN_FORMATS);
+	out_uint32_le(out, format_count);
+	out_uint32_le(out, size);	/* cbSizeFormatsPacket */
+	for (i = 0; i < format_count; i++)
+	{
+		out_uint16_le(out, formats[i].wFormatTag);
+		out_uint16_le(out, formats[i].nChannels);
+		out_uint32_le(out, formats[i].nSamplesPerSec);
+		out_uint32_le(out, formats[i].nAvgBytesPerSec);
+		out_uint16_le(out, formats[i].nBlockAlign);
+		out_uint16_le(out, formats[i].wBitsPerSample);
+		out_uint16_le(out, formats[i].cbSize);
+		out_uint8a(out, formats[i].cb, formats[i].cbSize);
+	}
+	rdpeai_send(out);
+}
+
+static void
+rdpeai_stop(void)
+{
+	if (!capturing)
+		return;
+
+	__atomic_store_n(&capturing, False, __ATOMIC_RELEASE);
+	current_driver->wave_in_close();
+
+	if (ring.overruns)
+		logger(Sound, Warning, "rdpeai_stop(), %u captured buffers were dropped",
+		       ring.overruns);
+	ring.overruns = 0;
+}
+
+static RD_BOOL
+rdpeai_start(uint32 index, uint32 frames_per_packet)
+{
+	RD_WAVEFORMATEX pcm;
+	unsigned int block_frames;
+
+	rdpeai_stop();
+
+	if (index >= format_count || current_driver == NULL)
+		return False;
+
+	rdpsnd_dsp_decode_format(&formats[index], &pcm);
+	if (!current_driver->wave_in_open())
+		return False;
+	if (!current_driver->wave_in_set_format(&pcm))
+	{
+		current_driver->wave_in_close();
+		return False;
+	}
+
+	/* whole ADPCM blocks per packet, and well within the ring */
+	block_frames = rdpsnd_dsp_block_frames(&formats[index]);
+	frames_per_packet = MAX(1, frames_per_packet / block_frames) * block_frames;
+	packet_size = MIN(frames_per_packet * pcm.nBlockAlign, RING_SIZE / 4);
+	packet_size -= packet_size % (block_frames * pcm.nBlockAlign);
+	packet_buf = xrealloc(packet_buf, packet_size);
+
+	logger(Sound, Debug,
+	       "rdpeai_start(), format %d, %d Hz, %d channels, %d bytes of PCM per packet", index,
+	       pcm.nSamplesPerSec, pcm.nChannels, packet_size);
+
+	current_format = index;
+	ring_clear();
+	__atomic_store_n(&capturing, True, __ATOMIC_RELEASE);
+
+	return True;
+}
+
+static void
+rdpeai_process_open(STREAM s)
+{
+	uint32 frames_per_packet, initial_format;
+	RD_BOOL started;
+
+	in_uint32_le(s, frames_per_packet);
+	in_uint32_le(s, initial_format);
+	/* the capture format follows, we always capture PCM matching the wire format */
+
+	packet_frames = frames_per_packet;
+	started = rdpeai_start(initial_format, frames_per_packet);
+
+	rdpeai_send_uint32_pdu(MSG_SNDIN_FORMATCHANGE, initial_format);
+	rdpeai_send_uint32_pdu(MSG_SNDIN_OPEN_REPLY, started ? 0 : 0x80004005 /* E_FAIL */ );
+}
+
+static void
+rdpeai_process_formatchange(STREAM s)
+{
+	uint32 new_format;
+
+	in_uint32_le(s, new_format);
+	if (!rdpeai_start(new_format, packet_frames))
+		logger(Sound, Warning, "rdpeai_process_formatchange(), failed to change format");
+	rdpeai_send_uint32_pdu(MSG_SNDIN_FORMATCHANGE, new_format);
+}
+
+static void
+rdpeai_process_pdu(STREAM s)
+{
+	uint8 type;
+	uint32 version;
+
+	in_uint8(s, type);
+
+	switch (type)
+	{
+		case MSG_SNDIN_VERSION:
+			in_uint32_le(s, version);
+			logger(Sound, Debug, "rdpeai_process_pdu(), server version %d", version);
+			rdpeai_send_uint32_pdu(MSG_SNDIN_VERSION, RDPEAI_VERSION);
+			break;
+
+		case MSG_SNDIN_FORMATS:
+			rdpeai_process_formats(s);
+			break;
+
+		case MSG_SNDIN_OPEN:
+			rdpeai_process_open(s);
+			break;
+
+		case MSG_SNDIN_FORMATCHANGE:
+			rdpeai_process_formatchange(s);
+			break;
+
+		default:
+			logger(Sound, Warning, "rdpeai_process_pdu(), Unhandled PDU type %d", type);
+			break;
+	}
+}
+
+static void
+rdpeai_send_data(uint8 * data, unsigned int size)
+{
+	RD_WAVEFORMATEX *format = &formats[current_format];
+	STREAM s, encoded = NULL;
+
+	if (format->wFormatTag != WAVE_FORMAT_PCM)
+	{
+		encoded = rdpsnd_dsp_encode(data, size, format);
+		data = encoded->data;
+		size = s_length(encoded);
+	}
+
+	s = s_alloc(1);
+	out_uint8(s, MSG_SNDIN_DATA_INCOMING);
+	rdpeai_send(s);
+
+	s = s_alloc(1 + size);
+	out_uint8(s, MSG_SNDIN_DATA);
+	out_uint8a(s, data, size);
+	rdpeai_send(s);
+
+	if (encoded != NULL)
+		s_free(encoded);
+}
+
+/* Sends what has been captured, from the main loop */
+void
+rdpeai_check(void)
+{
+	if (!capturing)
+		return;
+
+	/* the server closed the channel */
+	if (!dvc_channels_is_available(RDPEAI_CHANNEL_NAME))
+	{
+		rdpeai_stop();
+		return;
+	}
+
+	while (ring_read(packet_buf, packet_size))
+		rdpeai_send_data(packet_buf, packet_size);
+}
+
+void
+rdpeai_init(void)
+{
+	dvc_channels_register(RDPEAI_CHANNEL_NAME, rdpeai_process_pdu);
+}
@@ -45,7 +45,11 @@
 #define MAX_FORMATS		10
 #define MAX_QUEUE		50
 
+#define MAX_LATENCY		1000	/* ms */
+#define DROP_SLACK		250	/* ms queued beyond the target before dropping */
+
 extern RD_BOOL g_rdpsnd;
+extern uint32 g_rdpsnd_latency;
 
 static VCHANNEL *rdpsnd_channel;
 static VCHANNEL *rdpsnddbg_channel;
@@ -69,11 +73,33 @@ static struct stream packet;
 
 void (*wave_out_play) (void);
 
-static void rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index);
+/* Adaptive playout, times in ms */
+static struct
+{
+	RD_BOOL started;	/* something was played since the last reset */
+	RD_BOOL prebuffering;	/* packets are held back until the target is reached */
+	struct timeval prebuffer_tv;	/* arrival of the oldest held packet */
+	struct timeval drained_tv;	/* when the device runs out of queued audio */
+	long transit;		/* arrival time less server tick, of the last packet */
+	long jitter;		/* interarrival jitter in 1/16 ms, as in RFC 3550 */
+	long target;
+
+	unsigned long received;
+	unsigned long played;
+	unsigned long dropped;
+	unsigned long underruns;
+	unsigned long latency_sum;
+	unsigned long latency_max;
+} playout;
+
+static void rdpsnd_queue_write(unsigned char *data, unsigned int size, uint16 tick, uint8 index,
+			       unsigned int duration);
 static void rdpsnd_queue_init(void);
 static void rdpsnd_queue_clear(void);
 static void rdpsnd_queue_complete_pending(void);
 static long rdpsnd_queue_next_completion(void);
+static void rdpsnd_playout_check(void);
+static long tv_diff_ms(struct timeval *a, struct timeval *b);
 
 static STREAM
 rdpsnd_init_packet(uint8 type, uint16 size)
@@ -110,15 +136,43 @@ rdpsnd_send_waveconfirm(uint16 tick, uint8 packet_index)
 	       (unsigned) tick, (unsigned) packet_index);
 }
 
+/* Captured audio, see rdpeai.c */
 void
 rdpsnd_record(const void *data, unsigned int size)
 {
-	UNUSED(data);
-	UNUSED(size);
-	/* TODO: Send audio over RDP */
+	rdpeai_record(data, size);
 }
 
-static RD_BOOL
+/* Held packets are released, so the driver plays out everything on close */
+static void
+rdpsnd_wave_out_close(void)
+{
+	playout.prebuffering = False;
+	current_driver->wave_out_close();
+}
+
+static void
+rdpsnd_playout_stats(void)
+{
+	if (playout.played == 0)
+		return;
+
+	logger(Sound, Verbose,
+	       "rdpsnd: %lu packets played, %lu dropped, %lu underruns, latency %lu ms average, %lu ms max, jitter %ld ms, target %ld ms",
+	       playout.played, playout.dropped, playout.underruns,
+	       playout.latency_sum / playout.played, playout.latency_max, playout.jitter / 16,
+	       playout.target);
+}
+
+static void
+rdpsnd_playout_reset(void)
+{
+	rdpsnd_playout_stats();
+	memset(&playout, 0, sizeof(playout));
+	playout.target = MIN(g_rdpsnd_latency, MAX_LATENCY);
+}
+
+RD_BOOL
 rdpsnd_auto_select(void)
 {
 	static RD_BOOL failed = False;
@@ -148,17 +202,29 @@ rdpsnd_auto_select(void)
 	return False;
 }
 
+/* Size of the extra format data sent back to the server */
+static uint16
+rdpsnd_format_extra(RD_WAVEFORMATEX * format)
+{
+	if (format->wFormatTag == WAVE_FORMAT_PCM)
+		return 0;
+
+	/* rdpsnd_dsp_decode_format() refuses formats with truncated extra data */
+	return format->cbSize;
+}
+
 static void
 rdpsnd_process_negotiate(STREAM in)
 {
 	uint16 in_format_count, i;
 	uint8 pad;
 	uint16 version;
-	RD_WAVEFORMATEX *format;
+	RD_WAVEFORMATEX *format, pcm;
 	STREAM out;
 	RD_BOOL device_available = False;
 	int readcnt;
 	int discardcnt;
+	unsigned int formats_size;
 
 	in_uint8s(in, 14);	/* initial bytes not valid from server */
 	in_uint16_le(in, in_format_count);
@@ -213,7 +279,9 @@ rdpsnd_process_negotiate(STREAM in)
 			in_uint8a(in, format->cb, readcnt);
 			in_uint8s(in, discardcnt);
 
-			if (current_driver && current_driver->wave_out_format_supported(format))
+			/* compressed formats are offered if we can play them once decoded */
+			if (current_driver && rdpsnd_dsp_decode_format(format, &pcm)
+			    && current_driver->wave_out_format_supported(&pcm))
 			{
 				format_count++;
 				if (format_count == MAX_FORMATS)
@@ -222,7 +290,12 @@ rdpsnd_process_negotiate(STREAM in)
 		}
 	}
 
-	out = rdpsnd_init_packet(SNDC_FORMATS, 20 + 18 * format_count);
+	/* decoders need the extra data of compressed formats, so echo it back */
+	formats_size = 0;
+	for (i = 0; i < format_count; i++)
+		formats_size += 18 + rdpsnd_format_extra(&formats[i]);
+
+	out = rdpsnd_init_packet(SNDC_FORMATS, 20 + formats_size);
 
 	uint32 flags = TSSNDCAPS_VOLUME;
 
@@ -252,7 +325,8 @@ rdpsnd_process_negotiate(STREAM in)
 		out_uint32_le(out, format->nAvgBytesPerSec);
 		out_uint16_le(out, format->nBlockAlign);
 		out_uint16_le(out, format->wBitsPerSample);
-		out_uint16(out, 0);	/* cbSize */
+		out_uint16_le(out, rdpsnd_format_extra(format));	/* cbSize */
+		out_uint8a(out, format->cb, rdpsnd_format_extra(format));
 	}
 
 	s_mark_end(out);
@@ -298,8 +372,9 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 	uint16 vol_left, vol_right;
 
 	uint16 tick, format;
+	RD_WAVEFORMATEX pcm;
 	uint8 packet_index;
-	unsigned int size;
+	unsigned int size, duration;
 	unsigned char *data;
 
 	switch (opcode)
@@ -338,10 +413,12 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 					rdpsnd_send_waveconfirm(tick, packet_index);
 					break;
 				}
-				if (!current_driver->wave_out_set_format(&formats[format]))
+				/* the device plays what rdpsnd_dsp_process() produces */
+				rdpsnd_dsp_decode_format(&formats[format], &pcm);
+				if (!current_driver->wave_out_set_format(&pcm))
 				{
 					rdpsnd_send_waveconfirm(tick, packet_index);
-					current_driver->wave_out_close();
+					rdpsnd_wave_out_close();
 					device_open = False;
 					break;
 				}
@@ -350,18 +427,18 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 			}
 
 			size = s_remaining(s);
+			duration = formats[current_format].nAvgBytesPerSec ?
+				(size * 1000) / formats[current_format].nAvgBytesPerSec : 0;
 			in_uint8p(s, data, size);
-			rdpsnd_queue_write(rdpsnd_dsp_process(data, size,
-							      current_driver,
-							      &formats[current_format]),
-					   tick, packet_index);
+			rdpsnd_queue_write(data, size, tick, packet_index, duration);
 			return;
 			break;
 		case SNDC_CLOSE:
 			logger(Sound, Debug, "rdpsnd_process_packet(), SNDC_CLOSE()");
 			if (device_open)
-				current_driver->wave_out_close();
+				rdpsnd_wave_out_close();
 			device_open = False;
+			rdpsnd_playout_stats();
 			break;
 		case SNDC_FORMATS:
 			rdpsnd_process_negotiate(s);
@@ -537,6 +614,7 @@ rdpsnd_init(char *optarg)
 	}
 
 	rdpsnd_queue_init();
+	rdpsnd_playout_reset();
 
 	if (optarg != NULL && strlen(optarg) > 0)
 	{
@@ -578,9 +656,10 @@ void
 rdpsnd_reset_state(void)
 {
 	if (device_open)
-		current_driver->wave_out_close();
+		rdpsnd_wave_out_close();
 	device_open = False;
 	rdpsnd_queue_clear();
+	rdpsnd_playout_reset();
 	rdpsnd_negotiated = False;
 }
 
@@ -605,10 +684,23 @@ rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
 {
 	long next_pending;
 
-	if (device_open)
+	rdpsnd_playout_check();
+
+	/* drivers only poll what they have open, capture may run without playback */
+	if (current_driver != NULL)
 		current_driver->add_fds(n, rfds, wfds, tv);
 
 	next_pending = rdpsnd_queue_next_completion();
+	if (playout.prebuffering)
+	{
+		struct timeval now;
+		long held;
+
+		gettimeofday(&now, NULL);
+		held = MAX(0, playout.target - tv_diff_ms(&now, &playout.prebuffer_tv)) * 1000;
+		if (next_pending < 0 || held < next_pending)
+			next_pending = held;
+	}
 	if (next_pending >= 0)
 	{
 		long cur_timeout;
@@ -627,15 +719,101 @@ rdpsnd_check_fds(fd_set * rfds, fd_set * wfds)
 {
 	rdpsnd_queue_complete_pending();
 
-	if (device_open)
+	if (current_driver != NULL)
 		current_driver->check_fds(rfds, wfds);
+
+	rdpeai_check();
+}
+
+static long
+tv_diff_ms(struct timeval *a, struct timeval *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_usec - b->tv_usec) / 1000;
+}
+
+/* Audio queued but not yet handed to the device */
+static long
+rdpsnd_playout_queued(void)
+{
+	unsigned int i;
+	long queued = 0;
+
+	for (i = queue_lo; i != queue_hi; i = (i + 1) % MAX_QUEUE)
+		queued += packet_queue[i].duration;
+
+	return queued;
 }
 
+/* Track arrival jitter against the server tick, and aim for a latency that covers it */
 static void
-rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index)
+rdpsnd_playout_arrival(uint16 tick, struct timeval *now)
+{
+	long transit, d;
+
+	transit = ((now->tv_sec * 1000 + now->tv_usec / 1000) - tick) & 0xffff;
+	if (playout.received > 0)
+	{
+		/* a single stall should not pin the target at the maximum */
+		d = MIN(labs((sint16) (transit - playout.transit)), MAX_LATENCY / 4);
+		playout.jitter += d - (playout.jitter + 8) / 16;
+	}
+	playout.transit = transit;
+	playout.received++;
+
+	playout.target = MIN(MAX_LATENCY, MAX((long) g_rdpsnd_latency, 3 * playout.jitter / 16));
+}
+
+/* Release held packets once there is enough queued, or the oldest has waited long enough */
+static void
+rdpsnd_playout_check(void)
+{
+	struct timeval now;
+
+	if (!playout.prebuffering)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (rdpsnd_playout_queued() >= playout.target
+	    || tv_diff_ms(&now, &playout.prebuffer_tv) >= playout.target)
+	{
+		logger(Sound, Debug, "rdpsnd_playout_check(), starting with %ld ms queued",
+		       rdpsnd_playout_queued());
+		playout.prebuffering = False;
+	}
+}
+
+/* When playout has fallen behind, skip packets that have not been started */
+static void
+rdpsnd_playout_trim(void)
+{
+	struct audio_packet *packet;
+
+	while (rdpsnd_playout_queued() > playout.target + DROP_SLACK)
+	{
+		packet = &packet_queue[queue_lo];
+		if (s_tell(packet->s) != 0 || (queue_lo + 1) % MAX_QUEUE == queue_hi)
+			break;
+
+		logger(Sound, Debug, "rdpsnd_playout_trim(), dropping packet with tick %u",
+		       (unsigned) packet->tick);
+		playout.dropped++;
+		packet->dropped = True;
+		gettimeofday(&packet->completion_tv, NULL);
+		rdpsnd_dsp_release(packet->s);
+		queue_lo = (queue_lo + 1) % MAX_QUEUE;
+	}
+
+	rdpsnd_queue_complete_pending();
+}
+
+/* The device format is produced straight into the DSP ring, each entry has a view of its part */
+static void
+rdpsnd_queue_write(unsigned char *data, unsigned int size, uint16 tick, uint8 index,
+		   unsigned int duration)
 {
 	struct audio_packet *packet = &packet_queue[queue_hi];
 	unsigned int next_hi = (queue_hi + 1) % MAX_QUEUE;
+	struct timeval now;
 
 	if (next_hi == queue_pending)
 	{
@@ -643,13 +821,40 @@ rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index)
 		return;
 	}
 
+	if (packet->s == NULL)
+		packet->s = s_inherit(NULL, 0);
+	if (!rdpsnd_dsp_process(data, size, current_driver, &formats[current_format], packet->s))
+	{
+		logger(Sound, Error, "rdpsnd_queue_write(), no space to convert audio packet");
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	rdpsnd_playout_arrival(tick, &now);
+
+	/* nothing left to play, build up the queue again before starting */
+	if (queue_lo == queue_hi && !playout.prebuffering
+	    && (!playout.started || tv_diff_ms(&now, &playout.drained_tv) >= 0))
+	{
+		if (playout.started)
+		{
+			logger(Sound, Debug, "rdpsnd_queue_write(), underrun");
+			playout.underruns++;
+		}
+		playout.prebuffering = True;
+		playout.prebuffer_tv = now;
+	}
+
 	queue_hi = next_hi;
 
-	packet->s = s;
 	packet->tick = tick;
 	packet->index = index;
+	packet->duration = duration;
+	packet->arrive_tv = now;
+	packet->dropped = False;
 
-	gettimeofday(&packet->arrive_tv, NULL);
+	rdpsnd_playout_check();
+	rdpsnd_playout_trim();
 }
 
 struct audio_packet *
@@ -661,7 +866,7 @@ rdpsnd_queue_current_packet(void)
 RD_BOOL
 rdpsnd_queue_empty(void)
 {
-	return (queue_lo == queue_hi);
+	return (queue_lo == queue_hi) || playout.prebuffering;
 }
 
 static void
@@ -673,17 +878,12 @@ rdpsnd_queue_init(void)
 static void
 rdpsnd_queue_clear(void)
 {
-	struct audio_packet *packet;
-
-	/* Go through everything, not just the pending packets */
-	while (queue_pending != queue_hi)
+	/* what has not been played yet goes back to the DSP ring, oldest first */
+	while (queue_lo != queue_hi)
 	{
-		packet = &packet_queue[queue_pending];
-		s_free(packet->s);
-		queue_pending = (queue_pending + 1) % MAX_QUEUE;
+		rdpsnd_dsp_release(packet_queue[queue_lo].s);
+		queue_lo = (queue_lo + 1) % MAX_QUEUE;
 	}
-
-	/* Reset everything back to the initial state */
 	queue_pending = queue_lo = queue_hi = 0;
 }
 
@@ -702,6 +902,10 @@ rdpsnd_queue_next(unsigned long completed_in_us)
 	packet->completion_tv.tv_sec += packet->completion_tv.tv_usec / 1000000;
 	packet->completion_tv.tv_usec %= 1000000;
 
+	playout.started = True;
+	playout.drained_tv = packet->completion_tv;
+
+	rdpsnd_dsp_release(packet->s);
 	queue_lo = (queue_lo + 1) % MAX_QUEUE;
 
 	rdpsnd_queue_complete_pending();
@@ -744,7 +948,15 @@ rdpsnd_queue_complete_pending(void)
 			(packet->completion_tv.tv_usec - packet->arrive_tv.tv_usec);
 		elapsed /= 1000;
 
-		s_free(packet->s);
+		/* skipped packets are acknowledged but already counted as dropped */
+		if (!packet->dropped)
+		{
+			playout.played++;
+			playout.latency_sum += MAX(0, elapsed);
+			playout.latency_max =
+				MAX(playout.latency_max, (unsigned long) MAX(0, elapsed));
+		}
+
 		rdpsnd_send_waveconfirm((packet->tick + elapsed) % 65536, packet->index);
 		queue_pending = (queue_pending + 1) % MAX_QUEUE;
 	}
@@ -18,12 +18,17 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <math.h>
 #include <strings.h>
 
 #include "rdesktop.h"
 #include "rdpsnd.h"
 #include "rdpsnd_dsp.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_LIBSAMPLERATE
 #include <samplerate.h>
 
@@ -39,8 +44,46 @@ static uint16 resample_to_bitspersample = 16;
 static uint16 resample_to_channels = 2;
 #ifdef HAVE_LIBSAMPLERATE
 static SRC_STATE *src_converter = NULL;
+#else
+/* Built in polyphase resampler, going up by a factor up and down by down */
+#define RESAMPLE_TAPS		16
+#define RESAMPLE_MAX_TAPS	64
+#define RESAMPLE_MAX_PHASES	1024
+#define RESAMPLE_SHIFT		14
+
+static struct
+{
+	uint32 srate;		/* input the filter was made for, 0 for none */
+	uint16 channels;
+	unsigned int up, down;
+	unsigned int taps;
+	sint16 *filter;		/* taps coefficients for each of the up phases */
+	sint16 *history[2];	/* taps - 1 old frames, then the current packet */
+	unsigned int history_frames;
+	unsigned int pos;	/* newest frame used by the next output frame */
+	unsigned int phase;
+} resampler;
 #endif
 
+/*
+ * The device format output of every queued packet, each packet in one
+ * piece. Pieces are given back in the order they were handed out, so the
+ * ring only ever frees up from its tail.
+ */
+#define RING_MIN_SIZE		(256 * 1024)
+#define RING_SECONDS		4
+
+static struct
+{
+	unsigned char *ring;
+	unsigned int size;
+	unsigned int head;	/* where the next piece starts */
+	unsigned int tail;	/* end of the last piece given back */
+	unsigned int pieces;	/* handed out and not given back yet */
+	unsigned char *block;	/* one ADPCM block, expanded */
+	unsigned int block_size;
+} dsp;
+
 void
 rdpsnd_dsp_softvol_set(uint16 left, uint16 right)
 {
@@ -49,86 +92,420 @@ rdpsnd_dsp_softvol_set(uint16 left, uint16 right)
 	logger(Sound, Debug, "rdpsnd_dsp_softvol_set(), left: %u, right: %u\n", left, right);
 }
 
-void
-rdpsnd_dsp_softvol(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format)
+/* Points out at size free bytes of the ring, False if they are not there */
+static RD_BOOL
+ring_reserve(STREAM out, unsigned int size, unsigned int rate)
+{
+	unsigned int want;
+
+	if (dsp.pieces == 0)
+	{
+		/* nothing is queued, so this is the one time the ring may move */
+		dsp.head = dsp.tail = 0;
+		want = MAX(RING_MIN_SIZE, MAX(RING_SECONDS * rate, 2 * size));
+		if (dsp.size < want)
+		{
+			xfree(dsp.ring);
+			dsp.ring = xmalloc(want);
+			dsp.size = want;
+		}
+	}
+	else if (dsp.head >= dsp.tail)
+	{
+		/* the rest of the end is skipped until the pieces before it are back */
+		if (dsp.size - dsp.head < size)
+		{
+			if (size >= dsp.tail)
+				return False;
+			dsp.head = 0;
+		}
+	}
+	else if (dsp.tail - dsp.head <= size)
+	{
+		return False;
+	}
+
+	out->data = out->p = dsp.ring + dsp.head;
+	out->end = out->data + size;
+	out->size = size;
+	dsp.pieces++;
+	return True;
+}
+
+/* Ends the piece where the converters stopped writing */
+static void
+ring_commit(STREAM out)
 {
-	unsigned int factor_left, factor_right;
-	unsigned char *posin = buffer;
-	unsigned char *posout = buffer;
+	out->size = out->p - out->data;
+	s_mark_end(out);
+	s_seek(out, 0);
+	dsp.head += out->size;
+}
 
-	if ((softvol_left == MAX_VOLUME) && (softvol_right == MAX_VOLUME))
+/* Gives the oldest piece still handed out back to the ring */
+void
+rdpsnd_dsp_release(STREAM s)
+{
+	if (s->data == NULL || dsp.pieces == 0)
 		return;
 
-	factor_left = (softvol_left * 256) / MAX_VOLUME;
-	factor_right = (softvol_right * 256) / MAX_VOLUME;
+	dsp.tail = s->end - dsp.ring;
+	dsp.pieces--;
+	s->data = s->p = s->end = NULL;
+	s->size = 0;
+}
 
-	if (format->nChannels == 1)
+/* IMA and MS ADPCM, expanded to 16 bit PCM before anything else is done */
+static const sint16 ima_step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55,
+	60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411,
+	1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+	20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const sint8 ima_index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int ms_adapt_table[16] = {
+	230, 230, 230, 230, 307, 409, 512, 614, 768, 614, 512, 409, 307, 230, 230, 230
+};
+
+static const sint16 ms_default_coefs[7][2] = {
+	{256, 0}, {512, -256}, {0, 0}, {192, 64}, {240, 0}, {460, -208}, {392, -232}
+};
+
+#define MS_MAX_COEFS ((MAX_CBSIZE - 4) / 4)
+
+struct ima_state
+{
+	int predictor;
+	int index;
+};
+
+struct ms_state
+{
+	int coef1, coef2;
+	int delta;
+	int sample1, sample2;
+};
+
+static int
+clamp_sample(int sample)
+{
+	if (sample > 32767)
+		return 32767;
+	if (sample < -32768)
+		return -32768;
+	return sample;
+}
+
+static void
+put_sample(unsigned char *out, int sample)
+{
+	out[0] = sample & 0xff;
+	out[1] = (sample >> 8) & 0xff;
+}
+
+static int
+get_sample(const unsigned char *in)
+{
+	return (sint16) (in[0] | (in[1] << 8));
+}
+
+static int
+ima_expand_nibble(struct ima_state *state, int nibble)
+{
+	int step, diff;
+
+	step = ima_step_table[state->index];
+	diff = step >> 3;
+	if (nibble & 1)
+		diff += step >> 2;
+	if (nibble & 2)
+		diff += step >> 1;
+	if (nibble & 4)
+		diff += step;
+	if (nibble & 8)
+		diff = -diff;
+
+	state->predictor = clamp_sample(state->predictor + diff);
+	state->index = MAX(0, MIN(88, state->index + ima_index_table[nibble]));
+
+	return state->predictor;
+}
+
+static int
+ms_expand_nibble(struct ms_state *state, int nibble)
+{
+	int predictor;
+
+	predictor = (state->sample1 * state->coef1 + state->sample2 * state->coef2) >> 8;
+	predictor += ((nibble & 8) ? nibble - 16 : nibble) * state->delta;
+	predictor = clamp_sample(predictor);
+
+	state->sample2 = state->sample1;
+	state->sample1 = predictor;
+	state->delta = MAX(16, (ms_adapt_table[nibble] * state->delta) >> 8);
+
+	return predictor;
+}
+
+/* Frames in one block of the given size, 0 if it is too short to decode */
+static unsigned int
+adpcm_block_frames(RD_WAVEFORMATEX * format, unsigned int size)
+{
+	unsigned int channels = format->nChannels;
+
+	if (format->wFormatTag == WAVE_FORMAT_IMA_ADPCM)
 	{
-		factor_left = factor_right = (factor_left + factor_right) / 2;
+		/* 4 byte header per channel, then groups of 4 bytes per channel */
+		if (size < 4 * channels)
+			return 0;
+		return 1 + (size - 4 * channels) / (4 * channels) * 8;
 	}
 
-	if (format->wBitsPerSample == 8)
+	/* 7 byte header per channel, then one nibble per sample */
+	if (size < 7 * channels)
+		return 0;
+	return 2 + (size - 7 * channels) * 2 / channels;
+}
+
+static void
+ima_adpcm_decode_block(const unsigned char *in, unsigned int frames, unsigned int channels,
+		       unsigned char *out)
+{
+	struct ima_state state[2];
+	unsigned int c, i, frame;
+	int nibble;
+
+	for (c = 0; c < channels; c++)
 	{
-		sint8 val;
+		state[c].predictor = get_sample(in);
+		state[c].index = MIN(88, in[2]);
+		put_sample(out + c * 2, state[c].predictor);
+		in += 4;
+	}
 
-		while (posout < buffer + size)
+	/* each channel has 8 samples in every group of 4 bytes */
+	for (frame = 1; frame < frames; frame += 8)
+	{
+		for (c = 0; c < channels; c++)
 		{
-			/* Left */
-			val = *posin++;
-			val = (val * factor_left) >> 8;
-			*posout++ = val;
-
-			/* Right */
-			val = *posin++;
-			val = (val * factor_right) >> 8;
-			*posout++ = val;
+			for (i = 0; i < 8; i++)
+			{
+				nibble = (i & 1) ? (in[i / 2] >> 4) : (in[i / 2] & 0xf);
+				put_sample(out + ((frame + i) * channels + c) * 2,
+					   ima_expand_nibble(&state[c], nibble));
+			}
+			in += 4;
 		}
 	}
-	else
+}
+
+static void
+ms_adpcm_decode_block(const unsigned char *in, unsigned int frames, RD_WAVEFORMATEX * format,
+		      unsigned char *out)
+{
+	struct ms_state state[2];
+	unsigned int c, i, channels = format->nChannels;
+	unsigned int numcoefs, predictor;
+	const unsigned char *cb = format->cb;
+
+	numcoefs = (format->cbSize >= 4) ? (cb[2] | (cb[3] << 8)) : 0;
+
+	for (c = 0; c < channels; c++)
+	{
+		predictor = in[c];
+		if (numcoefs != 0)
+		{
+			predictor = MIN(predictor, numcoefs - 1);
+			state[c].coef1 = get_sample(cb + 4 + predictor * 4);
+			state[c].coef2 = get_sample(cb + 6 + predictor * 4);
+		}
+		else
+		{
+			predictor = MIN(predictor, 6);
+			state[c].coef1 = ms_default_coefs[predictor][0];
+			state[c].coef2 = ms_default_coefs[predictor][1];
+		}
+		state[c].delta = get_sample(in + channels + c * 2);
+		state[c].sample1 = get_sample(in + channels * 3 + c * 2);
+		state[c].sample2 = get_sample(in + channels * 5 + c * 2);
+
+		/* the older sample is played first */
+		put_sample(out + c * 2, state[c].sample2);
+		put_sample(out + (channels + c) * 2, state[c].sample1);
+	}
+	in += channels * 7;
+
+	/* high nibble first, interleaved between channels */
+	for (i = 2 * channels; i < frames * channels; i++)
+	{
+		c = i % channels;
+		put_sample(out + i * 2,
+			   ms_expand_nibble(&state[c], (i & 1) ? (*in++ & 0xf) : (*in >> 4)));
+	}
+}
+
+/* Encoder state is kept between blocks, only the step index carries over */
+static struct ima_state ima_encoder[2];
+
+static int
+ima_compress_sample(struct ima_state *state, int sample)
+{
+	int step, diff, nibble = 0;
+
+	step = ima_step_table[state->index];
+	diff = sample - state->predictor;
+	if (diff < 0)
+	{
+		nibble = 8;
+		diff = -diff;
+	}
+	if (diff >= step)
+	{
+		nibble |= 4;
+		diff -= step;
+	}
+	step >>= 1;
+	if (diff >= step)
+	{
+		nibble |= 2;
+		diff -= step;
+	}
+	step >>= 1;
+	if (diff >= step)
+		nibble |= 1;
+
+	/* track what the decoder will see */
+	ima_expand_nibble(state, nibble);
+
+	return nibble;
+}
+
+static void
+ima_adpcm_encode_block(const unsigned char *in, unsigned int frames, unsigned int channels,
+		       unsigned char *out)
+{
+	struct ima_state *state;
+	unsigned int c, i, frame;
+	int nibble;
+
+	for (c = 0; c < channels; c++)
 	{
-		sint16 val;
+		state = &ima_encoder[c];
+		state->predictor = get_sample(in + c * 2);
+		put_sample(out, state->predictor);
+		out[2] = state->index;
+		out[3] = 0;
+		out += 4;
+	}
 
-		while (posout < buffer + size)
+	for (frame = 1; frame < frames; frame += 8)
+	{
+		for (c = 0; c < channels; c++)
 		{
-			/* Left */
-			val = *posin++;
-			val |= *posin++ << 8;
-			val = (val * factor_left) >> 8;
-			*posout++ = val & 0xff;
-			*posout++ = val >> 8;
-
-			/* Right */
-			val = *posin++;
-			val |= *posin++ << 8;
-			val = (val * factor_right) >> 8;
-			*posout++ = val & 0xff;
-			*posout++ = val >> 8;
+			for (i = 0; i < 8; i++)
+			{
+				nibble = ima_compress_sample(&ima_encoder[c],
+							     get_sample(in +
+									((frame + i) * channels +
+									 c) * 2));
+				if (i & 1)
+					out[i / 2] |= nibble << 4;
+				else
+					out[i / 2] = nibble;
+			}
+			out += 4;
 		}
 	}
+}
 
-	logger(Sound, Debug,
-	       "rdpsnd_dsp_softvol(), using softvol with factors left: %d, right: %d (%d/%d)",
-	       factor_left, factor_right, format->wBitsPerSample, format->nChannels);
+RD_BOOL
+rdpsnd_dsp_decode_format(RD_WAVEFORMATEX * format, RD_WAVEFORMATEX * pcm)
+{
+	unsigned int numcoefs, channels = format->nChannels;
+
+	*pcm = *format;
+	if (format->wFormatTag == WAVE_FORMAT_PCM)
+		return True;
+
+	if (format->wFormatTag != WAVE_FORMAT_ADPCM && format->wFormatTag != WAVE_FORMAT_IMA_ADPCM)
+		return False;
+	if (format->wBitsPerSample != 4 || (channels != 1 && channels != 2))
+		return False;
+	if (format->nSamplesPerSec == 0 || adpcm_block_frames(format, format->nBlockAlign) <= 2)
+		return False;
+	if (format->wFormatTag == WAVE_FORMAT_IMA_ADPCM && (format->nBlockAlign % (4 * channels)))
+		return False;
+
+	/* the extra data is echoed back, and holds the MS ADPCM coefficients */
+	if (format->cbSize > MAX_CBSIZE)
+		return False;
+	if (format->wFormatTag == WAVE_FORMAT_ADPCM && format->cbSize >= 4)
+	{
+		numcoefs = format->cb[2] | (format->cb[3] << 8);
+		if (numcoefs > MS_MAX_COEFS || 4 + numcoefs * 4 > format->cbSize)
+			return False;
+	}
+
+	pcm->wFormatTag = WAVE_FORMAT_PCM;
+	pcm->wBitsPerSample = 16;
+	pcm->nBlockAlign = channels * 2;
+	pcm->nAvgBytesPerSec = format->nSamplesPerSec * pcm->nBlockAlign;
+	pcm->cbSize = 0;
+
+	return True;
 }
 
-void
-rdpsnd_dsp_swapbytes(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format)
+/* Frames in size bytes of the format, a short final ADPCM block counts as far as it goes */
+static unsigned int
+format_frames(RD_WAVEFORMATEX * format, RD_WAVEFORMATEX * pcm, unsigned int size)
 {
-	int i;
-	uint8 swap;
+	unsigned int blocksize = format->nBlockAlign;
 
-	if (format->wBitsPerSample == 8)
-		return;
+	if (format->wFormatTag == WAVE_FORMAT_PCM)
+		return size / pcm->nBlockAlign;
+
+	return (size / blocksize) * adpcm_block_frames(format, blocksize)
+		+ adpcm_block_frames(format, size % blocksize);
+}
 
-	if (size & 0x1)
-		logger(Sound, Warning, "rdpsnd_dsp_swapbytes(), badly aligned sound data");
+/* Frames in each unit of the format, so that whole units can be encoded */
+unsigned int
+rdpsnd_dsp_block_frames(RD_WAVEFORMATEX * format)
+{
+	if (format->wFormatTag == WAVE_FORMAT_PCM)
+		return 1;
+
+	return adpcm_block_frames(format, format->nBlockAlign);
+}
+
+/* Compresses 16 bit PCM to IMA ADPCM, whole blocks only */
+STREAM
+rdpsnd_dsp_encode(unsigned char *in, unsigned int size, RD_WAVEFORMATEX * format)
+{
+	unsigned int frames, framesize, blocks, i;
+	unsigned char *data;
+	STREAM out;
 
-	for (i = 0; i < (int) size; i += 2)
+	frames = adpcm_block_frames(format, format->nBlockAlign);
+	framesize = format->nChannels * 2;
+	blocks = size / (frames * framesize);
+
+	out = s_alloc(blocks * format->nBlockAlign);
+	for (i = 0; i < blocks; i++)
 	{
-		swap = *(buffer + i);
-		*(buffer + i) = *(buffer + i + 1);
-		*(buffer + i + 1) = swap;
+		out_uint8p(out, data, format->nBlockAlign);
+		ima_adpcm_encode_block(in, frames, format->nChannels, data);
+		in += frames * framesize;
 	}
+
+	s_mark_end(out);
+	return out;
 }
 
 RD_BOOL
@@ -157,6 +534,9 @@ rdpsnd_dsp_resample_set(uint32 device_srate, uint16 device_bitspersample, uint16
 		logger(Sound, Warning, "rdpsnd_dsp_resample_set(), src_new() failed with %d", err);
 		return False;
 	}
+#else
+	/* the filter is remade for the next packet */
+	resampler.srate = 0;
 #endif
 
 	return True;
@@ -175,108 +555,201 @@ rdpsnd_dsp_resample_supported(RD_WAVEFORMATEX * format)
 	return True;
 }
 
-STREAM
-rdpsnd_dsp_resample(unsigned char *in, unsigned int size,
-		    RD_WAVEFORMATEX * format, RD_BOOL stream_be)
+/* How samples are converted on their way to the device */
+struct dsp_conv
 {
-	UNUSED(stream_be);
-#ifdef HAVE_LIBSAMPLERATE
-	SRC_DATA resample_data;
-	float *infloat, *outfloat;
-	int err;
-#else
-	int ratio1k = (resample_to_srate * 1000) / format->nSamplesPerSec;
-#endif
-	int innum, outnum;
-	unsigned char *tmpdata = NULL, *tmp = NULL;
-	int samplewidth = format->wBitsPerSample / 8;
-	STREAM out;
-	int outsize = 0;
-	unsigned char *data;
-	int i;
+	RD_BOOL in_be;		/* byte order of 16 bit input */
+	RD_BOOL out_be;		/* and of 16 bit output */
+	int volume[2];		/* per channel, 256 is unity */
+};
 
-	if ((resample_to_bitspersample == format->wBitsPerSample) &&
-	    (resample_to_channels == format->nChannels) &&
-	    (resample_to_srate == format->nSamplesPerSec))
-		return NULL;
+static void
+softvol_factors(struct dsp_conv *conv, RD_WAVEFORMATEX * format, RD_BOOL softvol)
+{
+	conv->volume[0] = conv->volume[1] = 256;
+	if (!softvol || ((softvol_left == MAX_VOLUME) && (softvol_right == MAX_VOLUME)))
+		return;
 
-#ifdef B_ENDIAN
-	if (!stream_be)
-		rdpsnd_dsp_swapbytes(in, size, format);
-#endif
+	conv->volume[0] = (softvol_left * 256) / MAX_VOLUME;
+	conv->volume[1] = (softvol_right * 256) / MAX_VOLUME;
 
-	if (resample_to_channels != format->nChannels)
-	{
-		int newsize = (size / format->nChannels) * resample_to_channels;
-		tmpdata = (unsigned char *) xmalloc(newsize);
+	if (format->nChannels == 1)
+		conv->volume[0] = conv->volume[1] = (conv->volume[0] + conv->volume[1]) / 2;
+}
 
-		for (i = 0; i < newsize / samplewidth; i++)
-		{
-			if (format->nChannels > resample_to_channels)
-				memcpy(tmpdata + (i * samplewidth),
-				       in +
-				       (((i * format->nChannels) / resample_to_channels) *
-					samplewidth), samplewidth);
-			else
-				memcpy(tmpdata + (i * samplewidth),
-				       in +
-				       (((i / resample_to_channels) * format->nChannels +
-					 (i % format->nChannels)) * samplewidth), samplewidth);
+/* 8 or 16 bit samples, as signed 16 bit values. 8 bit PCM is unsigned. */
+static int
+read_sample(unsigned char **in, int samplewidth, RD_BOOL be)
+{
+	unsigned char *p = *in;
+
+	*in += samplewidth;
+	if (samplewidth == 1)
+		return (p[0] - 128) << 8;
+	if (be)
+		return (sint16) ((p[0] << 8) | p[1]);
+	return (sint16) (p[0] | (p[1] << 8));
+}
 
-		}
+static void
+write_sample(unsigned char **out, int sample, int samplewidth, RD_BOOL be)
+{
+	unsigned char *p = *out;
 
-		in = tmpdata;
-		size = newsize;
+	if (samplewidth == 1)
+	{
+		*p++ = (sample >> 8) + 128;
+	}
+	else if (be)
+	{
+		*p++ = (sample >> 8) & 0xff;
+		*p++ = sample & 0xff;
+	}
+	else
+	{
+		*p++ = sample & 0xff;
+		*p++ = (sample >> 8) & 0xff;
 	}
 
+	*out = p;
+}
 
-	/* Expand 8-bit input-samples to 16-bit */
-#ifndef HAVE_LIBSAMPLERATE	/* libsamplerate needs 16-bit samples */
-	if (format->wBitsPerSample != resample_to_bitspersample)
+#ifdef __SSE2__
+/* Scales whole groups of 8 little endian samples, returns how many were done */
+static unsigned int
+softvol_sse2(const unsigned char *in, unsigned char *out, unsigned int samples, int volume[2])
+{
+	__m128i v, x, lo, hi;
+	unsigned int i;
+
+	v = _mm_set_epi16(volume[1], volume[0], volume[1], volume[0],
+			  volume[1], volume[0], volume[1], volume[0]);
+
+	for (i = 0; i + 8 <= samples; i += 8)
+	{
+		/* the full 32 bit products, shifted down and packed again */
+		x = _mm_loadu_si128((const __m128i *) (in + i * 2));
+		lo = _mm_mullo_epi16(x, v);
+		hi = _mm_mulhi_epi16(x, v);
+		x = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 8),
+				    _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 8));
+		_mm_storeu_si128((__m128i *) (out + i * 2), x);
+	}
+
+	return i;
+}
 #endif
+
+/* Volume and byte order only, for when the device takes the format as is */
+static void
+convert(unsigned char *in, unsigned int size, RD_WAVEFORMATEX * format, struct dsp_conv *conv,
+	STREAM out)
+{
+	int samplewidth = format->wBitsPerSample / 8;
+	unsigned int samples, i;
+	int c, sample;
+	unsigned char *p = out->p;
+
+	samples = size / samplewidth;
+
+	if (conv->volume[0] == 256 && conv->volume[1] == 256
+	    && (samplewidth == 1 || conv->in_be == conv->out_be))
 	{
-		/* source: 8 bit, dest: 16 bit */
-		if (format->wBitsPerSample == 8)
+		memcpy(p, in, samples * samplewidth);
+		p += samples * samplewidth;
+	}
+#ifdef __SSE2__
+	else if (samplewidth == 2 && !conv->in_be && !conv->out_be)
+	{
+		/* an even count, so the channels stay in step for the rest */
+		i = softvol_sse2(in, p, samples, conv->volume);
+		in += i * 2;
+		p += i * 2;
+		for (c = 0; i < samples; i++, c ^= (format->nChannels == 2))
 		{
-			tmp = tmpdata;
-			tmpdata = (unsigned char *) xmalloc(size * 2);
-			for (i = 0; i < (int) size; i++)
-			{
-				tmpdata[i * 2] = in[i];
-				tmpdata[(i * 2) + 1] = 0x00;
-			}
-			in = tmpdata;
-			samplewidth = 16 / 2;
-			size *= 2;
+			sample = read_sample(&in, 2, False);
+			write_sample(&p, (sample * conv->volume[c]) >> 8, 2, False);
+		}
+	}
+#elif defined(L_ENDIAN) && !defined(NEED_ALIGN)
+	else if (samplewidth == 2 && !conv->in_be && !conv->out_be && format->nChannels == 2)
+	{
+		/* the usual case, simple enough for the compiler to vectorise */
+		const sint16 *src = (const sint16 *) in;
+		sint16 *dst = (sint16 *) p;
+		int left = conv->volume[0], right = conv->volume[1];
 
-			if (tmp != NULL)
-				xfree(tmp);
+		for (i = 0; i < samples / 2; i++)
+		{
+			dst[2 * i] = (src[2 * i] * left) >> 8;
+			dst[2 * i + 1] = (src[2 * i + 1] * right) >> 8;
+		}
+		p += (samples / 2) * 4;
+	}
+#endif
+	else
+	{
+		for (i = 0, c = 0; i < samples; i++, c ^= (format->nChannels == 2))
+		{
+			sample = read_sample(&in, samplewidth, conv->in_be);
+			write_sample(&p, (sample * conv->volume[c]) >> 8, samplewidth, conv->out_be);
 		}
 	}
 
-	innum = size / samplewidth;
+	out->p = p;
+}
 
-	/* Do the resampling */
 #ifdef HAVE_LIBSAMPLERATE
-	if (src_converter == NULL)
-	{
-		logger(Sound, Warning,
-		       "rdpsndp_dsp_resample_set(), no sample rate converter available");
-		return NULL;
-	}
+static void
+resample_libsamplerate(unsigned char *in, unsigned int size, RD_WAVEFORMATEX * format,
+		       struct dsp_conv *conv, STREAM out)
+{
+	static float *infloat, *outfloat;
+	static unsigned int infloat_size, outfloat_size;
+	SRC_DATA resample_data;
+	int samplewidth = format->wBitsPerSample / 8;
+	int outwidth = resample_to_bitspersample / 8;
+	unsigned int frames, outframes, i;
+	int left, right, err;
+	unsigned char *p = out->p;
 
-	outnum = ((float) innum * ((float) resample_to_srate / (float) format->nSamplesPerSec)) + 1;
+	/* never more than the room left in the piece of the ring */
+	frames = size / (samplewidth * format->nChannels);
+	outframes = (out->end - p) / (outwidth * resample_to_channels);
 
-	infloat = (float *) xmalloc(sizeof(float) * innum);
-	outfloat = (float *) xmalloc(sizeof(float) * outnum);
+	if (infloat_size < frames * resample_to_channels)
+	{
+		infloat_size = frames * resample_to_channels;
+		infloat = xrealloc(infloat, infloat_size * sizeof(float));
+	}
+	if (outfloat_size < outframes * resample_to_channels)
+	{
+		outfloat_size = outframes * resample_to_channels;
+		outfloat = xrealloc(outfloat, outfloat_size * sizeof(float));
+	}
 
-	src_short_to_float_array((short *) in, infloat, innum);
+	/* volume and channel mixing on the way in */
+	for (i = 0; i < frames; i++)
+	{
+		left = (read_sample(&in, samplewidth, conv->in_be) * conv->volume[0]) >> 8;
+		right = (format->nChannels == 2) ?
+			(read_sample(&in, samplewidth, conv->in_be) * conv->volume[1]) >> 8 : left;
+		if (resample_to_channels == 1)
+		{
+			infloat[i] = (left + right) / 65536.0f;
+		}
+		else
+		{
+			infloat[2 * i] = left / 32768.0f;
+			infloat[2 * i + 1] = right / 32768.0f;
+		}
+	}
 
 	bzero(&resample_data, sizeof(resample_data));
 	resample_data.data_in = infloat;
 	resample_data.data_out = outfloat;
-	resample_data.input_frames = innum / resample_to_channels;
-	resample_data.output_frames = outnum / resample_to_channels;
+	resample_data.input_frames = frames;
+	resample_data.output_frames = outframes;
 	resample_data.src_ratio = (double) resample_to_srate / (double) format->nSamplesPerSec;
 	resample_data.end_of_input = 0;
 
@@ -284,151 +757,346 @@ rdpsnd_dsp_resample(unsigned char *in, unsigned int size,
 		logger(Sound, Warning, "rdpsnd_dsp_resample_set(), src_process(): '%s'",
 		       src_strerror(err));
 
-	xfree(infloat);
+	/* and the device format on the way out */
+	for (i = 0; i < resample_data.output_frames_gen * resample_to_channels; i++)
+		write_sample(&p, clamp_sample(lrintf(outfloat[i] * 32768.0f)), outwidth,
+			     conv->out_be);
 
-	outsize = resample_data.output_frames_gen * resample_to_channels * samplewidth;
-	out = s_alloc(outsize);
-	out_uint8p(out, data, outsize);
-	src_float_to_short_array(outfloat, (short *) data,
-				 resample_data.output_frames_gen * resample_to_channels);
-	xfree(outfloat);
+	out->p = p;
+}
 
-#else
-	/* Michaels simple linear resampler */
-	if (resample_to_srate < format->nSamplesPerSec)
+/* Upper bound on the frames made from frames input frames */
+static unsigned int
+resample_frames(unsigned int frames, RD_WAVEFORMATEX * format)
+{
+	return ((double) frames * resample_to_srate) / format->nSamplesPerSec + 2;
+}
+
+#else /* HAVE_LIBSAMPLERATE */
+
+static uint32
+gcd(uint32 a, uint32 b)
+{
+	uint32 t;
+
+	while (b != 0)
 	{
-		logger(Sound, Warning,
-		       "rdpsnd_dsp_reasmple_set(), downsampling currently not supported");
-		return 0;
+		t = a % b;
+		a = b;
+		b = t;
 	}
 
-	outnum = (innum * ratio1k) / 1000;
+	return a;
+}
 
-	outsize = outnum * samplewidth;
-	out = s_alloc(outsize);
-	out_uint8p(out, data, outsize);
-	bzero(data, outsize);
+/* Sets up the filter for resampling from srate to resample_to_srate */
+static void
+resample_init(uint32 srate, uint16 channels)
+{
+	unsigned int up, down, taps, length, phase, i, c;
+	double cutoff, x, sum, *h;
 
-	for (i = 0; i < outsize / (resample_to_channels * samplewidth); i++)
+	up = resample_to_srate / gcd(resample_to_srate, srate);
+	down = srate / gcd(resample_to_srate, srate);
+	if (up > RESAMPLE_MAX_PHASES)
 	{
-		int source = (i * 1000) / ratio1k;
-#if 0				/* Partial for linear resampler */
-		int part = (i * 100000) / ratio1k - source * 100;
-#endif
-		int j;
+		/* odd rates, accept a tiny pitch error */
+		down = MAX(1, (down * RESAMPLE_MAX_PHASES + up / 2) / up);
+		up = RESAMPLE_MAX_PHASES;
+		i = gcd(up, down);
+		up /= i;
+		down /= i;
+	}
 
-		if (source * resample_to_channels + samplewidth > (int) size)
-			break;
+	/* longer filters when downsampling, to keep the transition band as narrow */
+	taps = (up == down) ? 1 : MIN(RESAMPLE_MAX_TAPS, RESAMPLE_TAPS * ((down + up - 1) / up));
+	length = up * taps;
 
-#if 0				/* Linear resampling, TODO: soundquality fixes (LP filter) */
-		if (samplewidth == 1)
+	resampler.filter = xrealloc(resampler.filter, length * sizeof(sint16));
+	if (taps == 1)
+	{
+		resampler.filter[0] = 1 << RESAMPLE_SHIFT;
+	}
+	else
+	{
+		/* Blackman windowed sinc, just below the lower of the two Nyquist rates */
+		h = xmalloc(length * sizeof(double));
+		cutoff = 0.45 / MAX(up, down);
+		for (i = 0; i < length; i++)
 		{
-			sint8 cval1, cval2;
-			for (j = 0; j < resample_to_channels; j++)
-			{
-				memcpy(&cval1,
-				       in + (source * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-				memcpy(&cval2,
-				       in + ((source + 1) * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-
-				cval1 += (sint8) (cval2 * part) / 100;
-
-				memcpy(data + (i * resample_to_channels * samplewidth) +
-				       (samplewidth * j), &cval1, samplewidth);
-			}
+			x = i - (length - 1) / 2.0;
+			h[i] = (x == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+			h[i] *= 0.42 - 0.5 * cos(2 * M_PI * i / (length - 1))
+				+ 0.08 * cos(4 * M_PI * i / (length - 1));
 		}
-		else
+
+		/* one row per phase, each scaled to unity gain and stored in input order */
+		for (phase = 0; phase < up; phase++)
 		{
-			sint16 sval1, sval2;
-			for (j = 0; j < resample_to_channels; j++)
-			{
-				memcpy(&sval1,
-				       in + (source * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-				memcpy(&sval2,
-				       in + ((source + 1) * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
+			sum = 0;
+			for (i = 0; i < taps; i++)
+				sum += h[phase + i * up];
+			for (i = 0; i < taps; i++)
+				resampler.filter[phase * taps + taps - 1 - i] =
+					floor(h[phase + i * up] / sum * (1 << RESAMPLE_SHIFT) + 0.5);
+		}
+		xfree(h);
+	}
 
-				sval1 += (sint16) (sval2 * part) / 100;
+	/* start from silence */
+	resampler.history_frames = MAX(resampler.history_frames, taps - 1);
+	for (c = 0; c < 2; c++)
+	{
+		resampler.history[c] = xrealloc(resampler.history[c],
+						resampler.history_frames * sizeof(sint16));
+		memset(resampler.history[c], 0, (taps - 1) * sizeof(sint16));
+	}
 
-				memcpy(data + (i * resample_to_channels * samplewidth) +
-				       (samplewidth * j), &sval1, samplewidth);
-			}
+	resampler.srate = srate;
+	resampler.channels = channels;
+	resampler.up = up;
+	resampler.down = down;
+	resampler.taps = taps;
+	resampler.pos = taps - 1;
+	resampler.phase = 0;
+
+	logger(Sound, Debug, "resample_init(), %u Hz to %u Hz, up %u, down %u, %u taps", srate,
+	       resample_to_srate, up, down, taps);
+}
+
+#ifdef __SSE2__
+/* Taps is a multiple of 8, the sum is exact as it fits in 32 bits */
+static int
+dot_sse2(const sint16 * coef, const sint16 * x, unsigned int taps)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned int j;
+
+	for (j = 0; j < taps; j += 8)
+		acc = _mm_add_epi32(acc,
+				    _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (coef + j)),
+						   _mm_loadu_si128((const __m128i *) (x + j))));
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(acc);
+}
+#endif
+
+/* Upper bound on the frames made from frames input frames */
+static unsigned int
+resample_frames(unsigned int frames, RD_WAVEFORMATEX * format)
+{
+	if (resampler.srate != format->nSamplesPerSec || resampler.channels != format->nChannels)
+		resample_init(format->nSamplesPerSec, format->nChannels);
+
+	/* the position carries over, so this holds for any run of calls */
+	return (frames * resampler.up) / resampler.down + 2;
+}
+
+static void
+resample_polyphase(unsigned char *in, unsigned int size, RD_WAVEFORMATEX * format,
+		   struct dsp_conv *conv, STREAM out)
+{
+	int samplewidth = format->wBitsPerSample / 8;
+	int outwidth = resample_to_bitspersample / 8;
+	unsigned int channels = resample_to_channels;
+	unsigned int frames, taps, end, pos, phase, step, rem, i, j, c;
+	int left, right, acc;
+	unsigned char *p = out->p;
+	sint16 *coef, *x;
+
+	taps = resampler.taps;
+	frames = size / (samplewidth * format->nChannels);
+	end = taps - 1 + frames;
+	if (end > resampler.history_frames)
+	{
+		resampler.history_frames = end;
+		for (c = 0; c < 2; c++)
+			resampler.history[c] = xrealloc(resampler.history[c],
+							end * sizeof(sint16));
+	}
+
+	/* append the packet to the history, one row per output channel */
+	for (i = taps - 1; i < end; i++)
+	{
+		left = (read_sample(&in, samplewidth, conv->in_be) * conv->volume[0]) >> 8;
+		right = (format->nChannels == 2) ?
+			(read_sample(&in, samplewidth, conv->in_be) * conv->volume[1]) >> 8 : left;
+		if (resample_to_channels == 1)
+		{
+			resampler.history[0][i] = (left + right) / 2;
 		}
-#else /* Nearest neighbor search */
-		for (j = 0; j < resample_to_channels; j++)
+		else
 		{
-			memcpy(out + (i * resample_to_channels * samplewidth) + (samplewidth * j),
-			       in + (source * resample_to_channels * samplewidth) +
-			       (samplewidth * j), samplewidth);
+			resampler.history[0][i] = left;
+			resampler.history[1][i] = right;
 		}
-#endif
 	}
-	outsize = i * resample_to_channels * samplewidth;
-#endif
-
-	if (tmpdata != NULL)
-		xfree(tmpdata);
 
-	/* Shrink 16-bit output-samples to 8-bit */
-#ifndef HAVE_LIBSAMPLERATE	/* libsamplerate produces 16-bit samples */
-	if (format->wBitsPerSample != resample_to_bitspersample)
-#endif
+	/*
+	 * Kept in locals, the byte stores below could alias the resampler
+	 * state. No division per frame either, down is split into whole
+	 * frames and a remainder.
+	 */
+	pos = resampler.pos;
+	phase = resampler.phase;
+	step = resampler.down / resampler.up;
+	rem = resampler.down % resampler.up;
+	while (pos < end)
 	{
-		/* source: 16 bit, dest: 8 bit */
-		if (resample_to_bitspersample == 8)
+		coef = resampler.filter + phase * taps;
+		for (c = 0; c < channels; c++)
 		{
-			for (i = 0; i < outsize; i++)
-			{
-				data[i] = data[i * 2];
-			}
-			outsize /= 2;
+			x = resampler.history[c] + pos + 1 - taps;
+			acc = 1 << (RESAMPLE_SHIFT - 1);
+#ifdef __SSE2__
+			if (taps >= 8)
+				acc += dot_sse2(coef, x, taps);
+			else
+#endif
+				for (j = 0; j < taps; j++)
+					acc += coef[j] * x[j];
+			write_sample(&p, clamp_sample(acc >> RESAMPLE_SHIFT), outwidth, conv->out_be);
+		}
+
+		pos += step;
+		phase += rem;
+		if (phase >= resampler.up)
+		{
+			phase -= resampler.up;
+			pos++;
 		}
 	}
 
-#ifdef B_ENDIAN
-	if (!stream_be)
-		rdpsnd_dsp_swapbytes(data, outsize, format);
+	/* keep the last frames for the start of the next packet */
+	for (c = 0; c < channels; c++)
+		memmove(resampler.history[c], resampler.history[c] + frames,
+			(taps - 1) * sizeof(sint16));
+	resampler.pos = pos - frames;
+	resampler.phase = phase;
+
+	out->p = p;
+}
+
+#endif /* HAVE_LIBSAMPLERATE */
+
+/* False when the device takes the format as it is */
+static RD_BOOL
+resample_needed(RD_WAVEFORMATEX * format)
+{
+	if ((resample_to_bitspersample == format->wBitsPerSample) &&
+	    (resample_to_channels == format->nChannels) &&
+	    (resample_to_srate == format->nSamplesPerSec))
+		return False;
+
+#ifdef HAVE_LIBSAMPLERATE
+	if (src_converter == NULL)
+	{
+		logger(Sound, Warning,
+		       "rdpsndp_dsp_resample_set(), no sample rate converter available");
+		return False;
+	}
 #endif
 
-	return out;
+	return True;
 }
 
-STREAM
-rdpsnd_dsp_process(unsigned char *data, unsigned int size, struct audio_driver * current_driver,
-		   RD_WAVEFORMATEX * format)
+static void
+process_pcm(unsigned char *in, unsigned int size, RD_WAVEFORMATEX * format,
+	    struct dsp_conv *conv, RD_BOOL resampling, STREAM out)
 {
-	STREAM out;
-	RD_BOOL stream_be = False;
+	if (!resampling)
+		convert(in, size, format, conv, out);
+#ifdef HAVE_LIBSAMPLERATE
+	else
+		resample_libsamplerate(in, size, format, conv, out);
+#else
+	else
+		resample_polyphase(in, size, format, conv, out);
+#endif
+}
 
-	/* softvol and byteswap do not change the amount of data they
-	   return, so they can operate on the input-stream */
-	if (current_driver->wave_out_volume == rdpsnd_dsp_softvol_set)
-		rdpsnd_dsp_softvol(data, size, format);
+/*
+ * Everything the device needs is done in a single pass over the data:
+ * volume, channel mixing, resampling and byte order. ADPCM is expanded one
+ * block at a time on the way. out is pointed at a piece of the ring, which
+ * is given back with rdpsnd_dsp_release() once the device is done with it.
+ * False if the ring has no room left for the packet.
+ */
+RD_BOOL
+rdpsnd_dsp_process(unsigned char *data, unsigned int size, struct audio_driver *current_driver,
+		   RD_WAVEFORMATEX * format, STREAM out)
+{
+	struct dsp_conv conv;
+	RD_WAVEFORMATEX pcm;
+	RD_BOOL resampling;
+	unsigned int frames, outsize, rate, blocksize, frame_size;
+
+	rdpsnd_dsp_decode_format(format, &pcm);
+	pcm.nBlockAlign = pcm.nChannels * pcm.wBitsPerSample / 8;
+	if (pcm.nBlockAlign == 0)
+		return False;
 
+	conv.in_be = False;
+	conv.out_be = False;
 #ifdef B_ENDIAN
-	if (current_driver->need_byteswap_on_be)
+	conv.out_be = current_driver->need_byteswap_on_be;
+#endif
+	softvol_factors(&conv, &pcm, current_driver->wave_out_volume == rdpsnd_dsp_softvol_set);
+
+	frames = format_frames(format, &pcm, size);
+	resampling = current_driver->need_resampling && resample_needed(&pcm);
+	if (resampling)
 	{
-		rdpsnd_dsp_swapbytes(data, size, format);
-		stream_be = True;
+		frame_size = resample_to_channels * resample_to_bitspersample / 8;
+		outsize = resample_frames(frames, &pcm) * frame_size;
+		rate = resample_to_srate * frame_size;
+	}
+	else
+	{
+		outsize = frames * pcm.nBlockAlign;
+		rate = pcm.nSamplesPerSec * pcm.nBlockAlign;
 	}
-#endif
 
-	out = NULL;
+	if (!ring_reserve(out, outsize, rate))
+		return False;
 
-	if (current_driver->need_resampling)
-		out = rdpsnd_dsp_resample(data, size, format, stream_be);
+	if (format->wFormatTag == WAVE_FORMAT_PCM)
+	{
+		process_pcm(data, frames * pcm.nBlockAlign, &pcm, &conv, resampling, out);
+		ring_commit(out);
+		return True;
+	}
 
-	if (out == NULL)
+	blocksize = format->nBlockAlign;
+	if (dsp.block_size < adpcm_block_frames(format, blocksize) * pcm.nBlockAlign)
 	{
-		out = s_alloc(size);
-		out_uint8a(out, data, size);
+		dsp.block_size = adpcm_block_frames(format, blocksize) * pcm.nBlockAlign;
+		dsp.block = xrealloc(dsp.block, dsp.block_size);
 	}
 
-	s_mark_end(out);
-	s_seek(out, 0);
+	while (size > 0)
+	{
+		/* a short final block is decoded as far as it goes */
+		frames = adpcm_block_frames(format, MIN(size, blocksize));
+		if (frames == 0)
+		{
+			logger(Sound, Warning,
+			       "rdpsnd_dsp_process(), dropping %u bytes of truncated block", size);
+			break;
+		}
 
-	return out;
+		if (format->wFormatTag == WAVE_FORMAT_IMA_ADPCM)
+			ima_adpcm_decode_block(data, frames, format->nChannels, dsp.block);
+		else
+			ms_adpcm_decode_block(data, frames, format, dsp.block);
+		process_pcm(dsp.block, frames * pcm.nBlockAlign, &pcm, &conv, resampling, out);
+
+		data += MIN(size, blocksize);
+		size -= MIN(size, blocksize);
+	}
+
+	ring_commit(out);
+	return True;
 }
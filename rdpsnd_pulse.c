@@ -80,10 +80,6 @@ static int capture_samplewidth;
 static const int playback_latency_part = 10;	// Playback latency (in part of second)
 static const int capture_latency_part = 10;	// Capture latency (in part of second)
 
-/* Capture buffer */
-static void *capture_buf = NULL;
-static size_t capture_buf_size = 0;
-
 static RD_BOOL pulse_init(void);
 static void pulse_deinit(void);
 static RD_BOOL pulse_context_init(void);
@@ -883,12 +879,16 @@ pulse_stream_state_cb(pa_stream * p, void *userdata)
 		pa_threaded_mainloop_signal((pa_threaded_mainloop *) userdata, 0);
 }
 
+/* Captured data goes straight to rdpeai's ring, the main loop is only woken to send it */
 static void
 pulse_read_cb(pa_stream * p, size_t nbytes, void *userdata)
 {
 	assert(userdata != NULL);
 
-	pulse_send_msg(pulse_ctl[1], RDPSND_PULSE_IN_AVAIL);
+	if (pulse_record() != True)
+		pulse_send_msg(pulse_ctl[1], RDPSND_PULSE_IN_ERR);
+	else
+		pulse_send_msg(pulse_ctl[1], RDPSND_PULSE_IN_AVAIL);
 }
 
 static void
@@ -1015,13 +1015,7 @@ pulse_check_fds(fd_set * rfds, fd_set * wfds)
 							}
 						break;
 					case RDPSND_PULSE_IN_AVAIL:
-						if (pulse_record() != True)
-							if (pulse_recover(&capture_stream) != True)
-							{
-								logger(Sound, Error,
-								       "pulse_check_fds(), PulseAudio capture error");
-								return;
-							}
+						/* already recorded, rdpsnd_check_fds() sends it */
 						break;
 					case RDPSND_PULSE_OUT_ERR:
 						if (pulse_recover(&playback_stream) != True)
@@ -1317,62 +1311,42 @@ pulse_set_format_in(RD_WAVEFORMATEX * pwfx)
 	return True;
 }
 
+/* Called in the audio thread, with the mainloop locked */
 RD_BOOL
 pulse_record(void)
 {
 	const void *pulse_buf;
 	size_t audio_size;
-	RD_BOOL result = False;
 
 
 	if (capture_stream == NULL)
 		return False;
 
-	pa_threaded_mainloop_lock(mainloop);
-
-	do
+	while (pa_stream_readable_size(capture_stream) > 0)
 	{
 		if (pa_stream_peek(capture_stream, &pulse_buf, &audio_size) != 0)
 		{
 			logger(Sound, Error, "pulse_record(), pa_stream_peek: %s",
 			       pa_strerror(pa_context_errno(context)));
-			break;
+			return False;
 		}
 
-		/* Stretch the buffer, if needed */
-		if (capture_buf_size < audio_size)
-		{
-			capture_buf_size = audio_size;
-			if (capture_buf != NULL)
-				free(capture_buf);
-			capture_buf = malloc(capture_buf_size);
-			if (capture_buf == NULL)
-			{
-				logger(Sound, Error, "pulse_record(), malloc error");
-				capture_buf_size = 0;
-				break;
-			}
-		}
+		if (audio_size == 0)
+			break;
 
-		memcpy(capture_buf, pulse_buf, audio_size);
+		/* a NULL buffer is a hole in the stream, just skip it */
+		if (pulse_buf != NULL)
+			rdpsnd_record(pulse_buf, audio_size);
 
 		if (pa_stream_drop(capture_stream) != 0)
 		{
 			logger(Sound, Error, "pulse_record(), pa_stream_drop: %s",
 			       pa_strerror(pa_context_errno(context)));
-			break;
+			return False;
 		}
-
-		result = True;
 	}
-	while (0);
-
-	pa_threaded_mainloop_unlock(mainloop);
 
-	if (result == True)
-		rdpsnd_record(capture_buf, audio_size);
-
-	return result;
+	return True;
 }
 
 static RD_BOOL
@@ -70,21 +70,40 @@ static uint32 curEpoch = 0, curDevice = 0, curId = 0, curBytesOut = 0;
 static PSCNameMapRec nameMapList = NULL;
 static int nameMapCount = 0;
 
-static pthread_t queueHandler;
+/* Requests are run by a pool of workers, started as needed. Requests on the
+   same context run one at a time and in order, so a blocking call only holds
+   up its own context. */
+#define SCARD_MAX_WORKERS	32
+#define SCARD_IDLE_WORKERS	4	/* idle workers kept, the rest exit */
+
 static pthread_mutex_t queueAccess;
 static pthread_cond_t queueEmpty;
 static pthread_mutex_t hcardAccess;
-
-static PMEM_HANDLE threadListHandle = NULL;
-static PThreadListElement threadList = NULL;
-
+/* Also used by scard_release_all_contexts(), without any device */
+static pthread_mutex_t handleAccess = PTHREAD_MUTEX_INITIALIZER;
 
 static PSCThreadData queueFirst = NULL, queueLast = NULL;
-static int threadCount = 0;
+static int workerCount = 0, workerIdle = 0;
+/* Worker slots in use, and the context of the request each worker runs, 0 if none */
+static RD_BOOL workerRunning[SCARD_MAX_WORKERS];
+static SERVER_SCARDCONTEXT workerContext[SCARD_MAX_WORKERS];
 
 static PSCHCardRec hcardFirst = NULL;
 
-static void *queue_handler_function(void *data);
+/* Reader states, kept up to date by a watcher thread with its own context,
+   for answering polls without asking pcscd */
+#define SCARD_PNP_READER	"\\\\?PnP?\\Notification"
+#define SCARD_WATCH_RETRY	2	/* seconds before retrying after an error */
+#define SCARD_WATCH_RELIST	2000	/* ms between reader lists without PnP */
+#define SCARD_STATE_MASK	(SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE | \
+				 SCARD_STATE_EMPTY | SCARD_STATE_PRESENT | SCARD_STATE_EXCLUSIVE | \
+				 SCARD_STATE_INUSE | SCARD_STATE_MUTE | SCARD_STATE_UNPOWERED)
+
+static pthread_mutex_t readerCacheAccess = PTHREAD_MUTEX_INITIALIZER;
+static RD_BOOL readerCacheStarted = False;
+static RD_BOOL readerCacheValid = False;
+static PSCReaderCacheRec readerCache = NULL;
+static unsigned int readerCacheCount = 0;
 
 /* code segment */
 
@@ -189,14 +208,6 @@ scard_enum_devices(uint32 * id, char *optarg)
 		return 0;
 	}
 
-	if (0 !=
-	    pthread_create(&queueHandler, NULL, (void *(*)(void *)) queue_handler_function, NULL))
-	{
-		logger(SmartCard, Error,
-		       "scard_enum_devices(), can't create queue handling thread");
-		return 0;
-	}
-
 	strncpy(g_rdpdr_device[*id].name, "SCARD\0\0\0", 8);
 	toupper_str(g_rdpdr_device[*id].name);
 	g_rdpdr_device[*id].local_path = "/dev/scard";
@@ -280,22 +291,40 @@ static void _scard_handle_list_remove(long handle);
 static uint32_t _scard_handle_list_get_server_handle(long handle);
 static long _scard_handle_list_get_pcsc_handle(uint32_t server);
 
+/* Workers use the list concurrently, so these take handleAccess */
+
+static long
+_scard_handle_list_lookup(uint32_t server)
+{
+	_scard_handle_list_t *item;
+	item = g_scard_handle_list;
+	while (item)
+	{
+		if (item->server == server)
+			return item->handle;
+		item = item->next;
+	}
+	return 0;
+}
+
 void
 _scard_handle_list_add(long handle)
 {
-	_scard_handle_list_t *list = g_scard_handle_list;
-	/* we don't care of order of list so to simplify the add 
-	   we add new items to front of list */
 	_scard_handle_list_t *item = xmalloc(sizeof(_scard_handle_list_t));
-	item->next = list;
 	item->handle = handle;
 
+	pthread_mutex_lock(&handleAccess);
+
+	/* we don't care of order of list so to simplify the add 
+	   we add new items to front of list */
+	item->next = g_scard_handle_list;
+
 	/* lookup first unused handle id */
 	int overlap = 0;
 	if (g_scard_handle_counter == 0)
 		g_scard_handle_counter++;
 
-	while (_scard_handle_list_get_pcsc_handle(g_scard_handle_counter))
+	while (_scard_handle_list_lookup(g_scard_handle_counter))
 	{
 		g_scard_handle_counter++;
 
@@ -313,14 +342,19 @@ _scard_handle_list_add(long handle)
 
 	item->server = g_scard_handle_counter;
 	g_scard_handle_list = item;
+
+	pthread_mutex_unlock(&handleAccess);
 }
 
 void
 _scard_handle_list_remove(long handle)
 {
-	_scard_handle_list_t *item, *list, *prev_item;
+	_scard_handle_list_t *item, *prev_item;
+
+	pthread_mutex_lock(&handleAccess);
+
 	prev_item = NULL;
-	item = list = g_scard_handle_list;
+	item = g_scard_handle_list;
 
 	while (item)
 	{
@@ -340,34 +374,42 @@ _scard_handle_list_remove(long handle)
 		prev_item = item;
 		item = item->next;
 	}
+
+	pthread_mutex_unlock(&handleAccess);
 }
 
 uint32_t
 _scard_handle_list_get_server_handle(long handle)
 {
 	_scard_handle_list_t *item;
+	uint32_t server = 0;
+
+	pthread_mutex_lock(&handleAccess);
 	item = g_scard_handle_list;
 	while (item)
 	{
 		if (item->handle == handle)
-			return item->server;
+		{
+			server = item->server;
+			break;
+		}
 		item = item->next;
 	}
-	return 0;
+	pthread_mutex_unlock(&handleAccess);
+
+	return server;
 }
 
 long
 _scard_handle_list_get_pcsc_handle(uint32_t server)
 {
-	_scard_handle_list_t *item;
-	item = g_scard_handle_list;
-	while (item)
-	{
-		if (item->server == server)
-			return item->handle;
-		item = item->next;
-	}
-	return 0;
+	long handle;
+
+	pthread_mutex_lock(&handleAccess);
+	handle = _scard_handle_list_lookup(server);
+	pthread_mutex_unlock(&handleAccess);
+
+	return handle;
 }
 
 static void *
@@ -1156,6 +1198,231 @@ copyReaderState_ServerToMyPCSC(SERVER_LPSCARD_READERSTATE_A src, MYPCSC_LPSCARD_
 	}
 }
 
+/* Replaces the cached states with what the watcher got from pcscd. An
+   empty list of readers is valid too. */
+static void
+SC_readerCacheUpdate(MYPCSC_LPSCARD_READERSTATE_A states, unsigned int count, RD_BOOL valid)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&readerCacheAccess);
+
+	for (i = 0; i < readerCacheCount; i++)
+		xfree(readerCache[i].name);
+	xfree(readerCache);
+	readerCache = NULL;
+	readerCacheCount = 0;
+	readerCacheValid = valid;
+
+	if (valid && count > 0)
+	{
+		readerCache = xmalloc(count * sizeof(TSCReaderCacheRec));
+		for (i = 0; i < count; i++)
+		{
+			readerCache[i].name = xstrdup(states[i].szReader);
+			readerCache[i].state = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+			readerCache[i].cbAtr = MIN(states[i].cbAtr, MAX_ATR_SIZE);
+			memcpy(readerCache[i].rgbAtr, states[i].rgbAtr, readerCache[i].cbAtr);
+		}
+		readerCacheCount = count;
+	}
+
+	pthread_mutex_unlock(&readerCacheAccess);
+}
+
+/* Waits for changes of any reader on its own context, and updates the cache.
+   Lists the readers again when one comes or goes. */
+static void *
+SC_readerWatcher(void *arg)
+{
+	UNUSED(arg);
+	MYPCSC_SCARDCONTEXT hContext;
+	MYPCSC_LPSCARD_READERSTATE_A states;
+	MYPCSC_DWORD rv, readersLength, timeout;
+	unsigned int i, count, waitCount;
+	char *readers, *name;
+	RD_BOOL relist, established;
+
+	while (1)
+	{
+		hContext = 0;
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hContext);
+		established = (rv == SCARD_S_SUCCESS);
+		while (rv == SCARD_S_SUCCESS)
+		{
+			readers = NULL;
+			readersLength = 0;
+			rv = SCardListReaders(hContext, NULL, NULL, &readersLength);
+			if (rv == SCARD_S_SUCCESS)
+			{
+				readers = xmalloc(readersLength);
+				rv = SCardListReaders(hContext, NULL, readers, &readersLength);
+			}
+			if (rv == (MYPCSC_DWORD) SCARD_E_NO_READERS_AVAILABLE)
+			{
+				readersLength = 0;
+				rv = SCARD_S_SUCCESS;
+			}
+			if (rv != SCARD_S_SUCCESS)
+			{
+				xfree(readers);
+				break;
+			}
+
+			count = 0;
+			for (name = readers; name && name < readers + readersLength && *name;
+			     name += strlen(name) + 1)
+				count++;
+
+			/* and the PnP reader, to hear of new readers */
+			states = xmalloc((count + 1) * sizeof(MYPCSC_SCARD_READERSTATE_A));
+			memset(states, 0, (count + 1) * sizeof(MYPCSC_SCARD_READERSTATE_A));
+			for (i = 0, name = readers; i < count; i++, name += strlen(name) + 1)
+				states[i].szReader = name;
+			states[count].szReader = SCARD_PNP_READER;
+#if WITH_PNP_NOTIFICATIONS
+			waitCount = count + 1;
+			timeout = INFINITE;
+#else
+			waitCount = count;
+			timeout = SCARD_WATCH_RELIST;
+#endif
+
+			logger(SmartCard, Debug, "SC_readerWatcher(), watching %u readers", count);
+
+			/* the first call returns right away, all states are unaware */
+			relist = False;
+			while (!relist)
+			{
+				if (waitCount == 0)
+				{
+					/* nothing to wait on */
+					usleep(SCARD_WATCH_RELIST * 1000);
+					rv = SCARD_E_TIMEOUT;
+				}
+				else
+					rv = SCardGetStatusChange(hContext, timeout, states,
+								  waitCount);
+				if (rv == (MYPCSC_DWORD) SCARD_E_TIMEOUT && waitCount == count)
+				{
+					relist = True;
+					rv = SCARD_S_SUCCESS;
+				}
+				if (rv != SCARD_S_SUCCESS)
+					break;
+
+				SC_readerCacheUpdate(states, count, True);
+
+				for (i = 0; i < waitCount; i++)
+				{
+					if ((i == count && (states[i].dwEventState & SCARD_STATE_CHANGED)
+					     && states[i].dwCurrentState != SCARD_STATE_UNAWARE)
+					    || (states[i].dwEventState & SCARD_STATE_UNKNOWN))
+						relist = True;
+					states[i].dwCurrentState =
+						states[i].dwEventState & ~SCARD_STATE_CHANGED;
+				}
+			}
+
+			xfree(states);
+			xfree(readers);
+		}
+
+		logger(SmartCard, Debug, "SC_readerWatcher(), pcscd unavailable: %s (0x%08x)",
+		       pcsc_stringify_error(rv), (unsigned int) rv);
+		SC_readerCacheUpdate(NULL, 0, False);
+		if (established)
+			SCardReleaseContext(hContext);
+		sleep(SCARD_WATCH_RETRY);
+	}
+
+	return NULL;
+}
+
+/* Answers a poll from the cached reader states. Returns False if the cache
+   can't, and pcscd has to be asked. */
+static RD_BOOL
+SC_readerCacheLookup(MYPCSC_LPSCARD_READERSTATE_A states, SERVER_DWORD count,
+		     MYPCSC_DWORD * rv)
+{
+	MYPCSC_LPSCARD_READERSTATE_A cur;
+	PSCReaderCacheRec cached;
+	pthread_t thread;
+	MYPCSC_DWORD current, event;
+	unsigned int i, j, changed;
+
+	pthread_mutex_lock(&readerCacheAccess);
+
+	if (!readerCacheStarted)
+	{
+		/* from the first poll on */
+		readerCacheStarted = True;
+		if (pthread_create(&thread, NULL, SC_readerWatcher, NULL) != 0)
+			logger(SmartCard, Warning,
+			       "SC_readerCacheLookup(), pthread_create() failed, not caching");
+		else
+			pthread_detach(thread);
+	}
+
+	if (!readerCacheValid)
+	{
+		pthread_mutex_unlock(&readerCacheAccess);
+		return False;
+	}
+
+	/* compared like pcsc-lite does */
+	changed = 0;
+	for (i = 0, cur = states; i < count; i++, cur++)
+	{
+		current = cur->dwCurrentState;
+
+		if (current & SCARD_STATE_IGNORE)
+		{
+			cur->dwEventState = SCARD_STATE_IGNORE;
+			continue;
+		}
+
+		if (cur->szReader == NULL)
+			break;
+
+		if (strcmp(cur->szReader, SCARD_PNP_READER) == 0)
+		{
+			event = readerCacheCount << 16;
+			if ((current >> 16) != readerCacheCount)
+				event |= SCARD_STATE_CHANGED;
+		}
+		else
+		{
+			cached = NULL;
+			for (j = 0; j < readerCacheCount; j++)
+				if (strcmp(readerCache[j].name, cur->szReader) == 0)
+					cached = &readerCache[j];
+			if (cached == NULL)
+				break;
+
+			event = cached->state;
+			cur->cbAtr = cached->cbAtr;
+			memcpy(cur->rgbAtr, cached->rgbAtr, cached->cbAtr);
+
+			if ((current & SCARD_STATE_MASK) != (event & SCARD_STATE_MASK)
+			    || ((current >> 16) != 0 && (current >> 16) != (event >> 16)))
+				event |= SCARD_STATE_CHANGED;
+		}
+
+		if (event & SCARD_STATE_CHANGED)
+			changed++;
+		cur->dwEventState = event;
+	}
+
+	pthread_mutex_unlock(&readerCacheAccess);
+
+	/* a reader we don't know */
+	if (i < count)
+		return False;
+
+	*rv = changed ? SCARD_S_SUCCESS : (MYPCSC_DWORD) SCARD_E_TIMEOUT;
+	return True;
+}
 
 static MYPCSC_DWORD
 TS_SCardGetStatusChange(STREAM in, STREAM out, RD_BOOL wide)
@@ -1213,7 +1480,7 @@ TS_SCardGetStatusChange(STREAM in, STREAM out, RD_BOOL wide)
 						 dataLength, wide));
 
 #if !WITH_PNP_NOTIFICATIONS
-				if (strcmp(cur->szReader, "\\\\?PnP?\\Notification") == 0)
+				if (strcmp(cur->szReader, SCARD_PNP_READER) == 0)
 					cur->dwCurrentState |= SCARD_STATE_IGNORE;
 #endif
 			}
@@ -1235,13 +1502,22 @@ TS_SCardGetStatusChange(STREAM in, STREAM out, RD_BOOL wide)
 	memset(myRsArray, 0, dwCount * sizeof(SERVER_SCARD_READERSTATE_A));
 	copyReaderState_ServerToMyPCSC(rsArray, myRsArray, (SERVER_DWORD) dwCount);
 
-	/* Workaround for a bug in pcsc-lite, timeout value of 0 is handled as INFINIT
-	   but is by Windows PCSC spec. used for polling current state.
-	 */
-	if (dwTimeout == 0)
-		dwTimeout = 1;
-	rv = SCardGetStatusChange(myHContext, (MYPCSC_DWORD) dwTimeout,
-				  myRsArray, (MYPCSC_DWORD) dwCount);
+	/* Polls are answered from the reader cache when it can */
+	if (dwTimeout == 0 && myHContext && dwCount > 0
+	    && SC_readerCacheLookup(myRsArray, dwCount, &rv))
+	{
+		logger(SmartCard, Debug, "TS_SCardGetStatusChange(), answered from cache");
+	}
+	else
+	{
+		/* Workaround for a bug in pcsc-lite, timeout value of 0 is handled as INFINIT
+		   but is by Windows PCSC spec. used for polling current state.
+		 */
+		if (dwTimeout == 0)
+			dwTimeout = 1;
+		rv = SCardGetStatusChange(myHContext, (MYPCSC_DWORD) dwTimeout,
+					  myRsArray, (MYPCSC_DWORD) dwCount);
+	}
 	copyReaderState_MyPCSCToServer(myRsArray, rsArray, (MYPCSC_DWORD) dwCount);
 
 	logger(SmartCard, Debug,
@@ -2513,11 +2789,143 @@ freeStream(PMEM_HANDLE * handle, STREAM s)
 }
 #endif
 
+/* Where the server's handle for the context is in each request, see
+   MS-RDPESC 2.2.2. The context is the first deferred pointer, so it comes
+   before the card handle and any pioSendPci extra bytes. Requests not
+   listed run without ordering. */
+static const struct
+{
+	uint32 request;
+	uint32 offset;
+} contextOffsets[] = {
+	{SC_RELEASE_CONTEXT, 0x1C},
+	{SC_IS_VALID_CONTEXT, 0x1C},
+	{SC_LIST_READERS, 0x2C},
+	{SC_LIST_READERS + 4, 0x2C},
+	{SC_RECONNECT, 0x30},
+	{SC_DISCONNECT, 0x28},
+	{SC_GET_STATUS_CHANGE, 0x28},
+	{SC_GET_STATUS_CHANGE + 4, 0x28},
+	{SC_LOCATE_CARDS_BY_ATR, 0x2C},
+	{SC_LOCATE_CARDS_BY_ATR + 4, 0x2C},
+	{SC_BEGIN_TRANSACTION, 0x28},
+	{SC_END_TRANSACTION, 0x28},
+	{SC_STATE, 0x2C},
+	{SC_STATUS, 0x30},
+	{SC_STATUS + 4, 0x30},
+	{SC_TRANSMIT, 0x44},
+	{SC_CONTROL, 0x38},
+	{SC_GETATTRIB, 0x30}
+};
+
+/* SCardCancel is not listed, it has to overtake the call it cancels */
+static SERVER_SCARDCONTEXT
+SC_requestContext(uint32 request, STREAM in)
+{
+	SERVER_SCARDCONTEXT hContext;
+	SERVER_DWORD cbContext, pbContext, len;
+	struct stream peek;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(contextOffsets) / sizeof(contextOffsets[0]); i++)
+	{
+		if (contextOffsets[i].request != request)
+			continue;
+
+		peek = *in;
+		if (!s_check_rem(&peek, contextOffsets[i].offset + 4))
+			return 0;
+
+		/* the REDIR_SCARDCONTEXT every request starts with */
+		in_uint8s(&peek, 0x10);
+		in_uint32_le(&peek, cbContext);
+		in_uint32_le(&peek, pbContext);
+		if (pbContext == 0)
+			return 0;
+
+		/* its deferred data must be what sits at the offset */
+		in_uint8s(&peek, contextOffsets[i].offset - 0x1C);
+		in_uint32_le(&peek, len);
+		in_uint32_le(&peek, hContext);
+		if (len != cbContext || (len != 4 && len != 8))
+		{
+			logger(SmartCard, Warning,
+			       "SC_requestContext(), no context at offset 0x%x in request 0x%08x",
+			       (unsigned) contextOffsets[i].offset, (unsigned) request);
+			return 0;
+		}
+		return hContext;
+	}
+
+	return 0;
+}
+
+/* Returns True if nothing on the same context is running or queued before
+   data. Needs queueAccess. */
+static RD_BOOL
+SC_isRunnable(PSCThreadData data)
+{
+	PSCThreadData cur;
+	int i;
+
+	if (data->context == 0)
+		return True;
+
+	for (i = 0; i < SCARD_MAX_WORKERS; i++)
+		if (workerContext[i] == data->context)
+			return False;
+
+	for (cur = queueFirst; cur != data; cur = cur->next)
+		if (cur->context == data->context)
+			return False;
+
+	return True;
+}
+
+static void *SC_worker(void *arg);
+
+/* Starts another worker if there is more runnable work than idle workers.
+   Needs queueAccess. */
+static void
+SC_startWorkers(void)
+{
+	PSCThreadData cur;
+	pthread_t thread;
+	int runnable, i;
+
+	runnable = 0;
+	for (cur = queueFirst; cur != NULL; cur = cur->next)
+		if (SC_isRunnable(cur))
+			runnable++;
+
+	for (i = 0; runnable > workerIdle && i < SCARD_MAX_WORKERS; i++)
+	{
+		if (workerRunning[i])
+			continue;
+
+		workerContext[i] = 0;
+		if (pthread_create(&thread, NULL, SC_worker, (void *) (intptr_t) i) != 0)
+		{
+			logger(SmartCard, Error, "SC_startWorkers(), pthread_create() failed");
+			break;
+		}
+		pthread_detach(thread);
+		workerRunning[i] = True;
+		workerCount++;
+		runnable--;
+	}
+
+	if (runnable > workerIdle)
+		logger(SmartCard, Warning,
+		       "SC_startWorkers(), all %d workers busy, request delayed", workerCount);
+}
+
 static PSCThreadData
 SC_addToQueue(RD_NTHANDLE handle, uint32 request, STREAM in, STREAM out)
 {
 	PMEM_HANDLE lcHandle = NULL;
 	PSCThreadData data = SC_xmalloc(&lcHandle, sizeof(TSCThreadData));
+	long hContext;
 
 	if (!data)
 		return NULL;
@@ -2544,8 +2952,18 @@ SC_addToQueue(RD_NTHANDLE handle, uint32 request, STREAM in, STREAM out)
 			SC_xfreeallmemory(&(data->memHandle));
 			return NULL;
 		}
+		data->context = SC_requestContext(request, data->in);
 		data->next = NULL;
 
+		/* Releasing a context ends the calls on it, and must not wait
+		   behind a status change that may never come */
+		if (request == SC_RELEASE_CONTEXT)
+		{
+			hContext = _scard_handle_list_get_pcsc_handle(data->context);
+			if (hContext)
+				SCardCancel(hContext);
+		}
+
 		pthread_mutex_lock(&queueAccess);
 
 		if (queueLast)
@@ -2554,6 +2972,7 @@ SC_addToQueue(RD_NTHANDLE handle, uint32 request, STREAM in, STREAM out)
 		if (!queueFirst)
 			queueFirst = data;
 
+		SC_startWorkers();
 		pthread_cond_broadcast(&queueEmpty);
 		pthread_mutex_unlock(&queueAccess);
 	}
@@ -2570,25 +2989,31 @@ SC_destroyThreadData(PSCThreadData data)
 	}
 }
 
+/* Takes the first request that can run now off the queue, NULL if there is
+   none. Needs queueAccess. */
 static PSCThreadData
 SC_getNextInQueue()
 {
-	PSCThreadData Result = NULL;
-
-	pthread_mutex_lock(&queueAccess);
+	PSCThreadData Result, prev;
 
-	while (queueFirst == NULL)
-		pthread_cond_wait(&queueEmpty, &queueAccess);
-
-	Result = queueFirst;
-	queueFirst = queueFirst->next;
-	if (!queueFirst)
+	prev = NULL;
+	for (Result = queueFirst; Result != NULL; Result = Result->next)
 	{
-		queueLast = NULL;
+		if (SC_isRunnable(Result))
+			break;
+		prev = Result;
 	}
-	Result->next = NULL;
 
-	pthread_mutex_unlock(&queueAccess);
+	if (Result == NULL)
+		return NULL;
+
+	if (prev)
+		prev->next = Result->next;
+	else
+		queueFirst = Result->next;
+	if (queueLast == Result)
+		queueLast = prev;
+	Result->next = NULL;
 
 	return Result;
 }
@@ -2615,97 +3040,41 @@ SC_deviceControl(PSCThreadData data)
 	SC_destroyThreadData(data);
 }
 
-
 static void *
-thread_function(PThreadListElement listElement)
-{
-	pthread_mutex_lock(&listElement->busy);
-	while (1)
-	{
-		while (listElement->data == NULL)
-			pthread_cond_wait(&listElement->nodata, &listElement->busy);
-
-		SC_deviceControl(listElement->data);
-		listElement->data = NULL;
-	}
-	pthread_mutex_unlock(&listElement->busy);
-
-	pthread_exit(NULL);
-	return NULL;
-}
-
-static void
-SC_handleRequest(PSCThreadData data)
+SC_worker(void *arg)
 {
-	int Result = 0;
-	PThreadListElement cur;
+	int id = (int) (intptr_t) arg;
+	PSCThreadData data;
 
-	for (cur = threadList; cur != NULL; cur = cur->next)
+	pthread_mutex_lock(&queueAccess);
+	while (1)
 	{
-		if (cur->data == NULL)
+		data = SC_getNextInQueue();
+		if (data == NULL)
 		{
-			pthread_mutex_lock(&cur->busy);
-			/* double check with lock held.... */
-			if (cur->data != NULL)
-			{
-				pthread_mutex_unlock(&cur->busy);
-				continue;
-			}
+			/* a burst of requests leaves no more than a few workers behind */
+			if (workerIdle >= SCARD_IDLE_WORKERS)
+				break;
 
-			/* Wake up thread */
-			cur->data = data;
-			pthread_cond_broadcast(&cur->nodata);
-			pthread_mutex_unlock(&cur->busy);
-			return;
+			workerIdle++;
+			pthread_cond_wait(&queueEmpty, &queueAccess);
+			workerIdle--;
+			continue;
 		}
-	}
 
-	cur = SC_xmalloc(&threadListHandle, sizeof(TThreadListElement));
-	if (!cur)
-		return;
-
-	threadCount++;
+		workerContext[id] = data->context;
+		pthread_mutex_unlock(&queueAccess);
 
-	pthread_mutex_init(&cur->busy, NULL);
-	pthread_cond_init(&cur->nodata, NULL);
-	cur->data = data;
+		SC_deviceControl(data);
 
-	Result = pthread_create(&cur->thread, NULL, (void *(*)(void *)) thread_function, cur);
-	if (0 != Result)
-	{
-		logger(SmartCard, Debug, "SC_handleRequest(), pthread_create() failed with 0x%.8x",
-		       Result);
-		SC_xfree(&threadListHandle, cur);
-		SC_destroyThreadData(data);
-		data = NULL;
+		pthread_mutex_lock(&queueAccess);
+		workerContext[id] = 0;
 	}
-	cur->next = threadList;
-	threadList = cur;
-}
 
-static void *
-queue_handler_function(void *data)
-{
-	UNUSED(data);
-	PSCThreadData cur_data = NULL;
-	while (1)
-	{
-		cur_data = SC_getNextInQueue();
-		switch (cur_data->request)
-		{
-			case SC_ESTABLISH_CONTEXT:
-			case SC_RELEASE_CONTEXT:
-				{
-					SC_deviceControl(cur_data);
-					break;
-				}
-			default:
-				{
-					SC_handleRequest(cur_data);
-					break;
-				}
-		}
-	}
+	workerRunning[id] = False;
+	workerCount--;
+	pthread_mutex_unlock(&queueAccess);
+
 	return NULL;
 }
 
@@ -2772,7 +3141,10 @@ scard_release_all_contexts(void)
 {
 	_scard_handle_list_t *item, *next;
 
+	pthread_mutex_lock(&handleAccess);
 	item = g_scard_handle_list;
+	g_scard_handle_list = NULL;
+	pthread_mutex_unlock(&handleAccess);
 
 	while (item)
 	{
@@ -2785,6 +3157,4 @@ scard_release_all_contexts(void)
 		xfree(item);
 		item = next;
 	}
-
-	g_scard_handle_list = NULL;
 }
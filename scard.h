@@ -151,6 +151,14 @@ typedef struct _TSCHCardRec
 	struct _TSCHCardRec *prev;
 } TSCHCardRec, *PSCHCardRec;
 
+typedef struct _TSCReaderCacheRec
+{
+	char *name;
+	SERVER_DWORD state;
+	SERVER_DWORD cbAtr;
+	unsigned char rgbAtr[MAX_ATR_SIZE];
+} TSCReaderCacheRec, *PSCReaderCacheRec;
+
 typedef struct _TSCThreadData
 {
 	uint32 device;
@@ -161,15 +169,8 @@ typedef struct _TSCThreadData
 	uint32 request;
 	STREAM in;
 	STREAM out;
+	/* Requests on the same context run in order, 0 for no ordering */
+	SERVER_SCARDCONTEXT context;
 	PMEM_HANDLE memHandle;
 	struct _TSCThreadData *next;
 } TSCThreadData, *PSCThreadData;
-
-typedef struct _TThreadListElement
-{
-	pthread_t thread;
-	pthread_mutex_t busy;
-	pthread_cond_t nodata;
-	PSCThreadData data;
-	struct _TThreadListElement *next;
-} TThreadListElement, *PThreadListElement;
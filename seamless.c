@@ -27,8 +27,42 @@ extern RD_BOOL g_seamless_rdp;
 static VCHANNEL *seamless_channel;
 static unsigned int seamless_serial;
 static char *seamless_rest = NULL;
+static size_t seamless_rest_len, seamless_rest_size;
 static char icon_buf[1024];
 
+#define SEAMLESS_PENDING_WINDOWS	16
+#define SEAMLESS_PENDING_ZCHANGES	16
+
+#define SEAMLESS_PENDING_STATE		0x01
+#define SEAMLESS_PENDING_POSITION	0x02
+#define SEAMLESS_PENDING_TITLE		0x04
+
+/* Latest state, position and title of a window, applied at the end of the
+   packet. The title points into the packet or into seamless_rest. */
+typedef struct
+{
+	unsigned long id;
+	unsigned int pending;
+	unsigned int state;
+	unsigned long state_flags;
+	int x, y, width, height;
+	unsigned long position_flags;
+	const char *title;
+	unsigned long title_flags;
+} seamless_update;
+
+typedef struct
+{
+	unsigned long id;
+	unsigned long behind;
+	unsigned long flags;
+} seamless_zchange;
+
+static seamless_update seamless_updates[SEAMLESS_PENDING_WINDOWS];
+static int seamless_num_updates;
+static seamless_zchange seamless_zchanges[SEAMLESS_PENDING_ZCHANGES];
+static int seamless_num_zchanges;
+
 static char *
 seamless_get_token(char **s)
 {
@@ -52,18 +86,120 @@ seamless_get_token(char **s)
 	return head;
 }
 
+/* Put back the commas seamless_get_token() cut out of line */
+static void
+seamless_untokenize(char *line, const char *end)
+{
+	for (; line < end; line++)
+	{
+		if (*line == '\0')
+			*line = ',';
+	}
+}
+
+static void
+seamless_apply_update(seamless_update * u)
+{
+	if (u->pending & SEAMLESS_PENDING_STATE)
+		ui_seamless_setstate(u->id, u->state, u->state_flags);
+	if (u->pending & SEAMLESS_PENDING_POSITION)
+		ui_seamless_move_window(u->id, u->x, u->y, u->width, u->height,
+					u->position_flags);
+	if (u->pending & SEAMLESS_PENDING_TITLE)
+		ui_seamless_settitle(u->id, u->title, u->title_flags);
+	u->pending = 0;
+}
+
+/* Apply everything held back, window updates first and then the
+   restacking in the order it arrived */
+static void
+seamless_flush(void)
+{
+	int i;
+
+	for (i = 0; i < seamless_num_updates; i++)
+		seamless_apply_update(&seamless_updates[i]);
+	seamless_num_updates = 0;
+
+	for (i = 0; i < seamless_num_zchanges; i++)
+		ui_seamless_restack_window(seamless_zchanges[i].id, seamless_zchanges[i].behind,
+					   seamless_zchanges[i].flags);
+	seamless_num_zchanges = 0;
+}
+
+static seamless_update *
+seamless_get_update(unsigned long id)
+{
+	seamless_update *u;
+	int i;
+
+	for (i = 0; i < seamless_num_updates; i++)
+	{
+		if (seamless_updates[i].id == id)
+			return &seamless_updates[i];
+	}
+
+	if (seamless_num_updates == SEAMLESS_PENDING_WINDOWS)
+		seamless_flush();
+
+	u = &seamless_updates[seamless_num_updates++];
+	u->id = id;
+	u->pending = 0;
+	return u;
+}
+
+/* A window's earlier restack is dropped unless a later one was placed
+   behind that window, as only then did its position in between matter */
+static void
+seamless_queue_zchange(unsigned long id, unsigned long behind, unsigned long flags)
+{
+	seamless_zchange *z;
+	int i, j;
+
+	for (i = seamless_num_zchanges - 1; i >= 0; i--)
+	{
+		if (seamless_zchanges[i].id == id)
+			break;
+	}
+
+	if (i >= 0)
+	{
+		for (j = i + 1; j < seamless_num_zchanges; j++)
+		{
+			if (seamless_zchanges[j].behind == id)
+				break;
+		}
+
+		if (j == seamless_num_zchanges)
+		{
+			memmove(&seamless_zchanges[i], &seamless_zchanges[i + 1],
+				(seamless_num_zchanges - i - 1) * sizeof(seamless_zchange));
+			seamless_num_zchanges--;
+		}
+	}
+
+	if (seamless_num_zchanges == SEAMLESS_PENDING_ZCHANGES)
+		seamless_flush();
+
+	z = &seamless_zchanges[seamless_num_zchanges++];
+	z->id = id;
+	z->behind = behind;
+	z->flags = flags;
+}
 
+/* Parse line in place, cutting it up at the commas. Window state, position,
+   title and stacking are held back until seamless_flush(), everything else
+   is handled after what came before it. */
 static RD_BOOL
-seamless_process_line(const char *line, void *data)
+seamless_process_line(char *line, char *end)
 {
-	UNUSED(data);
-	char *p, *l;
+	char *p;
 	char *tok1, *tok3, *tok4, *tok5, *tok6, *tok7, *tok8;
 	unsigned long id, flags;
 	char *endptr;
+	seamless_update *u;
 
-	l = xstrdup(line);
-	p = l;
+	p = line;
 
 	logger(Core, Debug, "seamless_process_line(), got '%s'", p);
 
@@ -76,6 +212,10 @@ seamless_process_line(const char *line, void *data)
 	tok7 = seamless_get_token(&p);
 	tok8 = seamless_get_token(&p);
 
+	if (strcmp("POSITION", tok1) && strcmp("STATE", tok1) && strcmp("ZCHANGE", tok1)
+	    && strcmp("TITLE", tok1) && strcmp("DEBUG", tok1))
+		seamless_flush();
+
 	if (!strcmp("CREATE", tok1))
 	{
 		unsigned long group, parent;
@@ -228,12 +368,21 @@ seamless_process_line(const char *line, void *data)
 		if (*endptr)
 			return False;
 
-		ui_seamless_move_window(id, x, y, width, height, flags);
+		u = seamless_get_update(id);
+		u->x = x;
+		u->y = y;
+		u->width = width;
+		u->height = height;
+		u->position_flags = flags;
+		u->pending |= SEAMLESS_PENDING_POSITION;
 	}
 	else if (!strcmp("ZCHANGE", tok1))
 	{
 		unsigned long behind;
 
+		if (!tok5)
+			return False;
+
 		id = strtoul(tok3, &endptr, 0);
 		if (*endptr)
 			return False;
@@ -246,7 +395,7 @@ seamless_process_line(const char *line, void *data)
 		if (*endptr)
 			return False;
 
-		ui_seamless_restack_window(id, behind, flags);
+		seamless_queue_zchange(id, behind, flags);
 	}
 	else if (!strcmp("TITLE", tok1))
 	{
@@ -261,7 +410,10 @@ seamless_process_line(const char *line, void *data)
 		if (*endptr)
 			return False;
 
-		ui_seamless_settitle(id, tok4, flags);
+		u = seamless_get_update(id);
+		u->title = tok4;
+		u->title_flags = flags;
+		u->pending |= SEAMLESS_PENDING_TITLE;
 	}
 	else if (!strcmp("STATE", tok1))
 	{
@@ -282,10 +434,17 @@ seamless_process_line(const char *line, void *data)
 		if (*endptr)
 			return False;
 
-		ui_seamless_setstate(id, state, flags);
+		/* a move before a state change must stay before it */
+		u = seamless_get_update(id);
+		if (u->pending & SEAMLESS_PENDING_POSITION)
+			seamless_apply_update(u);
+		u->state = state;
+		u->state_flags = flags;
+		u->pending |= SEAMLESS_PENDING_STATE;
 	}
 	else if (!strcmp("DEBUG", tok1))
 	{
+		seamless_untokenize(line, end);
 		logger(Core, Debug, "seamless_process_line(), %s", line);
 	}
 	else if (!strcmp("SYNCBEGIN", tok1))
@@ -325,6 +484,9 @@ seamless_process_line(const char *line, void *data)
 	{
 		unsigned int serial;
 
+		if (!tok3)
+			return False;
+
 		serial = strtoul(tok3, &endptr, 0);
 		if (*endptr)
 			return False;
@@ -354,37 +516,73 @@ seamless_process_line(const char *line, void *data)
 		ui_seamless_unhide_desktop();
 	}
 
-
-	xfree(l);
 	return True;
 }
 
 
-static RD_BOOL
-seamless_line_handler(const char *line, void *data)
+static void
+seamless_line_handler(char *line, char *end)
 {
-	if (!seamless_process_line(line, data))
+	*end = '\0';
+	if (!seamless_process_line(line, end))
 	{
+		seamless_untokenize(line, end);
 		logger(Core, Warning, "seamless_line_handler(), invalid request '%s'", line);
 	}
-	return True;
 }
 
 
+static void
+seamless_rest_append(const char *data, size_t len)
+{
+	if (seamless_rest_len + len + 1 > seamless_rest_size)
+	{
+		seamless_rest_size = seamless_rest_len + len + 1;
+		seamless_rest = xrealloc(seamless_rest, seamless_rest_size);
+	}
+	memcpy(seamless_rest + seamless_rest_len, data, len);
+	seamless_rest_len += len;
+	seamless_rest[seamless_rest_len] = '\0';
+}
+
+
+/* Lines are parsed where they lie in the packet. Only a line split over
+   packets is gathered in seamless_rest. */
 static void
 seamless_process(STREAM s)
 {
 	unsigned int pkglen;
-	char *buf;
+	uint8 *data;
+	char *line, *end, *newline;
 
 	pkglen = s_remaining(s);
-	/* str_handle_lines requires null terminated strings */
-	buf = xmalloc(pkglen + 1);
-	in_uint8a(s, buf, pkglen);
-	buf[pkglen] = '\0';
-	str_handle_lines(buf, &seamless_rest, seamless_line_handler, NULL);
+	in_uint8p(s, data, pkglen);
+	line = (char *) data;
+	end = line + pkglen;
 
-	xfree(buf);
+	if (seamless_rest_len > 0)
+	{
+		newline = memchr(line, '\n', pkglen);
+		seamless_rest_append(line, (newline ? newline : end) - line);
+		if (newline == NULL)
+			return;
+
+		seamless_line_handler(seamless_rest, seamless_rest + seamless_rest_len);
+		line = newline + 1;
+	}
+
+	while ((newline = memchr(line, '\n', end - line)) != NULL)
+	{
+		seamless_line_handler(line, newline);
+		line = newline + 1;
+	}
+
+	/* the titles held back point into the lines */
+	seamless_flush();
+
+	seamless_rest_len = 0;
+	if (line < end)
+		seamless_rest_append(line, end - line);
 }
 
 
@@ -410,6 +608,11 @@ seamless_reset_state(void)
 		xfree(seamless_rest);
 		seamless_rest = NULL;
 	}
+	seamless_rest_len = 0;
+	seamless_rest_size = 0;
+
+	seamless_num_updates = 0;
+	seamless_num_zchanges = 0;
 }
 
 static unsigned int
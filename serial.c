@@ -22,6 +22,12 @@
 #include <termios.h>
 #include <strings.h>
 #include <sys/ioctl.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #ifdef HAVE_SYS_MODEM_H
 #include <sys/modem.h>
@@ -156,6 +162,200 @@ get_serial_info(RD_NTHANDLE handle)
 	return NULL;
 }
 
+/*
+ * A pending SERIAL_WAIT_ON_MASK is woken up through the main loop: by the
+ * tty itself when data arrives, and by g_serial_event when a modem line
+ * changes, which a thread per port waits for with TIOCMIWAIT. Only what
+ * cannot wake the loop, like a transmit queue draining, is polled.
+ */
+
+#define SERIAL_DATA_EVENTS	(SERIAL_EV_RXCHAR | SERIAL_EV_RXFLAG | SERIAL_EV_RLSD)
+#define SERIAL_MODEM_EVENTS	(SERIAL_EV_CTS | SERIAL_EV_DSR)
+
+#define SERIAL_TIMEOUT_MAX	0xffffffff	/* MAXULONG */
+
+struct modem_watch
+{
+	pthread_t thread;
+	RD_NTHANDLE fd;
+	RD_BOOL running, failed;
+	volatile int stop, done;
+};
+
+static struct modem_watch g_modem_watch[RDPDR_MAX_DEVICES];
+static int g_serial_event[2] = { -1, -1 };
+
+#ifdef TIOCMIWAIT
+/* Only there to interrupt TIOCMIWAIT */
+static void
+serial_modem_signal(int sig)
+{
+	UNUSED(sig);
+}
+
+static void *
+serial_modem_thread(void *arg)
+{
+	struct modem_watch *watch = arg;
+	uint64 one = 1;
+
+	while (!watch->stop)
+	{
+		if (ioctl(watch->fd, TIOCMIWAIT, TIOCM_CTS | TIOCM_DSR) != 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			logger(Core, Warning, "serial_modem_thread(), TIOCMIWAIT failed: %s",
+			       strerror(errno));
+			watch->failed = True;
+		}
+
+		if (write(g_serial_event[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+			logger(Core, Error, "serial_modem_thread(), write() failed: %s",
+			       strerror(errno));
+
+		if (watch->failed)
+			break;
+	}
+
+	watch->done = 1;
+	return NULL;
+}
+#endif
+
+/* Starts waiting for modem line changes on the port, False if they have to be polled */
+static RD_BOOL
+serial_modem_watch(int index, RD_NTHANDLE handle)
+{
+#ifdef TIOCMIWAIT
+	struct modem_watch *watch = &g_modem_watch[index];
+	struct sigaction act;
+
+	if (watch->running || watch->failed)
+		return !watch->failed;
+
+	if (g_serial_event[0] == -1)
+	{
+#ifdef HAVE_SYS_EVENTFD_H
+		g_serial_event[0] = g_serial_event[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (g_serial_event[0] == -1)
+#else
+		if (pipe(g_serial_event) == -1 || fcntl(g_serial_event[0], F_SETFL, O_NONBLOCK) == -1
+		    || fcntl(g_serial_event[1], F_SETFL, O_NONBLOCK) == -1)
+#endif
+		{
+			logger(Core, Warning, "serial_modem_watch(), no event fd: %s",
+			       strerror(errno));
+			g_serial_event[0] = g_serial_event[1] = -1;
+			watch->failed = True;
+			return False;
+		}
+
+		/* no SA_RESTART, so that the signal breaks TIOCMIWAIT */
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = serial_modem_signal;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGUSR2, &act, NULL);
+	}
+
+	watch->fd = handle;
+	watch->stop = watch->done = 0;
+	if (pthread_create(&watch->thread, NULL, serial_modem_thread, watch) != 0)
+	{
+		logger(Core, Warning, "serial_modem_watch(), pthread_create() failed");
+		watch->failed = True;
+		return False;
+	}
+
+	watch->running = True;
+	return True;
+#else
+	UNUSED(index);
+	UNUSED(handle);
+	return False;
+#endif
+}
+
+static void
+serial_modem_unwatch(int index)
+{
+#ifdef TIOCMIWAIT
+	struct modem_watch *watch = &g_modem_watch[index];
+
+	if (watch->running)
+	{
+		/* repeated, in case the thread was not in TIOCMIWAIT yet */
+		watch->stop = 1;
+		while (!watch->done)
+		{
+			pthread_kill(watch->thread, SIGUSR2);
+			usleep(1000);
+		}
+		pthread_join(watch->thread, NULL);
+	}
+#endif
+	g_modem_watch[index].running = g_modem_watch[index].failed = False;
+}
+
+/* Sets up the wakeups for a pending SERIAL_WAIT_ON_MASK, True if it has to be polled */
+RD_BOOL
+serial_add_fds(RD_NTHANDLE handle, int *n, fd_set * rfds)
+{
+	int index, bytes = 0;
+	SERIAL_DEVICE *pser_inf;
+	RD_BOOL poll = False;
+
+	index = get_device_index(handle);
+	if (index < 0 || g_rdpdr_device[index].device_type != DEVICE_TYPE_SERIAL)
+		return False;
+
+	pser_inf = (SERIAL_DEVICE *) g_rdpdr_device[index].pdevice_data;
+
+	if (pser_inf->wait_mask & SERIAL_DATA_EVENTS)
+	{
+#ifdef TIOCINQ
+		ioctl(handle, TIOCINQ, &bytes);
+#endif
+		/* with data already waiting, the tty stays readable */
+		if (bytes == 0)
+		{
+			FD_SET(handle, rfds);
+			*n = MAX(*n, (int) handle);
+		}
+		else
+			poll = True;
+	}
+
+	if ((pser_inf->wait_mask & SERIAL_EV_TXEMPTY) && pser_inf->event_txempty > 0)
+		poll = True;
+
+	if (pser_inf->wait_mask & SERIAL_MODEM_EVENTS)
+	{
+		if (serial_modem_watch(index, handle))
+		{
+			FD_SET(g_serial_event[0], rfds);
+			*n = MAX(*n, g_serial_event[0]);
+		}
+		else
+			poll = True;
+	}
+
+	return poll;
+}
+
+void
+serial_check_fds(fd_set * rfds)
+{
+	uint64 events[8];
+
+	if (g_serial_event[0] == -1 || !FD_ISSET(g_serial_event[0], rfds))
+		return;
+
+	/* the pending events themselves are checked by serial_get_event() */
+	while (read(g_serial_event[0], events, sizeof(events)) > 0);
+}
+
 static RD_BOOL
 get_termios(SERIAL_DEVICE * pser_inf, RD_NTHANDLE serial_fd)
 {
@@ -620,63 +820,31 @@ serial_close(RD_NTHANDLE handle)
 {
 	int i = get_device_index(handle);
 	if (i >= 0)
+	{
+		serial_modem_unwatch(i);
 		g_rdpdr_device[i].handle = 0;
+	}
 
 	rdpdr_abort_io(handle, 0, RD_STATUS_TIMEOUT);
 	close(handle);
 	return RD_STATUS_SUCCESS;
 }
 
+/* Only called once the tty is readable, or for a read that returns at once */
 static RD_NTSTATUS
 serial_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
 {
 	UNUSED(offset);  /* Offset must always be zero according to MS-RDPESP */
-	long timeout;
-	SERIAL_DEVICE *pser_inf;
-	struct termios *ptermios;
-#ifdef TIOCINQ
-	int bytes_inqueue;
-#endif
-
+	ssize_t n;
 
-	timeout = 90;
-	pser_inf = get_serial_info(handle);
-	ptermios = pser_inf->ptermios;
-
-	/* Set timeouts kind of like the windows serial timeout parameters. Multiply timeout
-	   with requested read size */
-	if (pser_inf->read_total_timeout_multiplier | pser_inf->read_total_timeout_constant)
-	{
-		timeout =
-			(pser_inf->read_total_timeout_multiplier * length +
-			 pser_inf->read_total_timeout_constant + 99) / 100;
-	}
-	else if (pser_inf->read_interval_timeout)
-	{
-		timeout = (pser_inf->read_interval_timeout * length + 99) / 100;
-	}
-
-	/* If a timeout is set, do a blocking read, which times out after some time.
-	   It will make rdesktop less responsive, but it will improve serial performance, by not
-	   reading one character at a time. */
-	if (timeout == 0)
+	n = read(handle, data, length);
+	if (n < 0)
 	{
-		ptermios->c_cc[VTIME] = 0;
-		ptermios->c_cc[VMIN] = 0;
+		if (errno != EAGAIN && errno != EINTR)
+			logger(Core, Error, "serial_read(), read() failed: %s", strerror(errno));
+		n = 0;
 	}
-	else
-	{
-		ptermios->c_cc[VTIME] = timeout;
-		ptermios->c_cc[VMIN] = 1;
-	}
-	tcsetattr(handle, TCSANOW, ptermios);
-
-#if defined(TIOCINQ)
-	ioctl(handle, TIOCINQ, &bytes_inqueue);
-	logger(Core, Debug, "serial_read(), inqueue: %d expected %d\n", bytes_inqueue, length);
-#endif
-
-	*result = read(handle, data, length);
+	*result = n;
 
 	logger(Core, Debug, "serial_read(), %d bytes read", *result);
 
@@ -1073,13 +1241,41 @@ serial_get_timeout(RD_NTHANDLE handle, uint32 length, uint32 * timeout, uint32 *
 
 	pser_inf = (SERIAL_DEVICE *) g_rdpdr_device[index].pdevice_data;
 
-	*timeout =
-		pser_inf->read_total_timeout_multiplier * length +
-		pser_inf->read_total_timeout_constant;
+	/* MAXULONG multiplier: the constant applies only until the first byte */
+	if (pser_inf->read_total_timeout_multiplier == SERIAL_TIMEOUT_MAX)
+		*timeout = pser_inf->read_total_timeout_constant;
+	else
+		*timeout =
+			pser_inf->read_total_timeout_multiplier * length +
+			pser_inf->read_total_timeout_constant;
 	*itv_timeout = pser_inf->read_interval_timeout;
 	return True;
 }
 
+/* True if reads return with what has arrived, instead of waiting to be filled.
+   With immediate, only if they return at once, even with nothing. */
+RD_BOOL
+serial_read_partial(RD_NTHANDLE handle, RD_BOOL immediate)
+{
+	int index;
+	SERIAL_DEVICE *pser_inf;
+
+	index = get_device_index(handle);
+	if (index < 0 || g_rdpdr_device[index].device_type != DEVICE_TYPE_SERIAL)
+		return False;
+
+	pser_inf = (SERIAL_DEVICE *) g_rdpdr_device[index].pdevice_data;
+
+	if (pser_inf->read_interval_timeout != SERIAL_TIMEOUT_MAX)
+		return False;
+
+	if (pser_inf->read_total_timeout_multiplier == 0
+	    && pser_inf->read_total_timeout_constant == 0)
+		return True;
+
+	return !immediate && pser_inf->read_total_timeout_multiplier == SERIAL_TIMEOUT_MAX;
+}
+
 DEVICE_FNS serial_fns = {
 	serial_create,
 	serial_close,
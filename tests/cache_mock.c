@@ -13,6 +13,12 @@ cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor)
   mock(cache_idx, cursor);
 }
 
+void
+cache_resize_cursors(uint16 size)
+{
+  mock(size);
+}
+
 
 FONTGLYPH *
 cache_get_font(uint8 font, uint16 character)
@@ -32,17 +38,23 @@ cache_put_text(uint8 cache_id, void *data, int length)
   mock(cache_id, data, length);
 }
 
+RD_HBITMAP
+cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel, int *y)
+{
+  return (RD_HBITMAP) mock(offset, cx, cy, bytes_per_pixel, y);
+}
+
 uint8 *
-cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel)
+cache_get_desktop_data(uint32 offset, int cx, int cy, int bytes_per_pixel)
 {
   return (uint8 *) mock(offset, cx, cy, bytes_per_pixel);
 }
 
 void
-cache_put_desktop(uint32 offset, int cx, int cy, int scanline,
-		  int bytes_per_pixel, uint8 * data)
+cache_put_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel,
+		  RD_HBITMAP bitmap)
 {
-  mock(offset, cx, cy, scanline, bytes_per_pixel, data);
+  mock(offset, cx, cy, bytes_per_pixel, bitmap);
 }
 
 void
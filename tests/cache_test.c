@@ -0,0 +1,247 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+/* globals */
+int g_pstcache_fd[8];
+
+#include "../cache.c"
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* realloc; exit if out of memory */
+void *
+xrealloc(void *oldmem, size_t size)
+{
+	void *mem;
+
+	if (size == 0)
+		size = 1;
+	mem = realloc(oldmem, size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xrealloc, failed to reallocate %ld bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* free */
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+static int destroyed;
+
+void
+ui_destroy_bitmap(RD_HBITMAP bmp)
+{
+	UNUSED(bmp);
+	destroyed++;
+}
+
+/* every byte of a row reads back as the bitmap number times 16 plus the row */
+void
+ui_desktop_read(RD_HBITMAP bitmap, int y, int cx, int cy, uint8 * data)
+{
+	int row;
+
+	for (row = 0; row < cy; row++)
+		memset(data + row * cx, (uintptr_t) bitmap * 16 + y + row, cx);
+}
+
+static void
+cache_reset_desktop(void)
+{
+	int n;
+
+	for (n = 0; n < DESKCACHE_ENTRIES; n++)
+		g_deskcache[n].bitmap = NULL;
+	g_deskcache_victim = 0;
+	memset(g_deskcache_data, 0, sizeof(g_deskcache_data));
+	destroyed = 0;
+}
+
+/* Boilerplate */
+Describe(Cache);
+BeforeEach(Cache) { cgreen_mocks_are(loose_mocks); cache_reset_desktop(); }
+AfterEach(Cache) {}
+
+#define SAVE_A ((RD_HBITMAP) 1)
+#define SAVE_B ((RD_HBITMAP) 2)
+
+/* ten rows of ten one byte pixels at offset */
+static void
+put(uint32 offset, int cy, RD_HBITMAP bitmap)
+{
+	cache_put_desktop(offset, 10, cy, 1, bitmap);
+}
+
+static RD_HBITMAP
+get(uint32 offset, int cy, int *y)
+{
+	*y = -1;
+	return cache_get_desktop(offset, 10, cy, 1, y);
+}
+
+Ensure(Cache, restores_whole_rows_of_a_save)
+{
+	int y;
+
+	put(0, 10, SAVE_A);
+
+	assert_that(get(30, 2, &y), is_equal_to(SAVE_A));
+	assert_that(y, is_equal_to(3));
+	assert_that(get(35, 2, &y), is_equal_to(NULL));
+	assert_that(get(90, 2, &y), is_equal_to(NULL));
+}
+
+Ensure(Cache, drops_a_save_that_is_overwritten_completely)
+{
+	int y;
+
+	put(0, 10, SAVE_A);
+	put(0, 10, SAVE_B);
+
+	assert_that(destroyed, is_equal_to(1));
+	assert_that(get(0, 10, &y), is_equal_to(SAVE_B));
+	assert_that(y, is_equal_to(0));
+}
+
+Ensure(Cache, keeps_the_rows_before_a_later_save)
+{
+	int y;
+
+	put(0, 10, SAVE_A);
+	put(50, 10, SAVE_B);
+
+	assert_that(destroyed, is_equal_to(0));
+	assert_that(get(0, 5, &y), is_equal_to(SAVE_A));
+	assert_that(y, is_equal_to(0));
+	assert_that(get(40, 1, &y), is_equal_to(SAVE_A));
+	assert_that(y, is_equal_to(4));
+	assert_that(get(0, 6, &y), is_equal_to(NULL));
+	assert_that(get(50, 10, &y), is_equal_to(SAVE_B));
+	assert_that(y, is_equal_to(0));
+}
+
+Ensure(Cache, keeps_the_rows_after_a_later_save)
+{
+	int y;
+
+	put(100, 10, SAVE_A);
+	put(95, 2, SAVE_B);
+
+	/* rows 0 and 1 of the first save are touched */
+	assert_that(destroyed, is_equal_to(0));
+	assert_that(get(120, 8, &y), is_equal_to(SAVE_A));
+	assert_that(y, is_equal_to(2));
+	assert_that(get(110, 1, &y), is_equal_to(NULL));
+}
+
+Ensure(Cache, keeps_the_larger_part_of_a_split_save)
+{
+	int y;
+
+	put(0, 10, SAVE_A);
+	put(25, 1, SAVE_B);
+
+	/* rows 2 and 3 are touched, 0-1 and 4-9 are not */
+	assert_that(destroyed, is_equal_to(0));
+	assert_that(get(40, 6, &y), is_equal_to(SAVE_A));
+	assert_that(y, is_equal_to(4));
+	assert_that(get(0, 1, &y), is_equal_to(NULL));
+	assert_that(get(25, 1, &y), is_equal_to(SAVE_B));
+}
+
+Ensure(Cache, reads_back_only_with_the_width_it_was_saved_with)
+{
+	int y;
+
+	put(0, 10, SAVE_A);
+
+	assert_that(cache_get_desktop(0, 5, 2, 1, &y), is_equal_to(NULL));
+}
+
+/* the bytes of ten byte rows at offset, one value per row */
+static RD_BOOL
+rows_are(uint32 offset, int cy, const uint8 * values)
+{
+	uint8 *data = cache_get_desktop_data(offset, 10, cy, 1);
+	int i;
+
+	for (i = 0; data != NULL && i < cy * 10; i++)
+		if (data[i] != values[i / 10])
+			return False;
+
+	return data != NULL;
+}
+
+Ensure(Cache, reads_a_restore_across_two_saves_as_data)
+{
+	const uint8 expected[] = { 0x13, 0x14, 0x20, 0x21 };
+	int y;
+
+	put(0, 5, SAVE_A);
+	put(50, 5, SAVE_B);
+
+	assert_that(get(30, 4, &y), is_equal_to(NULL));
+	assert_that(rows_are(30, 4, expected), is_true);
+}
+
+Ensure(Cache, reads_a_restore_with_another_width_as_data)
+{
+	uint8 *data;
+
+	put(0, 10, SAVE_A);
+
+	data = cache_get_desktop_data(0, 5, 2, 1);
+	assert_that(data[0], is_equal_to(0x10));
+	assert_that(data[9], is_equal_to(0x10));
+	data = cache_get_desktop_data(10, 5, 1, 1);
+	assert_that(data[4], is_equal_to(0x11));
+}
+
+Ensure(Cache, keeps_the_smaller_part_of_a_split_save_as_data)
+{
+	const uint8 expected[] = { 0x10, 0x11 };
+	uint8 *data;
+
+	put(0, 10, SAVE_A);
+	put(25, 1, SAVE_B);
+
+	assert_that(rows_are(0, 2, expected), is_true);
+
+	/* rows 2 and 3 are only partly overwritten */
+	data = cache_get_desktop_data(20, 10, 2, 1);
+	assert_that(data[4], is_equal_to(0x12));
+	assert_that(data[5], is_equal_to(0x20));
+	assert_that(data[14], is_equal_to(0x20));
+	assert_that(data[15], is_equal_to(0x13));
+}
+
+Ensure(Cache, keeps_a_save_evicted_for_room_as_data)
+{
+	const uint8 expected[] = { 0x10 };
+	int n, y;
+
+	for (n = 0; n <= DESKCACHE_ENTRIES; n++)
+		put(n * 10, 1, (RD_HBITMAP) (uintptr_t) (n + 1));
+
+	assert_that(destroyed, is_equal_to(1));
+	assert_that(get(0, 1, &y), is_equal_to(NULL));
+	assert_that(rows_are(0, 1, expected), is_true);
+}
@@ -5,3 +5,13 @@ void channel_process(STREAM s, uint16 mcs_channel)
 {
   mock(s, mcs_channel);
 }
+
+void channel_set_chunk_size(uint32 size)
+{
+  mock(size);
+}
+
+void channel_log_stats(void)
+{
+  mock();
+}
@@ -6,3 +6,15 @@ cliprdr_set_mode(const char *optarg)
 {
   mock(optarg);
 }
+
+void
+cliprdr_add_fds(int *n, fd_set * rfds)
+{
+  mock(n, rfds);
+}
+
+void
+cliprdr_check_fds(fd_set * rfds)
+{
+  mock(rfds);
+}
@@ -10,3 +10,13 @@ RD_BOOL pstcache_init(uint8 cache_id)
 {
   return mock(cache_id);
 }
+
+void pstcache_touch_bitmap(uint8 cache_id, uint16 cache_idx, uint32 stamp)
+{
+  mock(cache_id, cache_idx, stamp);
+}
+
+RD_BOOL pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
+{
+  return mock(cache_id, cache_idx);
+}
@@ -0,0 +1,330 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+char g_codepage[16];
+
+/* Boilerplate */
+Describe(RDP8Bulk);
+BeforeEach(RDP8Bulk) { cgreen_mocks_are(loose_mocks); rdp8_bulk_reset(); }
+AfterEach(RDP8Bulk) {}
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* realloc; exit if out of memory */
+void *
+xrealloc(void *oldmem, size_t size)
+{
+	void *mem;
+
+	if (size == 0)
+		size = 1;
+	mem = realloc(oldmem, size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xrealloc, failed to reallocate %ld bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* free */
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+void
+_rdp_protocol_error(const char *file, int line, const char *func,
+		    const char *message, STREAM s)
+{
+	fail_test(message);
+	exit(EX_SOFTWARE);
+}
+
+
+/* A minimal RDP8 bulk compressor, producing literals, matches and
+   unencoded runs, for round trips through the decompressor */
+#define MAX_DATA 8192
+
+struct bits
+{
+	uint8 data[MAX_DATA * 2];
+	uint32 nbits;
+};
+
+static void
+put_bits(struct bits *b, uint32 value, int n)
+{
+	while (n--)
+	{
+		if ((value >> n) & 1)
+			b->data[b->nbits / 8] |= 0x80 >> (b->nbits % 8);
+		b->nbits++;
+	}
+}
+
+static void
+put_match(struct bits *b, uint32 distance, uint32 count)
+{
+	/* the five shortest distance codes */
+	static const uint32 base[] = { 0, 32, 160, 672, 1696, 5792 };
+	static const int value_bits[] = { 5, 7, 9, 10, 12 };
+	int i, k;
+
+	for (i = 0; distance >= base[i + 1]; i++);
+	put_bits(b, 0x11 + i, 5);
+	put_bits(b, distance - base[i], value_bits[i]);
+
+	if (count == 3)
+	{
+		put_bits(b, 0, 1);
+		return;
+	}
+
+	for (k = 2; count >= (2u << k); k++);
+	put_bits(b, ((1 << (k - 1)) - 1) << 1, k);
+	put_bits(b, count - (1 << k), k);
+}
+
+static void
+put_raw(struct bits *b, const uint8 * data, uint32 length)
+{
+	put_bits(b, 0x11, 5);
+	put_bits(b, 0, 5);
+	put_bits(b, length, 15);
+	b->nbits = (b->nbits + 7) & ~7;
+	memcpy(b->data + b->nbits / 8, data, length);
+	b->nbits += length * 8;
+}
+
+/* RDP_SEGMENTED_DATA with a single compressed segment, returns its length */
+static uint32
+compress(const uint8 * in, uint32 length, uint8 * out)
+{
+	static struct bits b;
+	uint32 i, d, n, best, best_distance;
+
+	memset(&b, 0, sizeof(b));
+	for (i = 0; i < length; i += MAX(best, 1))
+	{
+		best = 0;
+		best_distance = 0;
+		for (d = 1; d <= MIN(i, 5000); d++)
+		{
+			for (n = 0; i + n < length && n < 1000 && in[i + n - d] == in[i + n]; n++);
+			if (n > best)
+			{
+				best = n;
+				best_distance = d;
+			}
+		}
+
+		if (best >= 3)
+		{
+			put_match(&b, best_distance, best);
+		}
+		else if (in[i] == 0xfe && i + 4 <= length)
+		{
+			put_raw(&b, in + i, 4);
+			best = 4;
+		}
+		else
+		{
+			put_bits(&b, 0, 1);
+			put_bits(&b, in[i], 8);
+			best = 1;
+		}
+	}
+
+	out[0] = 0xe0;
+	out[1] = 0x24;
+	memcpy(out + 2, b.data, (b.nbits + 7) / 8);
+	out[2 + (b.nbits + 7) / 8] = (8 - b.nbits % 8) % 8;
+	return 3 + (b.nbits + 7) / 8;
+}
+
+/* Words picked at random, repetitive enough to compress */
+static void
+sample(uint8 * data, uint32 length, unsigned int seed)
+{
+	static const struct
+	{
+		const char *text;
+		uint32 length;
+	} words[] = {
+		{"grid ", 5}, {"window ", 7}, {"\xfe\x01\x02\x03", 4}, {"aaaaaaaa", 8},
+		{"surface ", 8}, {"\0\0\0\0", 4}, {"cache ", 6}, {"x", 1}
+	};
+	uint32 n, w;
+
+	for (n = 0; n < length; n += MIN(words[w].length, length - n))
+	{
+		seed = seed * 1103515245 + 12345;
+		w = (seed >> 16) % (sizeof(words) / sizeof(words[0]));
+		memcpy(data + n, words[w].text, MIN(words[w].length, length - n));
+	}
+}
+
+static RD_BOOL
+expand(uint8 * data, uint32 length, STREAM out)
+{
+	s_reset(out);
+	return rdp8_bulk_expand(data, length, out);
+}
+
+Ensure(RDP8Bulk, copies_an_uncompressed_segment)
+{
+  uint8 pdu[] = { 0xe0, 0x04, 'a', 'b', 'c' };
+  STREAM out = s_alloc(16);
+
+  assert_that(expand(pdu, sizeof(pdu), out), is_true);
+  assert_that(s_tell(out), is_equal_to(3));
+  assert_that(out->data, is_equal_to_contents_of("abc", 3));
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, round_trips_literals_matches_and_raw_runs)
+{
+  static uint8 plain[MAX_DATA], pdu[MAX_DATA * 2];
+  STREAM out = s_alloc(16);
+  uint32 length, seed;
+
+  for (seed = 1; seed <= 8; seed++)
+  {
+    rdp8_bulk_reset();
+    sample(plain, 500 * seed, seed);
+    length = compress(plain, 500 * seed, pdu);
+    assert_that(length, is_less_than(500 * seed));
+
+    assert_that(expand(pdu, length, out), is_true);
+    assert_that(s_tell(out), is_equal_to(500 * seed));
+    assert_that(out->data, is_equal_to_contents_of(plain, 500 * seed));
+  }
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, matches_reach_into_earlier_messages)
+{
+  uint8 first[] = { 0xe0, 0x04, 'h', 'e', 'l', 'l', 'o' };
+  struct bits b;
+  uint8 pdu[16];
+  STREAM out = s_alloc(16);
+
+  /* distance 5, count 5: the previous message again */
+  memset(&b, 0, sizeof(b));
+  put_match(&b, 5, 5);
+  pdu[0] = 0xe0;
+  pdu[1] = 0x24;
+  memcpy(pdu + 2, b.data, (b.nbits + 7) / 8);
+  pdu[2 + (b.nbits + 7) / 8] = (8 - b.nbits % 8) % 8;
+
+  assert_that(expand(first, sizeof(first), out), is_true);
+  assert_that(expand(pdu, 3 + (b.nbits + 7) / 8, out), is_true);
+  assert_that(s_tell(out), is_equal_to(5));
+  assert_that(out->data, is_equal_to_contents_of("hello", 5));
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, joins_multipart_segments)
+{
+  uint8 pdu[] = { 0xe1, 2, 0, 6, 0, 0, 0,
+    3, 0, 0, 0, 0x04, 'a', 'b',
+    5, 0, 0, 0, 0x04, 'c', 'd', 'e', 'f'
+  };
+  STREAM out = s_alloc(16);
+
+  assert_that(expand(pdu, sizeof(pdu), out), is_true);
+  assert_that(s_tell(out), is_equal_to(6));
+  assert_that(out->data, is_equal_to_contents_of("abcdef", 6));
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, rejects_truncated_multipart_data)
+{
+  uint8 pdu[] = { 0xe1, 2, 0, 6, 0, 0, 0,
+    3, 0, 0, 0, 0x04, 'a', 'b',
+    5, 0, 0, 0, 0x04, 'c', 'd', 'e', 'f'
+  };
+  STREAM out = s_alloc(16);
+  uint32 length;
+
+  for (length = 0; length < sizeof(pdu); length++)
+    assert_that(expand(pdu, length, out), is_false);
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, survives_truncated_compressed_data)
+{
+  static uint8 plain[MAX_DATA], pdu[MAX_DATA * 2];
+  STREAM out = s_alloc(16);
+  uint32 length, cut;
+
+  sample(plain, 4000, 7);
+  length = compress(plain, 4000, pdu);
+
+  /* whatever is decoded has to be a prefix of what was sent */
+  for (cut = 0; cut < length; cut++)
+  {
+    rdp8_bulk_reset();
+    if (expand(pdu, cut, out))
+    {
+      assert_that(s_tell(out), is_less_than(4000));
+      assert_that(out->data, is_equal_to_contents_of(plain, s_tell(out)));
+    }
+  }
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, rejects_corrupt_data)
+{
+  uint8 descriptor[] = { 0xe2, 0x04, 'a' };
+  uint8 compression[] = { 0xe0, 0x03, 'a' };
+  uint8 padding[] = { 0xe0, 0x24, 0x00, 0x08 };
+  uint8 prefix[] = { 0xe0, 0x24, 0xbf, 0x80, 0x07 };
+  uint8 distance[] = { 0xe0, 0x24, 0xbf, 0x00, 0x00, 0x00, 0x00, 0x06 };
+  uint8 count[] = { 0xe0, 0x24, 0x88, 0xff, 0xff, 0xff, 0x00 };
+  uint8 raw[] = { 0xe0, 0x24, 0x88, 0x00, 0x40, 0x00, 'a', 0x00 };
+  STREAM out = s_alloc(16);
+
+  assert_that(expand(descriptor, sizeof(descriptor), out), is_false);
+  assert_that(expand(compression, sizeof(compression), out), is_false);
+  assert_that(expand(padding, sizeof(padding), out), is_false);
+  assert_that(expand(prefix, sizeof(prefix), out), is_false);
+  assert_that(expand(distance, sizeof(distance), out), is_false);
+  assert_that(expand(count, sizeof(count), out), is_false);
+  assert_that(expand(raw, sizeof(raw), out), is_false);
+  s_free(out);
+}
+
+Ensure(RDP8Bulk, survives_flipped_bits)
+{
+  static uint8 plain[MAX_DATA], pdu[MAX_DATA * 2];
+  STREAM out = s_alloc(16);
+  uint32 length, bit;
+
+  sample(plain, 2000, 3);
+  length = compress(plain, 2000, pdu);
+
+  for (bit = 16; bit < length * 8; bit++)
+  {
+    rdp8_bulk_reset();
+    pdu[bit / 8] ^= 0x80 >> (bit % 8);
+    if (expand(pdu, length, out))
+      assert_that(s_tell(out), is_less_than(65536));
+    pdu[bit / 8] ^= 0x80 >> (bit % 8);
+  }
+  s_free(out);
+}
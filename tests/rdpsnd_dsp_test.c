@@ -0,0 +1,236 @@
+#include <cgreen/cgreen.h>
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+char g_codepage[16];
+
+#include "../rdpsnd_dsp.c"
+
+/* malloc; exit if out of memory */
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xmalloc, failed to allocate %d bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* realloc; exit if out of memory */
+void *
+xrealloc(void *oldmem, size_t size)
+{
+	void *mem;
+
+	if (size == 0)
+		size = 1;
+	mem = realloc(oldmem, size);
+	if (mem == NULL)
+	{
+		logger(Core, Error, "xrealloc, failed to reallocate %ld bytes", size);
+		exit(EX_UNAVAILABLE);
+	}
+	return mem;
+}
+
+/* free */
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+void
+_rdp_protocol_error(const char *file, int line, const char *func,
+		    const char *message, STREAM s)
+{
+	fail_test(message);
+	exit(EX_SOFTWARE);
+}
+
+/* plays anything as it is, with its own volume control */
+static struct audio_driver as_is;
+/* takes 16 bit stereo at the rate given to rdpsnd_dsp_resample_set() */
+static struct audio_driver resampling;
+
+static struct stream out;
+
+/* Boilerplate */
+Describe(RdpsndDsp);
+BeforeEach(RdpsndDsp)
+{
+	cgreen_mocks_are(loose_mocks);
+	memset(&as_is, 0, sizeof(as_is));
+	memset(&resampling, 0, sizeof(resampling));
+	resampling.need_resampling = True;
+	memset(&out, 0, sizeof(out));
+}
+AfterEach(RdpsndDsp)
+{
+	rdpsnd_dsp_release(&out);
+}
+
+static void
+set_format(RD_WAVEFORMATEX * format, uint16 tag, uint32 rate, uint16 bits, uint16 align)
+{
+	memset(format, 0, sizeof(*format));
+	format->wFormatTag = tag;
+	format->nChannels = 1;
+	format->nSamplesPerSec = rate;
+	format->wBitsPerSample = bits;
+	format->nBlockAlign = align;
+}
+
+/* Checks the 16 bit samples of the output against expected */
+static RD_BOOL
+samples_are(const sint16 * expected, unsigned int count)
+{
+	unsigned int i;
+
+	if (s_length(&out) != count * 2)
+		return False;
+
+	for (i = 0; i < count; i++)
+		if (get_sample(out.data + i * 2) != expected[i])
+			return False;
+
+	return True;
+}
+
+Ensure(RdpsndDsp, decodes_ima_adpcm)
+{
+	/* predictor 0, step index 0, then eight times nibble 7 */
+	uint8 block[] = { 0x00, 0x00, 0x00, 0x00, 0x77, 0x77, 0x77, 0x77 };
+	const sint16 expected[] = { 0, 11, 41, 104, 240, 533, 1164, 2521, 5431 };
+	RD_WAVEFORMATEX format;
+
+	set_format(&format, WAVE_FORMAT_IMA_ADPCM, 22050, 4, sizeof(block));
+
+	assert_that(rdpsnd_dsp_process(block, sizeof(block), &as_is, &format, &out), is_true);
+	assert_that(samples_are(expected, 9), is_true);
+}
+
+Ensure(RdpsndDsp, clamps_ima_adpcm_at_the_largest_step)
+{
+	/* predictor -32760, step index 88, then nibbles 15 and 7 in turn */
+	uint8 block[] = { 0x08, 0x80, 88, 0x00, 0x7f, 0x7f, 0x7f, 0x7f };
+	const sint16 expected[] = { -32760, -32768, 28668, -32768, 28668,
+		-32768, 28668, -32768, 28668
+	};
+	RD_WAVEFORMATEX format;
+
+	set_format(&format, WAVE_FORMAT_IMA_ADPCM, 22050, 4, sizeof(block));
+
+	assert_that(rdpsnd_dsp_process(block, sizeof(block), &as_is, &format, &out), is_true);
+	assert_that(samples_are(expected, 9), is_true);
+}
+
+Ensure(RdpsndDsp, decodes_ms_adpcm)
+{
+	/* predictor 0, delta 16, samples 100 and 50, then nibbles 1, 2, -1 and -8 */
+	uint8 block[] = { 0, 16, 0, 100, 0, 50, 0, 0x12, 0xf8 };
+	const sint16 expected[] = { 50, 100, 116, 148, 132, 4 };
+	RD_WAVEFORMATEX format;
+
+	set_format(&format, WAVE_FORMAT_ADPCM, 22050, 4, sizeof(block));
+
+	assert_that(rdpsnd_dsp_process(block, sizeof(block), &as_is, &format, &out), is_true);
+	assert_that(samples_are(expected, 6), is_true);
+}
+
+Ensure(RdpsndDsp, decodes_ms_adpcm_with_the_coefficients_of_the_format)
+{
+	/* predictor 1, which extrapolates linearly */
+	uint8 block[] = { 1, 16, 0, 100, 0, 50, 0, 0x00, 0x00 };
+	const sint16 expected[] = { 50, 100, 150, 200, 250, 300 };
+	RD_WAVEFORMATEX format;
+
+	set_format(&format, WAVE_FORMAT_ADPCM, 22050, 4, sizeof(block));
+	format.cbSize = 12;
+	format.cb[2] = 2;
+	put_sample(format.cb + 4, 256);
+	put_sample(format.cb + 6, 0);
+	put_sample(format.cb + 8, 512);
+	put_sample(format.cb + 10, -256);
+
+	assert_that(rdpsnd_dsp_process(block, sizeof(block), &as_is, &format, &out), is_true);
+	assert_that(samples_are(expected, 6), is_true);
+}
+
+/* Resamples packets of frames frames of constant 16 bit mono, returns the
+   output frames of all of them */
+static unsigned int
+resample(uint32 from, uint32 to, unsigned int packets, unsigned int frames, sint16 value)
+{
+	RD_WAVEFORMATEX format;
+	unsigned char *in;
+	unsigned int i, total;
+
+	in = xmalloc(frames * 2);
+	for (i = 0; i < frames; i++)
+		put_sample(in + i * 2, value);
+
+	set_format(&format, WAVE_FORMAT_PCM, from, 16, 2);
+	rdpsnd_dsp_resample_set(to, 16, 2);
+
+	total = 0;
+	for (i = 0; i < packets; i++)
+	{
+		rdpsnd_dsp_release(&out);
+		if (!rdpsnd_dsp_process(in, frames * 2, &resampling, &format, &out))
+			break;
+		total += s_length(&out) / 4;
+	}
+
+	xfree(in);
+	return total;
+}
+
+Ensure(RdpsndDsp, doubles_the_frames_from_22050_to_44100_hz)
+{
+	assert_that(resample(22050, 44100, 1, 1000, 0), is_equal_to(2000));
+	assert_that(resample(22050, 44100, 3, 1001, 0), is_equal_to(3 * 2002));
+}
+
+Ensure(RdpsndDsp, keeps_the_length_over_packets_from_44100_to_48000_hz)
+{
+	/* 160 output frames for every 147, carried over from packet to packet */
+	assert_that(resample(44100, 48000, 10, 441, 0), is_equal_to(4800));
+}
+
+Ensure(RdpsndDsp, halves_the_frames_from_44100_to_22050_hz)
+{
+	assert_that(resample(44100, 22050, 4, 1000, 0), is_equal_to(2000));
+}
+
+/* The largest difference of a sample of the last packet from value */
+static int
+dc_error(sint16 value)
+{
+	unsigned int i;
+	int error = 0;
+
+	for (i = 0; i < s_length(&out) / 2; i++)
+		error = MAX(error, abs(get_sample(out.data + i * 2) - value));
+
+	return error;
+}
+
+Ensure(RdpsndDsp, passes_dc_through_upsampling_at_unity_gain)
+{
+	/* the second packet is past the ramp up from silence */
+	assert_that(resample(22050, 44100, 2, 1000, 10000), is_equal_to(4000));
+	assert_that(dc_error(10000), is_less_than(8));
+
+	assert_that(resample(44100, 48000, 2, 1000, -20000), is_equal_to(2177));
+	assert_that(dc_error(-20000), is_less_than(8));
+}
+
+Ensure(RdpsndDsp, passes_dc_through_downsampling_at_unity_gain)
+{
+	assert_that(resample(48000, 22050, 2, 1000, 10000), is_equal_to(919));
+	assert_that(dc_error(10000), is_less_than(8));
+}
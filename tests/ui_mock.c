@@ -118,3 +118,15 @@ ui_seamless_end()
 {
   mock();
 }
+
+void
+ui_destroy_cursor(RD_HCURSOR cursor)
+{
+  mock(cursor);
+}
+
+void
+ui_destroy_glyph(RD_HGLYPH glyph)
+{
+  mock(glyph);
+}
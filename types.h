@@ -170,6 +170,12 @@ typedef struct _VCHANNEL
 	uint32 flags;
 	struct stream in;
 	void (*process) (STREAM);
+	RD_BOOL(*fragment) (STREAM, uint32, RD_BOOL, RD_BOOL);
+	RD_BOOL streaming;
+	struct stream out;
+	uint32 out_length, out_sent;
+	uint64 bytes_in, bytes_out;
+	uint32 chunks_in, chunks_out;
 }
 VCHANNEL;
 
@@ -286,6 +292,7 @@ typedef struct rdpdr_printer_info
 	uint32 bloblen;
 	uint8 *blob;
 	RD_BOOL default_printer;
+	struct print_job *job;	/* the open job, if any */
 }
 PRINTER;
 
@@ -305,9 +312,27 @@ typedef struct fileinfo
 	DIR *pdir;
 	struct dirent *pdirent;
 	char pattern[PATH_MAX];
+	struct dir_snapshot *listing;	/* entries being enumerated */
+	unsigned int listing_pos;
 	RD_BOOL delete_on_close;
 	NOTIFY notify;
 	uint32 info_class;
+	int watch;		/* inotify watch descriptor, 0 when polling */
+	STREAM notify_records;	/* FILE_NOTIFY_INFORMATION not yet sent */
+	unsigned char *notify_last;
+	RD_BOOL notify_overflow;
+	dev_t dev;		/* of an open file, to find other handles on it */
+	ino_t ino;
+	RD_BOOL shared;		/* other handles have the file open, nothing is cached */
+	uint8 *cache;		/* read-ahead data, or writes not yet done */
+	uint64 cache_offset;
+	uint32 cache_length;
+	RD_BOOL cache_dirty;
+	RD_NTSTATUS cache_status;	/* failure of a coalesced write */
+	time_t cache_mtime;	/* of the file when read-ahead was done */
+	off_t cache_size;
+	uint64 next_offset;	/* where a sequential read or write continues */
+	int sequential;
 }
 FILEINFO;
 
@@ -23,6 +23,10 @@
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include "rdesktop.h"
 
 /*
@@ -34,6 +38,10 @@
     http://msdn.microsoft.com/library/en-us/winui/winui/windowsuserinterface/dataexchange/clipboard/clipboardformats.asp
 */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef HAVE_LANGINFO_H
 #include <langinfo.h>
 #include <iconv.h>
@@ -47,6 +55,10 @@
 #endif
 
 #define MAX_TARGETS 8
+/* Transfers are converted and passed on in pieces of at most this size */
+#define CLIP_CHUNK_SIZE 65536
+/* Seconds to wait for a requestor to take the next INCR chunk */
+#define CLIP_INCR_TIMEOUT 5
 
 extern Display *g_display;
 extern Window g_wnd;
@@ -95,6 +107,8 @@ static RD_BOOL probing_selections, reprobe_selections;
    on the root window to indicate which selections that are owned by rdesktop. */
 static Atom rdesktop_primary_owner_atom, rdesktop_clipboard_owner_atom;
 static Atom format_string_atom, format_utf8_string_atom, format_unicode_atom;
+/* Atoms of the file list targets file managers offer */
+static Atom format_uri_list_atom, format_gnome_files_atom;
 /* Atom of the INCR clipboard type (see ICCCM on "INCR Properties") */
 static Atom incr_atom;
 /* Stores the last "selection request" (= another X client requesting clipboard data from us).
@@ -118,102 +132,496 @@ static int num_targets;
 static RD_BOOL rdesktop_is_selection_owner = False;
 /* Time when we acquired the selection. */
 static Time acquire_time = 0;
+/* File list target offered by the selection owner, and its selection. 0 if none. */
+static Atom g_files_target = 0;
+static Atom g_files_selection = 0;
+
+/* Data of one clipboard transfer, in either direction. The first chunk is
+   kept in memory; once a transfer outgrows it, everything goes to an
+   unlinked temporary file and the buffer only holds what was last read back. */
+struct clip_spool
+{
+	uint8 *buffer;
+	FILE *file;
+	uint32 length;
+	uint32 offset;
+};
+
+/* Converts a transfer piece by piece as it arrives, into a spool */
+struct clip_convert
+{
+#ifdef USE_UNICODE_CLIPBOARD
+	iconv_t cd;
+	/* Incomplete multibyte sequence at the end of the last piece */
+	uint8 carry[8];
+	size_t carry_length;
+#endif
+	/* Character size of the output, 1 or 2 (UTF-16LE) */
+	unsigned int unit;
+	RD_BOOL add_cr;		/* LF to CR-LF */
+	RD_BOOL strip_cr;	/* CR-LF to LF, by dropping all CRs */
+	RD_BOOL to_null;	/* stop at the first null character */
+	RD_BOOL add_null;	/* null-terminate */
+	RD_BOOL drop_last;	/* drop the last byte */
+	RD_BOOL done;
+	RD_BOOL failed;
+	uint8 partial[2];
+	unsigned int partial_length;
+	uint16 previous;
+	uint8 held;
+	RD_BOOL holding;
+	uint8 out[4096];
+	uint32 out_length;
+	struct clip_spool *spool;
+};
 
 /* Denotes that an INCR ("chunked") transfer is in progress. */
 static int g_waiting_for_INCR = 0;
 /* Denotes the target format of the ongoing INCR ("chunked") transfer. */
 static Atom g_incr_target = 0;
-/* Buffers an INCR transfer. */
-static uint8 *g_clip_buffer = 0;
-/* Denotes the size of g_clip_buffer. */
-static uint32 g_clip_buflen = 0;
-
-/* Translates CR-LF to LF.
-   Changes the string in-place.
-   Does not stop on embedded nulls.
-   The length is updated. */
+/* Converted data from an X selection owner, for the RDP server. */
+static struct clip_spool g_clip_spool;
+static struct clip_convert g_clip_convert;
+
+/* Identifies the data of a selection owner, in a given RDP format. Owners
+   that report no TIMESTAMP have a timestamp of 0 or 1 and are never cached. */
+struct clip_cache_key
+{
+	Atom selection;
+	Window owner;
+	Time timestamp;
+	uint32 format;
+};
+/* Key of the request in progress */
+static struct clip_cache_key g_clip_key;
+/* The last converted data, sent again for as long as the owner keeps the selection */
+static struct clip_cache_key g_clip_cache_key;
+static struct clip_spool g_clip_cache;
+/* Selection whose TIMESTAMP alone is waited for, None when comparing both */
+static Atom g_timestamp_selection = None;
+
+/* Converted data from the RDP server, for the X requestor in selection_request. */
+static struct clip_spool g_provide_spool;
+static struct clip_convert g_provide_convert;
+/* Denotes that the requestor is served in INCR chunks. */
+static RD_BOOL g_provide_incr = False;
+/* Denotes that the requestor deleted the last chunk and waits for the next one. */
+static RD_BOOL g_provide_waiting = False;
+/* Denotes that the whole response from the RDP server is in the spool. */
+static RD_BOOL g_provide_done = False;
+/* Time of the last INCR chunk, to give up on requestors that went away. */
+static time_t g_provide_time = 0;
+
 static void
-crlf2lf(uint8 * data, uint32 * length)
+clip_spool_free(struct clip_spool *spool)
 {
-	uint8 *dst, *src;
-	src = dst = data;
-	while (src < data + *length)
+	if (spool->file != NULL)
+		fclose(spool->file);
+	xfree(spool->buffer);
+	memset(spool, 0, sizeof(*spool));
+}
+
+static RD_BOOL
+clip_spool_pwrite(struct clip_spool *spool, uint8 * data, uint32 length, uint32 offset)
+{
+	ssize_t n;
+
+	while (length > 0)
 	{
-		if (*src != '\x0d')
-			*dst++ = *src;
-		src++;
+		n = pwrite(fileno(spool->file), data, length, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			logger(Clipboard, Error, "clip_spool_pwrite(), write failed: %s",
+			       strerror(errno));
+			return False;
+		}
+		data += n;
+		length -= n;
+		offset += n;
 	}
-	*length = dst - data;
+
+	return True;
 }
 
-#ifdef USE_UNICODE_CLIPBOARD
-/* Translate LF to CR-LF. To do this, we must allocate more memory.
-   The returned string is null-terminated, as required by CF_UNICODETEXT.
-   The size is updated. */
+static RD_BOOL
+clip_spool_write(struct clip_spool *spool, uint8 * data, uint32 length)
+{
+	if (spool->buffer == NULL)
+		spool->buffer = xmalloc(CLIP_CHUNK_SIZE);
+
+	if (spool->file == NULL && length > CLIP_CHUNK_SIZE - spool->length)
+	{
+		spool->file = tmpfile();
+		if (spool->file == NULL)
+		{
+			logger(Clipboard, Error,
+			       "clip_spool_write(), failed to create temporary file: %s",
+			       strerror(errno));
+			return False;
+		}
+		if (!clip_spool_pwrite(spool, spool->buffer, spool->length, 0))
+			return False;
+	}
+
+	if (spool->file == NULL)
+		memcpy(spool->buffer + spool->length, data, length);
+	else if (!clip_spool_pwrite(spool, data, length, spool->length))
+		return False;
+
+	spool->length += length;
+	return True;
+}
+
+/* Returns up to *length bytes from the read offset, NULL at the end or on error */
 static uint8 *
-utf16_lf2crlf(uint8 * data, uint32 * size)
+clip_spool_read(struct clip_spool *spool, uint32 * length)
 {
-	uint8 *result;
-	uint16 *inptr, *outptr;
-	RD_BOOL swap_endianness;
+	uint8 *data;
+	ssize_t n;
 
-	/* Worst case: Every char is LF */
-	result = xmalloc((*size * 2) + 2);
-	if (result == NULL)
+	*length = MIN(*length, spool->length - spool->offset);
+	if (*length == 0)
 		return NULL;
 
-	inptr = (uint16 *) data;
-	outptr = (uint16 *) result;
+	if (spool->file == NULL)
+	{
+		data = spool->buffer + spool->offset;
+	}
+	else
+	{
+		*length = MIN(*length, CLIP_CHUNK_SIZE);
+		do
+			n = pread(fileno(spool->file), spool->buffer, *length, spool->offset);
+		while (n < 0 && errno == EINTR);
+		if (n <= 0)
+		{
+			logger(Clipboard, Error, "clip_spool_read(), read failed: %s",
+			       strerror(errno));
+			return NULL;
+		}
+		*length = n;
+		data = spool->buffer;
+	}
+
+	spool->offset += *length;
+	return data;
+}
+
+/* Drops what was read from a spool in a file, once that is at least as much
+   as what is left, so a long INCR transfer keeps no more than about twice
+   what the requestor has yet to take on disk */
+static RD_BOOL
+clip_spool_compact(struct clip_spool *spool)
+{
+	uint32 kept, moved;
+	ssize_t n;
+
+	if (spool->file == NULL || spool->offset < CLIP_CHUNK_SIZE
+	    || spool->offset < spool->length - spool->offset)
+		return True;
 
-	/* Check for a reversed BOM */
-	swap_endianness = (*inptr == 0xfffe);
+	kept = spool->length - spool->offset;
+	for (moved = 0; moved < kept; moved += n)
+	{
+		do
+			n = pread(fileno(spool->file), spool->buffer,
+				  MIN(kept - moved, CLIP_CHUNK_SIZE), spool->offset + moved);
+		while (n < 0 && errno == EINTR);
+		if (n <= 0)
+		{
+			logger(Clipboard, Error, "clip_spool_compact(), read failed: %s",
+			       strerror(errno));
+			return False;
+		}
+		if (!clip_spool_pwrite(spool, spool->buffer, n, moved))
+			return False;
+	}
 
-	uint16 uvalue_previous = 0;	/* Kept so we'll avoid translating CR-LF to CR-CR-LF */
-	while ((uint8 *) inptr < data + *size)
+	if (ftruncate(fileno(spool->file), kept) != 0)
 	{
-		uint16 uvalue = *inptr;
-		if (swap_endianness)
-			uvalue = ((uvalue << 8) & 0xff00) + (uvalue >> 8);
-		if ((uvalue == 0x0a) && (uvalue_previous != 0x0d))
-			*outptr++ = swap_endianness ? 0x0d00 : 0x0d;
-		uvalue_previous = uvalue;
-		*outptr++ = *inptr++;
+		logger(Clipboard, Error, "clip_spool_compact(), truncate failed: %s",
+		       strerror(errno));
+		return False;
 	}
-	*outptr++ = 0;		/* null termination */
-	*size = (uint8 *) outptr - result;
 
-	return result;
+	spool->length = kept;
+	spool->offset = 0;
+	return True;
 }
-#else
-/* Translate LF to CR-LF. To do this, we must allocate more memory.
-   The length is updated. */
-static uint8 *
-lf2crlf(uint8 * data, uint32 * length)
+
+static void
+clip_convert_start(struct clip_convert *conv, struct clip_spool *spool, unsigned int unit)
+{
+	clip_spool_free(spool);
+	memset(conv, 0, sizeof(*conv));
+#ifdef USE_UNICODE_CLIPBOARD
+	conv->cd = (iconv_t) - 1;
+#endif
+	conv->unit = unit;
+	conv->spool = spool;
+}
+
+static void
+clip_convert_flush(struct clip_convert *conv)
+{
+	if (conv->out_length > 0 && !conv->failed
+	    && !clip_spool_write(conv->spool, conv->out, conv->out_length))
+	{
+		conv->failed = True;
+		conv->done = True;
+	}
+	conv->out_length = 0;
+}
+
+static void
+clip_convert_write(struct clip_convert *conv, const uint8 * data, size_t length)
+{
+	if (conv->out_length + length > sizeof(conv->out))
+		clip_convert_flush(conv);
+
+	/* large runs go straight to the spool */
+	if (length >= sizeof(conv->out))
+	{
+		if (!conv->failed && !clip_spool_write(conv->spool, (uint8 *) data, length))
+		{
+			conv->failed = True;
+			conv->done = True;
+		}
+		return;
+	}
+
+	memcpy(conv->out + conv->out_length, data, length);
+	conv->out_length += length;
+}
+
+static void
+clip_convert_put(struct clip_convert *conv, const uint8 * unit)
+{
+	clip_convert_write(conv, unit, conv->unit);
+}
+
+/* Returns the length of the leading characters that need no translation, that
+   is none below 16 with its bit set in stops */
+static size_t
+clip_convert_span(const uint8 * data, size_t length, unsigned int unit, unsigned int stops)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i match[16], block, hit;
+	int n, k, bits;
+
+	/* sixteen bytes at a time, the rest below */
+	for (n = 0, k = 0; k < 16; k++)
+		if (stops & (1 << k))
+			match[n++] = (unit == 2) ? _mm_set1_epi16(k) : _mm_set1_epi8(k);
+
+	for (; i + 16 <= length; i += 16)
+	{
+		block = _mm_loadu_si128((const __m128i *) (data + i));
+		hit = _mm_setzero_si128();
+		for (k = 0; k < n; k++)
+			hit = _mm_or_si128(hit, (unit == 2) ? _mm_cmpeq_epi16(block, match[k]) :
+					   _mm_cmpeq_epi8(block, match[k]));
+
+		bits = _mm_movemask_epi8(hit);
+		if (bits != 0)
+			return i + __builtin_ctz(bits);
+	}
+#endif
+
+	if (unit == 2)
+	{
+		for (; i + 1 < length; i += 2)
+			if (data[i + 1] == 0 && data[i] < 16 && (stops & (1 << data[i])))
+				break;
+		return i;
+	}
+
+	for (; i < length; i++)
+		if (data[i] < 16 && (stops & (1 << data[i])))
+			break;
+	return i;
+}
+
+/* Translates linebreaks and finds the end of a single character */
+static void
+clip_convert_char(struct clip_convert *conv, const uint8 * unit)
+{
+	static const uint8 cr[2] = { '\x0d', 0 };
+	uint16 c;
+
+	c = (conv->unit == 2) ? (unit[0] | (unit[1] << 8)) : unit[0];
+
+	if (conv->to_null && c == 0)
+	{
+		conv->done = True;
+		return;
+	}
+	if (conv->strip_cr && c == 0x0d)
+		return;
+	/* Kept so we'll avoid translating CR-LF to CR-CR-LF */
+	if (conv->add_cr && c == 0x0a && conv->previous != 0x0d)
+		clip_convert_put(conv, cr);
+	conv->previous = c;
+
+	if (conv->drop_last)
+	{
+		if (conv->holding)
+			clip_convert_put(conv, &conv->held);
+		conv->held = unit[0];
+		conv->holding = True;
+		return;
+	}
+
+	clip_convert_put(conv, unit);
+}
+
+/* Splits converted data into characters, which may straddle pieces */
+static void
+clip_convert_chars(struct clip_convert *conv, const uint8 * data, size_t length)
+{
+	unsigned int stops;
+	size_t run;
+
+	stops = 0;
+	if (conv->to_null)
+		stops |= 1 << 0;
+	if (conv->strip_cr || conv->add_cr)
+		stops |= 1 << 0x0d;
+	if (conv->add_cr)
+		stops |= 1 << 0x0a;
+
+	while (length > 0 && !conv->done)
+	{
+		/* copy runs of plain characters in one go */
+		if (conv->partial_length == 0 && !conv->drop_last)
+		{
+			run = clip_convert_span(data, length, conv->unit, stops);
+			if (run > 0)
+			{
+				clip_convert_write(conv, data, run);
+				/* a CR ends the run whenever previous matters */
+				conv->previous = 0;
+				data += run;
+				length -= run;
+				continue;
+			}
+		}
+
+		conv->partial[conv->partial_length++] = *data++;
+		length--;
+		if (conv->partial_length == conv->unit)
+		{
+			clip_convert_char(conv, conv->partial);
+			conv->partial_length = 0;
+		}
+	}
+}
+
+#ifdef USE_UNICODE_CLIPBOARD
+/* Returns False on invalid input, and leaves an incomplete sequence at the end in *in */
+static RD_BOOL
+clip_convert_iconv(struct clip_convert *conv, char **in, size_t * in_length)
 {
-	uint8 *result, *p, *o;
+	char buffer[4096], *out;
+	size_t out_length;
+
+	while (*in_length > 0 && !conv->done)
+	{
+		out = buffer;
+		out_length = sizeof(buffer);
+		if (iconv(conv->cd, in, in_length, &out, &out_length) == (size_t) - 1
+		    && errno != E2BIG)
+		{
+			clip_convert_chars(conv, (uint8 *) buffer, out - buffer);
+			return (errno == EINVAL);
+		}
+		clip_convert_chars(conv, (uint8 *) buffer, out - buffer);
+	}
+
+	return True;
+}
+#endif
 
-	/* Worst case: Every char is LF */
-	result = xmalloc(*length * 2);
+static void
+clip_convert_feed(struct clip_convert *conv, uint8 * data, uint32 length)
+{
+#ifdef USE_UNICODE_CLIPBOARD
+	char *in;
+	size_t in_length;
 
-	p = data;
-	o = result;
+	if (conv->done)
+		return;
 
-	uint8 previous = '\0';	/* Kept to avoid translating CR-LF to CR-CR-LF */
-	while (p < data + *length)
+	if (conv->cd != (iconv_t) - 1)
 	{
-		if ((*p == '\x0a') && (previous != '\x0d'))
-			*o++ = '\x0d';
-		previous = *p;
-		*o++ = *p++;
+		/* complete a sequence split over the previous piece */
+		while (conv->carry_length > 0 && length > 0)
+		{
+			conv->carry[conv->carry_length++] = *data++;
+			length--;
+			in = (char *) conv->carry;
+			in_length = conv->carry_length;
+			if (!clip_convert_iconv(conv, &in, &in_length))
+				goto invalid;
+			if (conv->done)
+				return;
+			if (in_length == sizeof(conv->carry))
+				goto invalid;
+			memmove(conv->carry, in, in_length);
+			conv->carry_length = in_length;
+		}
+		if (conv->carry_length > 0)
+			return;
+
+		in = (char *) data;
+		in_length = length;
+		if (!clip_convert_iconv(conv, &in, &in_length))
+			goto invalid;
+		if (conv->done)
+			return;
+		if (in_length >= sizeof(conv->carry))
+			goto invalid;
+		memcpy(conv->carry, in, in_length);
+		conv->carry_length = in_length;
+		return;
 	}
-	*length = o - result;
+#endif
 
-	/* Convenience */
-	*o++ = '\0';
+	clip_convert_chars(conv, data, length);
+	return;
 
-	return result;
+#ifdef USE_UNICODE_CLIPBOARD
+      invalid:
+	/* like iconv(), convert up to the first invalid sequence */
+	logger(Clipboard, Warning, "clip_convert_feed(), invalid input, data truncated");
+	conv->carry_length = 0;
+	conv->done = True;
+#endif
 }
+
+static void
+clip_convert_finish(struct clip_convert *conv)
+{
+	static const uint8 null[2] = { 0, 0 };
+
+	if (conv->spool == NULL)
+		return;
+
+	if (conv->add_null)
+		clip_convert_put(conv, null);
+	clip_convert_flush(conv);
+
+#ifdef USE_UNICODE_CLIPBOARD
+	if (conv->cd != (iconv_t) - 1)
+		iconv_close(conv->cd);
+	conv->cd = (iconv_t) - 1;
 #endif
+	conv->done = True;
+	conv->spool = NULL;
+}
 
 static void
 xclip_provide_selection(XSelectionRequestEvent * req, Atom type, unsigned int format, uint8 * data,
@@ -272,16 +680,58 @@ xclip_refuse_selection(XSelectionRequestEvent * req)
 	XSendEvent(g_display, req->requestor, False, NoEventMask, &xev);
 }
 
-/* Wrapper for cliprdr_send_data which also cleans the request state. */
+/* Sends the spooled data to RDP. The server is told the length up front, so
+   the data can only go once all of it has been converted. */
 static void
-helper_cliprdr_send_response(uint8 * data, uint32 length)
+xclip_send_spool(struct clip_spool *spool)
+{
+	uint32 length, sent;
+	uint8 *data;
+
+	logger(Clipboard, Debug, "xclip_send_spool(), sending %u bytes", (unsigned) spool->length);
+
+	cliprdr_send_data_start(spool->length);
+	spool->offset = 0;
+	for (sent = 0; sent < spool->length; sent += length)
+	{
+		length = CLIP_CHUNK_SIZE;
+		data = clip_spool_read(spool, &length);
+		if (data == NULL)
+		{
+			/* keep the framing, the server was promised this much */
+			length = MIN(CLIP_CHUNK_SIZE, spool->length - sent);
+			memset(spool->buffer, 0, length);
+			data = spool->buffer;
+			spool->offset += length;
+		}
+		cliprdr_send_data_more(data, length);
+	}
+}
+
+/* Announces the formats the current X selection owner offers */
+static void
+xclip_announce_formats(void)
+{
+	if (g_files_target != 0)
+		cliprdr_send_file_format_announce(RDP_CF_TEXT);
+	else
+		cliprdr_send_simple_native_format_announce(RDP_CF_TEXT);
+}
+
+/* Wrapper for cliprdr_send_data which also cleans the request state.
+   A NULL spool sends an empty response. */
+static void
+helper_cliprdr_send_response(struct clip_spool *spool)
 {
 	if (rdp_clipboard_request_format != 0)
 	{
-		cliprdr_send_data(data, length);
+		if (spool != NULL)
+			xclip_send_spool(spool);
+		else
+			cliprdr_send_data(NULL, 0);
 		rdp_clipboard_request_format = 0;
 		if (!rdesktop_is_selection_owner)
-			cliprdr_send_simple_native_format_announce(RDP_CF_TEXT);
+			xclip_announce_formats();
 	}
 }
 
@@ -291,35 +741,102 @@ helper_cliprdr_send_response(uint8 * data, uint32 length)
 static void
 helper_cliprdr_send_empty_response()
 {
-	helper_cliprdr_send_response(NULL, 0);
+	helper_cliprdr_send_response(NULL);
+}
+
+static void
+xclip_cache_clear(void)
+{
+	clip_spool_free(&g_clip_cache);
+	memset(&g_clip_cache_key, 0, sizeof(g_clip_cache_key));
+}
+
+/* Keeps the data just sent for the key of the request */
+static void
+xclip_cache_store(struct clip_spool *spool)
+{
+	if (g_clip_key.timestamp <= 1)
+		return;
+
+	clip_spool_free(&g_clip_cache);
+	g_clip_cache = *spool;
+	memset(spool, 0, sizeof(*spool));
+	memcpy(&g_clip_cache_key, &g_clip_key, sizeof(g_clip_key));
+}
+
+/* Replies from the cache if it holds this owner's data. Returns False if the
+   data has to be fetched. */
+static RD_BOOL
+xclip_send_cached(Atom selection, Time timestamp)
+{
+	/* compared with memcmp(), so the padding has to be zero too */
+	memset(&g_clip_key, 0, sizeof(g_clip_key));
+	g_clip_key.selection = selection;
+	g_clip_key.owner = XGetSelectionOwner(g_display, selection);
+	g_clip_key.timestamp = timestamp;
+	g_clip_key.format = rdp_clipboard_request_format;
+
+	if (timestamp <= 1 || memcmp(&g_clip_key, &g_clip_cache_key, sizeof(g_clip_key)) != 0)
+		return False;
+
+	logger(Clipboard, Debug, "xclip_send_cached(), sending %u cached bytes",
+	       (unsigned) g_clip_cache.length);
+	helper_cliprdr_send_response(&g_clip_cache);
+	return True;
 }
 
-/* Replies with clipboard data to RDP, converting it from the target format
-   to the expected RDP format as necessary. Returns true if data was sent.
+/* Asks the owner of selection for its targets, unless the cache can reply */
+static void
+xclip_request_targets(Atom selection, Time timestamp, Time time)
+{
+	if (!probing_selections && xclip_send_cached(selection, timestamp))
+		return;
+
+	XConvertSelection(g_display, selection, targets_atom, rdesktop_clipboard_target_atom,
+			  g_wnd, time);
+}
+
+/* Asks the owner of selection for its TIMESTAMP, which keys the cache */
+static void
+xclip_request_timestamp(Atom selection)
+{
+	g_timestamp_selection = selection;
+	XConvertSelection(g_display, selection, timestamp_atom,
+			  (selection == primary_atom) ? rdesktop_primary_timestamp_target_atom :
+			  rdesktop_clipboard_timestamp_target_atom, g_wnd, CurrentTime);
+}
+
+/* Sets up g_clip_convert to convert data from the target format to the
+   expected RDP format, as it arrives. Returns false if there is no such
+   conversion.
  */
 static RD_BOOL
-xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
+xclip_convert_start(Atom target)
 {
 	char *target_name;
 
 	target_name = XGetAtomName(g_display, target);
-	logger(Clipboard, Debug, "xclip_send_data_with_convert(), target=%s, size=%u",
-	       target_name, (unsigned) source_size);
+	logger(Clipboard, Debug, "xclip_convert_start(), target=%s", target_name);
 	XFree(target_name);
 
+	if (rdp_clipboard_request_format == CF_FILEGROUPDESCRIPTORW)
+	{
+		if (target != format_uri_list_atom && target != format_gnome_files_atom)
+			return False;
+
+		/* the list, as text */
+		clip_convert_start(&g_clip_convert, &g_clip_spool, 1);
+		g_clip_convert.add_null = True;
+
+		return True;
+	}
+
 #ifdef USE_UNICODE_CLIPBOARD
 	if (target == format_string_atom ||
 	    target == format_unicode_atom || target == format_utf8_string_atom)
 	{
-		size_t unicode_buffer_size;
-		char *unicode_buffer;
+		char *charset;
 		iconv_t cd;
-		size_t unicode_buffer_size_remaining;
-		char *unicode_buffer_remaining;
-		char *data_remaining;
-		size_t data_size_remaining;
-		uint32 translated_data_size;
-		uint8 *translated_data;
 
 		if (rdp_clipboard_request_format != RDP_CF_TEXT)
 			return False;
@@ -330,93 +847,49 @@ xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
 		   WinNT versions are Unicode-minded).
 		 */
 		if (target == format_string_atom)
-		{
-			char *locale_charset = nl_langinfo(CODESET);
-			cd = iconv_open(WINDOWS_CODEPAGE, locale_charset);
-			if (cd == (iconv_t) - 1)
-			{
-				logger(Clipboard, Error,
-				       "xclip_send_data_with_convert(), convert failed, locale charset %s not found",
-				       locale_charset);
-				return False;
-			}
-			unicode_buffer_size = source_size * 4;
-		}
+			charset = nl_langinfo(CODESET);
 		else if (target == format_unicode_atom)
-		{
-			cd = iconv_open(WINDOWS_CODEPAGE, "UCS-2");
-			if (cd == (iconv_t) - 1)
-			{
-				return False;
-			}
-			unicode_buffer_size = source_size;
-		}
-		else if (target == format_utf8_string_atom)
-		{
-			cd = iconv_open(WINDOWS_CODEPAGE, "UTF-8");
-			if (cd == (iconv_t) - 1)
-			{
-				return False;
-			}
-			/* UTF-8 is guaranteed to be less or equally compact
-			   as UTF-16 for all Unicode chars >=2 bytes.
-			 */
-			unicode_buffer_size = source_size * 2;
-		}
+			charset = "UCS-2";
 		else
-		{
-			return False;
-		}
+			charset = "UTF-8";
 
-		unicode_buffer = xmalloc(unicode_buffer_size);
-		unicode_buffer_size_remaining = unicode_buffer_size;
-		unicode_buffer_remaining = unicode_buffer;
-		data_remaining = (char *) source;
-		data_size_remaining = source_size;
-		iconv(cd, (char **) &data_remaining, &data_size_remaining,
-		      &unicode_buffer_remaining, &unicode_buffer_size_remaining);
-		iconv_close(cd);
-
-		/* translate linebreaks */
-		translated_data_size = unicode_buffer_size - unicode_buffer_size_remaining;
-		translated_data = utf16_lf2crlf((uint8 *) unicode_buffer, &translated_data_size);
-		if (translated_data != NULL)
+		cd = iconv_open(WINDOWS_CODEPAGE, charset);
+		if (cd == (iconv_t) - 1)
 		{
-			logger(Clipboard, Debug,
-			       "xclip_send_data_with_convert(), sending unicode string of %d bytes",
-			       translated_data_size);
-			helper_cliprdr_send_response(translated_data, translated_data_size);
-			xfree(translated_data);	/* Not the same thing as XFree! */
+			logger(Clipboard, Error,
+			       "xclip_convert_start(), convert failed, charset %s not found",
+			       charset);
+			return False;
 		}
 
-		xfree(unicode_buffer);
+		/* translate linebreaks, CF_UNICODETEXT is null-terminated */
+		clip_convert_start(&g_clip_convert, &g_clip_spool, 2);
+		g_clip_convert.cd = cd;
+		g_clip_convert.add_cr = True;
+		g_clip_convert.add_null = True;
 
 		return True;
 	}
 #else
 	if (target == format_string_atom)
 	{
-		uint8 *translated_data;
-		uint32 length = source_size;
-
 		if (rdp_clipboard_request_format != RDP_CF_TEXT)
 			return False;
 
 		logger(Clipboard, Debug,
-		       "xclip_send_data_with_convert(), translating linebreaks before sending data");
-		translated_data = lf2crlf(source, &length);
-		if (translated_data != NULL)
-		{
-			helper_cliprdr_send_response(translated_data, length + 1);
-			xfree(translated_data);	/* Not the same thing as XFree! */
-		}
+		       "xclip_convert_start(), translating linebreaks before sending data");
+		clip_convert_start(&g_clip_convert, &g_clip_spool, 1);
+		g_clip_convert.add_cr = True;
+		g_clip_convert.add_null = True;
 
 		return True;
 	}
 #endif
 	else if (target == rdesktop_native_atom)
 	{
-		helper_cliprdr_send_response(source, source_size + 1);
+		/* with the null the property had */
+		clip_convert_start(&g_clip_convert, &g_clip_spool, 1);
+		g_clip_convert.add_null = True;
 
 		return True;
 	}
@@ -426,6 +899,292 @@ xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
 	}
 }
 
+/* Turns a text/uri-list, or the lines after "copy" or "cut" in an
+   x-special/gnome-copied-files, into local paths. Works in place. */
+static char **
+xclip_parse_uri_list(char *text, unsigned int *count)
+{
+	char **paths = NULL;
+	char *line, *next, *p, *q;
+	char hex[3] = { 0 };
+	unsigned int size = 0;
+
+	*count = 0;
+	for (line = text; line != NULL && *line != '\0'; line = next)
+	{
+		next = strpbrk(line, "\r\n");
+		if (next != NULL)
+		{
+			*next++ = '\0';
+			next += strspn(next, "\r\n");
+		}
+
+		/* skips comments and other schemes too */
+		if (!str_startswith(line, "file://"))
+			continue;
+
+		/* past the host name, if any */
+		p = strchr(line + 7, '/');
+		if (p == NULL)
+			continue;
+
+		for (q = p; *p != '\0'; q++)
+		{
+			if (p[0] == '%' && isxdigit((unsigned char) p[1])
+			    && isxdigit((unsigned char) p[2]))
+			{
+				hex[0] = p[1];
+				hex[1] = p[2];
+				*q = strtol(hex, NULL, 16);
+				p += 3;
+			}
+			else
+				*q = *p++;
+		}
+		*q = '\0';
+
+		if (*count == size)
+		{
+			size = size ? size * 2 : 8;
+			paths = xrealloc(paths, size * sizeof(char *));
+		}
+		paths[(*count)++] = strchr(line + 7, '/');
+	}
+
+	return paths;
+}
+
+/* Replies with the files listed in g_clip_spool */
+static void
+xclip_send_file_list(void)
+{
+	char *text, **paths;
+	unsigned int count;
+	uint32 length, offset;
+	uint8 *data;
+
+	text = xmalloc(g_clip_spool.length + 1);
+	g_clip_spool.offset = 0;
+	for (offset = 0; length = CLIP_CHUNK_SIZE,
+	     (data = clip_spool_read(&g_clip_spool, &length)) != NULL; offset += length)
+		memcpy(text + offset, data, length);
+	text[offset] = '\0';
+
+	paths = xclip_parse_uri_list(text, &count);
+	if (count == 0)
+	{
+		helper_cliprdr_send_empty_response();
+	}
+	else if (rdp_clipboard_request_format != 0)
+	{
+		cliprdr_send_file_list(paths, count);
+		/* no new format list, the server reads the files after this */
+		rdp_clipboard_request_format = 0;
+	}
+
+	xfree(paths);
+	xfree(text);
+}
+
+/* Replies with what g_clip_convert produced */
+static void
+xclip_send_converted(void)
+{
+	clip_convert_finish(&g_clip_convert);
+	if (!g_clip_convert.failed && rdp_clipboard_request_format == CF_FILEGROUPDESCRIPTORW)
+		xclip_send_file_list();
+	else if (g_clip_convert.failed)
+		helper_cliprdr_send_empty_response();
+	else
+	{
+		helper_cliprdr_send_response(&g_clip_spool);
+		xclip_cache_store(&g_clip_spool);
+	}
+	clip_spool_free(&g_clip_spool);
+}
+
+/* Sets up g_provide_convert to convert data from the RDP format to the
+   format the requestor asked for. Returns false if there is no such
+   conversion. */
+static RD_BOOL
+xclip_provide_start(void)
+{
+	char *target_name;
+
+	if (selection_request.target == format_string_atom || selection_request.target == XA_STRING)
+	{
+		/* We're expecting a CF_TEXT response. Translate linebreaks,
+		   and only send data up to the null byte, if any */
+		clip_convert_start(&g_provide_convert, &g_provide_spool, 1);
+		g_provide_convert.strip_cr = True;
+		g_provide_convert.to_null = True;
+	}
+#ifdef USE_UNICODE_CLIPBOARD
+	else if (selection_request.target == format_utf8_string_atom)
+	{
+		/* We're expecting a CF_UNICODETEXT response */
+		iconv_t cd = iconv_open("UTF-8", WINDOWS_CODEPAGE);
+		if (cd == (iconv_t) - 1)
+			return False;
+
+		/* translate linebreaks (works just as well on UTF-8) */
+		clip_convert_start(&g_provide_convert, &g_provide_spool, 1);
+		g_provide_convert.cd = cd;
+		g_provide_convert.strip_cr = True;
+		g_provide_convert.to_null = True;
+	}
+	else if (selection_request.target == format_unicode_atom)
+	{
+		/* We're expecting a CF_UNICODETEXT response, so what we're
+		   receiving matches our requirements and there's no need
+		   for further conversions. */
+		clip_convert_start(&g_provide_convert, &g_provide_spool, 2);
+		g_provide_convert.to_null = True;
+	}
+#endif
+	else if (selection_request.target == rdesktop_native_atom)
+	{
+		/* Pass as-is, without the null the other rdesktop added */
+		clip_convert_start(&g_provide_convert, &g_provide_spool, 1);
+		g_provide_convert.drop_last = True;
+	}
+	else
+	{
+		target_name = XGetAtomName(g_display, selection_request.target);
+		logger(Clipboard, Debug,
+		       "xclip_provide_start(), no handler for selection target '%s'",
+		       target_name);
+		XFree(target_name);
+		return False;
+	}
+
+	g_provide_incr = False;
+	g_provide_waiting = False;
+	g_provide_done = False;
+	return True;
+}
+
+/* Ends the transfer to the requestor, refusing it if it never got any data */
+static void
+xclip_provide_end(RD_BOOL refuse)
+{
+	if (refuse)
+		xclip_refuse_selection(&selection_request);
+
+	if (g_provide_incr && selection_request.requestor != g_wnd)
+		XSelectInput(g_display, selection_request.requestor, NoEventMask);
+
+	clip_convert_finish(&g_provide_convert);
+	clip_spool_free(&g_provide_spool);
+	g_provide_incr = False;
+	has_selection_request = False;
+}
+
+/* Too much for a single property, so hand the data out in INCR chunks. The
+   requestor deletes the property to ask for the next one. */
+static void
+xclip_provide_incr(uint32 size)
+{
+	long size_hint = size;
+
+	logger(Clipboard, Debug, "xclip_provide_incr(), sending INCR, size hint %u",
+	       (unsigned) size);
+
+	if (selection_request.requestor != g_wnd)
+		XSelectInput(g_display, selection_request.requestor, PropertyChangeMask);
+	xclip_provide_selection(&selection_request, incr_atom, 32, (uint8 *) & size_hint, 1);
+
+	g_provide_incr = True;
+	g_provide_waiting = False;
+	g_provide_time = time(NULL);
+}
+
+/* Passes on whatever the requestor can take of the converted data */
+static void
+xclip_provide_more(void)
+{
+	uint8 *data;
+	uint32 length;
+
+	/* the requestor took all chunks before the next one */
+	if (g_provide_incr && g_provide_waiting && !clip_spool_compact(&g_provide_spool))
+		g_provide_convert.failed = True;
+
+	if (g_provide_convert.failed)
+	{
+		/* an INCR requestor gets what it has so far */
+		if (g_provide_incr)
+			XChangeProperty(g_display, selection_request.requestor,
+					selection_request.property, selection_request.target, 8,
+					PropModeReplace, NULL, 0);
+		xclip_provide_end(!g_provide_incr);
+		return;
+	}
+
+	if (!g_provide_incr)
+	{
+		if (!g_provide_done)
+			return;
+
+		if (g_provide_spool.file != NULL)
+		{
+			xclip_provide_incr(g_provide_spool.length);
+			return;
+		}
+
+		xclip_provide_selection(&selection_request, selection_request.target, 8,
+					g_provide_spool.buffer, g_provide_spool.length);
+		xclip_provide_end(False);
+		return;
+	}
+
+	if (!g_provide_waiting)
+		return;
+
+	length = CLIP_CHUNK_SIZE;
+	data = clip_spool_read(&g_provide_spool, &length);
+	if (data == NULL && !g_provide_done)
+		return;
+
+	/* the last chunk is empty */
+	XChangeProperty(g_display, selection_request.requestor, selection_request.property,
+			selection_request.target, 8, PropModeReplace, data, length);
+	g_provide_waiting = False;
+	g_provide_time = time(NULL);
+
+	if (data == NULL)
+		xclip_provide_end(False);
+}
+
+/* Gives up on an INCR requestor that stopped taking chunks */
+void
+xclip_check_timers(void)
+{
+	if (has_selection_request && g_provide_incr
+	    && time(NULL) - g_provide_time > CLIP_INCR_TIMEOUT)
+	{
+		logger(Clipboard, Warning,
+		       "xclip_check_timers(), INCR transfer stalled, giving up on it.");
+		xclip_provide_end(False);
+	}
+}
+
+/* Update select timeout, to notice a stalled INCR requestor */
+void
+xclip_select_timeout(struct timeval *tv)
+{
+	struct timeval ourtimeout = { 1, 0 };
+
+	if (has_selection_request && g_provide_incr)
+	{
+		if (timercmp(&ourtimeout, tv, <))
+		{
+			tv->tv_sec = ourtimeout.tv_sec;
+			tv->tv_usec = ourtimeout.tv_usec;
+		}
+	}
+}
+
 static void
 xclip_clear_target_props()
 {
@@ -446,6 +1205,9 @@ xclip_probe_selections()
 {
 	Window primary_owner, clipboard_owner;
 
+	/* the owner changed or is about to */
+	xclip_cache_clear();
+
 	if (probing_selections)
 	{
 		logger(Clipboard, Debug,
@@ -458,6 +1220,7 @@ xclip_probe_selections()
 
 	probing_selections = True;
 	reprobe_selections = False;
+	g_files_target = 0;
 
 	xclip_clear_target_props();
 
@@ -477,6 +1240,7 @@ xclip_probe_selections()
 	{
 		primary_timestamp = 0;
 		clipboard_timestamp = 0;
+		g_timestamp_selection = None;
 		XConvertSelection(g_display, primary_atom, timestamp_atom,
 				  rdesktop_primary_timestamp_target_atom, g_wnd, CurrentTime);
 		XConvertSelection(g_display, clipboard_atom, timestamp_atom,
@@ -528,7 +1292,11 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 	char *selection_name, *target_name, *property_name;
 
 	if (event->property == None)
+	{
+		if (event->target == timestamp_atom && event->selection == g_timestamp_selection)
+			goto no_timestamp;
 		goto fail;
+	}
 
 	selection_name = XGetAtomName(g_display, event->selection);
 	target_name = XGetAtomName(g_display, event->target);
@@ -560,6 +1328,8 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 
 		if ((res != Success) || (nitems != 1) || (format != 32))
 		{
+			if (event->selection == g_timestamp_selection)
+				goto no_timestamp;
 			logger(Clipboard, Error,
 			       "xclip_handle_SelectionNotify(), XGetWindowProperty failed");
 			goto fail;
@@ -588,23 +1358,28 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 
 		XFree(data);
 
-		if (primary_timestamp && clipboard_timestamp)
+		if (event->selection == g_timestamp_selection)
+		{
+			g_timestamp_selection = None;
+			xclip_request_targets(event->selection,
+					      (event->selection == primary_atom) ? primary_timestamp :
+					      clipboard_timestamp, event->time);
+		}
+		else if (g_timestamp_selection == None && primary_timestamp && clipboard_timestamp)
 		{
 			if (primary_timestamp > clipboard_timestamp)
 			{
 				logger(Clipboard, Debug,
 				       "xclip_handle_SelectionNotify(), PRIMARY is most recent selection");
-				XConvertSelection(g_display, primary_atom, targets_atom,
-						  rdesktop_clipboard_target_atom, g_wnd,
-						  event->time);
+				xclip_request_targets(primary_atom, primary_timestamp,
+						      event->time);
 			}
 			else
 			{
 				logger(Clipboard, Debug,
 				       "xclip_handle_SelectionNotify(), CLIPBOARD is most recent selection");
-				XConvertSelection(g_display, clipboard_atom, targets_atom,
-						  rdesktop_clipboard_target_atom, g_wnd,
-						  event->time);
+				xclip_request_targets(clipboard_atom, clipboard_timestamp,
+						      event->time);
 			}
 		}
 
@@ -644,6 +1419,13 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 		data = NULL;
 		g_incr_target = event->target;
 		g_waiting_for_INCR = 1;
+		/* without a conversion, still drain the transfer */
+		if (!xclip_convert_start(g_incr_target))
+		{
+			clip_convert_start(&g_clip_convert, &g_clip_spool, 1);
+			g_clip_convert.failed = True;
+			g_clip_convert.done = True;
+		}
 		goto end;
 	}
 
@@ -698,6 +1480,18 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 					}
 				}
 #endif
+				else if (supported_targets[i] == format_gnome_files_atom
+					 || supported_targets[i] == format_uri_list_atom)
+				{
+					/* both carry the same list, the former says whether it was cut */
+					if (probing_selections && g_files_target != format_gnome_files_atom)
+					{
+						logger(Clipboard, Debug,
+						       "xclip_handle_SelectionNotify(), other party offers files");
+						g_files_target = supported_targets[i];
+						g_files_selection = event->selection;
+					}
+				}
 				else if (supported_targets[i] == rdesktop_clipboard_formats_atom)
 				{
 					if (probing_selections && (text_target_satisfaction < 4))
@@ -757,10 +1551,15 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 			rdesktop_is_selection_owner = True;
 			cliprdr_send_native_format_announce(data, nitems);
 		}
-		else if ((!nitems) || (!xclip_send_data_with_convert(data, nitems, event->target)))
+		else if ((!nitems) || (!xclip_convert_start(event->target)))
 		{
 			goto fail;
 		}
+		else
+		{
+			clip_convert_feed(&g_clip_convert, data, nitems);
+			xclip_send_converted();
+		}
 	}
 
       end:
@@ -782,13 +1581,20 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 		   Without XFIXES, we cannot reliably know the formats offered by an
 		   upcoming selection owner, so we just lie about him offering
 		   RDP_CF_TEXT. */
-		cliprdr_send_simple_native_format_announce(RDP_CF_TEXT);
+		xclip_announce_formats();
 	}
 	else
 	{
 		helper_cliprdr_send_empty_response();
 	}
 	goto end;
+
+      no_timestamp:
+	/* this owner's data can't be told apart, so it isn't cached */
+	logger(Clipboard, Debug, "xclip_handle_SelectionNotify(), no TIMESTAMP from owner");
+	g_timestamp_selection = None;
+	xclip_request_targets(event->selection, 0, event->time);
+	goto end;
 }
 
 /* This function is called for SelectionRequest events.
@@ -833,6 +1639,7 @@ xclip_handle_SelectionRequest(XSelectionRequestEvent * event)
 		/* All the following targets require an async operation with the RDP server
 		   and currently we don't do X clipboard request queueing so we can only
 		   handle one such request at a time. */
+		xclip_check_timers();
 		if (has_selection_request)
 		{
 			logger(Clipboard, Warning,
@@ -925,6 +1732,15 @@ xclip_handle_PropertyNotify(XPropertyEvent * event)
 	uint8 *data;
 	Atom type;
 
+	if (g_provide_incr && event->state == PropertyDelete
+	    && event->window == selection_request.requestor
+	    && event->atom == selection_request.property)
+	{
+		g_provide_waiting = True;
+		xclip_provide_more();
+		return;
+	}
+
 	if (event->state == PropertyNewValue && g_waiting_for_INCR)
 	{
 		logger(Clipboard, Debug, "xclip_handle_PropertyNotify(), g_waiting_for_INCR != 0");
@@ -951,25 +1767,15 @@ xclip_handle_PropertyNotify(XPropertyEvent * event)
 				XFree(data);
 				g_waiting_for_INCR = 0;
 
-				if (g_clip_buflen > 0)
-				{
-					if (!xclip_send_data_with_convert
-					    (g_clip_buffer, g_clip_buflen, g_incr_target))
-					{
-						helper_cliprdr_send_empty_response();
-					}
-					xfree(g_clip_buffer);
-					g_clip_buffer = NULL;
-					g_clip_buflen = 0;
-				}
+				if (g_clip_spool.length == 0 && g_clip_convert.out_length == 0)
+					g_clip_convert.failed = True;
+				xclip_send_converted();
 			}
 			else
 			{
-				/* Another chunk in the INCR transfer */
+				/* Another chunk in the INCR transfer, converted right away */
 				offset += (nitems / 4);	/* offset at which to begin the next slurp */
-				g_clip_buffer = xrealloc(g_clip_buffer, g_clip_buflen + nitems);
-				memcpy(g_clip_buffer + g_clip_buflen, data, nitems);
-				g_clip_buflen += nitems;
+				clip_convert_feed(&g_clip_convert, data, nitems);
 
 				XFree(data);
 			}
@@ -994,6 +1800,8 @@ ui_clip_format_announce(uint8 * data, uint32 length)
 {
 	acquire_time = g_last_gesturetime;
 
+	xclip_cache_clear();
+
 	XSetSelectionOwner(g_display, primary_atom, g_wnd, acquire_time);
 	if (XGetSelectionOwner(g_display, primary_atom) != g_wnd)
 		logger(Clipboard, Warning, "failed to acquire ownership of PRIMARY clipboard");
@@ -1011,97 +1819,45 @@ ui_clip_format_announce(uint8 * data, uint32 length)
 	xclip_notify_change();
 }
 
-/* Called when the RDP server responds with clipboard data (after we've requested it). */
+/* Called when the RDP server responds with clipboard data (after we've requested it).
+   Large responses come in several pieces, the first with offset 0, the last
+   ending at total. Each is converted and passed on to the requestor right away. */
 void
-ui_clip_handle_data(uint8 * data, uint32 length)
+ui_clip_handle_data(uint8 * data, uint32 length, uint32 offset, uint32 total)
 {
-	RD_BOOL free_data = False;
-
-	if (length == 0)
-	{
-		xclip_refuse_selection(&selection_request);
-		has_selection_request = False;
+	if (!has_selection_request)
 		return;
-	}
 
-	if (selection_request.target == format_string_atom || selection_request.target == XA_STRING)
-	{
-		/* We're expecting a CF_TEXT response */
-		uint8 *firstnull;
-
-		/* translate linebreaks */
-		crlf2lf(data, &length);
-
-		/* Only send data up to null byte, if any */
-		firstnull = (uint8 *) strchr((char *) data, '\0');
-		if (firstnull)
-		{
-			length = firstnull - data + 1;
-		}
-	}
-#ifdef USE_UNICODE_CLIPBOARD
-	else if (selection_request.target == format_utf8_string_atom)
+	if (offset == 0)
 	{
-		/* We're expecting a CF_UNICODETEXT response */
-		iconv_t cd = iconv_open("UTF-8", WINDOWS_CODEPAGE);
-		if (cd != (iconv_t) - 1)
+		if (total == 0 || !xclip_provide_start())
 		{
-			size_t utf8_length = length * 2;
-			char *utf8_data = malloc(utf8_length);
-			size_t utf8_length_remaining = utf8_length;
-			char *utf8_data_remaining = utf8_data;
-			char *data_remaining = (char *) data;
-			size_t length_remaining = (size_t) length;
-			if (utf8_data == NULL)
-			{
-				iconv_close(cd);
-				return;
-			}
-			iconv(cd, (char **) &data_remaining, &length_remaining,
-			      &utf8_data_remaining, &utf8_length_remaining);
-			iconv_close(cd);
-			free_data = True;
-			data = (uint8 *) utf8_data;
-			length = utf8_length - utf8_length_remaining;
-			/* translate linebreaks (works just as well on UTF-8) */
-			crlf2lf(data, &length);
+			xclip_refuse_selection(&selection_request);
+			has_selection_request = False;
+			return;
 		}
+
+		if (total > CLIP_CHUNK_SIZE)
+			xclip_provide_incr(total);
 	}
-	else if (selection_request.target == format_unicode_atom)
-	{
-		/* We're expecting a CF_UNICODETEXT response, so what we're
-		   receiving matches our requirements and there's no need
-		   for further conversions. */
-	}
-#endif
-	else if (selection_request.target == rdesktop_native_atom)
+
+	clip_convert_feed(&g_provide_convert, data, length);
+	clip_convert_flush(&g_provide_convert);
+
+	if (offset + length >= total)
 	{
-		/* Pass as-is */
+		clip_convert_finish(&g_provide_convert);
+		g_provide_done = True;
 	}
-	else
-	{
-		char *target_name = XGetAtomName(g_display, selection_request.target);
-		logger(Clipboard, Debug,
-		       "ui_clip_handle_data(), no handler for selection target '%s'",
-		       target_name);
-		XFree(target_name);
-		xclip_refuse_selection(&selection_request);
-		has_selection_request = False;
-		return;
-	}
-
-	xclip_provide_selection(&selection_request, selection_request.target, 8, data, length - 1);
-	has_selection_request = False;
 
-	if (free_data)
-		free(data);
+	xclip_provide_more();
 }
 
 void
 ui_clip_request_failed()
 {
-	xclip_refuse_selection(&selection_request);
-	has_selection_request = False;
+	if (has_selection_request)
+		xclip_provide_end(!g_provide_incr);
 }
 
 void
@@ -1111,6 +1867,7 @@ ui_clip_request_data(uint32 format)
 
 	logger(Clipboard, Debug, "request from server for format %d", format);
 	rdp_clipboard_request_format = format;
+	memset(&g_clip_key, 0, sizeof(g_clip_key));
 
 	if (probing_selections)
 	{
@@ -1132,6 +1889,16 @@ ui_clip_request_data(uint32 format)
 		return;
 	}
 
+	if (format == CF_FILEGROUPDESCRIPTORW)
+	{
+		if (g_files_target == 0)
+			helper_cliprdr_send_empty_response();
+		else
+			XConvertSelection(g_display, g_files_selection, g_files_target,
+					  rdesktop_clipboard_target_atom, g_wnd, CurrentTime);
+		return;
+	}
+
 	if (auto_mode)
 		primary_owner = XGetSelectionOwner(g_display, primary_atom);
 	else
@@ -1144,6 +1911,7 @@ ui_clip_request_data(uint32 format)
 	{
 		primary_timestamp = 0;
 		clipboard_timestamp = 0;
+		g_timestamp_selection = None;
 		XConvertSelection(g_display, primary_atom, timestamp_atom,
 				  rdesktop_primary_timestamp_target_atom, g_wnd, CurrentTime);
 		XConvertSelection(g_display, clipboard_atom, timestamp_atom,
@@ -1154,16 +1922,14 @@ ui_clip_request_data(uint32 format)
 	/* Just PRIMARY */
 	if (primary_owner != None)
 	{
-		XConvertSelection(g_display, primary_atom, targets_atom,
-				  rdesktop_clipboard_target_atom, g_wnd, CurrentTime);
+		xclip_request_timestamp(primary_atom);
 		return;
 	}
 
 	/* Just CLIPBOARD */
 	if (clipboard_owner != None)
 	{
-		XConvertSelection(g_display, clipboard_atom, targets_atom,
-				  rdesktop_clipboard_target_atom, g_wnd, CurrentTime);
+		xclip_request_timestamp(clipboard_atom);
 		return;
 	}
 
@@ -1216,6 +1982,8 @@ xclip_init(void)
 	format_string_atom = XInternAtom(g_display, "STRING", False);
 	format_utf8_string_atom = XInternAtom(g_display, "UTF8_STRING", False);
 	format_unicode_atom = XInternAtom(g_display, "text/unicode", False);
+	format_uri_list_atom = XInternAtom(g_display, "text/uri-list", False);
+	format_gnome_files_atom = XInternAtom(g_display, "x-special/gnome-copied-files", False);
 
 	/* rdesktop sets _RDESKTOP_SELECTION_NOTIFY on the root window when acquiring the clipboard.
 	   Other interested rdesktops can use this to notify their server of the available formats. */
@@ -1251,4 +2019,5 @@ xclip_deinit(void)
 	if (XGetSelectionOwner(g_display, clipboard_atom) == g_wnd)
 		XSetSelectionOwner(g_display, clipboard_atom, None, acquire_time);
 	xclip_notify_change();
+	xclip_cache_clear();
 }
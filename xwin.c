@@ -123,6 +123,8 @@ typedef struct _seamless_window
 	unsigned int icon_offset;
 	char icon_buffer[32 * 32 * 4];
 
+	unsigned int damage_stamp;
+
 	struct _seamless_window *next;
 } seamless_window;
 static seamless_window *g_seamless_windows = NULL;
@@ -158,6 +160,20 @@ static XModifierKeymap *g_mod_map;
 static unsigned char g_pointer_log_to_phys_map[32];
 static Cursor g_current_cursor;
 static RD_HCURSOR g_null_cursor = NULL;
+
+/* Converted cursors, keyed by a digest of the pointer data they were
+   made from. Lets the server resend a shape without it being converted
+   and uploaded to the X server again. */
+typedef struct _cursor_entry
+{
+	Cursor cursor;
+	uint64 digest;
+	uint8 *key;		/* what it was made from, see cursor_key() */
+	uint32 key_length;
+	uint32 refs;
+	struct _cursor_entry *next;
+} cursor_entry;
+static cursor_entry *g_cursors = NULL;
 static Atom g_protocol_atom, g_kill_atom;
 extern Atom g_net_wm_state_atom;
 extern Atom g_net_wm_desktop_atom;
@@ -225,6 +241,244 @@ typedef struct
 }
 PixelColour;
 
+/* Drawing reaches seamless windows as copies from the backstore, of the
+   areas damaged during an update. Each area is copied to the windows a
+   grid over the desktop lists for the cells it covers. */
+#define SEAMLESS_GRID_SHIFT	7
+#define SEAMLESS_DAMAGE_RECTS	32
+
+typedef struct
+{
+	seamless_window **windows;
+	int count, size;
+} seamless_cell;
+
+static XRectangle g_seamless_damage[SEAMLESS_DAMAGE_RECTS];
+static int g_seamless_num_damage = 0;
+static seamless_cell *g_seamless_grid = NULL;
+static int g_seamless_grid_width = 0, g_seamless_grid_height = 0;
+static RD_BOOL g_seamless_grid_dirty = True;
+static unsigned int g_seamless_damage_stamp = 0;
+
+/* Cells covering pos to pos + len, False if none */
+static RD_BOOL
+sw_grid_range(int pos, int len, int cells, int *first, int *last)
+{
+	if (len <= 0 || pos + len <= 0)
+		return False;
+
+	*first = pos < 0 ? 0 : pos >> SEAMLESS_GRID_SHIFT;
+	*last = MIN((pos + len - 1) >> SEAMLESS_GRID_SHIFT, cells - 1);
+	return *first <= *last;
+}
+
+static void
+sw_free_grid(void)
+{
+	int i;
+
+	for (i = 0; i < g_seamless_grid_width * g_seamless_grid_height; i++)
+		xfree(g_seamless_grid[i].windows);
+	xfree(g_seamless_grid);
+
+	g_seamless_grid = NULL;
+	g_seamless_grid_width = g_seamless_grid_height = 0;
+	g_seamless_grid_dirty = True;
+}
+
+static void
+sw_rebuild_grid(void)
+{
+	seamless_window *sw;
+	seamless_cell *cell;
+	int width, height, i, x, y, x1, x2, y1, y2;
+
+	width = (g_session_width >> SEAMLESS_GRID_SHIFT) + 1;
+	height = (g_session_height >> SEAMLESS_GRID_SHIFT) + 1;
+	if (width != g_seamless_grid_width || height != g_seamless_grid_height)
+	{
+		sw_free_grid();
+		g_seamless_grid = xmalloc(width * height * sizeof(seamless_cell));
+		memset(g_seamless_grid, 0, width * height * sizeof(seamless_cell));
+		g_seamless_grid_width = width;
+		g_seamless_grid_height = height;
+	}
+
+	for (i = 0; i < width * height; i++)
+		g_seamless_grid[i].count = 0;
+
+	for (sw = g_seamless_windows; sw; sw = sw->next)
+	{
+		if (!sw_grid_range(sw->xoffset, sw->width, width, &x1, &x2)
+		    || !sw_grid_range(sw->yoffset, sw->height, height, &y1, &y2))
+			continue;
+
+		for (y = y1; y <= y2; y++)
+		{
+			for (x = x1; x <= x2; x++)
+			{
+				cell = &g_seamless_grid[y * width + x];
+				if (cell->count == cell->size)
+				{
+					cell->size = cell->size ? cell->size * 2 : 4;
+					cell->windows = xrealloc(cell->windows,
+								 cell->size *
+								 sizeof(seamless_window *));
+				}
+				cell->windows[cell->count++] = sw;
+			}
+		}
+	}
+
+	g_seamless_grid_dirty = False;
+}
+
+/* Record an area drawn to, merging it into one already recorded when
+   that costs no extra area, or when the list is full */
+static void
+sw_add_damage(int x, int y, int cx, int cy)
+{
+	XRectangle *d;
+	int i, best, x1, y1, x2, y2;
+	long growth, best_growth;
+
+	/* drawing is clipped */
+	x2 = MIN(x + cx, g_clip_rectangle.x + g_clip_rectangle.width);
+	y2 = MIN(y + cy, g_clip_rectangle.y + g_clip_rectangle.height);
+	x = MAX(x, g_clip_rectangle.x);
+	y = MAX(y, g_clip_rectangle.y);
+	if (x2 <= x || y2 <= y)
+		return;
+
+	best = -1;
+	best_growth = 0;
+	for (i = 0; i < g_seamless_num_damage; i++)
+	{
+		d = &g_seamless_damage[i];
+		x1 = MIN(d->x, x);
+		y1 = MIN(d->y, y);
+		growth = (long) (MAX(d->x + d->width, x2) - x1) * (MAX(d->y + d->height, y2) - y1)
+			- (long) d->width * d->height - (long) (x2 - x) * (y2 - y);
+		if (best < 0 || growth < best_growth)
+		{
+			best = i;
+			best_growth = growth;
+		}
+	}
+
+	if (best < 0 || (best_growth > 0 && g_seamless_num_damage < SEAMLESS_DAMAGE_RECTS))
+	{
+		d = &g_seamless_damage[g_seamless_num_damage++];
+		d->x = x;
+		d->y = y;
+		d->width = x2 - x;
+		d->height = y2 - y;
+		return;
+	}
+
+	d = &g_seamless_damage[best];
+	x1 = MIN(d->x, x);
+	y1 = MIN(d->y, y);
+	x2 = MAX(d->x + d->width, x2);
+	y2 = MAX(d->y + d->height, y2);
+	d->x = x1;
+	d->y = y1;
+	d->width = x2 - x1;
+	d->height = y2 - y1;
+}
+
+/* Damage the bounding box of a CoordModePrevious point list */
+static void
+sw_add_damage_points(XPoint * points, int npoints)
+{
+	int i, x, y, x1, y1, x2, y2;
+
+	if (npoints < 1)
+		return;
+
+	x = x1 = x2 = points[0].x;
+	y = y1 = y2 = points[0].y;
+	for (i = 1; i < npoints; i++)
+	{
+		x += points[i].x;
+		y += points[i].y;
+		x1 = MIN(x1, x);
+		y1 = MIN(y1, y);
+		x2 = MAX(x2, x);
+		y2 = MAX(y2, y);
+	}
+
+	sw_add_damage(x1, y1, x2 - x1 + 1, y2 - y1 + 1);
+}
+
+/* Copy the damaged areas to the seamless windows overlapping them */
+static void
+sw_flush_damage(void)
+{
+	seamless_window *sw;
+	seamless_cell *cell;
+	XRectangle *d;
+	Drawable src;
+	int i, k, x, y, cx1, cx2, cy1, cy2, x1, y1, x2, y2;
+
+	if (g_seamless_num_damage == 0)
+		return;
+
+	if (g_seamless_windows == NULL)
+	{
+		g_seamless_num_damage = 0;
+		return;
+	}
+
+	if (g_seamless_grid_dirty)
+		sw_rebuild_grid();
+
+	src = g_ownbackstore ? g_backstore : g_wnd;
+	XSetClipMask(g_display, g_gc, None);
+
+	for (i = 0; i < g_seamless_num_damage; i++)
+	{
+		d = &g_seamless_damage[i];
+		if (!sw_grid_range(d->x, d->width, g_seamless_grid_width, &cx1, &cx2)
+		    || !sw_grid_range(d->y, d->height, g_seamless_grid_height, &cy1, &cy2))
+			continue;
+
+		/* a window is listed in every cell it covers */
+		g_seamless_damage_stamp++;
+		for (y = cy1; y <= cy2; y++)
+		{
+			for (x = cx1; x <= cx2; x++)
+			{
+				cell = &g_seamless_grid[y * g_seamless_grid_width + x];
+				for (k = 0; k < cell->count; k++)
+				{
+					sw = cell->windows[k];
+					if (sw->damage_stamp == g_seamless_damage_stamp)
+						continue;
+					sw->damage_stamp = g_seamless_damage_stamp;
+
+					x1 = MAX(d->x, sw->xoffset);
+					y1 = MAX(d->y, sw->yoffset);
+					x2 = MIN(d->x + d->width, sw->xoffset + sw->width);
+					y2 = MIN(d->y + d->height, sw->yoffset + sw->height);
+					if (x2 <= x1 || y2 <= y1)
+						continue;
+
+					XCopyArea(g_display, src, sw->wnd, g_gc, x1, y1,
+						  x2 - x1, y2 - y1, x1 - sw->xoffset,
+						  y1 - sw->yoffset);
+				}
+			}
+		}
+	}
+
+	g_seamless_num_damage = 0;
+	XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded);
+}
+
+#define SEAMLESS_DAMAGE(x,y,cx,cy) \
+	{ if (g_seamless_windows) sw_add_damage(x, y, cx, cy); }
+
 #define ON_ALL_SEAMLESS_WINDOWS(func, args) \
         do { \
                 seamless_window *sw; \
@@ -241,30 +495,10 @@ PixelColour;
                 XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded); \
         } while (0)
 
-static void
-seamless_XFillPolygon(Drawable d, XPoint * points, int npoints, int xoffset, int yoffset)
-{
-	points[0].x -= xoffset;
-	points[0].y -= yoffset;
-	XFillPolygon(g_display, d, g_gc, points, npoints, Complex, CoordModePrevious);
-	points[0].x += xoffset;
-	points[0].y += yoffset;
-}
-
-static void
-seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int yoffset)
-{
-	points[0].x -= xoffset;
-	points[0].y -= yoffset;
-	XDrawLines(g_display, d, g_gc, points, npoints, CoordModePrevious);
-	points[0].x += xoffset;
-	points[0].y += yoffset;
-}
-
 #define FILL_RECTANGLE(x,y,cx,cy)\
 { \
 	XFillRectangle(g_display, g_wnd, g_gc, x, y, cx, cy); \
-        ON_ALL_SEAMLESS_WINDOWS(XFillRectangle, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy)); \
+	SEAMLESS_DAMAGE(x, y, cx, cy); \
 	if (g_ownbackstore) \
 		XFillRectangle(g_display, g_backstore, g_gc, x, y, cx, cy); \
 }
@@ -279,7 +513,8 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 	XFillPolygon(g_display, g_wnd, g_gc, p, np, Complex, CoordModePrevious); \
 	if (g_ownbackstore) \
 		XFillPolygon(g_display, g_backstore, g_gc, p, np, Complex, CoordModePrevious); \
-	ON_ALL_SEAMLESS_WINDOWS(seamless_XFillPolygon, (sw->wnd, p, np, sw->xoffset, sw->yoffset)); \
+	if (g_seamless_windows) \
+		sw_add_damage_points(p, np); \
 }
 
 #define DRAW_ELLIPSE(x,y,cx,cy,m)\
@@ -288,17 +523,16 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 	{ \
 		case 0:	/* Outline */ \
 			XDrawArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
-                        ON_ALL_SEAMLESS_WINDOWS(XDrawArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
 			if (g_ownbackstore) \
 				XDrawArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
 			break; \
 		case 1: /* Filled */ \
 			XFillArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
-			ON_ALL_SEAMLESS_WINDOWS(XFillArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
 			if (g_ownbackstore) \
 				XFillArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
 			break; \
 	} \
+	SEAMLESS_DAMAGE(x, y, cx + 1, cy + 1); \
 }
 
 /* colour maps */
@@ -375,6 +609,7 @@ sw_remove_window(seamless_window * win)
 			}
 			xfree(sw->position_timer);
 			xfree(sw);
+			g_seamless_grid_dirty = True;
 			return;
 		}
 		prevnext = &sw->next;
@@ -2077,6 +2312,91 @@ ui_get_workarea_size(uint32 * width, uint32 * height)
 	}
 }
 
+/* BRUSH TILE CACHE */
+/* Brush patterns are rendered once into a stipple (mono brushes) or tile
+   (colour brushes) and kept around, as the same few patterns are used
+   over and over for things like scrollbars and selections. The stipple
+   colours come from the GC, so only the pattern itself is part of the key,
+   along with the server depth that tile data is read with. */
+#define BRUSH_TILE_CACHE_SIZE 64
+
+typedef struct _brush_tile
+{
+	RD_BOOL tile;
+	int depth;
+	uint32 length;
+	uint8 data[8 * 8 * 4];
+	Pixmap pixmap;
+	uint32 stamp;
+} brush_tile;
+
+static brush_tile g_brush_tiles[BRUSH_TILE_CACHE_SIZE];
+static uint32 g_brush_tile_stamp;
+
+/* Drop all rendered brushes, e.g. when the palette they were translated with goes away */
+static void
+brush_tile_flush(void)
+{
+	int i;
+
+	for (i = 0; i < BRUSH_TILE_CACHE_SIZE; i++)
+	{
+		if (g_brush_tiles[i].pixmap == 0)
+			continue;
+
+		XFreePixmap(g_display, g_brush_tiles[i].pixmap);
+		g_brush_tiles[i].pixmap = 0;
+	}
+}
+
+/* Return a stipple or tile for an 8x8 brush pattern, rendering it on a miss */
+static Pixmap
+brush_tile_get(RD_BOOL tile, uint8 * data, uint32 length)
+{
+	brush_tile *entry, *victim;
+	int i;
+
+	if (length > sizeof(victim->data))
+		length = sizeof(victim->data);
+
+	victim = &g_brush_tiles[0];
+	for (i = 0; i < BRUSH_TILE_CACHE_SIZE; i++)
+	{
+		entry = &g_brush_tiles[i];
+		if (entry->pixmap == 0)
+		{
+			if (victim->pixmap != 0)
+				victim = entry;
+			continue;
+		}
+
+		if (entry->tile == tile && entry->depth == g_server_depth
+		    && entry->length == length && memcmp(entry->data, data, length) == 0)
+		{
+			entry->stamp = ++g_brush_tile_stamp;
+			return entry->pixmap;
+		}
+
+		/* least recently used */
+		if (victim->pixmap != 0 && entry->stamp < victim->stamp)
+			victim = entry;
+	}
+
+	if (victim->pixmap != 0)
+		XFreePixmap(g_display, victim->pixmap);
+
+	victim->tile = tile;
+	victim->depth = g_server_depth;
+	victim->length = length;
+	memcpy(victim->data, data, length);
+	victim->stamp = ++g_brush_tile_stamp;
+	if (tile)
+		victim->pixmap = (Pixmap) ui_create_bitmap(8, 8, data);
+	else
+		victim->pixmap = (Pixmap) ui_create_glyph(8, 8, data);
+
+	return victim->pixmap;
+}
 
 void
 ui_deinit(void)
@@ -2089,8 +2409,17 @@ ui_deinit(void)
 	if (g_null_cursor != NULL)
 		XFreeCursor(g_display, (Cursor) g_null_cursor);
 
+	while (g_cursors != NULL)
+	{
+		cursor_entry *next = g_cursors->next;
+		xfree(g_cursors->key);
+		xfree(g_cursors);
+		g_cursors = next;
+	}
+
 	XFreeModifiermap(g_mod_map);
 
+	brush_tile_flush();
 	XFreeGC(g_display, g_gc);
 	XCloseDisplay(g_display);
 	g_display = NULL;
@@ -2315,6 +2644,8 @@ ui_create_window(uint32 width, uint32 height)
 		g_null_cursor =
 			ui_create_cursor(0, 0, 1, 1, null_pointer_mask, null_pointer_data, 24);
 
+	XDefineCursor(g_display, g_wnd, g_current_cursor);
+
 	if (g_seamless_rdp)
 	{
 		seamless_reset_state();
@@ -3079,10 +3410,14 @@ process_fds(int rdp_socket, int ms)
 	/* add redirection handles */
 	rdpdr_add_fds(&n, &rfds, &wfds, &tv, &s_timeout);
 	seamless_select_timeout(&tv);
+	xclip_select_timeout(&tv);
 
 	/* add ctrl slaves handles */
 	ctrl_add_fds(&n, &rfds);
 
+	/* clipboard file reads */
+	cliprdr_add_fds(&n, &rfds);
+
 	n++;
 
 	ret = select(n, &rfds, &wfds, NULL, &tv);
@@ -3096,9 +3431,11 @@ process_fds(int rdp_socket, int ms)
 		rdpsnd_check_fds(&rfds, &wfds);
 #endif
 
-		/* Abort serial read calls */
+		/* Abort serial read calls, or check polled serial events */
 		if (s_timeout)
 			rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) True);
+		else if (ret == 0)
+			rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
 		return False;
 	}
 
@@ -3110,6 +3447,8 @@ process_fds(int rdp_socket, int ms)
 
 	ctrl_check_fds(&rfds, &wfds);
 
+	cliprdr_check_fds(&rfds);
+
 	if (FD_ISSET(rdp_socket, &rfds))
 		return True;
 
@@ -3262,6 +3601,8 @@ ui_select(int rdp_socket)
 		if (g_seamless_active)
 			sw_check_timers();
 
+		xclip_check_timers();
+
 		/* process_fds() is a little special, it does two
 		   things in one. It will perform a select() on all
 		   filedescriptors; rdpsnd / rdpdr / ctrl and
@@ -3354,17 +3695,12 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 	{
 		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
 		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
 	}
 	else
 	{
 		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
 	}
+	SEAMLESS_DAMAGE(x, y, cx, cy);
 
 	XFree(image);
 	if (tdata != data)
@@ -3507,9 +3843,51 @@ xcursor_merge(XcursorImage * src, XcursorImage * dst)
 	}
 }
 
-RD_HCURSOR
-ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
-		 uint32 height, uint8 * andmask, uint8 * xormask, int bpp)
+/* Everything ui_create_cursor() bases the cursor on, in one buffer */
+static uint8 *
+cursor_key(unsigned int xhot, unsigned int yhot, uint32 width, uint32 height,
+	   uint8 * andmask, uint8 * xormask, int bpp, uint32 * length)
+{
+	uint32 geometry[5];
+	uint32 pixels = width * height;
+	uint32 and_length, xor_length;
+	uint8 *key;
+
+	geometry[0] = xhot;
+	geometry[1] = yhot;
+	geometry[2] = width;
+	geometry[3] = height;
+	geometry[4] = bpp;
+
+	and_length = (pixels + 7) / 8;
+	xor_length = (bpp == 1) ? (pixels + 7) / 8 : pixels * (bpp / 8);
+
+	*length = sizeof(geometry) + and_length + xor_length;
+	key = xmalloc(*length);
+	memcpy(key, geometry, sizeof(geometry));
+	memcpy(key + sizeof(geometry), andmask, and_length);
+	memcpy(key + sizeof(geometry) + and_length, xormask, xor_length);
+
+	return key;
+}
+
+static uint64
+cursor_digest(const uint8 * data, uint32 length)
+{
+	/* FNV-1a */
+	uint64 digest = 0xcbf29ce484222325ULL;
+
+	while (length--)
+	{
+		digest ^= *data++;
+		digest *= 0x100000001b3ULL;
+	}
+	return digest;
+}
+
+static Cursor
+xcursor_create(unsigned int xhot, unsigned int yhot, uint32 width,
+	       uint32 height, uint8 * andmask, uint8 * xormask, int bpp)
 {
 	Cursor cursor;
 	XcursorPixel *out;
@@ -3517,21 +3895,11 @@ ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
 	uint32 x, y, oidx, idx, argb;
 	uint8 outline, xor;
 
-	logger(GUI, Debug, "ui_create_cursor(): xhot=%d, yhot=%d, width=%d, height=%d, bpp=%d",
-	       xhot, yhot, width, height, bpp);
-
-	if (bpp != 1 && bpp != 16 && bpp != 24 && bpp != 32)
-	{
-		logger(GUI, Warning, "ui_create_xcursor_cursor(): Unhandled cursor bit depth %d",
-		       bpp);
-		return g_null_cursor;
-	}
-
 	cimg = XcursorImageCreate(width, height);
 	if (!cimg)
 	{
 		logger(GUI, Error, "ui_create_xcursor_cursor(): XcursorImageCreate() failed");
-		return g_null_cursor;
+		return 0;
 	}
 
 	cimg->xhot = xhot;
@@ -3579,11 +3947,61 @@ ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
 	cursor = XcursorImageLoadCursor(g_display, cimg);
 	XcursorImageDestroy(cimg);
 	if (!cursor)
-	{
 		logger(GUI, Error, "ui_create_cursor(): XcursorImageLoadCursor() failed");
+
+	return cursor;
+}
+
+RD_HCURSOR
+ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
+		 uint32 height, uint8 * andmask, uint8 * xormask, int bpp)
+{
+	Cursor cursor;
+	cursor_entry *entry;
+	uint64 digest;
+	uint8 *key;
+	uint32 key_length;
+
+	logger(GUI, Debug, "ui_create_cursor(): xhot=%d, yhot=%d, width=%d, height=%d, bpp=%d",
+	       xhot, yhot, width, height, bpp);
+
+	if (bpp != 1 && bpp != 16 && bpp != 24 && bpp != 32)
+	{
+		logger(GUI, Warning, "ui_create_xcursor_cursor(): Unhandled cursor bit depth %d",
+		       bpp);
 		return g_null_cursor;
 	}
 
+	key = cursor_key(xhot, yhot, width, height, andmask, xormask, bpp, &key_length);
+	digest = cursor_digest(key, key_length);
+	for (entry = g_cursors; entry != NULL; entry = entry->next)
+	{
+		/* the digest only rules out, the shape has to be the same */
+		if (entry->digest == digest && entry->key_length == key_length
+		    && memcmp(entry->key, key, key_length) == 0)
+		{
+			xfree(key);
+			entry->refs++;
+			return (RD_HCURSOR) entry->cursor;
+		}
+	}
+
+	cursor = xcursor_create(xhot, yhot, width, height, andmask, xormask, bpp);
+	if (!cursor)
+	{
+		xfree(key);
+		return g_null_cursor;
+	}
+
+	entry = xmalloc(sizeof(cursor_entry));
+	entry->cursor = cursor;
+	entry->digest = digest;
+	entry->key = key;
+	entry->key_length = key_length;
+	entry->refs = 1;
+	entry->next = g_cursors;
+	g_cursors = entry;
+
 	return (RD_HCURSOR) cursor;
 }
 
@@ -3593,6 +4011,9 @@ ui_set_cursor(RD_HCURSOR cursor)
 	extern RD_BOOL g_local_cursor;
 	if (g_local_cursor)
 		return;
+	if (g_current_cursor == (Cursor) cursor)
+		return;
+
 	logger(GUI, Debug, "ui_set_cursor(): g_current_cursor = %p, new = %p",
 	       g_current_cursor, cursor);
 
@@ -3604,10 +4025,30 @@ ui_set_cursor(RD_HCURSOR cursor)
 void
 ui_destroy_cursor(RD_HCURSOR cursor)
 {
+	cursor_entry *entry, **prev;
+
 	// Do not destroy fallback null cursor
 	if (cursor == g_null_cursor)
 		return;
 
+	for (prev = &g_cursors; (entry = *prev) != NULL; prev = &entry->next)
+	{
+		if (entry->cursor != (Cursor) cursor)
+			continue;
+
+		if (--entry->refs > 0)
+			return;
+
+		*prev = entry->next;
+		xfree(entry->key);
+		xfree(entry);
+		break;
+	}
+
+	/* make sure a recycled XID is not mistaken for the current cursor */
+	if (g_current_cursor == (Cursor) cursor)
+		g_current_cursor = None;
+
 	XFreeCursor(g_display, (Cursor) cursor);
 }
 
@@ -3620,6 +4061,7 @@ ui_set_null_cursor(void)
 void
 ui_set_standard_cursor(void)
 {
+	g_current_cursor = None;
 	XUndefineCursor(g_display, g_wnd);
 }
 
@@ -3748,6 +4190,7 @@ ui_set_colourmap(RD_HCOLOURMAP map)
 			xfree(g_colmap);
 
 		g_colmap = (uint32 *) map;
+		brush_tile_flush();
 	}
 	else
 	{
@@ -3816,8 +4259,7 @@ ui_patblt(uint8 opcode,
 			break;
 
 		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
+			fill = brush_tile_get(False, hatch_patterns + brush->pattern[0] * 8, 8);
 			SET_FOREGROUND(fgcolour);
 			SET_BACKGROUND(bgcolour);
 			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -3826,7 +4268,6 @@ ui_patblt(uint8 opcode,
 			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
 			XSetFillStyle(g_display, g_gc, FillSolid);
 			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
 			break;
 
 		case 3:	/* Pattern */
@@ -3834,7 +4275,7 @@ ui_patblt(uint8 opcode,
 			{
 				for (i = 0; i != 8; i++)
 					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
+				fill = brush_tile_get(False, ipattern, 8);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -3843,22 +4284,21 @@ ui_patblt(uint8 opcode,
 				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
 			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
+				fill = brush_tile_get(True, brush->bd->data,
+						      brush->bd->data_size);
 				XSetFillStyle(g_display, g_gc, FillTiled);
 				XSetTile(g_display, g_gc, fill);
 				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
 				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
 			}
 			else
 			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
+				fill = brush_tile_get(False, brush->bd->data, 8);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -3867,7 +4307,6 @@ ui_patblt(uint8 opcode,
 				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			break;
 
@@ -3880,9 +4319,7 @@ ui_patblt(uint8 opcode,
 
 	if (g_ownbackstore)
 		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd, sw->wnd, g_gc,
-				 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	SEAMLESS_DAMAGE(x, y, cx, cy);
 }
 
 void
@@ -3902,9 +4339,7 @@ ui_screenblt(uint8 opcode,
 		XCopyArea(g_display, g_wnd, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
 	}
 
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd,
-				 sw->wnd, g_gc, x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	SEAMLESS_DAMAGE(x, y, cx, cy);
 
 	RESET_FUNCTION(opcode);
 }
@@ -3916,9 +4351,7 @@ ui_memblt(uint8 opcode,
 {
 	SET_FUNCTION(opcode);
 	XCopyArea(g_display, (Pixmap) src, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, (Pixmap) src, sw->wnd, g_gc,
-				 srcx, srcy, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	SEAMLESS_DAMAGE(x, y, cx, cy);
 	if (g_ownbackstore)
 		XCopyArea(g_display, (Pixmap) src, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
 	RESET_FUNCTION(opcode);
@@ -3965,9 +4398,8 @@ ui_line(uint8 opcode,
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
 	XDrawLine(g_display, g_wnd, g_gc, startx, starty, endx, endy);
-	ON_ALL_SEAMLESS_WINDOWS(XDrawLine, (g_display, sw->wnd, g_gc,
-					    startx - sw->xoffset, starty - sw->yoffset,
-					    endx - sw->xoffset, endy - sw->yoffset));
+	SEAMLESS_DAMAGE(MIN(startx, endx), MIN(starty, endy), abs(endx - startx) + 1,
+			abs(endy - starty) + 1);
 	if (g_ownbackstore)
 		XDrawLine(g_display, g_backstore, g_gc, startx, starty, endx, endy);
 	RESET_FUNCTION(opcode);
@@ -4018,8 +4450,7 @@ ui_polygon(uint8 opcode,
 			break;
 
 		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
+			fill = brush_tile_get(False, hatch_patterns + brush->pattern[0] * 8, 8);
 			SET_FOREGROUND(fgcolour);
 			SET_BACKGROUND(bgcolour);
 			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -4028,7 +4459,6 @@ ui_polygon(uint8 opcode,
 			FILL_POLYGON((XPoint *) point, npoints);
 			XSetFillStyle(g_display, g_gc, FillSolid);
 			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
 			break;
 
 		case 3:	/* Pattern */
@@ -4036,7 +4466,7 @@ ui_polygon(uint8 opcode,
 			{
 				for (i = 0; i != 8; i++)
 					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
+				fill = brush_tile_get(False, ipattern, 8);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -4045,22 +4475,21 @@ ui_polygon(uint8 opcode,
 				FILL_POLYGON((XPoint *) point, npoints);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
 			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
+				fill = brush_tile_get(True, brush->bd->data,
+						      brush->bd->data_size);
 				XSetFillStyle(g_display, g_gc, FillTiled);
 				XSetTile(g_display, g_gc, fill);
 				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
 				FILL_POLYGON((XPoint *) point, npoints);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
 			}
 			else
 			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
+				fill = brush_tile_get(False, brush->bd->data, 8);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -4069,7 +4498,6 @@ ui_polygon(uint8 opcode,
 				FILL_POLYGON((XPoint *) point, npoints);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			break;
 
@@ -4093,8 +4521,8 @@ ui_polyline(uint8 opcode,
 		XDrawLines(g_display, g_backstore, g_gc, (XPoint *) points, npoints,
 			   CoordModePrevious);
 
-	ON_ALL_SEAMLESS_WINDOWS(seamless_XDrawLines,
-				(sw->wnd, (XPoint *) points, npoints, sw->xoffset, sw->yoffset));
+	if (g_seamless_windows)
+		sw_add_damage_points((XPoint *) points, npoints);
 
 	RESET_FUNCTION(opcode);
 }
@@ -4123,8 +4551,7 @@ ui_ellipse(uint8 opcode,
 			break;
 
 		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
+			fill = brush_tile_get(False, hatch_patterns + brush->pattern[0] * 8, 8);
 			SET_FOREGROUND(fgcolour);
 			SET_BACKGROUND(bgcolour);
 			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -4133,7 +4560,6 @@ ui_ellipse(uint8 opcode,
 			DRAW_ELLIPSE(x, y, cx, cy, fillmode);
 			XSetFillStyle(g_display, g_gc, FillSolid);
 			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
 			break;
 
 		case 3:	/* Pattern */
@@ -4141,7 +4567,7 @@ ui_ellipse(uint8 opcode,
 			{
 				for (i = 0; i != 8; i++)
 					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
+				fill = brush_tile_get(False, ipattern, 8);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -4150,22 +4576,21 @@ ui_ellipse(uint8 opcode,
 				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
 			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
+				fill = brush_tile_get(True, brush->bd->data,
+						      brush->bd->data_size);
 				XSetFillStyle(g_display, g_gc, FillTiled);
 				XSetTile(g_display, g_gc, fill);
 				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
 				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
 			}
 			else
 			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
+				fill = brush_tile_get(False, brush->bd->data, 8);
 				SET_FOREGROUND(bgcolour);
 				SET_BACKGROUND(fgcolour);
 				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
@@ -4174,7 +4599,6 @@ ui_ellipse(uint8 opcode,
 				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
 				XSetFillStyle(g_display, g_gc, FillSolid);
 				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
 			}
 			break;
 
@@ -4351,21 +4775,13 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 		{
 			XCopyArea(g_display, g_backstore, g_wnd, g_gc, boxx,
 				  boxy, boxcx, boxcy, boxx, boxy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 boxx, boxy,
-						 boxcx, boxcy,
-						 boxx - sw->xoffset, boxy - sw->yoffset));
+			SEAMLESS_DAMAGE(boxx, boxy, boxcx, boxcy);
 		}
 		else
 		{
 			XCopyArea(g_display, g_backstore, g_wnd, g_gc, clipx,
 				  clipy, clipcx, clipcy, clipx, clipy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 clipx, clipy,
-						 clipcx, clipcy, clipx - sw->xoffset,
-						 clipy - sw->yoffset));
+			SEAMLESS_DAMAGE(clipx, clipy, clipcx, clipcy);
 		}
 	}
 }
@@ -4374,59 +4790,63 @@ void
 ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
 {
 	Pixmap pix;
-	XImage *image;
 
-	if (g_ownbackstore)
-	{
-		image = XGetImage(g_display, g_backstore, x, y, cx, cy, AllPlanes, ZPixmap);
-		exit_if_null(image);
-	}
-	else
-	{
-		pix = XCreatePixmap(g_display, g_wnd, cx, cy, g_depth);
-		XCopyArea(g_display, g_wnd, pix, g_gc, x, y, cx, cy, 0, 0);
-		image = XGetImage(g_display, pix, 0, 0, cx, cy, AllPlanes, ZPixmap);
-		exit_if_null(image);
-		XFreePixmap(g_display, pix);
-	}
+	pix = XCreatePixmap(g_display, g_wnd, cx, cy, g_depth);
+	XCopyArea(g_display, g_ownbackstore ? g_backstore : g_wnd, pix, g_gc, x, y, cx, cy, 0, 0);
 
 	offset *= g_bpp / 8;
-	cache_put_desktop(offset, cx, cy, image->bytes_per_line, g_bpp / 8, (uint8 *) image->data);
-
-	XDestroyImage(image);
+	cache_put_desktop(offset, cx, cy, g_bpp / 8, (RD_HBITMAP) pix);
 }
 
 void
 ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
 {
+	Pixmap pix;
 	XImage *image;
 	uint8 *data;
+	int srcy;
 
 	offset *= g_bpp / 8;
-	data = cache_get_desktop(offset, cx, cy, g_bpp / 8);
-	if (data == NULL)
-		return;
-
-	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
-			     (char *) data, cx, cy, g_bpp, 0);
+	pix = (Pixmap) cache_get_desktop(offset, cx, cy, g_bpp / 8, &srcy);
+	if (pix == 0)
+	{
+		/* spread over several saves, or saved with another width */
+		data = cache_get_desktop_data(offset, cx, cy, g_bpp / 8);
+		if (data == NULL)
+			return;
 
-	if (g_ownbackstore)
+		image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
+				     (char *) data, cx, cy, g_bpp, 0);
+		XPutImage(g_display, g_ownbackstore ? g_backstore : g_wnd, g_gc, image, 0, 0, x, y,
+			  cx, cy);
+		XFree(image);
+		if (g_ownbackstore)
+			XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
+	}
+	else if (g_ownbackstore)
 	{
-		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
+		XCopyArea(g_display, pix, g_backstore, g_gc, 0, srcy, cx, cy, x, y);
 		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc,
-					 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
 	}
 	else
 	{
-		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		XCopyArea(g_display, pix, g_wnd, g_gc, 0, srcy, cx, cy, x, y);
 	}
+	SEAMLESS_DAMAGE(x, y, cx, cy);
+}
 
-	XFree(image);
+/* Reads rows of a desktop save back as pixel data, cx * g_bpp / 8 bytes a row */
+void
+ui_desktop_read(RD_HBITMAP bitmap, int y, int cx, int cy, uint8 * data)
+{
+	XImage *image;
+	int row, scanline = cx * (g_bpp / 8);
+
+	image = XGetImage(g_display, (Pixmap) bitmap, 0, y, cx, cy, AllPlanes, ZPixmap);
+	exit_if_null(image);
+	for (row = 0; row < cy; row++)
+		memcpy(data + row * scanline, image->data + row * image->bytes_per_line, scanline);
+	XDestroyImage(image);
 }
 
 /* these do nothing here but are used in uiports */
@@ -4438,6 +4858,7 @@ ui_begin_update(void)
 void
 ui_end_update(void)
 {
+	sw_flush_damage();
 	XFlush(g_display);
 }
 
@@ -4476,6 +4897,7 @@ ui_seamless_end()
 		XDestroyWindow(g_display, g_seamless_windows->wnd);
 		sw_remove_window(g_seamless_windows);
 	}
+	sw_free_grid();
 
 	g_seamless_started = False;
 	g_seamless_active = False;
@@ -4647,6 +5069,9 @@ ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long p
 
 	XSetWMProtocols(g_display, wnd, supported, 2);
 
+	/* ui_set_cursor() only touches windows when the cursor changes */
+	XDefineCursor(g_display, wnd, g_current_cursor);
+
 	sw = xmalloc(sizeof(seamless_window));
 
 	memset(sw, 0, sizeof(seamless_window));
@@ -4667,6 +5092,7 @@ ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long p
 
 	sw->next = g_seamless_windows;
 	g_seamless_windows = sw;
+	g_seamless_grid_dirty = True;
 
 	/* WM_HINTS */
 	wmhints = XAllocWMHints();
@@ -4857,6 +5283,7 @@ ui_seamless_move_window(unsigned long id, int x, int y, int width, int height, u
 	sw->yoffset = y;
 	sw->width = width;
 	sw->height = height;
+	g_seamless_grid_dirty = True;
 
 	/* FIXME: Perhaps use ewmh_net_moveresize_window instead */
 	XMoveResizeWindow(g_display, sw->wnd, sw->xoffset, sw->yoffset, sw->width, sw->height);
@@ -5050,6 +5477,7 @@ ui_seamless_ack(unsigned int serial)
 			sw->width = sw->outpos_width;
 			sw->height = sw->outpos_height;
 			sw->outstanding_position = False;
+			g_seamless_grid_dirty = True;
 
 			/* Do a complete redraw of the window as part of the
 			   completion of the move. This is to remove any